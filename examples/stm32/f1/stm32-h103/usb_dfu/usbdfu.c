@@ -34,14 +34,9 @@
 /* We need a special large control buffer for this device: */
 u8 usbd_control_buffer[1024];
 
-static enum dfu_state usbdfu_state = STATE_DFU_IDLE;
-
-static struct {
-	u8 buf[sizeof(usbd_control_buffer)];
-	u16 len;
-	u32 addr;
-	u16 blocknum;
-} prog;
+/* Blocks are programmed from here while the next one is received. */
+static u8 dfu_buf[2 * sizeof(usbd_control_buffer)];
+static u32 prog_addr;
 
 const struct usb_device_descriptor dev = {
 	.bLength = USB_DT_DEVICE_SIZE,
@@ -113,117 +108,40 @@ static const char *usb_strings[] = {
 	"@Internal Flash   /0x08000000/8*001Ka,56*001Kg",
 };
 
-static u8 usbdfu_getstatus(usbd_device *usbd_dev, u32 *bwPollTimeout)
-{
-	(void)usbd_dev;
-
-	switch (usbdfu_state) {
-	case STATE_DFU_DNLOAD_SYNC:
-		usbdfu_state = STATE_DFU_DNBUSY;
-		*bwPollTimeout = 100;
-		return DFU_STATUS_OK;
-	case STATE_DFU_MANIFEST_SYNC:
-		/* Device will reset when read is complete. */
-		usbdfu_state = STATE_DFU_MANIFEST;
-		return DFU_STATUS_OK;
-	default:
-		return DFU_STATUS_OK;
-	}
-}
-
-static void usbdfu_getstatus_complete(usbd_device *usbd_dev, struct usb_setup_data *req)
+static int usbdfu_download(u16 block_num, const u8 *data, u16 len)
 {
 	int i;
-	(void)req;
-	(void)usbd_dev;
 
-	switch (usbdfu_state) {
-	case STATE_DFU_DNBUSY:
-		flash_unlock();
-		if (prog.blocknum == 0) {
-			switch (prog.buf[0]) {
-			case CMD_ERASE:
-				flash_erase_page(*(u32 *)(prog.buf + 1));
-			case CMD_SETADDR:
-				prog.addr = *(u32 *)(prog.buf + 1);
-			}
-		} else {
-			u32 baseaddr = prog.addr + ((prog.blocknum - 2) *
-				       dfu_function.wTransferSize);
-			for (i = 0; i < prog.len; i += 2)
-				flash_program_half_word(baseaddr + i,
-						*(u16 *)(prog.buf + i));
+	flash_unlock();
+	if (block_num == 0) {
+		switch (data[0]) {
+		case CMD_ERASE:
+			flash_erase_page(*(u32 *)(data + 1));
+		case CMD_SETADDR:
+			prog_addr = *(u32 *)(data + 1);
 		}
-		flash_lock();
-
-		/* Jump straight to dfuDNLOAD-IDLE, skipping dfuDNLOAD-SYNC. */
-		usbdfu_state = STATE_DFU_DNLOAD_IDLE;
-		return;
-	case STATE_DFU_MANIFEST:
-		/* USB device must detach, we just reset... */
-		scb_reset_system();
-		return; /* Will never return. */
-	default:
-		return;
+	} else {
+		u32 baseaddr = prog_addr + ((block_num - 2) *
+			       dfu_function.wTransferSize);
+		for (i = 0; i < len; i += 2)
+			flash_program_half_word(baseaddr + i,
+						*(u16 *)(data + i));
 	}
+	flash_lock();
+
+	return DFU_STATUS_OK;
 }
 
-static int usbdfu_control_request(usbd_device *usbd_dev, struct usb_setup_data *req, u8 **buf,
-		u16 *len, void (**complete)(usbd_device *usbd_dev, struct usb_setup_data *req))
+static void usbdfu_manifest(void)
 {
-	if ((req->bmRequestType & 0x7F) != 0x21)
-		return 0; /* Only accept class request. */
-
-	switch (req->bRequest) {
-	case DFU_DNLOAD:
-		if ((len == NULL) || (*len == 0)) {
-			usbdfu_state = STATE_DFU_MANIFEST_SYNC;
-			return 1;
-		} else {
-			/* Copy download data for use on GET_STATUS. */
-			prog.blocknum = req->wValue;
-			prog.len = *len;
-			memcpy(prog.buf, *buf, *len);
-			usbdfu_state = STATE_DFU_DNLOAD_SYNC;
-			return 1;
-		}
-	case DFU_CLRSTATUS:
-		/* Clear error and return to dfuIDLE. */
-		if (usbdfu_state == STATE_DFU_ERROR)
-			usbdfu_state = STATE_DFU_IDLE;
-		return 1;
-	case DFU_ABORT:
-		/* Abort returns to dfuIDLE state. */
-		usbdfu_state = STATE_DFU_IDLE;
-		return 1;
-	case DFU_UPLOAD:
-		/* Upload not supported for now. */
-		return 0;
-	case DFU_GETSTATUS: {
-		u32 bwPollTimeout = 0; /* 24-bit integer in DFU class spec */
-		(*buf)[0] = usbdfu_getstatus(usbd_dev, &bwPollTimeout);
-		(*buf)[1] = bwPollTimeout & 0xFF;
-		(*buf)[2] = (bwPollTimeout >> 8) & 0xFF;
-		(*buf)[3] = (bwPollTimeout >> 16) & 0xFF;
-		(*buf)[4] = usbdfu_state;
-		(*buf)[5] = 0; /* iString not used here */
-		*len = 6;
-		*complete = usbdfu_getstatus_complete;
-		return 1;
-		}
-	case DFU_GETSTATE:
-		/* Return state with no state transision. */
-		*buf[0] = usbdfu_state;
-		*len = 1;
-		return 1;
-	}
-
-	return 0;
+	/* USB device must detach, we just reset... */
+	scb_reset_system();
 }
 
 int main(void)
 {
 	usbd_device *usbd_dev;
+	usbd_dfu *dfu;
 
 	rcc_peripheral_enable_clock(&RCC_APB2ENR, RCC_APB2ENR_IOPAEN);
 
@@ -250,11 +168,11 @@ int main(void)
 
 	usbd_dev = usbd_init(&stm32f103_usb_driver, &dev, &config, usb_strings, 4);
 	usbd_set_control_buffer_size(usbd_dev, sizeof(usbd_control_buffer));
-	usbd_register_control_callback(
-				usbd_dev,
-				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
-				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
-				usbdfu_control_request);
+	/* Erasing a page and programming 1K take up to 50 ms. */
+	dfu = usb_dfu_init(usbd_dev, 0, dfu_function.bmAttributes,
+			   dfu_function.wTransferSize, dfu_buf, 50,
+			   usbdfu_download);
+	usb_dfu_set_callbacks(dfu, NULL, usbdfu_manifest);
 
 	gpio_clear(GPIOC, GPIO11);
 
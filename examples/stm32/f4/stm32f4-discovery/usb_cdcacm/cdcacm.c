@@ -41,11 +41,6 @@ static const struct usb_device_descriptor dev = {
 	.bNumConfigurations = 1,
 };
 
-/*
- * This notification endpoint isn't implemented. According to CDC spec it's
- * optional, but its absence causes a NULL pointer dereference in the
- * Linux cdc_acm driver.
- */
 static const struct usb_endpoint_descriptor comm_endp[] = {{
 	.bLength = USB_DT_ENDPOINT_SIZE,
 	.bDescriptorType = USB_DT_ENDPOINT,
@@ -164,64 +159,13 @@ static const char *usb_strings[] = {
 	"DEMO",
 };
 
-static int cdcacm_control_request(usbd_device *usbd_dev, struct usb_setup_data *req, u8 **buf,
-		u16 *len, void (**complete)(usbd_device *usbd_dev, struct usb_setup_data *req))
-{
-	(void)complete;
-	(void)buf;
-	(void)usbd_dev;
-
-	switch (req->bRequest) {
-	case USB_CDC_REQ_SET_CONTROL_LINE_STATE: {
-		/*
-		 * This Linux cdc_acm driver requires this to be implemented
-		 * even though it's optional in the CDC spec, and we don't
-		 * advertise it in the ACM functional descriptor.
-		 */
-		return 1;
-		}
-	case USB_CDC_REQ_SET_LINE_CODING:
-		if (*len < sizeof(struct usb_cdc_line_coding))
-			return 0;
-
-		return 1;
-	}
-	return 0;
-}
-
-static void cdcacm_data_rx_cb(usbd_device *usbd_dev, u8 ep)
-{
-	(void)ep;
-
-	char buf[64];
-	int len = usbd_ep_read_packet(usbd_dev, 0x01, buf, 64);
-
-	if (len) {
-		while (usbd_ep_write_packet(usbd_dev, 0x82, buf, len) == 0)
-			;
-	}
-
-	gpio_toggle(GPIOC, GPIO5);
-}
-
-static void cdcacm_set_config(usbd_device *usbd_dev, u16 wValue)
-{
-	(void)wValue;
-
-	usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_rx_cb);
-	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, NULL);
-	usbd_ep_setup(usbd_dev, 0x83, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
-
-	usbd_register_control_callback(
-				usbd_dev,
-				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
-				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
-				cdcacm_control_request);
-}
+static u8 tx_buf[256];
+static u8 rx_buf[256];
 
 int main(void)
 {
 	usbd_device *usbd_dev;
+	usbd_cdcacm *cdcacm;
 
 	rcc_clock_setup_hse_3v3(&hse_8mhz_3v3[CLOCK_3V3_120MHZ]);
 
@@ -233,8 +177,23 @@ int main(void)
 	gpio_set_af(GPIOA, GPIO_AF10, GPIO9 | GPIO11 | GPIO12);
 
 	usbd_dev = usbd_init(&otgfs_usb_driver, &dev, &config, usb_strings, 3);
-	usbd_register_set_config_callback(usbd_dev, cdcacm_set_config);
+	cdcacm = usb_cdcacm_init(usbd_dev, 0, 0x83, 0x82, 0x01, 64,
+				 tx_buf, sizeof(tx_buf), rx_buf, sizeof(rx_buf));
+
+	while (1) {
+		u8 buf[64];
+		u16 len;
 
-	while (1)
 		usbd_poll(usbd_dev);
+
+		/* Echo back what fits, the rest stays NAKed at the host. */
+		len = usb_cdcacm_write_space(cdcacm);
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+		len = usb_cdcacm_read(cdcacm, buf, len);
+		if (len) {
+			usb_cdcacm_write(cdcacm, buf, len);
+			gpio_toggle(GPIOC, GPIO5);
+		}
+	}
 }
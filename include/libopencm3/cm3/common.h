@@ -56,10 +56,19 @@ typedef uint64_t u64;
 
 
 /* Generic memory-mapped I/O accessor functions */
+#ifdef LIBOPENCM3_HOST
+/* Host builds access a simulated register space, see <libopencm3/host/mmio.h> */
+#include <libopencm3/host/mmio.h>
+#define MMIO8(addr)		(*(volatile u8 *)host_mmio_access((u32)(addr), 1))
+#define MMIO16(addr)		(*(volatile u16 *)host_mmio_access((u32)(addr), 2))
+#define MMIO32(addr)		(*(volatile u32 *)host_mmio_access((u32)(addr), 4))
+#define MMIO64(addr)		(*(volatile u64 *)host_mmio_access((u32)(addr), 8))
+#else
 #define MMIO8(addr)		(*(volatile u8 *)(addr))
 #define MMIO16(addr)		(*(volatile u16 *)(addr))
 #define MMIO32(addr)		(*(volatile u32 *)(addr))
 #define MMIO64(addr)		(*(volatile u64 *)(addr))
+#endif
 
 /* Generic bit definition */
 #define BIT0  (1<<0)
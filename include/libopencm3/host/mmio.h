@@ -0,0 +1,92 @@
+/** @defgroup host_mmio_defines Host MMIO Defines
+
+@brief <b>Simulated register space for host (Linux) builds of libopencm3</b>
+
+When the library is built with LIBOPENCM3_HOST defined, the MMIO8/16/32/64
+accessors in <libopencm3/cm3/common.h> no longer dereference the raw
+peripheral address. Every access is routed through host_mmio_access(), which
+maps the address into a block of simulated register memory. Blocks are
+allocated on first use with a granularity of HOST_MMIO_BLOCK_SIZE, which is
+the peripheral stride on the supported parts, so each peripheral gets its
+own register file.
+
+Test code can install hooks on an address range:
+
+ - The read hook is called before the driver loads from a register and may
+   update the register contents (e.g. to pop a status FIFO or to set a
+   ready flag the driver is polling for). A read-modify-write instruction
+   counts as a store only. This needs the page fault error code, on hosts
+   other than x86 the read hook is called before every access.
+ - The write hook is called for every store the driver makes through an
+   accessor, also when it leaves the stored value unchanged. The old and
+   new contents are passed, so the hook can implement write-one-to-clear
+   or toggle semantics by storing the result with host_mmio_poke().
+
+Loads and stores are detected with the page protection of the register
+blocks: a block is made inaccessible on every call of host_mmio_access(),
+a load opens it for reading and a store for writing. The write is
+reported at the next access (or at host_mmio_sync()). Accesses through a
+pointer kept from an earlier access, such as the in-place packet buffers,
+work on the register contents but only the first load and the first store
+after each access are reported. Hooks must use
+host_mmio_peek() and host_mmio_poke(), not the accessors.
+
+LGPL License Terms @ref lgpl_license
+ */
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBOPENCM3_HOST_MMIO_H
+#define LIBOPENCM3_HOST_MMIO_H
+
+#include <libopencm3/cm3/common.h>
+
+/**@{*/
+
+/** Size of one simulated register block in bytes. */
+#define HOST_MMIO_BLOCK_SIZE	0x400
+/** Maximum number of simulated register blocks. */
+#define HOST_MMIO_MAX_BLOCKS	256
+/** Maximum number of hooks that can be installed at the same time. */
+#define HOST_MMIO_MAX_HOOKS	16
+/** Maximum number of stores reported between two accesses. */
+#define HOST_MMIO_MAX_WRITES	8
+
+/** Called before a register in the hooked range is read. */
+typedef void (*host_mmio_read_hook)(u32 addr, u8 size);
+/** Called after a register in the hooked range has been written. */
+typedef void (*host_mmio_write_hook)(u32 addr, u8 size, u64 oldval,
+				     u64 newval);
+
+/**@}*/
+
+BEGIN_DECLS
+
+volatile void *host_mmio_access(u32 addr, u8 size);
+void host_mmio_sync(void);
+void host_mmio_reset(void);
+
+u64 host_mmio_peek(u32 addr, u8 size);
+void host_mmio_poke(u32 addr, u8 size, u64 value);
+
+int host_mmio_register_hooks(u32 base, u32 len,
+			     host_mmio_read_hook read_hook,
+			     host_mmio_write_hook write_hook);
+
+END_DECLS
+
+#endif
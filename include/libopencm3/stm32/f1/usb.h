@@ -28,21 +28,23 @@
 
 /* USB packet buffer memory base addr. */
 #define USB_PMA_BASE		0x40006000L
+/* USB packet buffer memory size in bytes, including the buffer table. */
+#define USB_PMA_SIZE		512
 
 /* --- USB general registers ----------------------------------------------- */
 
 /* USB Control register */
-#define USB_CNTR_REG		((volatile u32 *)(USB_DEV_FS_BASE + 0x40))
+#define USB_CNTR_REG		(&MMIO32(USB_DEV_FS_BASE + 0x40))
 /* USB Interrupt status register */
-#define USB_ISTR_REG		((volatile u32 *)(USB_DEV_FS_BASE + 0x44))
+#define USB_ISTR_REG		(&MMIO32(USB_DEV_FS_BASE + 0x44))
 /* USB Frame number register */
-#define USB_FNR_REG		((volatile u32 *)(USB_DEV_FS_BASE + 0x48))
+#define USB_FNR_REG		(&MMIO32(USB_DEV_FS_BASE + 0x48))
 /* USB Device address register */
-#define USB_DADDR_REG		((volatile u32 *)(USB_DEV_FS_BASE + 0x4C))
+#define USB_DADDR_REG		(&MMIO32(USB_DEV_FS_BASE + 0x4C))
 /* USB Buffer table address register */
-#define USB_BTABLE_REG		((volatile u32 *)(USB_DEV_FS_BASE + 0x50))
+#define USB_BTABLE_REG		(&MMIO32(USB_DEV_FS_BASE + 0x50))
 /* USB EP register */
-#define USB_EP_REG(EP)		((volatile u32 *)(USB_DEV_FS_BASE) + (EP))
+#define USB_EP_REG(EP)		(&MMIO32(USB_DEV_FS_BASE + (EP) * 4))
 
 /* --- USB control register masks / bits ----------------------------------- */
 
@@ -223,21 +225,39 @@
 		GET_REG(USB_EP_REG(EP)) & \
 		(USB_EP_NTOGGLE_MSK | USB_EP_RX_DTOG))
 
+/*
+ * Double buffered endpoints use the data toggle bit of the unused direction
+ * as the software buffer pointer (SW_BUF).
+ */
+#define USB_EP_TX_SW_BUF	USB_EP_RX_DTOG
+#define USB_EP_RX_SW_BUF	USB_EP_TX_DTOG
+
+/* Macros for toggling the SW_BUF bits */
+#define USB_TOG_EP_TX_SW_BUF(EP) \
+	SET_REG(USB_EP_REG(EP), \
+		(GET_REG(USB_EP_REG(EP)) & USB_EP_NTOGGLE_MSK) | \
+		USB_EP_TX_SW_BUF)
+
+#define USB_TOG_EP_RX_SW_BUF(EP) \
+	SET_REG(USB_EP_REG(EP), \
+		(GET_REG(USB_EP_REG(EP)) & USB_EP_NTOGGLE_MSK) | \
+		USB_EP_RX_SW_BUF)
+
 /* --- USB BTABLE registers ------------------------------------------------ */
 
 #define USB_GET_BTABLE		GET_REG(USB_BTABLE_REG)
 
 #define USB_EP_TX_ADDR(EP) \
-	((u32 *)(USB_PMA_BASE + (USB_GET_BTABLE + EP * 8 + 0) * 2))
+	(&MMIO32(USB_PMA_BASE + (USB_GET_BTABLE + EP * 8 + 0) * 2))
 
 #define USB_EP_TX_COUNT(EP) \
-	((u32 *)(USB_PMA_BASE + (USB_GET_BTABLE + EP * 8 + 2) * 2))
+	(&MMIO32(USB_PMA_BASE + (USB_GET_BTABLE + EP * 8 + 2) * 2))
 
 #define USB_EP_RX_ADDR(EP) \
-	((u32 *)(USB_PMA_BASE + (USB_GET_BTABLE + EP * 8 + 4) * 2))
+	(&MMIO32(USB_PMA_BASE + (USB_GET_BTABLE + EP * 8 + 4) * 2))
 
 #define USB_EP_RX_COUNT(EP) \
-	((u32 *)(USB_PMA_BASE + (USB_GET_BTABLE + EP * 8 + 6) * 2))
+	(&MMIO32(USB_PMA_BASE + (USB_GET_BTABLE + EP * 8 + 6) * 2))
 
 /* --- USB BTABLE manipulators --------------------------------------------- */
 
@@ -251,9 +271,9 @@
 #define USB_SET_EP_RX_COUNT(EP, COUNT)	SET_REG(USB_EP_RX_COUNT(EP), COUNT)
 
 #define USB_GET_EP_TX_BUFF(EP) \
-	(USB_PMA_BASE + (u8 *)(USB_GET_EP_TX_ADDR(EP) * 2))
+	(&MMIO8(USB_PMA_BASE + USB_GET_EP_TX_ADDR(EP) * 2))
 
 #define USB_GET_EP_RX_BUFF(EP) \
-	(USB_PMA_BASE + (u8 *)(USB_GET_EP_RX_ADDR(EP) * 2))
+	(&MMIO8(USB_PMA_BASE + USB_GET_EP_RX_ADDR(EP) * 2))
 
 #endif
@@ -231,6 +231,13 @@
 #define OTG_FS_DCFG_DAD			0x07F0
 #define OTG_FS_DCFG_PFIVL		0x1800
 
+/* OTG_FS Device status register (OTG_FS_DSTS) */
+#define OTG_FS_DSTS_FNSOF_MASK	(0x3fff << 8)
+#define OTG_FS_DSTS_FNSOF_ODD	(1 << 8)
+#define OTG_FS_DSTS_ENUMSPD_MASK	(0x3 << 1)
+#define OTG_FS_DSTS_ENUMSPD_HS		(0x0 << 1)
+#define OTG_FS_DSTS_ENUMSPD_FS		(0x3 << 1)
+
 /* OTG_FS Device IN Endpoint Common Interrupt Mask Register (OTG_FS_DIEPMSK) */
 /* Bits 31:10 - Reserved */
 #define OTG_FS_DIEPMSK_BIM		(1 << 9)
@@ -261,7 +268,9 @@
 #define OTG_FS_DIEPCTL0_EPENA		(1 << 31)
 #define OTG_FS_DIEPCTL0_EPDIS		(1 << 30)
 /* Bits 29:28 - Reserved */
+#define OTG_FS_DIEPCTLX_SODDFRM	(1 << 29)
 #define OTG_FS_DIEPCTLX_SD0PID		(1 << 28)
+#define OTG_FS_DIEPCTLX_SEVNFRM	(1 << 28)
 #define OTG_FS_DIEPCTL0_SNAK		(1 << 27)
 #define OTG_FS_DIEPCTL0_CNAK		(1 << 26)
 #define OTG_FS_DIEPCTL0_TXFNUM_MASK	(0xf << 22)
@@ -277,12 +286,15 @@
 #define OTG_FS_DIEPCTL0_MPSIZ_32	(0x1 << 0)
 #define OTG_FS_DIEPCTL0_MPSIZ_16	(0x2 << 0)
 #define OTG_FS_DIEPCTL0_MPSIZ_8		(0x3 << 0)
+#define OTG_FS_DIEPCTLX_MPSIZ_MASK	(0x7ff << 0)
 
 /* OTG_FS Device Control OUT Endpoint 0 Control Register (OTG_FS_DOEPCTL0) */
 #define OTG_FS_DOEPCTL0_EPENA		(1 << 31)
 #define OTG_FS_DOEPCTL0_EPDIS		(1 << 30)
 /* Bits 29:28 - Reserved */
+#define OTG_FS_DOEPCTLX_SODDFRM	(1 << 29)
 #define OTG_FS_DOEPCTLX_SD0PID		(1 << 28)
+#define OTG_FS_DOEPCTLX_SEVNFRM	(1 << 28)
 #define OTG_FS_DOEPCTL0_SNAK		(1 << 27)
 #define OTG_FS_DOEPCTL0_CNAK		(1 << 26)
 /* Bits 25:22 - Reserved */
@@ -298,6 +310,7 @@
 #define OTG_FS_DOEPCTL0_MPSIZ_32	(0x1 << 0)
 #define OTG_FS_DOEPCTL0_MPSIZ_16	(0x2 << 0)
 #define OTG_FS_DOEPCTL0_MPSIZ_8		(0x3 << 0)
+#define OTG_FS_DOEPCTLX_MPSIZ_MASK	(0x7ff << 0)
 
 /* OTG_FS Device IN Endpoint Interrupt Register (OTG_FS_DIEPINTx) */
 /* Bits 31:8 - Reserved */
@@ -331,4 +344,14 @@
 /* Bits 18:7 - Reserved */
 #define OTG_FS_DIEPSIZ0_XFRSIZ_MASK	(0x7f << 0)
 
+/* OTG_FS Device IN Endpoint x Transfer Size Register (OTG_FS_DIEPTSIZx) */
+#define OTG_FS_DIEPSIZX_MCNT_1	(0x1 << 29)
+#define OTG_FS_DIEPSIZX_PKTCNT_MASK	(0x3ff << 19)
+#define OTG_FS_DIEPSIZX_PKTCNT_SHIFT	19
+#define OTG_FS_DIEPSIZX_XFRSIZ_MASK	(0x7ffff << 0)
+
+/* OTG_FS Device IN Endpoint Transmit FIFO Status Register (OTG_FS_DTXFSTSx) */
+/* Bits 31:16 - Reserved */
+#define OTG_FS_DTXFSTS_INEPTFSAV_MASK	(0xffff << 0)
+
 #endif
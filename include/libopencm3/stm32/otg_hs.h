@@ -74,8 +74,10 @@
 #define OTG_DIEPTSIZ0			0x910
 #define OTG_DOEPTSIZ0			0xB10
 #define OTG_DIEPTSIZ(x)			(0x910 + 0x20*(x))
+#define OTG_DIEPDMA(x)			(0x914 + 0x20*(x))
 #define OTG_DTXFSTS(x)			(0x918 + 0x20*(x))
 #define OTG_DOEPTSIZ(x)			(0xB10 + 0x20*(x))
+#define OTG_DOEPDMA(x)			(0xB14 + 0x20*(x))
 
 /* Power and clock gating control and status register */
 #define OTG_PCGCCTL			0xE00
@@ -136,8 +138,10 @@
 #define OTG_HS_DIEPTSIZ0		MMIO32(USB_OTG_HS_BASE + OTG_DIEPTSIZ0)
 #define OTG_HS_DOEPTSIZ0		MMIO32(USB_OTG_HS_BASE + OTG_DOEPTSIZ0)
 #define OTG_HS_DIEPTSIZ(x)		MMIO32(USB_OTG_HS_BASE + OTG_DIEPTSIZ(x)))
+#define OTG_HS_DIEPDMA(x)		MMIO32(USB_OTG_HS_BASE + OTG_DIEPDMA(x))
 #define OTG_HS_DTXFSTS(x)		MMIO32(USB_OTG_HS_BASE + OTG_DTXFSTS(x))
 #define OTG_HS_DOEPTSIZ(x)		MMIO32(USB_OTG_HS_BASE + OTG_DOEPTSIZ(x))
+#define OTG_HS_DOEPDMA(x)		MMIO32(USB_OTG_HS_BASE + OTG_DOEPDMA(x))
 
 /* Power and clock gating control and status register */
 #define OTG_HS_PCGCCTL			MMIO32(USB_OTG_HS_BASE + OTG_PCGCCTL)
@@ -160,6 +164,13 @@
 
 /* OTG_FS AHB configuration register (OTG_HS_GAHBCFG) */
 #define OTG_HS_GAHBCFG_GINT		0x0001
+#define OTG_HS_GAHBCFG_HBSTLEN_MASK	(0xf << 1)
+#define OTG_HS_GAHBCFG_HBSTLEN_SINGLE	(0x0 << 1)
+#define OTG_HS_GAHBCFG_HBSTLEN_INCR	(0x1 << 1)
+#define OTG_HS_GAHBCFG_HBSTLEN_INCR4	(0x3 << 1)
+#define OTG_HS_GAHBCFG_HBSTLEN_INCR8	(0x5 << 1)
+#define OTG_HS_GAHBCFG_HBSTLEN_INCR16	(0x7 << 1)
+#define OTG_HS_GAHBCFG_DMAEN		0x0020
 #define OTG_HS_GAHBCFG_TXFELVL		0x0080
 #define OTG_HS_GAHBCFG_PTXFELVL		0x0100
 
@@ -293,6 +304,13 @@
 #define OTG_HS_DCFG_DAD			0x07F0
 #define OTG_HS_DCFG_PFIVL		0x1800
 
+/* OTG_HS Device status register (OTG_HS_DSTS) */
+#define OTG_HS_DSTS_FNSOF_MASK	(0x3fff << 8)
+#define OTG_HS_DSTS_FNSOF_ODD	(1 << 8)
+#define OTG_HS_DSTS_ENUMSPD_MASK	(0x3 << 1)
+#define OTG_HS_DSTS_ENUMSPD_HS		(0x0 << 1)
+#define OTG_HS_DSTS_ENUMSPD_FS		(0x3 << 1)
+
 /* OTG_FS Device IN Endpoint Common Interrupt Mask Register (OTG_HS_DIEPMSK) */
 /* Bits 31:10 - Reserved */
 #define OTG_HS_DIEPMSK_BIM		(1 << 9)
@@ -323,7 +341,9 @@
 #define OTG_HS_DIEPCTL0_EPENA		(1 << 31)
 #define OTG_HS_DIEPCTL0_EPDIS		(1 << 30)
 /* Bits 29:28 - Reserved */
+#define OTG_HS_DIEPCTLX_SODDFRM	(1 << 29)
 #define OTG_HS_DIEPCTLX_SD0PID		(1 << 28)
+#define OTG_HS_DIEPCTLX_SEVNFRM	(1 << 28)
 #define OTG_HS_DIEPCTL0_SNAK		(1 << 27)
 #define OTG_HS_DIEPCTL0_CNAK		(1 << 26)
 #define OTG_HS_DIEPCTL0_TXFNUM_MASK	(0xf << 22)
@@ -344,7 +364,9 @@
 #define OTG_HS_DOEPCTL0_EPENA		(1 << 31)
 #define OTG_HS_DOEPCTL0_EPDIS		(1 << 30)
 /* Bits 29:28 - Reserved */
+#define OTG_HS_DOEPCTLX_SODDFRM	(1 << 29)
 #define OTG_HS_DOEPCTLX_SD0PID		(1 << 28)
+#define OTG_HS_DOEPCTLX_SEVNFRM	(1 << 28)
 #define OTG_HS_DOEPCTL0_SNAK		(1 << 27)
 #define OTG_HS_DOEPCTL0_CNAK		(1 << 26)
 /* Bits 25:22 - Reserved */
@@ -393,4 +415,7 @@
 /* Bits 18:7 - Reserved */
 #define OTG_HS_DIEPSIZ0_XFRSIZ_MASK	(0x7f << 0)
 
+/* OTG_HS Device IN Endpoint x Transfer Size Register (OTG_HS_DIEPTSIZx) */
+#define OTG_HS_DIEPSIZX_MCNT_1	(0x1 << 29)
+
 #endif
@@ -0,0 +1,205 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AUDIO_H
+#define __AUDIO_H
+
+typedef struct _usbd_audio usbd_audio;
+
+/* Definitions of Audio Device Class from
+ * "Universal Serial Bus Device Class Definition for Audio Devices
+ * Release 1.0" and "Universal Serial Bus Device Class Definition for
+ * Audio Data Formats Release 1.0"
+ */
+
+/* Table A-1: Audio Interface Class Code */
+#define USB_CLASS_AUDIO				0x01
+
+/* Table A-2: Audio Interface Subclass Codes */
+#define USB_AUDIO_SUBCLASS_CONTROL		0x01
+#define USB_AUDIO_SUBCLASS_AUDIOSTREAMING	0x02
+#define USB_AUDIO_SUBCLASS_MIDISTREAMING	0x03
+
+/* Table A-4: Audio Class-specific Descriptor Types */
+#define USB_AUDIO_DT_CS_INTERFACE		0x24
+#define USB_AUDIO_DT_CS_ENDPOINT		0x25
+
+/* Table A-5: Audio Class-Specific AC Interface Descriptor Subtypes */
+#define USB_AUDIO_TYPE_HEADER			0x01
+#define USB_AUDIO_TYPE_INPUT_TERMINAL		0x02
+#define USB_AUDIO_TYPE_OUTPUT_TERMINAL		0x03
+#define USB_AUDIO_TYPE_MIXER_UNIT		0x04
+#define USB_AUDIO_TYPE_SELECTOR_UNIT		0x05
+#define USB_AUDIO_TYPE_FEATURE_UNIT		0x06
+
+/* Table A-6: Audio Class-Specific AS Interface Descriptor Subtypes */
+#define USB_AUDIO_TYPE_AS_GENERAL		0x01
+#define USB_AUDIO_TYPE_FORMAT_TYPE		0x02
+
+/* Table A-8: Audio Class-Specific Endpoint Descriptor Subtypes */
+#define USB_AUDIO_TYPE_EP_GENERAL		0x01
+
+/* Table A-9: Audio Class-Specific Request Codes */
+#define USB_AUDIO_REQ_SET_CUR			0x01
+#define USB_AUDIO_REQ_GET_CUR			0x81
+#define USB_AUDIO_REQ_SET_MIN			0x02
+#define USB_AUDIO_REQ_GET_MIN			0x82
+#define USB_AUDIO_REQ_SET_MAX			0x03
+#define USB_AUDIO_REQ_GET_MAX			0x83
+#define USB_AUDIO_REQ_SET_RES			0x04
+#define USB_AUDIO_REQ_GET_RES			0x84
+
+/* Table A-11: Feature Unit Control Selectors */
+#define USB_AUDIO_MUTE_CONTROL			0x01
+#define USB_AUDIO_VOLUME_CONTROL		0x02
+
+/* Table A-19: Endpoint Control Selectors */
+#define USB_AUDIO_SAMPLING_FREQ_CONTROL		0x01
+#define USB_AUDIO_PITCH_CONTROL			0x02
+
+/* Terminal Types: USB streaming, input and output terminals */
+#define USB_AUDIO_TERMINAL_USB_STREAMING	0x0101
+#define USB_AUDIO_TERMINAL_MICROPHONE		0x0201
+#define USB_AUDIO_TERMINAL_SPEAKER		0x0301
+#define USB_AUDIO_TERMINAL_HEADPHONES		0x0302
+
+/* Audio Data Formats Table A-1: Format Type Codes */
+#define USB_AUDIO_FORMAT_TYPE_I			0x01
+
+/* Audio Data Formats Table A-2: Audio Data Format Type I Codes */
+#define USB_AUDIO_FORMAT_PCM			0x0001
+
+/* Table 4-2: Class-Specific AC Interface Header Descriptor */
+struct usb_audio_header_descriptor {
+	u8 bLength;
+	u8 bDescriptorType;
+	u8 bDescriptorSubtype;
+	u16 bcdADC;
+	u16 wTotalLength;
+	u8 bInCollection;
+	u8 baInterfaceNr[1];
+	/* ... */
+} __attribute__((packed));
+
+/* Table 4-3: Input Terminal Descriptor */
+struct usb_audio_input_terminal_descriptor {
+	u8 bLength;
+	u8 bDescriptorType;
+	u8 bDescriptorSubtype;
+	u8 bTerminalID;
+	u16 wTerminalType;
+	u8 bAssocTerminal;
+	u8 bNrChannels;
+	u16 wChannelConfig;
+	u8 iChannelNames;
+	u8 iTerminal;
+} __attribute__((packed));
+
+/* Table 4-4: Output Terminal Descriptor */
+struct usb_audio_output_terminal_descriptor {
+	u8 bLength;
+	u8 bDescriptorType;
+	u8 bDescriptorSubtype;
+	u8 bTerminalID;
+	u16 wTerminalType;
+	u8 bAssocTerminal;
+	u8 bSourceID;
+	u8 iTerminal;
+} __attribute__((packed));
+
+/* Table 4-7: Feature Unit Descriptor, followed by bmaControls for the
+ * master channel and each logical channel, and iFeature. */
+struct usb_audio_feature_unit_descriptor {
+	u8 bLength;
+	u8 bDescriptorType;
+	u8 bDescriptorSubtype;
+	u8 bUnitID;
+	u8 bSourceID;
+	u8 bControlSize;
+	/* ... */
+} __attribute__((packed));
+
+/* Table 4-19: Class-Specific AS Interface Descriptor */
+struct usb_audio_as_general_descriptor {
+	u8 bLength;
+	u8 bDescriptorType;
+	u8 bDescriptorSubtype;
+	u8 bTerminalLink;
+	u8 bDelay;
+	u16 wFormatTag;
+} __attribute__((packed));
+
+/* Audio Data Formats Table 2-1: Type I Format Type Descriptor with one
+ * discrete sampling frequency. */
+struct usb_audio_format_type_i_descriptor {
+	u8 bLength;
+	u8 bDescriptorType;
+	u8 bDescriptorSubtype;
+	u8 bFormatType;
+	u8 bNrChannels;
+	u8 bSubframeSize;
+	u8 bBitResolution;
+	u8 bSamFreqType;
+	u8 tSamFreq[3];
+	/* ... */
+} __attribute__((packed));
+
+/* Table 4-20: Standard AS Isochronous Audio Data Endpoint Descriptor and
+ * Table 4-22: Standard AS Isochronous Synch Endpoint Descriptor.
+ * Audio endpoint descriptors are longer than the standard one, so the
+ * configuration has to be given with usbd_set_config_descriptors(). */
+struct usb_audio_endpoint_descriptor {
+	u8 bLength;
+	u8 bDescriptorType;
+	u8 bEndpointAddress;
+	u8 bmAttributes;
+	u16 wMaxPacketSize;
+	u8 bInterval;
+	u8 bRefresh;
+	u8 bSynchAddress;
+} __attribute__((packed));
+#define USB_AUDIO_DT_ENDPOINT_SIZE	sizeof(struct usb_audio_endpoint_descriptor)
+
+/* Table 4-21: Class-Specific AS Isochronous Audio Data Endpoint
+ * Descriptor */
+struct usb_audio_cs_endpoint_descriptor {
+	u8 bLength;
+	u8 bDescriptorType;
+	u8 bDescriptorSubtype;
+	u8 bmAttributes;
+	u8 bLockDelayUnits;
+	u16 wLockDelay;
+} __attribute__((packed));
+
+#define USB_AUDIO_EP_SAMPLING_FREQ		(1 << 0)
+#define USB_AUDIO_EP_PITCH			(1 << 1)
+#define USB_AUDIO_EP_MAX_PACKETS_ONLY		(1 << 7)
+
+/* USB 2.0 section 5.12.4.2: full speed feedback value, 10.14 samples per
+ * frame, sent as 3 bytes. */
+#define USB_AUDIO_FEEDBACK_SIZE			3
+
+usbd_audio *usb_audio_init(usbd_device *usbd_dev, u8 iface, u8 ep_out,
+			   u8 ep_fb, u16 ep_size, u32 rate, u8 frame_size,
+			   u8 *buf, u16 buf_size);
+void usb_audio_set_rate_callback(usbd_audio *audio,
+				 void (*callback)(usbd_audio *audio,
+						  u32 rate));
+u16 usb_audio_read(usbd_audio *audio, void *buf, u16 len);
+u32 usb_audio_get_feedback(usbd_audio *audio);
+
+#endif
@@ -20,6 +20,9 @@
 #ifndef __CDC_H
 #define __CDC_H
 
+typedef struct _usbd_cdcacm usbd_cdcacm;
+typedef struct _usbd_ncm usbd_ncm;
+
 /* Definitions of Communications Device Class from
  * "Universal Serial Bus Class Definitions for Communications Devices
  * Revision 1.2"
@@ -32,12 +35,18 @@
 #define USB_CDC_SUBCLASS_DLCM		0x01
 #define USB_CDC_SUBCLASS_ACM		0x02
 /* ... */
+#define USB_CDC_SUBCLASS_ECM		0x06
+/* ... */
+#define USB_CDC_SUBCLASS_NCM		0x0D
 
 /* Table 5 Communications Interface Class Control Protocol Codes */
 #define USB_CDC_PROTOCOL_NONE		0x00
 #define USB_CDC_PROTOCOL_AT		0x01
 /* ... */
 
+/* Table 7: Data Interface Class Protocol Codes */
+#define USB_CDC_PROTOCOL_NTB		0x01
+
 /* Table 6: Data Interface Class Code */
 #define USB_CLASS_DATA			0x0A
 
@@ -53,6 +62,9 @@
 /* ... */
 #define USB_CDC_TYPE_UNION		0x06
 /* ... */
+#define USB_CDC_TYPE_ETHERNET		0x0F
+/* ... */
+#define USB_CDC_TYPE_NCM		0x1A
 
 /* Table 15: Class-Specific Descriptor Header Format */
 struct usb_cdc_header_descriptor {
@@ -98,10 +110,15 @@ struct usb_cdc_acm_descriptor {
 /* Table 13: Class-Specific Request Codes for PSTN subclasses */
 /* ... */
 #define USB_CDC_REQ_SET_LINE_CODING		0x20
-/* ... */
+#define USB_CDC_REQ_GET_LINE_CODING		0x21
 #define USB_CDC_REQ_SET_CONTROL_LINE_STATE	0x22
+#define USB_CDC_REQ_SEND_BREAK			0x23
 /* ... */
 
+/* Table 18: Control Signal Bitmap Values for SetControlLineState */
+#define USB_CDC_CONTROL_LINE_DTR		(1 << 0)
+#define USB_CDC_CONTROL_LINE_RTS		(1 << 1)
+
 /* Table 17: Line Coding Structure */
 struct usb_cdc_line_coding {
 	u32 dwDTERate;
@@ -110,6 +127,16 @@ struct usb_cdc_line_coding {
 	u8 bDataBits;
 } __attribute__((packed));
 
+#define USB_CDC_1_STOP_BITS			0
+#define USB_CDC_1_5_STOP_BITS			1
+#define USB_CDC_2_STOP_BITS			2
+
+#define USB_CDC_NO_PARITY			0
+#define USB_CDC_ODD_PARITY			1
+#define USB_CDC_EVEN_PARITY			2
+#define USB_CDC_MARK_PARITY			3
+#define USB_CDC_SPACE_PARITY			4
+
 /* Table 30: Class-Specific Notification Codes for PSTN subclasses */
 /* ... */
 #define USB_CDC_NOTIFY_SERIAL_STATE		0x20
@@ -124,4 +151,119 @@ struct usb_cdc_notification {
 	u16 wLength;
 } __attribute__((packed));
 
+/* Table 31: UART State Bitmap Values */
+#define USB_CDC_SERIAL_STATE_DCD		(1 << 0)
+#define USB_CDC_SERIAL_STATE_DSR		(1 << 1)
+#define USB_CDC_SERIAL_STATE_BREAK		(1 << 2)
+#define USB_CDC_SERIAL_STATE_RING		(1 << 3)
+#define USB_CDC_SERIAL_STATE_FRAMING		(1 << 4)
+#define USB_CDC_SERIAL_STATE_PARITY		(1 << 5)
+#define USB_CDC_SERIAL_STATE_OVERRUN		(1 << 6)
+
+usbd_cdcacm *usb_cdcacm_init(usbd_device *usbd_dev, u8 iface, u8 ep_notif,
+			     u8 ep_in, u8 ep_out, u16 ep_size,
+			     u8 *tx_buf, u16 tx_size,
+			     u8 *rx_buf, u16 rx_size);
+void usb_cdcacm_set_flush_timeout(usbd_cdcacm *cdc, u8 frames);
+u16 usb_cdcacm_write(usbd_cdcacm *cdc, const void *buf, u16 len);
+void usb_cdcacm_flush(usbd_cdcacm *cdc);
+u16 usb_cdcacm_write_space(usbd_cdcacm *cdc);
+u16 usb_cdcacm_read(usbd_cdcacm *cdc, void *buf, u16 len);
+u16 usb_cdcacm_read_available(usbd_cdcacm *cdc);
+void usb_cdcacm_set_line_callback(usbd_cdcacm *cdc,
+				  void (*callback)(usbd_cdcacm *cdc));
+const struct usb_cdc_line_coding *usb_cdcacm_get_line_coding(
+							usbd_cdcacm *cdc);
+u16 usb_cdcacm_get_line_state(usbd_cdcacm *cdc);
+void usb_cdcacm_set_serial_state(usbd_cdcacm *cdc, u16 state);
+
+
+
+/* Definitions for Network Control Model devices from:
+ * "Universal Serial Bus Communications Class Subclass Specification for
+ * Ethernet Control Model Devices Revision 1.2" (ECM) and
+ * "Universal Serial Bus Communications Class Subclass Specification for
+ * Network Control Model Devices Revision 1.0" (NCM)
+ */
+
+/* ECM Table 3: Ethernet Networking Functional Descriptor */
+struct usb_cdc_ecm_descriptor {
+	u8 bFunctionLength;
+	u8 bDescriptorType;
+	u8 bDescriptorSubtype;
+	u8 iMACAddress;
+	u32 bmEthernetStatistics;
+	u16 wMaxSegmentSize;
+	u16 wNumberMCFilters;
+	u8 bNumberPowerFilters;
+} __attribute__((packed));
+
+/* NCM Table 5-2: NCM Functional Descriptor */
+struct usb_cdc_ncm_descriptor {
+	u8 bFunctionLength;
+	u8 bDescriptorType;
+	u8 bDescriptorSubtype;
+	u16 bcdNcmVersion;
+	u8 bmNetworkCapabilities;
+} __attribute__((packed));
+
+/* NCM Table 6-2: Class-Specific Request Codes for Network Control Model */
+#define USB_CDC_REQ_SET_ETHERNET_PACKET_FILTER	0x43
+#define USB_CDC_REQ_GET_NTB_PARAMETERS		0x80
+#define USB_CDC_REQ_GET_NTB_FORMAT		0x83
+#define USB_CDC_REQ_SET_NTB_FORMAT		0x84
+#define USB_CDC_REQ_GET_NTB_INPUT_SIZE		0x85
+#define USB_CDC_REQ_SET_NTB_INPUT_SIZE		0x86
+
+/* NCM Table 6-3: NTB Parameter Structure */
+struct usb_cdc_ncm_ntb_parameters {
+	u16 wLength;
+	u16 bmNtbFormatsSupported;
+	u32 dwNtbInMaxSize;
+	u16 wNdpInDivisor;
+	u16 wNdpInPayloadRemainder;
+	u16 wNdpInAlignment;
+	u16 wReserved;
+	u32 dwNtbOutMaxSize;
+	u16 wNdpOutDivisor;
+	u16 wNdpOutPayloadRemainder;
+	u16 wNdpOutAlignment;
+	u16 wNtbOutMaxDatagrams;
+} __attribute__((packed));
+
+/* NCM Table 6-4: Class-Specific Notification Codes */
+#define USB_CDC_NOTIFY_NETWORK_CONNECTION	0x00
+#define USB_CDC_NOTIFY_SPEED_CHANGE		0x2A
+
+/* NCM Table 3-1: 16-bit NCM Transfer Header */
+struct usb_cdc_ncm_nth16 {
+	u32 dwSignature;
+	u16 wHeaderLength;
+	u16 wSequence;
+	u16 wBlockLength;
+	u16 wNdpIndex;
+} __attribute__((packed));
+
+#define USB_CDC_NCM_NTH16_SIGNATURE		0x484D434E	/* "NCMH" */
+
+/* NCM Table 3-3: 16-bit NCM Datagram Pointer Table, followed by
+ * wDatagramIndex/wDatagramLength pairs ending with a zero pair. */
+struct usb_cdc_ncm_ndp16 {
+	u32 dwSignature;
+	u16 wLength;
+	u16 wNextNdpIndex;
+} __attribute__((packed));
+
+#define USB_CDC_NCM_NDP16_SIGNATURE		0x304D434E	/* "NCM0" */
+
+usbd_ncm *usb_ncm_init(usbd_device *usbd_dev, u8 iface, u8 ep_notif,
+		       u8 ep_in, u8 ep_out, u16 ep_size,
+		       u8 *in_buf, u16 in_size, u8 *out_buf, u16 out_size);
+void usb_ncm_set_flush_timeout(usbd_ncm *ncm, u8 frames);
+void usb_ncm_set_link(usbd_ncm *ncm, bool up);
+u8 *usb_ncm_send_alloc(usbd_ncm *ncm, u16 len);
+void usb_ncm_send_commit(usbd_ncm *ncm, u16 len);
+int usb_ncm_send(usbd_ncm *ncm, const void *frame, u16 len);
+const u8 *usb_ncm_recv(usbd_ncm *ncm, u16 *len);
+
 #endif
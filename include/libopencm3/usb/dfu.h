@@ -20,6 +20,8 @@
 #ifndef __DFU_H
 #define __DFU_H
 
+typedef struct _usbd_dfu usbd_dfu;
+
 enum dfu_req {
 	DFU_DETACH,
 	DFU_DNLOAD,
@@ -78,4 +80,16 @@ struct usb_dfu_descriptor {
 	u16 bcdDFUVersion;
 } __attribute__((packed));
 
+/* Returned by a download function that finishes through usb_dfu_complete(). */
+#define USB_DFU_PENDING			-1
+
+usbd_dfu *usb_dfu_init(usbd_device *usbd_dev, u8 iface, u8 attributes,
+		       u16 transfer_size, u8 *buf, u16 block_time,
+		       int (*download)(u16 block_num, const u8 *data,
+				       u16 len));
+void usb_dfu_set_callbacks(usbd_dfu *dfu,
+			   u16 (*upload)(u16 block_num, u8 *data, u16 len),
+			   void (*manifest)(void));
+void usb_dfu_complete(usbd_dfu *dfu, int status);
+
 #endif
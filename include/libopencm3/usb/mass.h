@@ -46,6 +46,7 @@ typedef struct _usbd_mass_storage usbd_mass_storage;
 #define USB_MASS_PROTOCOL_CBI		0x00
 #define USB_MASS_PROTOCOL_CBI_ALT	0x01
 #define USB_MASS_PROTOCOL_BBB		0x50
+#define USB_MASS_PROTOCOL_UAS		0x62
 
 /* (B) Table 4.1 Mass Storage Request Codes */
 #define USB_MASS_REQ_CODES_ADSC		0x00
@@ -58,9 +59,33 @@ typedef struct _usbd_mass_storage usbd_mass_storage;
 #define USB_MASS_REQ_BULK_ONLY_RESET	0xFF
 #define USB_MASS_REQ_GET_MAX_LUN	0xFE
 
+/* (C) Table 9: Pipe Usage Descriptor, follows each UAS endpoint descriptor.
+ *
+ * (C) "Universal Serial Bus Mass Storage Class - USB Attached SCSI
+ *      Protocol (UASP) Revision 1.0"
+ */
+#define USB_DT_PIPE_USAGE		0x24
+
+struct usb_mass_pipe_usage_descriptor {
+	u8 bLength;
+	u8 bDescriptorType;
+	u8 bPipeID;
+	u8 Reserved;
+} __attribute__((packed));
+#define USB_DT_PIPE_USAGE_SIZE		4
+
+/* (C) Table 10: Pipe IDs */
+#define USB_MASS_PIPE_COMMAND		0x01
+#define USB_MASS_PIPE_STATUS		0x02
+#define USB_MASS_PIPE_DATA_IN		0x03
+#define USB_MASS_PIPE_DATA_OUT		0x04
+
+/* Returned by a block callback that finishes through usb_mass_complete(). */
+#define USB_MASS_PENDING		1
+
 usbd_mass_storage *usb_mass_init(usbd_device *usbd_dev,
-				 u8 ep_in, u8 ep_in_size,
-				 u8 ep_out, u8 ep_out_size,
+				 u8 ep_in, u16 ep_in_size,
+				 u8 ep_out, u16 ep_out_size,
 				 const char *vendor_id,
 				 const char *product_id,
 				 const char *product_revision_level,
@@ -68,4 +93,19 @@ usbd_mass_storage *usb_mass_init(usbd_device *usbd_dev,
 				 int (*read_block)(u32 lba, u8 *copy_to),
 				 int (*write_block)(u32 lba, const u8 *copy_from));
 
+int usb_mass_set_block_io(usbd_mass_storage *ms,
+			  int (*read_blocks)(u32 lba, u32 count, u8 *copy_to),
+			  int (*write_blocks)(u32 lba, u32 count,
+					      const u8 *copy_from),
+			  u8 *buf, u32 buf_size);
+int usb_mass_set_block_size(usbd_mass_storage *ms, u32 block_size);
+void usb_mass_complete(usbd_mass_storage *ms, int status);
+int usb_mass_set_write_cache(usbd_mass_storage *ms, u8 *cache,
+			     u32 unit_size);
+void usb_mass_set_flush_timeout(usbd_mass_storage *ms, u16 timeout);
+void usb_mass_flush(usbd_mass_storage *ms);
+void usb_mass_set_uas(usbd_mass_storage *ms, u8 iface, u8 ep_cmd,
+		      u8 ep_status, u8 ep_data_in, u8 ep_data_out,
+		      u16 ep_size);
+
 #endif
@@ -37,8 +37,13 @@ typedef struct _usbd_device usbd_device;
 extern const usbd_driver stm32f103_usb_driver;
 extern const usbd_driver stm32f107_usb_driver;
 extern const usbd_driver stm32f207_usb_driver;
+/* The OTG HS core moving the packets with its own DMA. It works straight
+ * on the buffers of usbd_ep_transfer_in() and usbd_ep_transfer_out() that
+ * are word aligned, these must not be in the CCM. */
+extern const usbd_driver stm32f207_usb_driver_dma;
 #define otgfs_usb_driver stm32f107_usb_driver
 #define otghs_usb_driver stm32f207_usb_driver
+#define otghs_usb_driver_dma stm32f207_usb_driver_dma
 
 /* Static buffer for control transactions:
  * This is defined as weak in the library, applicaiton
@@ -59,8 +64,10 @@ extern void usbd_register_suspend_callback(usbd_device *usbd_dev,
 					   void (*callback)(void));
 extern void usbd_register_resume_callback(usbd_device *usbd_dev,
 					  void (*callback)(void));
-extern void usbd_register_sof_callback(usbd_device *usbd_dev,
-				       void (*callback)(void));
+typedef void (*usbd_sof_callback)(usbd_device *usbd_dev);
+
+extern int usbd_register_sof_callback(usbd_device *usbd_dev,
+				      usbd_sof_callback callback);
 
 typedef int (*usbd_control_callback)(usbd_device *usbd_dev,
 		struct usb_setup_data *req, u8 **buf, u16 *len,
@@ -73,15 +80,55 @@ extern int usbd_register_control_callback(usbd_device *usbd_dev, u8 type,
 					  usbd_control_callback callback);
 
 /* <usb_standard.c> */
-extern void usbd_register_set_config_callback(usbd_device *usbd_dev,
-		void (*callback)(usbd_device *usbd_dev, u16 wValue));
+typedef void (*usbd_set_config_callback)(usbd_device *usbd_dev,
+					 u16 wValue);
+
+extern int usbd_register_set_config_callback(usbd_device *usbd_dev,
+					     usbd_set_config_callback callback);
+extern u16 usbd_build_config_descriptor(const struct usb_config_descriptor *cfg,
+					u8 *buf, u16 len);
+extern void usbd_set_config_descriptors(usbd_device *usbd_dev,
+					const u8 * const *raw);
+
+/* Pre-encoded string descriptors for one language. */
+struct usbd_string_lang {
+	u16 langid;
+	int num_strings;
+	const u8 * const *strings;	/* Index 0 maps to USB index 1. */
+};
+
+extern u16 usbd_build_string_descriptor(const char *str, u8 *buf, u16 len);
+extern void usbd_set_string_descriptors(usbd_device *usbd_dev,
+					const struct usbd_string_lang *langs,
+					int num_langs);
+
+/* Event counters, updated by usbd_poll(). */
+struct usbd_poll_stats {
+	u32 polls;	/* Number of calls to usbd_poll(). */
+	u32 events;	/* Number of events handled in total. */
+	u16 last;	/* Number of events handled by the last call. */
+	u16 max;	/* Largest number of events handled by one call. */
+	u32 dropped;	/* Events lost because the deferred queue was full. */
+};
+
+extern void usbd_set_poll_budget(usbd_device *usbd_dev, u16 budget);
+extern const struct usbd_poll_stats *usbd_get_poll_stats(
+					usbd_device *usbd_dev);
 
 /* Functions to be provided by the hardware abstraction layer */
 extern void usbd_poll(usbd_device *usbd_dev);
+extern void usbd_set_deferred(usbd_device *usbd_dev, bool deferred);
+extern void usbd_process(usbd_device *usbd_dev);
 extern void usbd_disconnect(usbd_device *usbd_dev, bool disconnected);
 
+/* Flag for the type argument of usbd_ep_setup(): use the hardware double
+ * buffering if the driver supports it for this endpoint type. Drivers
+ * without support ignore it. */
+#define USBD_EP_DOUBLEBUF	0x80
+
 extern void usbd_ep_setup(usbd_device *usbd_dev, u8 addr, u8 type, u16 max_size,
 	      void (*callback)(usbd_device *usbd_dev, u8 ep));
+extern u16 usbd_get_free_memory(usbd_device *usbd_dev);
 
 extern u16 usbd_ep_write_packet(usbd_device *usbd_dev, u8 addr,
 				const void *buf, u16 len);
@@ -94,6 +141,61 @@ extern u8 usbd_ep_stall_get(usbd_device *usbd_dev, u8 addr);
 
 extern void usbd_ep_nak_set(usbd_device *usbd_dev, u8 addr, u8 nak);
 
+typedef void (*usbd_transfer_callback)(usbd_device *usbd_dev, u8 ep, u32 len);
+
+extern int usbd_ep_transfer_in(usbd_device *usbd_dev, u8 addr,
+			       const void *buf, u32 len, bool zlp,
+			       usbd_transfer_callback callback);
+extern int usbd_ep_transfer_out(usbd_device *usbd_dev, u8 addr,
+				void *buf, u32 len,
+				usbd_transfer_callback callback);
+
+/* Entry of an IN endpoint queue, see usbd_ep_queue_setup(). */
+struct usbd_queue_entry {
+	const void *buf;
+	u32 len;
+};
+
+extern int usbd_ep_queue_setup(usbd_device *usbd_dev, u8 addr,
+			       struct usbd_queue_entry *entries, u8 size,
+			       usbd_transfer_callback callback);
+extern int usbd_ep_queue_in(usbd_device *usbd_dev, u8 addr,
+			    const void *buf, u32 len);
+
+/* Fills (IN) or drains (OUT) one packet of an isochronous endpoint, see
+ * usbd_ep_iso_setup(). */
+typedef u16 (*usbd_iso_callback)(usbd_device *usbd_dev, u8 ep, u8 *buf,
+				 u16 len);
+
+extern void usbd_ep_iso_setup(usbd_device *usbd_dev, u8 addr, u16 max_size,
+			      u8 *buf, usbd_iso_callback callback);
+
+/* Packet buffer of an endpoint accessed in place, see usbd_ep_write_begin()
+ * and usbd_ep_read_begin(). Filled in by the driver. */
+struct usbd_ep_buffer {
+	usbd_device *usbd_dev;
+	volatile void *mem;	/* Next word of the buffer, or the FIFO. */
+	u8 addr;
+	u8 width;		/* Bytes per word, 2 or 4. */
+	u8 stride;		/* Bytes to the next word, 0 for a FIFO. */
+	u8 count;		/* Bytes held in word. */
+	u8 buffer;		/* Hardware buffer, for the driver. */
+	u32 word;		/* Word being assembled or taken apart. */
+	u16 len;		/* Bytes written or read so far. */
+	u16 size;		/* Length of the packet. */
+};
+
+extern int usbd_ep_write_begin(usbd_device *usbd_dev, u8 addr, u16 len,
+			       struct usbd_ep_buffer *buf);
+extern u16 usbd_ep_buffer_write(struct usbd_ep_buffer *buf, const void *data,
+				u16 len);
+extern void usbd_ep_write_end(struct usbd_ep_buffer *buf);
+extern int usbd_ep_read_begin(usbd_device *usbd_dev, u8 addr,
+			      struct usbd_ep_buffer *buf);
+extern u16 usbd_ep_buffer_read(struct usbd_ep_buffer *buf, void *data,
+			       u16 len);
+extern void usbd_ep_read_end(struct usbd_ep_buffer *buf);
+
 /* Optional */
 extern void usbd_cable_connect(usbd_device *usbd_dev, u8 on);
 
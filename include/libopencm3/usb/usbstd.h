@@ -186,6 +186,7 @@ struct usb_endpoint_descriptor {
 #define USB_DT_ENDPOINT_SIZE		sizeof(struct usb_endpoint_descriptor)
 
 /* USB Endpoint Descriptor bmAttributes bit definitions */
+#define USB_ENDPOINT_ATTR_TYPE			0x03
 #define USB_ENDPOINT_ATTR_CONTROL		0x00
 #define USB_ENDPOINT_ATTR_ISOCHRONOUS		0x01
 #define USB_ENDPOINT_ATTR_BULK			0x02
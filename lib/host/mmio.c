@@ -0,0 +1,416 @@
+/** @defgroup host_mmio_file Host MMIO
+
+@brief <b>libopencm3 simulated register space for host builds</b>
+
+Backs the MMIO accessors with lazily allocated register blocks and calls
+the read/write hooks installed by test code.
+
+LGPL License Terms @ref lgpl_license
+*/
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+/* For REG_ERR in ucontext_t. */
+#define _GNU_SOURCE
+#include <signal.h>
+#include <ucontext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <libopencm3/host/mmio.h>
+
+/*
+ * The register memory of a block is a page of its own, so its protection
+ * can be changed on its own, see host_mmio_fault().
+ */
+struct host_mmio_block {
+	u32 base;
+	u8 *mem;
+	int prot;
+};
+
+struct host_mmio_hook {
+	u32 base;
+	u32 len;
+	host_mmio_read_hook read_hook;
+	host_mmio_write_hook write_hook;
+};
+
+static struct host_mmio_block *blocks[HOST_MMIO_MAX_BLOCKS];
+static int num_blocks;
+static long page_size;
+
+static struct host_mmio_hook hooks[HOST_MMIO_MAX_HOOKS];
+static int num_hooks;
+
+/*
+ * The last accesses, to find the register a store faulted on. In
+ * 'REG_A = REG_B' the store to REG_A happens after both accesses.
+ */
+static struct {
+	u32 addr;
+	u8 size;
+} recent[4];
+static int recent_next;
+
+/*
+ * On x86 the page fault error code tells a load from a store, so the read
+ * hook is only called for loads, from host_mmio_fault(). Elsewhere it is
+ * called for every access, from host_mmio_access().
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define HOST_MMIO_FAULT_WRITE(ctx) \
+	(((ucontext_t *)(ctx))->uc_mcontext.gregs[REG_ERR] & 2)
+#endif
+
+/* Stores since the last access, reported by host_mmio_sync(). */
+static struct {
+	u32 addr;
+	u8 size;
+	u64 value;
+} writes[HOST_MMIO_MAX_WRITES];
+static int num_writes;
+
+static u64 host_mmio_load(volatile void *reg, u8 size)
+{
+	switch (size) {
+	case 1:
+		return *(volatile u8 *)reg;
+	case 2:
+		return *(volatile u16 *)reg;
+	case 4:
+		return *(volatile u32 *)reg;
+	default:
+		return *(volatile u64 *)reg;
+	}
+}
+
+static void host_mmio_store(volatile void *reg, u8 size, u64 value)
+{
+	switch (size) {
+	case 1:
+		*(volatile u8 *)reg = value;
+		break;
+	case 2:
+		*(volatile u16 *)reg = value;
+		break;
+	case 4:
+		*(volatile u32 *)reg = value;
+		break;
+	default:
+		*(volatile u64 *)reg = value;
+		break;
+	}
+}
+
+static void host_mmio_protect(struct host_mmio_block *block, int prot)
+{
+	if (block->prot == prot)
+		return;
+
+	if (mprotect(block->mem, page_size, prot))
+		abort();
+	block->prot = prot;
+}
+
+/* Makes all blocks inaccessible, so the next use of each one faults. */
+static void host_mmio_close(void)
+{
+	int i;
+
+	for (i = 0; i < num_blocks; i++)
+		host_mmio_protect(blocks[i], PROT_NONE);
+}
+
+static struct host_mmio_hook *host_mmio_find_hook(u32 addr)
+{
+	int i;
+
+	for (i = 0; i < num_hooks; i++) {
+		if ((addr >= hooks[i].base) &&
+		    (addr - hooks[i].base < hooks[i].len))
+			return &hooks[i];
+	}
+
+	return NULL;
+}
+
+/* The register of the access a fault belongs to. */
+static void host_mmio_fault_reg(struct host_mmio_block *block, u8 *fault,
+				u32 *addr, u8 *size)
+{
+	int i;
+
+	*addr = block->base + (fault - block->mem);
+	for (i = 0; i < 4; i++) {
+		if (recent[i].size && (*addr >= recent[i].addr) &&
+		    (*addr < recent[i].addr + recent[i].size)) {
+			*addr = recent[i].addr;
+			*size = recent[i].size;
+			return;
+		}
+	}
+
+	*addr &= ~3;
+	*size = 4;
+}
+
+static void host_mmio_fault(int sig, siginfo_t *info, void *context)
+{
+	u8 *fault = info->si_addr;
+	struct host_mmio_block *block = NULL;
+	struct host_mmio_hook *hook;
+	bool write;
+	u32 addr;
+	u8 size;
+	int i;
+
+	for (i = 0; i < num_blocks; i++) {
+		if ((fault >= blocks[i]->mem) &&
+		    (fault < blocks[i]->mem + page_size)) {
+			block = blocks[i];
+			break;
+		}
+	}
+
+	/* Not ours, or a store that still faults: crash as usual. */
+	if (!block || (block->prot == (PROT_READ | PROT_WRITE))) {
+		signal(sig, SIG_DFL);
+		return;
+	}
+
+	/*
+	 * A fault on a readable block is a store. Without the error code a
+	 * load or store is not known on the first fault, the block is opened
+	 * for reading and a store faults again.
+	 */
+	write = (block->prot == PROT_READ);
+#ifdef HOST_MMIO_FAULT_WRITE
+	write = write || HOST_MMIO_FAULT_WRITE(context);
+#else
+	(void)context;
+#endif
+	host_mmio_fault_reg(block, fault, &addr, &size);
+
+	if (!write) {
+#ifdef HOST_MMIO_FAULT_WRITE
+		hook = host_mmio_find_hook(addr);
+		if (hook && hook->read_hook) {
+			hook->read_hook(addr, size);
+			host_mmio_close();
+		}
+#else
+		(void)hook;
+#endif
+		host_mmio_protect(block, PROT_READ);
+		return;
+	}
+
+	if (num_writes < HOST_MMIO_MAX_WRITES) {
+		host_mmio_protect(block, PROT_READ);
+		writes[num_writes].addr = addr;
+		writes[num_writes].size = size;
+		writes[num_writes].value = host_mmio_load(
+			&block->mem[addr - block->base], size);
+		num_writes++;
+	}
+
+	host_mmio_protect(block, PROT_READ | PROT_WRITE);
+}
+
+static struct host_mmio_block *host_mmio_block(u32 addr)
+{
+	u32 base = addr & ~(HOST_MMIO_BLOCK_SIZE - 1);
+	struct host_mmio_block *block;
+	struct sigaction sa;
+	int i;
+
+	for (i = 0; i < num_blocks; i++) {
+		if (blocks[i]->base == base)
+			return blocks[i];
+	}
+
+	if (num_blocks == HOST_MMIO_MAX_BLOCKS)
+		abort();
+
+	if (!page_size) {
+		page_size = sysconf(_SC_PAGESIZE);
+		if (page_size < HOST_MMIO_BLOCK_SIZE)
+			abort();
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = host_mmio_fault;
+		sa.sa_flags = SA_SIGINFO;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGSEGV, &sa, NULL))
+			abort();
+	}
+
+	block = calloc(1, sizeof(*block));
+	if (!block)
+		abort();
+	block->base = base;
+	block->mem = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (block->mem == MAP_FAILED)
+		abort();
+	block->prot = PROT_READ | PROT_WRITE;
+	blocks[num_blocks++] = block;
+
+	return block;
+}
+
+/* Register memory for our own use, without faults. */
+static volatile void *host_mmio_lookup(u32 addr)
+{
+	struct host_mmio_block *block = host_mmio_block(addr);
+
+	host_mmio_protect(block, PROT_READ | PROT_WRITE);
+	return &block->mem[addr - block->base];
+}
+
+/** @brief Report the pending register writes to the write hooks.
+
+Called automatically at the start of every register access. Test code
+should call it after the last access of the code under test before it
+inspects the register space.
+*/
+void host_mmio_sync(void)
+{
+	struct host_mmio_hook *hook;
+	u64 value;
+	int i, n;
+
+	/* Hooks may not add to writes, they use host_mmio_poke(). */
+	n = num_writes;
+	num_writes = 0;
+
+	for (i = 0; i < n; i++) {
+		value = host_mmio_load(host_mmio_lookup(writes[i].addr),
+				       writes[i].size);
+		hook = host_mmio_find_hook(writes[i].addr);
+		if (hook && hook->write_hook)
+			hook->write_hook(writes[i].addr, writes[i].size,
+					 writes[i].value, value);
+	}
+
+	host_mmio_close();
+}
+
+/** @brief Resolve a peripheral address into the simulated register space.
+
+This is the target of the MMIO accessors in host builds.
+
+@param[in] addr Peripheral address as used on the target.
+@param[in] size Width of the access in bytes.
+@returns Pointer to the simulated register.
+*/
+volatile void *host_mmio_access(u32 addr, u8 size)
+{
+	struct host_mmio_hook *hook;
+	struct host_mmio_block *block;
+
+	host_mmio_sync();
+
+#ifndef HOST_MMIO_FAULT_WRITE
+	hook = host_mmio_find_hook(addr);
+	if (hook && hook->read_hook)
+		hook->read_hook(addr, size);
+#else
+	(void)hook;
+#endif
+
+	block = host_mmio_block(addr);
+	recent[recent_next].addr = addr;
+	recent[recent_next].size = size;
+	recent_next = (recent_next + 1) % 4;
+
+	host_mmio_close();
+
+	return &block->mem[addr - block->base];
+}
+
+/** @brief Read a simulated register without calling any hook.
+
+@param[in] addr Peripheral address.
+@param[in] size Width of the access in bytes.
+@returns Register contents.
+*/
+u64 host_mmio_peek(u32 addr, u8 size)
+{
+	return host_mmio_load(host_mmio_lookup(addr), size);
+}
+
+/** @brief Write a simulated register without calling any hook.
+
+Hooks use this to apply the hardware semantics of a register write.
+
+@param[in] addr Peripheral address.
+@param[in] size Width of the access in bytes.
+@param[in] value New register contents.
+*/
+void host_mmio_poke(u32 addr, u8 size, u64 value)
+{
+	host_mmio_store(host_mmio_lookup(addr), size, value);
+}
+
+/** @brief Install read and/or write hooks for an address range.
+
+@param[in] base First peripheral address covered by the hooks.
+@param[in] len Length of the covered range in bytes.
+@param[in] read_hook Called before a load, may be NULL.
+@param[in] write_hook Called after a register was written, may be NULL.
+@returns 0 if successful, -1 if all hook slots are in use.
+*/
+int host_mmio_register_hooks(u32 base, u32 len,
+			     host_mmio_read_hook read_hook,
+			     host_mmio_write_hook write_hook)
+{
+	if (num_hooks == HOST_MMIO_MAX_HOOKS)
+		return -1;
+
+	hooks[num_hooks].base = base;
+	hooks[num_hooks].len = len;
+	hooks[num_hooks].read_hook = read_hook;
+	hooks[num_hooks].write_hook = write_hook;
+	num_hooks++;
+
+	return 0;
+}
+
+/** @brief Drop all hooks and clear the simulated register space. */
+void host_mmio_reset(void)
+{
+	int i;
+
+	for (i = 0; i < num_blocks; i++) {
+		munmap(blocks[i]->mem, page_size);
+		free(blocks[i]);
+	}
+
+	memset(blocks, 0, sizeof(blocks));
+	num_blocks = 0;
+	memset(hooks, 0, sizeof(hooks));
+	num_hooks = 0;
+	memset(recent, 0, sizeof(recent));
+	num_writes = 0;
+}
+
+/**@}*/
@@ -0,0 +1,275 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A DFU download as a host tool runs it, on a simulated flash that takes
+ * BLOCK_TIME ms to program a block. The host waits bwPollTimeout after
+ * each GETSTATUS that reports dfuDNBUSY, each request takes a frame. Time
+ * is counted in SOFs. The download must take less than if each block was
+ * programmed while the host waits, and the same on a full and a high
+ * speed bus, where there are 8 SOFs per ms. An SOF callback of the
+ * application registered after DFU must not take its time base away.
+ */
+
+#include <string.h>
+#include <libopencm3/stm32/otg_fs.h>
+#include <libopencm3/stm32/otg_hs.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/dfu.h>
+#include "otg_model.h"
+#include "test.h"
+
+#define TRANSFER_SIZE	1024
+#define BLOCKS		16
+#define BLOCK_TIME	20
+
+/* The control buffer has to hold a block. */
+u8 usbd_control_buffer[TRANSFER_SIZE];
+
+static const struct usb_device_descriptor dev = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0x0483,
+	.idProduct = 0xdf11,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_interface_descriptor iface = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceClass = 0xfe,
+	.bInterfaceSubClass = 1,
+	.bInterfaceProtocol = 2,
+};
+
+static const struct usb_interface ifaces[] = {{
+	.num_altsetting = 1,
+	.altsetting = &iface,
+}};
+
+static const struct usb_config_descriptor config = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 0x32,
+	.interface = ifaces,
+};
+
+static usbd_device *usbd_dev;
+static usbd_dfu *dfu;
+static u8 dfu_buf[2 * TRANSFER_SIZE];
+
+static u8 flash[BLOCKS * TRANSFER_SIZE];
+static u8 image[BLOCKS * TRANSFER_SIZE];
+static bool manifested;
+
+/* SOFs sent so far and per ms, and seen by the application. */
+static u32 sofs;
+static u32 sofs_per_ms;
+static u32 app_sofs;
+
+/* Block being programmed, done at SOF deadline. */
+static struct {
+	bool active;
+	u16 block_num;
+	const u8 *data;
+	u16 len;
+	u32 deadline;
+} program;
+
+static int download(u16 block_num, const u8 *data, u16 len)
+{
+	CHECK(!program.active);
+	CHECK((block_num + 1) * TRANSFER_SIZE <= (int)sizeof(flash));
+	program.active = true;
+	program.block_num = block_num;
+	program.data = data;
+	program.len = len;
+	program.deadline = sofs + BLOCK_TIME * sofs_per_ms;
+	return USB_DFU_PENDING;
+}
+
+static void manifest(void)
+{
+	CHECK(!program.active);
+	manifested = true;
+}
+
+/* Registered after DFU, both must see every SOF. */
+static void app_sof(usbd_device *dev)
+{
+	CHECK(dev == usbd_dev);
+	app_sofs++;
+}
+
+static void poll(void)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		usbd_poll(usbd_dev);
+}
+
+/* Lets ms go by on the bus, the flash finishes its block on time. */
+static void wait_ms(u32 ms)
+{
+	u32 n;
+
+	for (n = 0; n < ms * sofs_per_ms; n++) {
+		otg_model_sof();
+		sofs++;
+		poll();
+		if (program.active && (sofs >= program.deadline)) {
+			program.active = false;
+			memcpy(&flash[program.block_num * TRANSFER_SIZE],
+			       program.data, program.len);
+			usb_dfu_complete(dfu, DFU_STATUS_OK);
+		}
+	}
+}
+
+static void request_out(u8 request, u16 value, const u8 *data, u16 len)
+{
+	struct usb_setup_data req = {
+		.bmRequestType = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+		.bRequest = request,
+		.wValue = value,
+		.wLength = len,
+	};
+	u8 status[8];
+	u16 sent, n;
+
+	otg_model_setup(0, &req);
+	poll();
+	for (sent = 0; sent < len; sent += n) {
+		n = (len - sent > 64) ? 64 : len - sent;
+		CHECK(otg_model_out(0, &data[sent], n));
+		poll();
+	}
+	CHECK(otg_model_in(0, status, sizeof(status)) == 0);
+	wait_ms(1);
+}
+
+static void request_in(u8 request, u8 *data, u16 len)
+{
+	struct usb_setup_data req = {
+		.bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS |
+				 USB_REQ_TYPE_INTERFACE,
+		.bRequest = request,
+		.wLength = len,
+	};
+	int n;
+
+	otg_model_setup(0, &req);
+	poll();
+	n = otg_model_in(0, data, len);
+	CHECK(n == len);
+	CHECK(otg_model_out(0, NULL, 0));
+	poll();
+	wait_ms(1);
+}
+
+/* Polls the status until the state is not busy, returns it. */
+static u8 getstatus(void)
+{
+	u8 status[6];
+
+	for (;;) {
+		request_in(DFU_GETSTATUS, status, sizeof(status));
+		CHECK(status[0] == DFU_STATUS_OK);
+		if ((status[4] != STATE_DFU_DNBUSY) &&
+		    (status[4] != STATE_DFU_MANIFEST))
+			return status[4];
+		wait_ms(status[1] | (status[2] << 8) | (status[3] << 16));
+	}
+}
+
+/* Downloads the image, returns the time it took in ms. */
+static u32 run(const usbd_driver *driver, u32 base, bool high_speed)
+{
+	struct usb_setup_data req = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1,
+	};
+	u8 status[8];
+	u32 i, start;
+
+	for (i = 0; i < sizeof(image); i++)
+		image[i] = i * 7 + (i >> 10);
+	memset(flash, 0xff, sizeof(flash));
+	manifested = false;
+	program.active = false;
+	sofs = 0;
+	app_sofs = 0;
+	sofs_per_ms = high_speed ? 8 : 1;
+
+	otg_model_init(base);
+	usbd_dev = usbd_init(driver, &dev, &config, NULL, 0);
+	usbd_set_control_buffer_size(usbd_dev, sizeof(usbd_control_buffer));
+	dfu = usb_dfu_init(usbd_dev, 0,
+			   USB_DFU_CAN_DOWNLOAD | USB_DFU_MANIFEST_TOLERANT,
+			   TRANSFER_SIZE, dfu_buf, BLOCK_TIME, download);
+	CHECK(dfu);
+	usb_dfu_set_callbacks(dfu, NULL, manifest);
+	CHECK(!usbd_register_sof_callback(usbd_dev, app_sof));
+
+	otg_model_bus_reset(high_speed);
+	poll();
+	otg_model_setup(0, &req);
+	poll();
+	CHECK(otg_model_in(0, status, sizeof(status)) == 0);
+
+	start = sofs;
+	for (i = 0; i < BLOCKS; i++) {
+		request_out(DFU_DNLOAD, i, &image[i * TRANSFER_SIZE],
+			    TRANSFER_SIZE);
+		CHECK(getstatus() == STATE_DFU_DNLOAD_IDLE);
+	}
+	request_out(DFU_DNLOAD, BLOCKS, NULL, 0);
+	CHECK(getstatus() == STATE_DFU_IDLE);
+
+	CHECK(manifested);
+	CHECK(!memcmp(flash, image, sizeof(flash)));
+	CHECK(app_sofs == sofs);
+
+	return (sofs - start) / sofs_per_ms;
+}
+
+int main(void)
+{
+	u32 fs, hs;
+
+	fs = run(&stm32f107_usb_driver, USB_OTG_FS_BASE, false);
+	hs = run(&stm32f207_usb_driver, USB_OTG_HS_BASE, true);
+
+	/*
+	 * Programming each block while the host waits would take a
+	 * DNLOAD, a GETSTATUS, the block time and a GETSTATUS per block.
+	 */
+	CHECK(fs >= BLOCKS * BLOCK_TIME);
+	CHECK(fs < BLOCKS * (BLOCK_TIME + 3));
+	CHECK(hs == fs);
+	printf("download: %u ms, %u ms if programmed while the host waits\n",
+	       (unsigned)fs, BLOCKS * (BLOCK_TIME + 3));
+
+	return 0;
+}
@@ -0,0 +1,427 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The write-back cache of the mass storage class on a simulated flash with
+ * erase units of four blocks. The same Bulk-Only command sequence is run
+ * on the OTG FS core without the cache, with it, and with it and block
+ * functions that finish later through usb_mass_complete(). The flash must
+ * end up with the same data each time, and with the cache each unit must
+ * be erased once per flush instead of once per command. The cache has to
+ * be flushed by SYNCHRONIZE CACHE, START STOP UNIT and an idle host, and
+ * reported by MODE SENSE.
+ */
+
+#include <string.h>
+#include <libopencm3/stm32/otg_fs.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/mass.h>
+#include "otg_model.h"
+#include "test.h"
+
+#define BLOCK		512
+#define UNIT_BLOCKS	4
+#define BLOCKS		32
+#define EP_OUT		0x01
+#define EP_IN		0x82
+#define MPS		64
+
+#define SCSI_START_STOP_UNIT		0x1B
+#define SCSI_MODE_SENSE_6		0x1A
+#define SCSI_READ_10			0x28
+#define SCSI_WRITE_10			0x2A
+#define SCSI_SYNCHRONIZE_CACHE		0x35
+/* Default idle time before the cache is flushed, in ms. */
+#define FLUSH_TIMEOUT			500
+
+static const struct usb_device_descriptor dev = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0x0483,
+	.idProduct = 0x5741,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_endpoint_descriptor endpoints[] = {{
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = EP_OUT,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = MPS,
+}, {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = EP_IN,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = MPS,
+}};
+
+static const struct usb_interface_descriptor iface = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bNumEndpoints = 2,
+	.bInterfaceClass = USB_CLASS_MASS,
+	.bInterfaceSubClass = USB_MASS_SUBCLASS_SCSI,
+	.bInterfaceProtocol = USB_MASS_PROTOCOL_BBB,
+	.endpoint = endpoints,
+};
+
+static const struct usb_interface ifaces[] = {{
+	.num_altsetting = 1,
+	.altsetting = &iface,
+}};
+
+static const struct usb_config_descriptor config = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 0x32,
+	.interface = ifaces,
+};
+
+struct cbw {
+	u32 dCBWSignature;
+	u32 dCBWTag;
+	u32 dCBWDataTransferLength;
+	u8  bmCBWFlags;
+	u8  bCBWLUN;
+	u8  bCBWCBLength;
+	u8  CBWCB[16];
+} __attribute__((packed));
+
+struct csw {
+	u32 dCSWSignature;
+	u32 dCSWTag;
+	u32 dCSWDataResidue;
+	u8  bCSWStatus;
+} __attribute__((packed));
+
+static usbd_device *usbd_dev;
+static usbd_mass_storage *ms;
+static u8 block_buf[2 * UNIT_BLOCKS * BLOCK];
+static u8 cache[UNIT_BLOCKS * BLOCK];
+
+/* The flash, what the host has written to it, and the units erased. */
+static u8 flash[BLOCKS * BLOCK];
+static u8 image[BLOCKS * BLOCK];
+static unsigned erases;
+static u32 tag;
+
+/* Block access left for service() to finish when the functions defer. */
+static bool deferred;
+static struct {
+	bool active;
+	bool write;
+	u32 lba;
+	u32 count;
+	u8 *buf;
+} pending;
+
+static void flash_read(u32 lba, u32 count, u8 *buf)
+{
+	CHECK(lba + count <= BLOCKS);
+	memcpy(buf, &flash[lba * BLOCK], count * BLOCK);
+}
+
+/* Each unit written to is erased once, the blocks of it not written are
+ * read and programmed back by the flash driver. */
+static void flash_write(u32 lba, u32 count, const u8 *buf)
+{
+	CHECK(lba + count <= BLOCKS);
+	erases += (lba + count - 1) / UNIT_BLOCKS - lba / UNIT_BLOCKS + 1;
+	memcpy(&flash[lba * BLOCK], buf, count * BLOCK);
+}
+
+static int read_blocks(u32 lba, u32 count, u8 *copy_to)
+{
+	if (!deferred) {
+		flash_read(lba, count, copy_to);
+		return 0;
+	}
+
+	CHECK(!pending.active);
+	pending.active = true;
+	pending.write = false;
+	pending.lba = lba;
+	pending.count = count;
+	pending.buf = copy_to;
+	return USB_MASS_PENDING;
+}
+
+static int write_blocks(u32 lba, u32 count, const u8 *copy_from)
+{
+	if (!deferred) {
+		flash_write(lba, count, copy_from);
+		return 0;
+	}
+
+	CHECK(!pending.active);
+	pending.active = true;
+	pending.write = true;
+	pending.lba = lba;
+	pending.count = count;
+	pending.buf = (u8 *)copy_from;
+	return USB_MASS_PENDING;
+}
+
+static int read_block(u32 lba, u8 *copy_to)
+{
+	return read_blocks(lba, 1, copy_to);
+}
+
+static int write_block(u32 lba, const u8 *copy_from)
+{
+	return write_blocks(lba, 1, copy_from);
+}
+
+/* Runs the device, and finishes a deferred block access. */
+static void service(void)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		usbd_poll(usbd_dev);
+
+	if (pending.active) {
+		pending.active = false;
+		if (pending.write)
+			flash_write(pending.lba, pending.count, pending.buf);
+		else
+			flash_read(pending.lba, pending.count, pending.buf);
+		usb_mass_complete(ms, 0);
+	}
+}
+
+static void bulk_out(const void *data, u32 len)
+{
+	const u8 *p = data;
+	u32 n;
+	int i;
+
+	do {
+		n = (len > MPS) ? MPS : len;
+		/* The endpoint NAKs while the media is busy. */
+		for (i = 0; !otg_model_out(EP_OUT, p, n); i++) {
+			CHECK(i < 100);
+			service();
+		}
+		service();
+		p += n;
+		len -= n;
+	} while (len);
+}
+
+static void bulk_in(void *data, u32 len)
+{
+	u8 *p = data;
+	int i, n;
+
+	while (len) {
+		for (i = 0; (n = otg_model_in(EP_IN & 0x7f, p, len)) < 0;
+		     i++) {
+			CHECK(i < 100);
+			service();
+		}
+		CHECK((u32)n <= len);
+		p += n;
+		len -= n;
+	}
+}
+
+static void command(u8 op, u32 lba, u16 count, void *data)
+{
+	struct cbw cbw;
+	struct csw csw;
+	u32 len = ((op == SCSI_READ_10) || (op == SCSI_WRITE_10)) ?
+		  count * BLOCK : 0;
+
+	memset(&cbw, 0, sizeof(cbw));
+	cbw.dCBWSignature = 0x43425355;
+	cbw.dCBWTag = ++tag;
+	cbw.dCBWDataTransferLength = len;
+	cbw.bmCBWFlags = (op == SCSI_READ_10) ? 0x80 : 0;
+	cbw.bCBWCBLength = 10;
+	cbw.CBWCB[0] = op;
+	cbw.CBWCB[2] = lba >> 24;
+	cbw.CBWCB[3] = lba >> 16;
+	cbw.CBWCB[4] = lba >> 8;
+	cbw.CBWCB[5] = lba;
+	cbw.CBWCB[7] = count >> 8;
+	cbw.CBWCB[8] = count;
+	bulk_out(&cbw, sizeof(cbw));
+
+	if (op == SCSI_READ_10)
+		bulk_in(data, len);
+	else if (len)
+		bulk_out(data, len);
+
+	bulk_in(&csw, sizeof(csw));
+	CHECK(csw.dCSWSignature == 0x53425355);
+	CHECK(csw.dCSWTag == tag);
+	CHECK(csw.dCSWDataResidue == 0);
+	CHECK(csw.bCSWStatus == 0);
+}
+
+static void write_image(u32 lba, u16 count, u8 fill)
+{
+	u32 i;
+
+	for (i = 0; i < count * BLOCK; i++)
+		image[lba * BLOCK + i] = fill + i / 7;
+	command(SCSI_WRITE_10, lba, count, &image[lba * BLOCK]);
+}
+
+static void check_image(u32 lba, u16 count)
+{
+	static u8 buf[BLOCKS * BLOCK];
+
+	command(SCSI_READ_10, lba, count, buf);
+	CHECK(!memcmp(buf, &image[lba * BLOCK], count * BLOCK));
+}
+
+/* MODE SENSE of the caching page, returns WCE. */
+static bool write_cache_enabled(bool use_cache)
+{
+	struct cbw cbw;
+	struct csw csw;
+	u8 data[24];
+	u32 len = use_cache ? 24 : 4;
+
+	memset(&cbw, 0, sizeof(cbw));
+	cbw.dCBWSignature = 0x43425355;
+	cbw.dCBWTag = ++tag;
+	cbw.dCBWDataTransferLength = len;
+	cbw.bmCBWFlags = 0x80;
+	cbw.bCBWCBLength = 6;
+	cbw.CBWCB[0] = SCSI_MODE_SENSE_6;
+	cbw.CBWCB[2] = 0x08;
+	cbw.CBWCB[4] = len;
+	bulk_out(&cbw, sizeof(cbw));
+
+	bulk_in(data, len);
+	CHECK(data[0] == len - 1);
+	bulk_in(&csw, sizeof(csw));
+	CHECK(csw.dCSWTag == tag);
+	CHECK(csw.bCSWStatus == 0);
+
+	if (!use_cache)
+		return false;
+	CHECK((data[4] == 0x08) && (data[5] == 18));
+	return data[6] & 0x04;
+}
+
+/* Lets ms go by on the bus. */
+static void wait_ms(u32 ms_count)
+{
+	u32 i;
+
+	for (i = 0; i < ms_count; i++) {
+		otg_model_sof();
+		service();
+	}
+}
+
+static unsigned run(bool use_cache, bool defer)
+{
+	struct usb_setup_data req = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1,
+	};
+	u8 status[8];
+	u32 i;
+
+	for (i = 0; i < BLOCKS * BLOCK; i++)
+		flash[i] = i * 13;
+	memcpy(image, flash, sizeof(image));
+	erases = 0;
+	deferred = defer;
+	pending.active = false;
+
+	otg_model_init(USB_OTG_FS_BASE);
+	usbd_dev = usbd_init(&stm32f107_usb_driver, &dev, &config, NULL, 0);
+	ms = usb_mass_init(usbd_dev, EP_IN, MPS, EP_OUT, MPS, "VENDOR",
+			   "PRODUCT", "0.01", BLOCKS, read_block,
+			   write_block);
+	CHECK(!usb_mass_set_block_io(ms, read_blocks, write_blocks,
+				     block_buf, sizeof(block_buf)));
+	CHECK(!usb_mass_set_write_cache(ms, use_cache ? cache : NULL,
+					sizeof(cache)));
+
+	otg_model_bus_reset(false);
+	service();
+	otg_model_setup(0, &req);
+	service();
+	CHECK(otg_model_in(0, status, sizeof(status)) == 0);
+
+	CHECK(write_cache_enabled(use_cache) == use_cache);
+
+	/* Single blocks of one unit. */
+	for (i = 0; i < UNIT_BLOCKS; i++)
+		write_image(i, 1, 0x10 + i);
+	/* Part of a unit, the rest is read back from the flash. */
+	write_image(5, 1, 0x20);
+	check_image(4, UNIT_BLOCKS);
+	/* A whole unit, it goes past the cache. */
+	write_image(8, UNIT_BLOCKS, 0x30);
+	/* Flushed by SYNCHRONIZE CACHE. */
+	write_image(13, 2, 0x40);
+	command(SCSI_SYNCHRONIZE_CACHE, 0, 0, NULL);
+	/* Flushed while the host is idle. */
+	write_image(19, 1, 0x50);
+	service();
+	usb_mass_flush(ms);
+	for (i = 0; pending.active || (i < 2); i++) {
+		CHECK(i < 100);
+		service();
+	}
+	/* Flushed after the idle timeout, not before. */
+	write_image(23, 1, 0x60);
+	wait_ms(FLUSH_TIMEOUT - 1);
+	CHECK(!memcmp(flash, image, sizeof(flash)) == !use_cache);
+	wait_ms(2);
+	CHECK(!memcmp(flash, image, sizeof(flash)));
+	/* Flushed by START STOP UNIT, before an eject. */
+	write_image(27, 1, 0x70);
+	command(SCSI_START_STOP_UNIT, 0, 0, NULL);
+
+	CHECK(!memcmp(flash, image, sizeof(flash)));
+	check_image(0, BLOCKS);
+
+	return erases;
+}
+
+int main(void)
+{
+	unsigned plain, cached;
+
+	plain = run(false, false);
+	cached = run(true, false);
+	CHECK(run(true, true) == cached);
+
+	/* Units 0, 4, 8, 12, 16, 20 and 24, each erased once. */
+	CHECK(cached == 7);
+	CHECK(plain == 10);
+	printf("erases: %u without the write cache, %u with it\n", plain,
+	       cached);
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Control writes on the OTG FS core: the DATA OUT stage that follows a
+ * SETUP must be received. The core disables EP0 OUT when the setup stage
+ * is done, so the driver may only enable it for the DATA OUT once the
+ * SETUP_COMP entry is popped, not while it reads the SETUP packet.
+ * The host reads the status stage right before the next SETUP, the driver
+ * sees both in one poll and has to finish the status stage first.
+ */
+
+#include <string.h>
+#include <libopencm3/stm32/otg_fs.h>
+#include <libopencm3/usb/usbd.h>
+#include "otg_model.h"
+#include "test.h"
+
+#define VENDOR_REQ	0x42
+
+static const struct usb_device_descriptor dev = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0x0483,
+	.idProduct = 0x5740,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_interface_descriptor iface = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceClass = 0xff,
+};
+
+static const struct usb_interface ifaces[] = {{
+	.num_altsetting = 1,
+	.altsetting = &iface,
+}};
+
+static const struct usb_config_descriptor config = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 0x32,
+	.interface = ifaces,
+};
+
+static u8 received[128];
+static u16 received_len;
+
+static int vendor_request(usbd_device *usbd_dev, struct usb_setup_data *req,
+			  u8 **buf, u16 *len,
+			  void (**complete)(usbd_device *usbd_dev,
+					    struct usb_setup_data *req))
+{
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->bRequest != VENDOR_REQ)
+		return USBD_REQ_NOTSUPP;
+
+	memcpy(received, *buf, *len);
+	received_len = *len;
+	return USBD_REQ_HANDLED;
+}
+
+static void poll_rx(usbd_device *usbd_dev)
+{
+	int i;
+
+	for (i = 0; (i < 32) && !otg_model_rx_empty(); i++)
+		usbd_poll(usbd_dev);
+	CHECK(otg_model_rx_empty());
+}
+
+static void control_write(usbd_device *usbd_dev, u16 len)
+{
+	struct usb_setup_data req = {
+		.bmRequestType = USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+		.bRequest = VENDOR_REQ,
+		.wLength = len,
+	};
+	u8 data[128], status[8];
+	u16 sent, n;
+
+	for (n = 0; n < len; n++)
+		data[n] = n + len;
+	received_len = 0;
+
+	otg_model_setup(0, &req);
+	poll_rx(usbd_dev);
+
+	for (sent = 0; sent < len; sent += n) {
+		n = (len - sent > 64) ? 64 : len - sent;
+		/* The driver has re-enabled EP0 OUT after the setup stage,
+		 * respectively after the last DATA OUT packet. */
+		CHECK(otg_model_out(0, &data[sent], n));
+		poll_rx(usbd_dev);
+	}
+
+	CHECK(received_len == len);
+	CHECK(!memcmp(received, data, len));
+	/* Status stage. */
+	CHECK(otg_model_in(0, status, sizeof(status)) == 0);
+}
+
+int main(void)
+{
+	usbd_device *usbd_dev;
+
+	otg_model_init(USB_OTG_FS_BASE);
+	usbd_dev = usbd_init(&stm32f107_usb_driver, &dev, &config, NULL, 0);
+	usbd_register_control_callback(usbd_dev, USB_REQ_TYPE_VENDOR,
+				       USB_REQ_TYPE_TYPE, vendor_request);
+
+	otg_model_bus_reset(false);
+	usbd_poll(usbd_dev);
+	/* ENUMDNE is cleared by writing it back alone. */
+	CHECK(!(OTG_FS_GINTSTS & OTG_FS_GINTSTS_ENUMDNE));
+
+	control_write(usbd_dev, 8);
+	control_write(usbd_dev, 64);
+	control_write(usbd_dev, 100);
+
+	return 0;
+}
@@ -0,0 +1,398 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <libopencm3/host/mmio.h>
+#include <libopencm3/stm32/otg_fs.h>
+#include <libopencm3/stm32/otg_hs.h>
+#include "otg_model.h"
+
+#define RX_ENTRIES	16
+#define TX_PACKETS	8
+#define ENDPOINTS	6
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+
+#define DEPCTL_WO	(OTG_FS_DIEPCTL0_SNAK | OTG_FS_DIEPCTL0_CNAK | \
+			 OTG_FS_DIEPCTLX_SD0PID | OTG_FS_DIEPCTLX_SODDFRM)
+
+static u32 base;
+
+/* Receive FIFO: status entries, each followed by its data words. */
+static struct {
+	u32 status;
+	u32 data[OTG_MODEL_MAX_PACKET / 4];
+	u16 words;
+} rx[RX_ENTRIES];
+static unsigned rx_head, rx_tail;
+/* Entry whose data the driver reads, popped from GRXSTSP. */
+static int rx_cur = -1;
+static u16 rx_word;
+
+/* NAK state of the OUT endpoints, set with SNAK and cleared with CNAK. */
+static bool out_nak[ENDPOINTS];
+
+/* Packet being pushed into a TX FIFO and the packets in it, not yet read
+ * by the host. */
+static struct {
+	u8 data[OTG_MODEL_MAX_PACKET];
+	u16 len;
+} tx[ENDPOINTS], sent[ENDPOINTS][TX_PACKETS];
+static unsigned sent_head[ENDPOINTS], sent_tail[ENDPOINTS];
+
+static u32 reg(u32 offset)
+{
+	return host_mmio_peek(base + offset, 4);
+}
+
+static void set_reg(u32 offset, u32 value)
+{
+	host_mmio_poke(base + offset, 4, value);
+}
+
+static void rx_push(u8 ep, u32 pktsts, const void *data, u16 len)
+{
+	unsigned i = rx_head % RX_ENTRIES;
+
+	rx[i].status = pktsts | (len << 4) | ep;
+	memset(rx[i].data, 0, sizeof(rx[i].data));
+	memcpy(rx[i].data, data, len);
+	rx[i].words = (len + 3) / 4;
+	rx_head++;
+}
+
+/* Largest packet of an endpoint, EP0 is always set up for 64 bytes. */
+static u16 max_packet(u32 ctl_offset, u8 ep)
+{
+	return ep ? (reg(ctl_offset) & OTG_FS_DIEPCTLX_MPSIZ_MASK) : 64;
+}
+
+/* The driver has pushed the whole packet in tx[ep], it waits in the FIFO. */
+static void tx_queue(u8 ep)
+{
+	unsigned i = sent_head[ep] % TX_PACKETS;
+
+	memcpy(sent[ep][i].data, tx[ep].data, tx[ep].len);
+	sent[ep][i].len = tx[ep].len;
+	sent_head[ep]++;
+	tx[ep].len = 0;
+}
+
+/*
+ * The host has read a packet of len bytes. The transfer is complete when
+ * the last packet programmed into DIEPTSIZ is sent.
+ */
+static void tx_complete(u8 ep, u16 len)
+{
+	u32 tsiz = reg(OTG_DIEPTSIZ(ep));
+	u32 pkts = (tsiz & OTG_FS_DIEPSIZX_PKTCNT_MASK) >>
+		   OTG_FS_DIEPSIZX_PKTCNT_SHIFT;
+	u32 left = tsiz & OTG_FS_DIEPSIZX_XFRSIZ_MASK;
+
+	left -= len;
+	pkts--;
+
+	set_reg(OTG_DIEPTSIZ(ep), (tsiz & ~(OTG_FS_DIEPSIZX_PKTCNT_MASK |
+					    OTG_FS_DIEPSIZX_XFRSIZ_MASK)) |
+		(pkts << OTG_FS_DIEPSIZX_PKTCNT_SHIFT) | left);
+	if (pkts)
+		return;
+
+	set_reg(OTG_DIEPCTL(ep), reg(OTG_DIEPCTL(ep)) & ~OTG_FS_DIEPCTL0_EPENA);
+	set_reg(OTG_DIEPINT(ep), reg(OTG_DIEPINT(ep)) | OTG_FS_DIEPINTX_XFRC);
+}
+
+/* Words of a TX FIFO taken by the packets the host has not read yet. */
+static u16 tx_words(u8 ep)
+{
+	unsigned i;
+	u16 words = (tx[ep].len + 3) / 4;
+
+	for (i = sent_tail[ep]; i != sent_head[ep]; i++)
+		words += (sent[ep][i % TX_PACKETS].len + 3) / 4;
+
+	return words;
+}
+
+static u16 tx_space(u8 ep)
+{
+	u16 size = reg(ep ? OTG_DIEPTXF(ep) : OTG_GNPTXFSIZ) >> 16;
+	u16 words = tx_words(ep);
+
+	if (sent_head[ep] - sent_tail[ep] == TX_PACKETS)
+		return 0;
+	return (size > words) ? size - words : 0;
+}
+
+/* Packets of the IN transfer programmed not pushed yet. */
+static u32 tx_packets_left(u8 ep)
+{
+	u32 pkts = (reg(OTG_DIEPTSIZ(ep)) & OTG_FS_DIEPSIZX_PKTCNT_MASK) >>
+		   OTG_FS_DIEPSIZX_PKTCNT_SHIFT;
+	u32 queued = sent_head[ep] - sent_tail[ep];
+
+	return (pkts > queued) ? pkts - queued : 0;
+}
+
+/* Length of the next packet of the IN transfer programmed. */
+static u16 tx_expected(u8 ep)
+{
+	u32 left = reg(OTG_DIEPTSIZ(ep)) & OTG_FS_DIEPSIZX_XFRSIZ_MASK;
+	unsigned i;
+
+	for (i = sent_tail[ep]; i != sent_head[ep]; i++)
+		left -= sent[ep][i % TX_PACKETS].len;
+
+	return MIN(left, max_packet(OTG_DIEPCTL(ep), ep));
+}
+
+static void global_read(u32 addr, u8 size)
+{
+	u32 offset = addr - base;
+	u32 status;
+
+	(void)size;
+
+	switch (offset) {
+	case OTG_GRSTCTL:
+		/* Resets and flushes are done at once. */
+		set_reg(offset, OTG_FS_GRSTCTL_AHBIDL);
+		break;
+	case OTG_GINTSTS:
+		status = reg(offset) & ~OTG_FS_GINTSTS_RXFLVL;
+		if (rx_tail != rx_head)
+			status |= OTG_FS_GINTSTS_RXFLVL;
+		set_reg(offset, status);
+		break;
+	case OTG_GRXSTSP:
+		if (rx_tail == rx_head) {
+			set_reg(offset, 0);
+			break;
+		}
+		rx_cur = rx_tail % RX_ENTRIES;
+		rx_word = 0;
+		rx_tail++;
+		status = rx[rx_cur].status;
+		set_reg(offset, status);
+		/* The setup stage is over, EP0 OUT is disabled. */
+		if ((status & OTG_FS_GRXSTSP_PKTSTS_MASK) ==
+		    OTG_FS_GRXSTSP_PKTSTS_SETUP_COMP) {
+			u8 ep = status & OTG_FS_GRXSTSP_EPNUM_MASK;
+
+			set_reg(OTG_DOEPCTL(ep), reg(OTG_DOEPCTL(ep)) &
+				~OTG_FS_DOEPCTL0_EPENA);
+		}
+		break;
+	}
+}
+
+static void global_write(u32 addr, u8 size, u64 oldval, u64 newval)
+{
+	(void)size;
+
+	/* Interrupt flags are cleared by writing one. */
+	if (addr - base == OTG_GINTSTS)
+		set_reg(OTG_GINTSTS, oldval & ~newval);
+}
+
+static void device_read(u32 addr, u8 size)
+{
+	u32 offset = addr - base;
+	u8 ep = (offset >> 5) & 7;
+
+	(void)size;
+
+	if ((offset < OTG_DIEPCTL(0)) || (offset >= OTG_DIEPCTL(ENDPOINTS)))
+		return;
+
+	if ((offset & 0x1f) == 0x18) {
+		set_reg(offset, tx_space(ep));
+	} else if ((offset & 0x1f) == 0x08) {
+		if (tx_words(ep) || (sent_head[ep] != sent_tail[ep]))
+			set_reg(offset, reg(offset) & ~OTG_FS_DIEPINTX_TXFE);
+		else
+			set_reg(offset, reg(offset) | OTG_FS_DIEPINTX_TXFE);
+	}
+}
+
+static void device_write(u32 addr, u8 size, u64 oldval, u64 newval)
+{
+	u32 offset = addr - base;
+	u8 ep = (offset >> 5) & 7;
+
+	(void)size;
+
+	if ((offset >= OTG_DIEPCTL(0)) && (offset < OTG_DIEPCTL(ENDPOINTS)) &&
+	    ((offset & 0x1f) == 0x08)) {
+		set_reg(offset, oldval & ~newval);
+	} else if ((offset >= OTG_DOEPCTL(0)) &&
+		   (offset < OTG_DOEPCTL(ENDPOINTS)) &&
+		   ((offset & 0x1f) == 0x08)) {
+		set_reg(offset, oldval & ~newval);
+	} else if ((offset >= OTG_DIEPCTL(0)) &&
+		   (offset < OTG_DIEPCTL(ENDPOINTS)) &&
+		   ((offset & 0x1f) == 0)) {
+		set_reg(offset, newval & ~DEPCTL_WO);
+		/* A packet of length 0 is queued when enabled. */
+		if ((newval & OTG_FS_DIEPCTL0_EPENA) && tx_packets_left(ep) &&
+		    !tx_expected(ep))
+			tx_queue(ep);
+	} else if ((offset >= OTG_DOEPCTL(0)) &&
+		   (offset < OTG_DOEPCTL(ENDPOINTS)) &&
+		   ((offset & 0x1f) == 0)) {
+		set_reg(offset, newval & ~DEPCTL_WO);
+		if (newval & OTG_FS_DOEPCTL0_SNAK)
+			out_nak[ep] = true;
+		if (newval & OTG_FS_DOEPCTL0_CNAK)
+			out_nak[ep] = false;
+	}
+}
+
+static void fifo_read(u32 addr, u8 size)
+{
+	u32 word = 0;
+
+	(void)size;
+
+	if ((rx_cur >= 0) && (rx_word < rx[rx_cur].words))
+		word = rx[rx_cur].data[rx_word++];
+	host_mmio_poke(addr, 4, word);
+}
+
+static void fifo_write(u32 addr, u8 size, u64 oldval, u64 newval)
+{
+	u8 ep = ((addr - base) >> 12) - 1;
+	u16 expected = tx_expected(ep);
+	u16 n = MIN(4, expected - tx[ep].len);
+
+	(void)size;
+	(void)oldval;
+
+	if (!tx_packets_left(ep) || (tx[ep].len >= expected))
+		return;
+
+	memcpy(&tx[ep].data[tx[ep].len], &newval, n);
+	tx[ep].len += n;
+	if (tx[ep].len == expected)
+		tx_queue(ep);
+}
+
+/** Installs the model on the core at base, which has just been reset. */
+void otg_model_init(u32 core_base)
+{
+	base = core_base;
+	rx_head = rx_tail = 0;
+	rx_cur = -1;
+	memset(out_nak, 0, sizeof(out_nak));
+	memset(tx, 0, sizeof(tx));
+	memset(sent_head, 0, sizeof(sent_head));
+	memset(sent_tail, 0, sizeof(sent_tail));
+
+	host_mmio_reset();
+	host_mmio_register_hooks(base, 0x800, global_read, global_write);
+	host_mmio_register_hooks(base + 0x800, 0x800, device_read,
+				 device_write);
+	host_mmio_register_hooks(base + OTG_FIFO(0), ENDPOINTS * 0x1000,
+				 fifo_read, fifo_write);
+}
+
+/** The host has reset the bus, enumeration is done at the speed given. */
+void otg_model_bus_reset(bool high_speed)
+{
+	host_mmio_sync();
+	set_reg(OTG_DSTS, (reg(OTG_DSTS) & ~OTG_FS_DSTS_ENUMSPD_MASK) |
+		(high_speed ? OTG_FS_DSTS_ENUMSPD_HS : OTG_FS_DSTS_ENUMSPD_FS));
+	set_reg(OTG_GINTSTS, reg(OTG_GINTSTS) | OTG_FS_GINTSTS_ENUMDNE);
+}
+
+/** The host sends a SOF, once per frame or per microframe at high speed. */
+void otg_model_sof(void)
+{
+	host_mmio_sync();
+	set_reg(OTG_GINTSTS, reg(OTG_GINTSTS) | OTG_FS_GINTSTS_SOF);
+}
+
+/** The host sends a SETUP packet to a control endpoint. */
+void otg_model_setup(u8 ep, const void *req)
+{
+	host_mmio_sync();
+	rx_push(ep, OTG_FS_GRXSTSP_PKTSTS_SETUP, req, 8);
+	rx_push(ep, OTG_FS_GRXSTSP_PKTSTS_SETUP_COMP, NULL, 0);
+}
+
+/**
+ * The host sends an OUT packet. Returns false if the endpoint NAKed it.
+ * The transfer is complete when the last packet the driver asked for in
+ * DOEPTSIZ, or a short one, is received.
+ */
+bool otg_model_out(u8 ep, const void *data, u16 len)
+{
+	u32 ctl, tsiz, pkts, left, mps;
+
+	host_mmio_sync();
+	ctl = reg(OTG_DOEPCTL(ep));
+	tsiz = reg(OTG_DOEPTSIZ(ep));
+	if (!(ctl & OTG_FS_DOEPCTL0_EPENA) || out_nak[ep] ||
+	    (ctl & OTG_FS_DOEPCTL0_STALL))
+		return false;
+
+	mps = max_packet(OTG_DOEPCTL(ep), ep);
+	pkts = (tsiz & OTG_FS_DIEPSIZX_PKTCNT_MASK) >>
+	       OTG_FS_DIEPSIZX_PKTCNT_SHIFT;
+	left = tsiz & OTG_FS_DIEPSIZX_XFRSIZ_MASK;
+	len = MIN(len, left);
+
+	rx_push(ep, OTG_FS_GRXSTSP_PKTSTS_OUT, data, len);
+	pkts = pkts ? pkts - 1 : 0;
+	left -= len;
+	set_reg(OTG_DOEPTSIZ(ep), (tsiz & ~(OTG_FS_DIEPSIZX_PKTCNT_MASK |
+					    OTG_FS_DIEPSIZX_XFRSIZ_MASK)) |
+		(pkts << OTG_FS_DIEPSIZX_PKTCNT_SHIFT) | left);
+
+	if (!pkts || (len < mps)) {
+		set_reg(OTG_DOEPCTL(ep), ctl & ~OTG_FS_DOEPCTL0_EPENA);
+		rx_push(ep, OTG_FS_GRXSTSP_PKTSTS_OUT_COMP, NULL, 0);
+	}
+
+	return true;
+}
+
+/** Returns true once the driver has popped all receive FIFO entries. */
+bool otg_model_rx_empty(void)
+{
+	host_mmio_sync();
+	return rx_tail == rx_head;
+}
+
+/**
+ * The host reads the next IN packet in the TX FIFO of an endpoint. Returns
+ * its length, or -1 if there is none.
+ */
+int otg_model_in(u8 ep, void *buf, u16 len)
+{
+	unsigned i = sent_tail[ep] % TX_PACKETS;
+
+	host_mmio_sync();
+	if (sent_tail[ep] == sent_head[ep])
+		return -1;
+
+	sent_tail[ep]++;
+	len = MIN(len, sent[ep][i].len);
+	memcpy(buf, sent[ep][i].data, len);
+	tx_complete(ep, sent[ep][i].len);
+	return sent[ep][i].len;
+}
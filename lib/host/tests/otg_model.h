@@ -0,0 +1,50 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBOPENCM3_HOST_OTG_MODEL_H
+#define LIBOPENCM3_HOST_OTG_MODEL_H
+
+#include <libopencm3/cm3/common.h>
+
+/*
+ * Device side of an OTG FS/HS core in slave (FIFO) mode, built on the
+ * register hooks of the host MMIO space. The test plays the host with the
+ * functions below, the driver sees the registers change as on the target.
+ *
+ * - OUT and SETUP packets are queued in the receive FIFO with their
+ *   'completed' status entries. A SETUP is always accepted, an OUT packet
+ *   only while the endpoint is enabled and not NAKing.
+ * - The core disables an OUT endpoint when its transfer is complete and
+ *   EP0 OUT when the setup stage is done, i.e. when the SETUP_COMP entry
+ *   is popped.
+ * - An IN packet waits in the TX FIFO, as seen in DTXFSTS and TXFE, once
+ *   the driver has pushed all its words, and is sent when the host reads
+ *   it. After the last packet of the transfer the endpoint is disabled
+ *   and XFRC set.
+ */
+
+#define OTG_MODEL_MAX_PACKET	1024
+
+void otg_model_init(u32 base);
+void otg_model_bus_reset(bool high_speed);
+void otg_model_sof(void);
+void otg_model_setup(u8 ep, const void *req);
+bool otg_model_out(u8 ep, const void *data, u16 len);
+bool otg_model_rx_empty(void);
+int otg_model_in(u8 ep, void *buf, u16 len);
+
+#endif
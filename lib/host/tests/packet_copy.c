@@ -0,0 +1,196 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The packet copy routines of the F103 and OTG drivers, for every length
+ * from 0 to 512 and every alignment of the application buffer. The source
+ * buffer ends right before an inaccessible page when the alignment allows,
+ * so reading past it crashes, and the destination buffer has guard bytes
+ * on both sides.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "usb_f103.c"
+#include "usb_fx07_common.c"
+#include "test.h"
+
+#define MAX_LEN		512
+#define GUARD		16
+#define FIFO_EP		1
+#define FIFO_BASE	(USB_OTG_FS_BASE + OTG_FIFO(FIFO_EP))
+
+static u8 *page_end;
+static u8 dst_mem[GUARD + MAX_LEN + 3 + GUARD];
+
+static u32 fifo[MAX_LEN / 4 + 1];
+static unsigned fifo_words;
+
+static const struct _usbd_driver otg_driver = {
+	.base_address = USB_OTG_FS_BASE,
+	.ep_count = 4,
+};
+static struct _usbd_device otg_dev = {
+	.driver = &otg_driver,
+};
+
+static u8 pattern(u16 i)
+{
+	return (i * 7 + 0x35) ^ (i >> 8);
+}
+
+/* Source buffer of len bytes at the given alignment, as close to
+ * page_end as possible. */
+static const u8 *source(u16 len, u8 align)
+{
+	u8 *src = page_end - len - ((4 - ((len + align) & 3)) & 3);
+	u16 i;
+
+	for (i = 0; i < len; i++)
+		src[i] = pattern(i);
+	return src;
+}
+
+static u8 *destination(u8 align)
+{
+	memset(dst_mem, 0xa5, sizeof(dst_mem));
+	return dst_mem + GUARD + align;
+}
+
+static void check_destination(u8 *dst, u16 len)
+{
+	u16 i;
+
+	for (i = 0; i < len; i++)
+		CHECK(dst[i] == pattern(i));
+	for (i = 0; dst_mem + i < dst; i++)
+		CHECK(dst_mem[i] == 0xa5);
+	for (i = len; dst + i < dst_mem + sizeof(dst_mem); i++)
+		CHECK(dst[i] == 0xa5);
+}
+
+static void fifo_push(u32 addr, u8 size, u64 oldval, u64 newval)
+{
+	(void)addr;
+	(void)size;
+	(void)oldval;
+
+	CHECK(fifo_words < sizeof(fifo) / 4);
+	fifo[fifo_words++] = newval;
+}
+
+static void fifo_pop(u32 addr, u8 size)
+{
+	u8 *word = (u8 *)&fifo[fifo_words];
+	u8 i;
+
+	(void)size;
+
+	for (i = 0; i < 4; i++)
+		word[i] = pattern(fifo_words * 4 + i);
+	host_mmio_poke(addr, 4, fifo[fifo_words++]);
+}
+
+static void test_copy_to_pm(u16 len, u8 align)
+{
+	const u8 *src = source(len, align);
+	u16 i, half;
+
+	for (i = 0; i < MAX_LEN / 2 + 1; i++)
+		host_mmio_poke(USB_PMA_BASE + i * 4, 2, 0xdead);
+
+	usb_copy_to_pm(&MMIO8(USB_PMA_BASE), src, len);
+	host_mmio_sync();
+
+	for (i = 0; i < len; i++) {
+		half = host_mmio_peek(USB_PMA_BASE + (i / 2) * 4, 2);
+		CHECK((u8)(half >> ((i & 1) * 8)) == pattern(i));
+	}
+	CHECK(host_mmio_peek(USB_PMA_BASE + ((len + 1) / 2) * 4, 2) ==
+	      0xdead);
+}
+
+static void test_copy_from_pm(u16 len, u8 align)
+{
+	u8 *dst = destination(align);
+	u16 i;
+
+	for (i = 0; i < MAX_LEN / 2; i++)
+		host_mmio_poke(USB_PMA_BASE + i * 4, 2,
+			       pattern(i * 2) | (pattern(i * 2 + 1) << 8));
+
+	usb_copy_from_pm(dst, &MMIO8(USB_PMA_BASE), len);
+	check_destination(dst, len);
+}
+
+static void test_fifo_write(u16 len, u8 align)
+{
+	const u8 *src = source(len, align);
+	u16 i;
+
+	fifo_words = 0;
+	stm32fx07_fifo_write(&otg_dev, FIFO_EP, src, len);
+	host_mmio_sync();
+
+	/* Every word is pushed, the last one padded with zeros. */
+	CHECK(fifo_words == (len + 3) / 4u);
+	for (i = 0; i < fifo_words * 4; i++)
+		CHECK(((u8 *)fifo)[i] == ((i < len) ? pattern(i) : 0));
+}
+
+static void test_fifo_read(u16 len, u8 align)
+{
+	u8 *dst = destination(align);
+
+	fifo_words = 0;
+	otg_dev.rxbcnt = len;
+	CHECK(stm32fx07_ep_read_packet(&otg_dev, FIFO_EP, dst, len) == len);
+	host_mmio_sync();
+
+	CHECK(fifo_words == (len + 3) / 4u);
+	CHECK(otg_dev.rxbcnt == 0);
+	check_destination(dst, len);
+}
+
+int main(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	u8 *mem;
+	u16 len;
+	u8 align;
+
+	mem = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	CHECK(mem != MAP_FAILED);
+	CHECK(!mprotect(mem + page, page, PROT_NONE));
+	page_end = mem + page;
+
+	host_mmio_reset();
+	host_mmio_register_hooks(FIFO_BASE, 0x1000, fifo_pop, fifo_push);
+
+	for (len = 0; len <= MAX_LEN; len++) {
+		for (align = 0; align < 4; align++) {
+			test_copy_to_pm(len, align);
+			test_copy_from_pm(len, align);
+			test_fifo_write(len, align);
+			test_fifo_read(len, align);
+		}
+	}
+
+	return 0;
+}
@@ -112,13 +112,13 @@ void flash_program_word(u32 address, u32 data)
 	FLASH_CR |= FLASH_CR_PG;
 
 	/* Program the first half of the word. */
-	(*(volatile u16 *)address) = (u16)data;
+	MMIO16(address) = (u16)data;
 
 	/* Wait for the write to complete. */
 	flash_wait_for_last_operation();
 
 	/* Program the second half of the word. */
-	(*(volatile u16 *)(address + 2)) = data >> 16;
+	MMIO16(address + 2) = data >> 16;
 
 	/* Wait for the write to complete. */
 	flash_wait_for_last_operation();
@@ -133,7 +133,7 @@ void flash_program_half_word(u32 address, u16 data)
 
 	FLASH_CR |= FLASH_CR_PG;
 
-	(*(volatile u16 *)address) = data;
+	MMIO16(address) = data;
 
 	flash_wait_for_last_operation();
 
@@ -184,7 +184,7 @@ void flash_program_option_bytes(u32 address, u16 data)
 		flash_unlock_option_bytes();
 
 	FLASH_CR |= FLASH_CR_OPTPG;	/* Enable option byte programming. */
-	(*(volatile u16 *)address) = data;
+	MMIO16(address) = data;
 	flash_wait_for_last_operation();
 	FLASH_CR &= ~FLASH_CR_OPTPG;	/* Disable option byte programming. */
 }
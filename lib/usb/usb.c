@@ -76,6 +76,11 @@ usbd_device *usbd_init(const usbd_driver *driver,
 	usbd_dev->num_strings = num_strings;
 	usbd_dev->ctrl_buf = usbd_control_buffer;
 	usbd_dev->ctrl_buf_len = sizeof(usbd_control_buffer);
+	usbd_dev->poll_budget = DEFAULT_POLL_BUDGET;
+	memset(usbd_dev->user_callback_sof, 0,
+	       sizeof(usbd_dev->user_callback_sof));
+	memset(usbd_dev->user_callback_set_config, 0,
+	       sizeof(usbd_dev->user_callback_set_config));
 
 	usbd_dev->user_callback_ctr[0][USB_TRANSACTION_SETUP] =
 	    _usbd_control_setup;
@@ -121,14 +126,34 @@ void usbd_register_resume_callback(usbd_device *usbd_dev,
 
 /** @brief Registers a callback function for the USB event 'SOF' takes place.
 
-@note This is called every 1ms, so be very careful in this routine.
+Up to MAX_USER_SOF_CALLBACK callbacks are kept, so class functions and the
+application can each have one. They are called in the order they were
+registered. Registering the same callback again has no effect.
+
+@note This is called every 1ms, every 125us on a high speed bus, so be very
+careful in this routine.
 
 @param[in] usbd_dev The USB device to interact with.
 @param[in] callback The callback.
+
+@return 0 if successful, -1 if all slots are taken.
 */
-void usbd_register_sof_callback(usbd_device *usbd_dev, void (*callback)(void))
+int usbd_register_sof_callback(usbd_device *usbd_dev,
+			       usbd_sof_callback callback)
 {
-	usbd_dev->user_callback_sof = callback;
+	int i;
+
+	for (i = 0; i < MAX_USER_SOF_CALLBACK; i++) {
+		if (usbd_dev->user_callback_sof[i] == callback)
+			return 0;
+		if (usbd_dev->user_callback_sof[i])
+			continue;
+
+		usbd_dev->user_callback_sof[i] = callback;
+		return 0;
+	}
+
+	return -1;
 }
 
 /** @brief Sets the size of the control buffer.
@@ -141,6 +166,34 @@ void usbd_set_control_buffer_size(usbd_device *usbd_dev, u16 size)
 	usbd_dev->ctrl_buf_len = size;
 }
 
+/** @brief Limits the number of transfer events handled by one usbd_poll().
+
+Drivers handle all endpoints with a completed transfer, and the OTG
+drivers all packets in the receive FIFO, in one call to usbd_poll(). The
+budget bounds the time spent in one call on a busy bus. The default is one
+event per endpoint and direction. A packet the callback does not read ends
+the call on the F103, it is reported again by the next one.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] budget Maximum number of transfer events per call, 0 for no
+		  limit.
+*/
+void usbd_set_poll_budget(usbd_device *usbd_dev, u16 budget)
+{
+	usbd_dev->poll_budget = budget;
+}
+
+/** @brief Returns the event counters maintained by usbd_poll().
+
+@param[in] usbd_dev The USB device to interact with.
+
+@return Pointer to the counters.
+*/
+const struct usbd_poll_stats *usbd_get_poll_stats(usbd_device *usbd_dev)
+{
+	return &usbd_dev->poll_stats;
+}
+
 /** @brief Resets the USB subsystem back to a USB 'RESET' state.
 
 @param[in] usbd_dev The USB device to interact with.
@@ -149,6 +202,7 @@ void _usbd_reset(usbd_device *usbd_dev)
 {
 	usbd_dev->current_address = 0;
 	usbd_dev->current_config = 0;
+	_usbd_transfer_reset(usbd_dev);
 	usbd_ep_setup(usbd_dev, 0, USB_ENDPOINT_ATTR_CONTROL, 64, NULL);
 	usbd_dev->driver->set_address(usbd_dev, 0);
 
@@ -164,7 +218,128 @@ void _usbd_reset(usbd_device *usbd_dev)
  */
 void usbd_poll(usbd_device *usbd_dev)
 {
+	struct usbd_poll_stats *stats = &usbd_dev->poll_stats;
+
+	/* The driver counts the events it handles in stats->last. */
+	stats->last = 0;
 	usbd_dev->driver->poll(usbd_dev);
+
+	stats->polls++;
+	stats->events += stats->last;
+	if (stats->last > stats->max)
+		stats->max = stats->last;
+}
+
+/** @brief Selects the context the USB callbacks are called from.
+
+By default usbd_poll() calls all callbacks itself. In deferred mode
+usbd_poll(), typically called from the USB interrupt handler, only
+acknowledges the hardware events and queues them, and the callbacks are
+called by usbd_process() from the main loop. Endpoints with an unhandled
+event NAK until then. Events are delivered in the order they occurred,
+except that SOF events not yet handled are merged into one.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] deferred true to queue events for usbd_process().
+*/
+void usbd_set_deferred(usbd_device *usbd_dev, bool deferred)
+{
+	usbd_dev->deferred = deferred;
+}
+
+static void usbd_dispatch_event(usbd_device *usbd_dev, u8 type, u8 ep,
+				u8 transaction)
+{
+	int i;
+
+	switch (type) {
+	case USBD_EVENT_RESET:
+		_usbd_reset(usbd_dev);
+		break;
+	case USBD_EVENT_SUSPEND:
+		if (usbd_dev->user_callback_suspend)
+			usbd_dev->user_callback_suspend();
+		break;
+	case USBD_EVENT_RESUME:
+		if (usbd_dev->user_callback_resume)
+			usbd_dev->user_callback_resume();
+		break;
+	case USBD_EVENT_SOF:
+		_usbd_iso_sof(usbd_dev);
+		for (i = 0; (i < MAX_USER_SOF_CALLBACK) &&
+			    usbd_dev->user_callback_sof[i]; i++)
+			usbd_dev->user_callback_sof[i](usbd_dev);
+		break;
+	case USBD_EVENT_TRANSACTION:
+		if (usbd_dev->user_callback_ctr[ep][transaction])
+			usbd_dev->user_callback_ctr[ep][transaction]
+				(usbd_dev, ep);
+		break;
+	}
+}
+
+/* Called by the drivers for every event: handled right away, or queued
+ * for usbd_process() in deferred mode. Returns -1 if the queue is full. */
+int _usbd_event(usbd_device *usbd_dev, u8 type, u8 ep, u8 transaction)
+{
+	u8 head = usbd_dev->event_head;
+	volatile struct usbd_event *ev;
+
+	if (!usbd_dev->deferred) {
+		usbd_dispatch_event(usbd_dev, type, ep, transaction);
+		return 0;
+	}
+
+	if (type == USBD_EVENT_SOF) {
+		usbd_dev->sof_pending = true;
+		return 0;
+	}
+
+	if ((u8)(head - usbd_dev->event_tail) == USBD_EVENT_QUEUE_SIZE) {
+		usbd_dev->poll_stats.dropped++;
+		return -1;
+	}
+
+	ev = &usbd_dev->events[head % USBD_EVENT_QUEUE_SIZE];
+	ev->type = type;
+	ev->ep = ep;
+	ev->transaction = transaction;
+	usbd_dev->event_head = head + 1;
+
+	return 0;
+}
+
+/** @brief Calls the callbacks for the events queued by usbd_poll().
+
+Only needed in deferred mode, see usbd_set_deferred(). Must not be called
+from the context usbd_poll() is called from.
+
+@param[in] usbd_dev The USB device to interact with.
+*/
+void usbd_process(usbd_device *usbd_dev)
+{
+	u8 tail, type, ep, transaction;
+	volatile struct usbd_event *ev;
+
+	while ((tail = usbd_dev->event_tail) != usbd_dev->event_head) {
+		ev = &usbd_dev->events[tail % USBD_EVENT_QUEUE_SIZE];
+		type = ev->type;
+		ep = ev->ep;
+		transaction = ev->transaction;
+		usbd_dev->event_tail = tail + 1;
+
+		usbd_dispatch_event(usbd_dev, type, ep, transaction);
+
+		if ((type == USBD_EVENT_TRANSACTION) &&
+		    (transaction != USB_TRANSACTION_IN) &&
+		    usbd_dev->driver->rx_done)
+			usbd_dev->driver->rx_done(usbd_dev);
+	}
+
+	if (usbd_dev->sof_pending) {
+		usbd_dev->sof_pending = false;
+		usbd_dispatch_event(usbd_dev, USBD_EVENT_SOF, 0, 0);
+	}
 }
 
 /** @brief Disconnects the driver
@@ -184,6 +359,10 @@ void usbd_disconnect(usbd_device *usbd_dev, bool disconnected)
 @note Control endpoints ignore the direction bit (bit 7).
 @note If bit 7 of the addr is '1' then the endpoint is IN.
 @note If bit 7 of the addr is '0' then the endpoint is OUT.
+@note If the driver has no buffer memory left for it, the endpoint is left
+disabled or stalled; see usbd_get_free_memory().
+Drivers that plan the memory of a configuration refuse SET_CONFIGURATION
+instead when its endpoints can not fit.
 
 @param[in] usbd_dev The USB device to interact with.
 @param[in] addr The address to assign the endpoint.
@@ -194,9 +373,30 @@ void usbd_disconnect(usbd_device *usbd_dev, bool disconnected)
 void usbd_ep_setup(usbd_device *usbd_dev, u8 addr, u8 type, u16 max_size,
 		   void (*callback)(usbd_device *usbd_dev, u8 ep))
 {
+	u8 dir = (addr & 0x80) ? USB_TRANSACTION_IN : USB_TRANSACTION_OUT;
+
+	usbd_dev->transfer[addr & 0x7f][dir].max_size = max_size;
+	usbd_dev->iso[addr & 0x7f][dir].callback = NULL;
 	usbd_dev->driver->ep_setup(usbd_dev, addr, type, max_size, callback);
 }
 
+/** @brief Returns the endpoint buffer memory left.
+
+Endpoints set up again, e.g. for another alternate setting, give their old
+buffers back first, and all of them are given back at SET_CONFIGURATION.
+
+@param[in] usbd_dev The USB device to interact with.
+@return Number of bytes still available for endpoint buffers, 0 if the
+driver does not keep track.
+*/
+u16 usbd_get_free_memory(usbd_device *usbd_dev)
+{
+	if (!usbd_dev->driver->mem_free)
+		return 0;
+
+	return usbd_dev->driver->mem_free(usbd_dev);
+}
+
 /** @brief Writes a single packet of data to the host.
 
 @note The data must be no larger then the endpoint max_size.
@@ -231,6 +431,209 @@ u16 usbd_ep_read_packet(usbd_device *usbd_dev, u8 addr, void *buf, u16 len)
 	return usbd_dev->driver->ep_read_packet(usbd_dev, addr, buf, len);
 }
 
+static void usbd_buffer_put(struct usbd_ep_buffer *buf)
+{
+	if (buf->width == 2)
+		*(volatile u16 *)buf->mem = buf->word;
+	else
+		*(volatile u32 *)buf->mem = buf->word;
+	buf->mem = (volatile u8 *)buf->mem + buf->stride;
+	buf->word = 0;
+	buf->count = 0;
+}
+
+static void usbd_buffer_get(struct usbd_ep_buffer *buf)
+{
+	if (buf->width == 2)
+		buf->word = *(volatile u16 *)buf->mem;
+	else
+		buf->word = *(volatile u32 *)buf->mem;
+	buf->mem = (volatile u8 *)buf->mem + buf->stride;
+	buf->count = buf->width;
+}
+
+/** @brief Starts writing a packet straight into the hardware buffer.
+
+The packet is put together with usbd_ep_buffer_write(), as often as needed,
+and handed to the hardware by usbd_ep_write_end(). This saves the copy
+into a packet sized buffer first that usbd_ep_write_packet() needs.
+
+@note Do not mix with a transfer in progress on the endpoint, and finish
+the packet before usbd_poll() can handle the endpoint again.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] addr The endpoint address to write to.
+@param[in] len Length of the packet, at most the endpoint max_size. The
+	       OTG cores need it before any data.
+@param[out] buf Handle for the packet.
+@return 0 if successful, -1 if the endpoint still holds a packet or the
+	driver does not support it.
+*/
+int usbd_ep_write_begin(usbd_device *usbd_dev, u8 addr, u16 len,
+			struct usbd_ep_buffer *buf)
+{
+	buf->usbd_dev = usbd_dev;
+	buf->addr = addr;
+	buf->word = 0;
+	buf->count = 0;
+	buf->len = 0;
+	buf->size = len;
+
+	if (!usbd_dev->driver->ep_write_begin ||
+	    !usbd_dev->driver->ep_write_begin(usbd_dev, buf))
+		return -1;
+
+	return 0;
+}
+
+/** @brief Appends data to a packet started with usbd_ep_write_begin().
+
+@param[in] buf Handle of the packet.
+@param[in] data The data to append.
+@param[in] len The number of bytes to append.
+@return The number of bytes taken, less than @a len when the packet is full.
+*/
+u16 usbd_ep_buffer_write(struct usbd_ep_buffer *buf, const void *data,
+			 u16 len)
+{
+	const u8 *src = data;
+	u16 i = 0;
+
+	len = MIN(len, buf->size - buf->len);
+
+	while (i < len) {
+		/* Whole words straight from an aligned source. */
+		if (!buf->count && (len - i >= buf->width) &&
+		    !((uintptr_t)(src + i) & (buf->width - 1))) {
+			if (buf->width == 2)
+				buf->word = *(const u16 *)(src + i);
+			else
+				buf->word = *(const u32 *)(src + i);
+			i += buf->width;
+			usbd_buffer_put(buf);
+			continue;
+		}
+
+		buf->word |= (u32)src[i++] << (8 * buf->count);
+		if (++buf->count == buf->width)
+			usbd_buffer_put(buf);
+	}
+
+	buf->len += len;
+
+	return len;
+}
+
+/** @brief Hands a packet started with usbd_ep_write_begin() to the hardware.
+
+What was not written of the packet is sent as zeros.
+
+@param[in] buf Handle of the packet.
+*/
+void usbd_ep_write_end(struct usbd_ep_buffer *buf)
+{
+	static const u32 zeros[4];
+	u16 len;
+
+	while (buf->len < buf->size) {
+		len = MIN(buf->size - buf->len, (u16)sizeof(zeros));
+		usbd_ep_buffer_write(buf, zeros, len);
+	}
+
+	if (buf->count)
+		usbd_buffer_put(buf);
+
+	if (buf->usbd_dev->driver->ep_write_end)
+		buf->usbd_dev->driver->ep_write_end(buf->usbd_dev, buf);
+}
+
+/** @brief Starts reading a packet straight from the hardware buffer.
+
+The packet is taken apart with usbd_ep_buffer_read(), as often as needed,
+and the buffer given back by usbd_ep_read_end(), typically from the
+endpoint callback.
+
+@note On the OTG cores the packet can only be read from the endpoint
+callback.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] addr The endpoint address to read from.
+@param[out] buf Handle for the packet.
+@return Length of the packet, -1 if there is none or the driver does not
+	support it.
+*/
+int usbd_ep_read_begin(usbd_device *usbd_dev, u8 addr,
+		       struct usbd_ep_buffer *buf)
+{
+	buf->usbd_dev = usbd_dev;
+	buf->addr = addr;
+	buf->count = 0;
+	buf->len = 0;
+	buf->size = 0;
+
+	if (!usbd_dev->driver->ep_read_begin ||
+	    !usbd_dev->driver->ep_read_begin(usbd_dev, buf))
+		return -1;
+
+	return buf->size;
+}
+
+/** @brief Takes data from a packet started with usbd_ep_read_begin().
+
+@param[in] buf Handle of the packet.
+@param[out] data Where to put the data, may be NULL to skip it.
+@param[in] len The number of bytes to take.
+@return The number of bytes taken, less than @a len at the end of the
+	packet.
+*/
+u16 usbd_ep_buffer_read(struct usbd_ep_buffer *buf, void *data, u16 len)
+{
+	u8 *dst = data;
+	u16 i = 0;
+
+	len = MIN(len, buf->size - buf->len);
+
+	while (i < len) {
+		if (!buf->count) {
+			/* Whole words straight to an aligned destination. */
+			if (dst && (len - i >= buf->width) &&
+			    !((uintptr_t)(dst + i) & (buf->width - 1))) {
+				usbd_buffer_get(buf);
+				if (buf->width == 2)
+					*(u16 *)(dst + i) = buf->word;
+				else
+					*(u32 *)(dst + i) = buf->word;
+				i += buf->width;
+				buf->count = 0;
+				continue;
+			}
+			usbd_buffer_get(buf);
+		}
+
+		if (dst)
+			dst[i] = buf->word;
+		buf->word >>= 8;
+		buf->count--;
+		i++;
+	}
+
+	buf->len += len;
+
+	return len;
+}
+
+/** @brief Gives back the buffer of a packet started with usbd_ep_read_begin().
+
+What was not read of the packet is dropped.
+
+@param[in] buf Handle of the packet.
+*/
+void usbd_ep_read_end(struct usbd_ep_buffer *buf)
+{
+	if (buf->usbd_dev->driver->ep_read_end)
+		buf->usbd_dev->driver->ep_read_end(buf->usbd_dev, buf);
+}
+
 /** @brief Sets the USB 'STALL' status for the specified endpoint.
 
 @param[in] usbd_dev The USB device to interact with.
@@ -266,4 +669,462 @@ void usbd_ep_nak_set(usbd_device *usbd_dev, u8 addr, u8 nak)
 {
 	usbd_dev->driver->ep_nak_set(usbd_dev, addr, nak);
 }
+
+static void usbd_transfer_done(usbd_device *usbd_dev, u8 ep, u8 dir)
+{
+	struct usbd_transfer *t = &usbd_dev->transfer[ep][dir];
+	u8 addr = (dir == USB_TRANSACTION_IN) ? (ep | 0x80) : ep;
+
+	/* Give the endpoint back before the callback may start the next
+	 * transfer. */
+	t->active = false;
+	usbd_dev->user_callback_ctr[ep][dir] = t->saved_cb;
+
+	if (t->callback)
+		t->callback(usbd_dev, addr, t->count);
+}
+
+static void usbd_transfer_in_next(usbd_device *usbd_dev, u8 ep)
+{
+	struct usbd_transfer *t = &usbd_dev->transfer[ep][USB_TRANSACTION_IN];
+	u32 left = t->len - t->count;
+	u16 chunk = MIN(t->max_size, left);
+	u32 len;
+
+	/* Any short packet, including the ZLP, terminates the transfer. */
+	if (chunk < t->max_size)
+		t->zlp = false;
+
+	/* Let the hardware send several packets in one go if it can. */
+	if ((left > t->max_size) && usbd_dev->driver->ep_transfer) {
+		len = usbd_dev->driver->ep_transfer(usbd_dev, ep | 0x80,
+						    t->buf + t->count, left);
+		if (len) {
+			t->count += len;
+			return;
+		}
+	}
+
+	t->count += usbd_ep_write_packet(usbd_dev, ep | 0x80,
+					 t->buf + t->count, chunk);
+}
+
+static void usbd_transfer_in_cb(usbd_device *usbd_dev, u8 ea)
+{
+	u8 ep = ea & 0x7f;
+	struct usbd_transfer *t = &usbd_dev->transfer[ep][USB_TRANSACTION_IN];
+
+	if (!t->active) {
+		if (t->saved_cb)
+			t->saved_cb(usbd_dev, ea);
+		return;
+	}
+
+	if ((t->count < t->len) || t->zlp)
+		usbd_transfer_in_next(usbd_dev, ep);
+	else
+		usbd_transfer_done(usbd_dev, ep, USB_TRANSACTION_IN);
+}
+
+/*
+ * Lets the hardware receive several packets in one go if it can, hw_len is
+ * left 0 otherwise. Called while the endpoint is NAKed or busy with the
+ * last packet read.
+ */
+static void usbd_transfer_out_next(usbd_device *usbd_dev, u8 ep)
+{
+	struct usbd_transfer *t = &usbd_dev->transfer[ep][USB_TRANSACTION_OUT];
+	u32 left = t->len - t->count;
+
+	if ((left > t->max_size) && usbd_dev->driver->ep_transfer)
+		t->hw_len = usbd_dev->driver->ep_transfer(usbd_dev, ep,
+							  t->buf + t->count,
+							  left);
+}
+
+static void usbd_transfer_out_cb(usbd_device *usbd_dev, u8 ea)
+{
+	u8 ep = ea & 0x7f;
+	struct usbd_transfer *t = &usbd_dev->transfer[ep][USB_TRANSACTION_OUT];
+	u32 received;
+	u16 chunk, len;
+
+	if (!t->active) {
+		if (t->saved_cb)
+			t->saved_cb(usbd_dev, ea);
+		else
+			usbd_ep_read_packet(usbd_dev, ep, NULL, 0);
+		return;
+	}
+
+	/* The hardware is done with its part, the endpoint NAKs. */
+	if (t->hw_len) {
+		received = usbd_dev->driver->ep_transfer_count(usbd_dev, ep);
+		t->count += received;
+
+		if ((received < t->hw_len) || (t->count == t->len)) {
+			t->hw_len = 0;
+			usbd_ep_nak_set(usbd_dev, ep, 1);
+			usbd_transfer_done(usbd_dev, ep, USB_TRANSACTION_OUT);
+			return;
+		}
+
+		t->hw_len = 0;
+		usbd_transfer_out_next(usbd_dev, ep);
+		if (!t->hw_len)
+			usbd_ep_nak_set(usbd_dev, ep, 0);
+		return;
+	}
+
+	chunk = MIN(t->max_size, t->len - t->count);
+
+	/* If this is the last packet for the buffer, keep the endpoint NAKed
+	 * until the next transfer is set up. */
+	if (chunk == t->len - t->count)
+		usbd_ep_nak_set(usbd_dev, ep, 1);
+
+	len = usbd_ep_read_packet(usbd_dev, ep, t->buf + t->count, chunk);
+	t->count += len;
+
+	if ((len < t->max_size) || (t->count == t->len)) {
+		usbd_ep_nak_set(usbd_dev, ep, 1);
+		usbd_transfer_done(usbd_dev, ep, USB_TRANSACTION_OUT);
+		return;
+	}
+
+	usbd_transfer_out_next(usbd_dev, ep);
+}
+
+/** @brief Drops all pending transfers and restores the endpoint callbacks.
+
+@param[in] usbd_dev The USB device to interact with.
+*/
+void _usbd_transfer_reset(usbd_device *usbd_dev)
+{
+	int ep, dir;
+
+	for (ep = 0; ep < 8; ep++) {
+		for (dir = USB_TRANSACTION_IN; dir <= USB_TRANSACTION_OUT;
+		     dir++) {
+			struct usbd_transfer *t = &usbd_dev->transfer[ep][dir];
+
+			if (!t->active)
+				continue;
+
+			t->active = false;
+			t->hw_len = 0;
+			usbd_dev->user_callback_ctr[ep][dir] = t->saved_cb;
+		}
+
+		usbd_dev->tx_queue[ep].head = 0;
+		usbd_dev->tx_queue[ep].count = 0;
+		usbd_dev->iso[ep][USB_TRANSACTION_IN].callback = NULL;
+		usbd_dev->iso[ep][USB_TRANSACTION_OUT].callback = NULL;
+	}
+}
+
+/** @brief Drops the transfer and queued buffers of one endpoint.
+
+An OUT endpoint is left NAKed. Data already handed to the hardware for an
+IN endpoint is not taken back.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] addr The endpoint address.
+*/
+void _usbd_transfer_cancel(usbd_device *usbd_dev, u8 addr)
+{
+	u8 ep = addr & 0x7f;
+	u8 dir = (addr & 0x80) ? USB_TRANSACTION_IN : USB_TRANSACTION_OUT;
+	struct usbd_transfer *t = &usbd_dev->transfer[ep][dir];
+
+	if (t->active) {
+		t->active = false;
+		t->hw_len = 0;
+		usbd_dev->user_callback_ctr[ep][dir] = t->saved_cb;
+	}
+
+	if (dir == USB_TRANSACTION_IN) {
+		usbd_dev->tx_queue[ep].head = 0;
+		usbd_dev->tx_queue[ep].count = 0;
+	} else {
+		usbd_ep_nak_set(usbd_dev, ep, 1);
+	}
+}
+
+/** @brief Sends a buffer of any length to the host.
+
+The buffer is split into packets of the endpoint max_size. The endpoint
+callback registered with usbd_ep_setup() is not called while the transfer
+is in progress; instead the completion callback is called once when the
+host has received all the data. The callback may start the next transfer.
+
+Where the hardware supports it (the OTG cores), the packets are handed to
+it in one go and the CPU is only involved to fill the FIFO and at the end.
+
+@note The endpoint must be idle when the transfer is started.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] addr The endpoint address to write to.
+@param[in] buf The data to write. Must stay valid until the callback.
+@param[in] len The number of bytes to write.
+@param[in] zlp If true, terminate the transfer with a zero length packet
+	       when len is a multiple of the endpoint max_size.
+@param[in] callback The function to call when the transfer is complete,
+		    may be NULL.
+
+@return 0 if successful, -1 if a transfer is already in progress or the
+	endpoint is not set up.
+*/
+int usbd_ep_transfer_in(usbd_device *usbd_dev, u8 addr,
+			const void *buf, u32 len, bool zlp,
+			usbd_transfer_callback callback)
+{
+	u8 ep = addr & 0x7f;
+	struct usbd_transfer *t = &usbd_dev->transfer[ep][USB_TRANSACTION_IN];
+
+	if (t->active || (t->max_size == 0))
+		return -1;
+
+	t->buf = (u8 *)buf;
+	t->len = len;
+	t->count = 0;
+	t->zlp = zlp && ((len % t->max_size) == 0);
+	t->hw_len = 0;
+	t->callback = callback;
+
+	if ((len == 0) && !t->zlp) {
+		if (callback)
+			callback(usbd_dev, ep | 0x80, 0);
+		return 0;
+	}
+
+	t->active = true;
+	t->saved_cb = usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_IN];
+	usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_IN] =
+		usbd_transfer_in_cb;
+
+	usbd_transfer_in_next(usbd_dev, ep);
+
+	return 0;
+}
+
+/** @brief Receives a buffer of any length from the host.
+
+Packets are read into the buffer until it is full or the host sends a
+short packet. The endpoint is NAKed between transfers, so data from the
+host is held back until the next transfer is set up. The endpoint callback
+registered with usbd_ep_setup() is not called while the transfer is in
+progress; instead the completion callback is called once with the number
+of bytes received. The callback may start the next transfer. As for
+usbd_ep_transfer_in(), the hardware may receive several packets in one go.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] addr The endpoint address to read from.
+@param[out] buf The location to read into. Must stay valid until the
+		callback.
+@param[in] len The size of the buffer in bytes.
+@param[in] callback The function to call when the transfer is complete,
+		    may be NULL.
+
+@return 0 if successful, -1 if a transfer is already in progress or the
+	endpoint is not set up.
+*/
+int usbd_ep_transfer_out(usbd_device *usbd_dev, u8 addr,
+			 void *buf, u32 len,
+			 usbd_transfer_callback callback)
+{
+	u8 ep = addr & 0x7f;
+	struct usbd_transfer *t = &usbd_dev->transfer[ep][USB_TRANSACTION_OUT];
+
+	if (t->active || (t->max_size == 0))
+		return -1;
+
+	t->buf = buf;
+	t->len = len;
+	t->count = 0;
+	t->zlp = false;
+	t->hw_len = 0;
+	t->callback = callback;
+
+	if (len == 0) {
+		if (callback)
+			callback(usbd_dev, ep, 0);
+		return 0;
+	}
+
+	t->active = true;
+	t->saved_cb = usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_OUT];
+	usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_OUT] =
+		usbd_transfer_out_cb;
+
+	usbd_transfer_out_next(usbd_dev, ep);
+	if (!t->hw_len)
+		usbd_ep_nak_set(usbd_dev, ep, 0);
+
+	return 0;
+}
+
+static void usbd_queue_in_start(usbd_device *usbd_dev, u8 ep);
+
+static void usbd_queue_in_done(usbd_device *usbd_dev, u8 addr, u32 len)
+{
+	struct usbd_tx_queue *q = &usbd_dev->tx_queue[addr & 0x7f];
+
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+
+	/* Keep the endpoint busy while the producer is told. */
+	usbd_queue_in_start(usbd_dev, addr & 0x7f);
+
+	if (q->callback)
+		q->callback(usbd_dev, addr, len);
+}
+
+static void usbd_queue_in_start(usbd_device *usbd_dev, u8 ep)
+{
+	struct usbd_tx_queue *q = &usbd_dev->tx_queue[ep];
+	struct usbd_queue_entry *e = &q->entries[q->head];
+
+	if (q->count)
+		usbd_ep_transfer_in(usbd_dev, ep | 0x80, e->buf, e->len,
+				    false, usbd_queue_in_done);
+}
+
+/** @brief Sets up a queue of buffers for an IN endpoint.
+
+Buffers added with usbd_ep_queue_in() are sent one after the other, each
+as a transfer started by usbd_ep_transfer_in(). The next buffer is started
+from the completion of the previous one, so the endpoint does not wait for
+the application while data is pending. All data for the endpoint must be
+sent through the queue. Pending buffers are dropped on a USB reset.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] addr The endpoint address.
+@param[in] entries Storage for the queue. Must stay valid while the
+		   endpoint is in use.
+@param[in] size Number of entries.
+@param[in] callback Called when a buffer has been sent and may be reused,
+		    may be NULL.
+
+@return 0 if successful, -1 if buffers are still pending.
+*/
+int usbd_ep_queue_setup(usbd_device *usbd_dev, u8 addr,
+			struct usbd_queue_entry *entries, u8 size,
+			usbd_transfer_callback callback)
+{
+	struct usbd_tx_queue *q = &usbd_dev->tx_queue[addr & 0x7f];
+
+	if (q->count)
+		return -1;
+
+	q->entries = entries;
+	q->size = size;
+	q->head = 0;
+	q->callback = callback;
+
+	return 0;
+}
+
+/** @brief Adds a buffer to the queue of an IN endpoint.
+
+Must be called from the context the USB callbacks run in, or with the USB
+interrupt disabled.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] addr The endpoint address.
+@param[in] buf The data to send. Must stay valid until the callback.
+@param[in] len The number of bytes to send.
+
+@return 0 if successful, -1 if the queue is full or not set up.
+*/
+int usbd_ep_queue_in(usbd_device *usbd_dev, u8 addr,
+		     const void *buf, u32 len)
+{
+	u8 ep = addr & 0x7f;
+	struct usbd_tx_queue *q = &usbd_dev->tx_queue[ep];
+	struct usbd_queue_entry *e;
+
+	if (q->count == q->size)
+		return -1;
+
+	e = &q->entries[(q->head + q->count) % q->size];
+	e->buf = buf;
+	e->len = len;
+
+	if (q->count++ == 0)
+		usbd_queue_in_start(usbd_dev, ep);
+
+	return 0;
+}
+
+static void usbd_iso_in_cb(usbd_device *usbd_dev, u8 ea)
+{
+	usbd_dev->iso[ea & 0x7f][USB_TRANSACTION_IN].ready = true;
+}
+
+static void usbd_iso_out_cb(usbd_device *usbd_dev, u8 ea)
+{
+	struct usbd_iso *iso = &usbd_dev->iso[ea & 0x7f][USB_TRANSACTION_OUT];
+	u16 len;
+
+	len = usbd_ep_read_packet(usbd_dev, ea, iso->buf, iso->max_size);
+	if (iso->callback)
+		iso->callback(usbd_dev, ea, iso->buf, len);
+}
+
+/* Called at the start of every frame, before the SOF callback. */
+void _usbd_iso_sof(usbd_device *usbd_dev)
+{
+	struct usbd_iso *iso;
+	u16 len;
+	int ep;
+
+	for (ep = 1; ep < 8; ep++) {
+		iso = &usbd_dev->iso[ep][USB_TRANSACTION_IN];
+		if (!iso->callback || !iso->ready)
+			continue;
+
+		len = iso->callback(usbd_dev, ep | 0x80, iso->buf,
+				    iso->max_size);
+		iso->ready = false;
+		usbd_ep_write_packet(usbd_dev, ep | 0x80, iso->buf, len);
+	}
+}
+
+/** @brief Sets up an isochronous endpoint served once per frame.
+
+The endpoint is set up with usbd_ep_setup() and the callback is called once
+per frame with @a buf:
+- IN: at the start of the frame, to fill up to @a max_size bytes and return
+  the length of the packet. It is sent in the next frame, 0 sends a zero
+  length packet. The callback is not called again before the host has
+  taken the packet, so nothing is lost while the host does not poll the
+  endpoint; if it is not called at all, zero length packets are sent.
+- OUT: with the packet received in the frame, the return value is ignored.
+  A packet the host did not send is not reported.
+
+The hardware buffers one packet on top of the one in transfer, so an IN
+packet reaches the host one frame after it is filled.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] addr The endpoint address.
+@param[in] max_size The endpoint size, and the size of @a buf.
+@param[in] buf Packet buffer. Must stay valid while the endpoint is in use.
+@param[in] callback The function to fill or drain a packet.
+*/
+void usbd_ep_iso_setup(usbd_device *usbd_dev, u8 addr, u16 max_size,
+		       u8 *buf, usbd_iso_callback callback)
+{
+	u8 dir = (addr & 0x80) ? USB_TRANSACTION_IN : USB_TRANSACTION_OUT;
+	struct usbd_iso *iso = &usbd_dev->iso[addr & 0x7f][dir];
+
+	usbd_ep_setup(usbd_dev, addr, USB_ENDPOINT_ATTR_ISOCHRONOUS, max_size,
+		      (dir == USB_TRANSACTION_IN) ? usbd_iso_in_cb :
+		      usbd_iso_out_cb);
+
+	iso->buf = buf;
+	iso->max_size = max_size;
+	iso->ready = true;
+	iso->callback = callback;
+}
 /**@}*/
@@ -0,0 +1,443 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/audio.h>
+#include "usb_private.h"
+
+/* The sample clock is measured over 1 << AUDIO_FB_WINDOW frames. */
+#define AUDIO_FB_WINDOW		10
+/* The ring level is averaged over about 1 << AUDIO_FILL_SHIFT frames. */
+#define AUDIO_FILL_SHIFT	5
+
+struct _usbd_audio {
+	usbd_device *usbd_dev;
+	u8 iface;		/* Streaming interface. */
+	u8 ep_out;
+	u8 ep_fb;
+	u16 ep_size;
+	u8 frame_size;		/* Bytes per sample of all channels. */
+	u32 rate;
+	u8 altsetting;
+	void (*rate_changed)(usbd_audio *audio, u32 rate);
+
+	/*
+	 * Samples from the host, written at ring_head by audio_out() and
+	 * read from ring_tail by usb_audio_read(), which may interrupt each
+	 * other: each index has one writer and a frame is always left free,
+	 * so the level needs no shared count. Reads only start once the ring
+	 * is half full, so the host can be early or late by half of it.
+	 */
+	u8 *packet;
+	u8 *ring;
+	u16 ring_size;
+	volatile u16 ring_head;
+	volatile u16 ring_tail;
+	volatile u8 ring_reset;	/* Changed to have the reader empty it. */
+	u8 ring_reset_seen;
+	bool primed;		/* Reader side. */
+
+	/* Feedback, 10.14 samples per frame. */
+	u32 fb_nominal;
+	u32 fb_rate;		/* Measured rate of the sample clock. */
+	u32 fb_value;		/* Sent to the host. */
+	u8 fb_packet[USB_AUDIO_FEEDBACK_SIZE];
+	u16 frames;
+	volatile u32 consumed;	/* Samples read by the application. */
+	u32 consumed_last;	/* consumed at the start of the window. */
+	s32 fill;		/* Average ring level, samples << 8. */
+};
+
+static usbd_audio _audio;
+
+/*
+ * Keeps the compiler from moving the samples copied to or from the ring past
+ * the index update that hands them over.
+ */
+static inline void audio_barrier(void)
+{
+	__asm__ volatile ("" : : : "memory");
+}
+
+static u16 audio_level(usbd_audio *audio, u16 head, u16 tail)
+{
+	return (head + audio->ring_size - tail) % audio->ring_size;
+}
+
+/*-- Data and feedback -------------------------------------------------------*/
+
+/* Packets that do not fit are dropped, the feedback corrects the rate. */
+static u16 audio_out(usbd_device *usbd_dev, u8 ep, u8 *buf, u16 len)
+{
+	usbd_audio *audio = &_audio;
+	u16 head, chunk;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	len -= len % audio->frame_size;
+	head = audio->ring_head;
+	if ((audio->altsetting != 1) ||
+	    (len > audio->ring_size - audio->frame_size -
+		   audio_level(audio, head, audio->ring_tail)))
+		return 0;
+
+	chunk = MIN(len, audio->ring_size - head);
+	memcpy(audio->ring + head, buf, chunk);
+	memcpy(audio->ring, buf + chunk, len - chunk);
+	audio_barrier();
+	audio->ring_head = (head + len) % audio->ring_size;
+
+	return 0;
+}
+
+static u16 audio_fb(usbd_device *usbd_dev, u8 ep, u8 *buf, u16 len)
+{
+	usbd_audio *audio = &_audio;
+
+	(void)usbd_dev;
+	(void)ep;
+	(void)len;
+
+	buf[0] = audio->fb_value;
+	buf[1] = audio->fb_value >> 8;
+	buf[2] = audio->fb_value >> 16;
+
+	return USB_AUDIO_FEEDBACK_SIZE;
+}
+
+/*
+ * The rate of the local sample clock is the number of samples the
+ * application read per frame, measured over a window long enough that
+ * reading in blocks does not matter. A correction towards a half full ring
+ * takes out the offset the host started with and what the measurement
+ * misses; the level is averaged for the same reason.
+ */
+static void audio_sof(usbd_device *usbd_dev)
+{
+	usbd_audio *audio = &_audio;
+	u32 samples, measured;
+	s32 fb, level;
+
+	(void)usbd_dev;
+
+	if (audio->altsetting != 1)
+		return;
+
+	if (++audio->frames == (1 << AUDIO_FB_WINDOW)) {
+		audio->frames = 0;
+		samples = audio->consumed - audio->consumed_last;
+		audio->consumed_last = audio->consumed;
+
+		/* Nothing was read yet, keep the nominal rate. */
+		if (samples) {
+			measured = samples << (14 - AUDIO_FB_WINDOW);
+			audio->fb_rate += (s32)(measured - audio->fb_rate) / 8;
+		}
+	}
+
+	level = audio_level(audio, audio->ring_head, audio->ring_tail);
+	level = (level / audio->frame_size) << 8;
+	audio->fill += (level - audio->fill) >> AUDIO_FILL_SHIFT;
+
+	/* 1/256 sample per frame for each sample off half full. */
+	fb = audio->fb_rate +
+	     (((s32)(audio->ring_size / audio->frame_size / 2) << 8) -
+	      audio->fill) / 4;
+
+	/* Stay within 1/16 of the nominal rate. */
+	fb = MIN(fb, (s32)(audio->fb_nominal + (audio->fb_nominal >> 4)));
+	if (fb < (s32)(audio->fb_nominal - (audio->fb_nominal >> 4)))
+		fb = audio->fb_nominal - (audio->fb_nominal >> 4);
+	audio->fb_value = fb;
+}
+
+static void audio_set_rate(usbd_audio *audio, u32 rate)
+{
+	audio->rate = rate;
+	/* rate / 1000 samples per frame in 10.14, rates up to 262 kHz. */
+	audio->fb_nominal = (rate << 14) / 1000;
+	audio->fb_rate = audio->fb_nominal;
+	audio->fb_value = audio->fb_nominal;
+}
+
+/*-- Control requests --------------------------------------------------------*/
+
+static void audio_set_altsetting(usbd_audio *audio, u8 altsetting)
+{
+	audio->altsetting = altsetting;
+	/* The tail belongs to the reader, it empties the ring on its side. */
+	audio->ring_reset++;
+	audio->frames = 0;
+	audio->consumed_last = audio->consumed;
+	audio->fill = (audio->ring_size / audio->frame_size / 2) << 8;
+	audio->fb_rate = audio->fb_nominal;
+	audio->fb_value = audio->fb_nominal;
+}
+
+static int audio_interface_request(usbd_device *usbd_dev,
+				   struct usb_setup_data *req, u8 **buf,
+				   u16 *len,
+				   void (**complete)(usbd_device *usbd_dev,
+						     struct usb_setup_data *req))
+{
+	usbd_audio *audio = &_audio;
+
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->wIndex != audio->iface)
+		return USBD_REQ_NEXT_CALLBACK;
+
+	switch (req->bRequest) {
+	case USB_REQ_GET_INTERFACE:
+		*len = 1;
+		(*buf)[0] = audio->altsetting;
+		return USBD_REQ_HANDLED;
+	case USB_REQ_SET_INTERFACE:
+		if (req->wValue > 1)
+			return USBD_REQ_NOTSUPP;
+		audio_set_altsetting(audio, req->wValue);
+		*len = 0;
+		return USBD_REQ_HANDLED;
+	}
+
+	return USBD_REQ_NEXT_CALLBACK;
+}
+
+static void audio_rate_complete(usbd_device *usbd_dev,
+				struct usb_setup_data *req)
+{
+	usbd_audio *audio = &_audio;
+
+	(void)usbd_dev;
+	(void)req;
+
+	if (audio->rate_changed)
+		audio->rate_changed(audio, audio->rate);
+}
+
+/* Sampling frequency control of the data endpoint. */
+static int audio_endpoint_request(usbd_device *usbd_dev,
+				  struct usb_setup_data *req, u8 **buf,
+				  u16 *len,
+				  void (**complete)(usbd_device *usbd_dev,
+						    struct usb_setup_data *req))
+{
+	usbd_audio *audio = &_audio;
+	u32 rate;
+
+	(void)usbd_dev;
+
+	if (req->wIndex != audio->ep_out)
+		return USBD_REQ_NEXT_CALLBACK;
+
+	if ((req->wValue >> 8) != USB_AUDIO_SAMPLING_FREQ_CONTROL)
+		return USBD_REQ_NOTSUPP;
+
+	switch (req->bRequest) {
+	case USB_AUDIO_REQ_SET_CUR:
+		if (*len < 3)
+			return USBD_REQ_NOTSUPP;
+		rate = (*buf)[0] | ((*buf)[1] << 8) | ((*buf)[2] << 16);
+		if (!rate)
+			return USBD_REQ_NOTSUPP;
+		audio_set_rate(audio, rate);
+		*complete = audio_rate_complete;
+		return USBD_REQ_HANDLED;
+	case USB_AUDIO_REQ_GET_CUR:
+		(*buf)[0] = audio->rate;
+		(*buf)[1] = audio->rate >> 8;
+		(*buf)[2] = audio->rate >> 16;
+		*len = MIN(*len, 3);
+		return USBD_REQ_HANDLED;
+	}
+
+	return USBD_REQ_NOTSUPP;
+}
+
+static void audio_set_config(usbd_device *usbd_dev, u16 wValue)
+{
+	usbd_audio *audio = &_audio;
+
+	(void)wValue;
+
+	usbd_ep_iso_setup(usbd_dev, audio->ep_out, audio->ep_size,
+			  audio->packet, audio_out);
+	usbd_ep_iso_setup(usbd_dev, audio->ep_fb, USB_AUDIO_FEEDBACK_SIZE,
+			  audio->fb_packet, audio_fb);
+
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_ENDPOINT,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				audio_endpoint_request);
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				audio_interface_request);
+
+	audio_set_altsetting(audio, 0);
+}
+
+/** @addtogroup usb_audio */
+/** @{ */
+
+/** @brief Initializes an audio streaming function with explicit feedback.
+
+@note Currently you can only have this profile active.
+
+The host streams PCM samples to the isochronous OUT endpoint @a ep_out of
+the streaming interface @a iface, alternate setting 1; alternate setting 0
+has no endpoints. The device runs on its own sample clock and tells the
+host how many samples to send per frame on the feedback endpoint @a ep_fb,
+isochronous IN with USB_AUDIO_FEEDBACK_SIZE bytes. The application
+provides the descriptors, with bSynchAddress of the data endpoint set to
+@a ep_fb.
+
+The samples are buffered in a ring the application drains with
+usb_audio_read() at the pace of its sample clock, e.g. from the DMA
+interrupt of the codec. The feedback is the rate at which it reads,
+measured against the USB frames, corrected towards a half full ring.
+
+Adds its set configuration and SOF callbacks to those of the device, so
+other class functions and the application can register theirs as well.
+The feedback is computed on each SOF.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] iface Number of the audio streaming interface.
+@param[in] ep_out Data endpoint, isochronous OUT.
+@param[in] ep_fb Feedback endpoint, isochronous IN.
+@param[in] ep_size Size of the data endpoint, room for one sample more
+		   than the nominal rate per frame.
+@param[in] rate Sampling frequency in Hz, may be changed by the host.
+@param[in] frame_size Bytes per sample of all channels together.
+@param[in] buf Buffer, @a ep_size bytes for the packet being received and
+	       the rest for the ring, several frames of samples.
+@param[in] buf_size Size of @a buf.
+@return Pointer to the usbd_audio struct, NULL if the device has no room
+left for its callbacks.
+*/
+usbd_audio *usb_audio_init(usbd_device *usbd_dev, u8 iface, u8 ep_out,
+			   u8 ep_fb, u16 ep_size, u32 rate, u8 frame_size,
+			   u8 *buf, u16 buf_size)
+{
+	usbd_audio *audio = &_audio;
+
+	memset(audio, 0, sizeof(*audio));
+
+	audio->usbd_dev = usbd_dev;
+	audio->iface = iface;
+	audio->ep_out = ep_out;
+	audio->ep_fb = ep_fb;
+	audio->ep_size = ep_size;
+	audio->frame_size = frame_size;
+	audio->packet = buf;
+	audio->ring = buf + ep_size;
+	audio->ring_size = buf_size - ep_size;
+	audio->ring_size -= audio->ring_size % frame_size;
+	audio_set_rate(audio, rate);
+
+	if (usbd_register_set_config_callback(usbd_dev, audio_set_config) ||
+	    usbd_register_sof_callback(usbd_dev, audio_sof))
+		return NULL;
+
+	return audio;
+}
+
+/** @brief Set the function called when the host changes the sampling
+frequency
+
+@param[in] audio Audio instance returned by usb_audio_init().
+@param[in] callback Called with the new rate in Hz after the request.
+*/
+void usb_audio_set_rate_callback(usbd_audio *audio,
+				 void (*callback)(usbd_audio *audio, u32 rate))
+{
+	audio->rate_changed = callback;
+}
+
+/** @brief Read samples received from the host
+
+Nothing is returned until the ring has filled up to half after the host
+started streaming, and again after it ran empty.
+
+May be called from another context than usbd_poll(), e.g. the DMA
+interrupt of the codec, without masking the USB interrupt; it must not be
+called from two contexts at once.
+
+@param[in] audio Audio instance returned by usb_audio_init().
+@param[out] buf Where to put the samples.
+@param[in] len Size of @a buf in bytes.
+@return Number of bytes read, whole samples. Less than @a len if the
+ring ran empty; the application plays silence for the rest.
+*/
+u16 usb_audio_read(usbd_audio *audio, void *buf, u16 len)
+{
+	u16 tail, level, chunk;
+	u8 reset;
+
+	len -= len % audio->frame_size;
+
+	/* The sample clock ran for what was asked for, silence or not. */
+	if (audio->altsetting == 1)
+		audio->consumed += len / audio->frame_size;
+
+	reset = audio->ring_reset;
+	if (reset != audio->ring_reset_seen) {
+		audio->ring_reset_seen = reset;
+		audio->ring_tail = audio->ring_head;
+		audio->primed = false;
+	}
+
+	tail = audio->ring_tail;
+	level = audio_level(audio, audio->ring_head, tail);
+	audio_barrier();
+
+	if (!audio->primed) {
+		if (level < audio->ring_size / 2)
+			return 0;
+		audio->primed = true;
+	}
+
+	if (len > level) {
+		len = level;
+		audio->primed = false;
+	}
+
+	chunk = MIN(len, audio->ring_size - tail);
+	memcpy(buf, audio->ring + tail, chunk);
+	memcpy((u8 *)buf + chunk, audio->ring, len - chunk);
+	audio_barrier();
+	audio->ring_tail = (tail + len) % audio->ring_size;
+
+	return len;
+}
+
+/** @brief Get the feedback value sent to the host
+
+@param[in] audio Audio instance returned by usb_audio_init().
+@return Samples per frame in 10.14 fixed point.
+*/
+u32 usb_audio_get_feedback(usbd_audio *audio)
+{
+	return audio->fb_value;
+}
+
+/** @} */
@@ -0,0 +1,523 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/cdc.h>
+#include "usb_private.h"
+
+/* The notification endpoint has to be set up with this size. */
+#define CDCACM_NOTIF_SIZE	16
+
+struct _usbd_cdcacm {
+	usbd_device *usbd_dev;
+	u8 iface;
+	u8 ep_notif;
+	u8 ep_in;
+	u8 ep_out;
+	u16 ep_size;
+
+	/* Data for the host, sent from tx_tail. */
+	u8 *tx_buf;
+	u16 tx_size;
+	u16 tx_tail;
+	u16 tx_count;
+	u16 tx_len;		/* Bytes on the bus, 0 when idle. */
+	bool tx_busy;
+	bool tx_zlp;		/* The last transfer ended with a full packet. */
+	u8 tx_age;		/* Frames since the last transfer started. */
+	u8 tx_timeout;
+
+	/*
+	 * Data from the host. Packets are received straight into the
+	 * buffer, so it wraps early when the space at the end is too small
+	 * for a packet: the data is then [rx_tail, rx_end) and [0, rx_head).
+	 */
+	u8 *rx_buf;
+	u16 rx_size;
+	u16 rx_head;
+	u16 rx_tail;
+	u16 rx_end;
+	bool rx_wrapped;
+	bool rx_busy;
+
+	struct usb_cdc_line_coding line_coding;
+	u16 line_state;
+	void (*line_changed)(usbd_cdcacm *cdc);
+
+	u8 notif[10];
+	u16 serial_state;
+	bool notif_busy;
+	bool notif_pending;
+};
+
+static usbd_cdcacm _cdcacm;
+
+/*-- Host to device ----------------------------------------------------------*/
+
+static void cdcacm_rx_arm(usbd_cdcacm *cdc);
+
+static void cdcacm_rx_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_cdcacm *cdc = &_cdcacm;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	cdc->rx_busy = false;
+	cdc->rx_head += len;
+
+	cdcacm_rx_arm(cdc);
+}
+
+/*
+ * Receives as many whole packets as fit. While there is no room for one,
+ * the endpoint stays NAKed and the host holds its data back.
+ */
+static void cdcacm_rx_arm(usbd_cdcacm *cdc)
+{
+	u16 space;
+
+	if (cdc->rx_busy || !cdc->usbd_dev->current_config)
+		return;
+
+	if (!cdc->rx_wrapped && (cdc->rx_tail == cdc->rx_head)) {
+		cdc->rx_head = 0;
+		cdc->rx_tail = 0;
+	}
+
+	if (cdc->rx_wrapped) {
+		space = cdc->rx_tail - cdc->rx_head;
+	} else {
+		space = cdc->rx_size - cdc->rx_head;
+		if ((space < cdc->ep_size) && (cdc->rx_tail >= cdc->ep_size)) {
+			cdc->rx_end = cdc->rx_head;
+			cdc->rx_head = 0;
+			cdc->rx_wrapped = true;
+			space = cdc->rx_tail;
+		}
+	}
+
+	space -= space % cdc->ep_size;
+	if (!space)
+		return;
+
+	cdc->rx_busy = true;
+	usbd_ep_transfer_out(cdc->usbd_dev, cdc->ep_out,
+			     cdc->rx_buf + cdc->rx_head, space,
+			     cdcacm_rx_done);
+}
+
+/*-- Device to host ----------------------------------------------------------*/
+
+static void cdcacm_tx_start(usbd_cdcacm *cdc, bool flush);
+
+static void cdcacm_tx_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_cdcacm *cdc = &_cdcacm;
+
+	(void)usbd_dev;
+	(void)ep;
+	(void)len;
+
+	cdc->tx_tail = (cdc->tx_tail + cdc->tx_len) % cdc->tx_size;
+	cdc->tx_count -= cdc->tx_len;
+	cdc->tx_zlp = cdc->tx_len && !(cdc->tx_len % cdc->ep_size);
+	cdc->tx_len = 0;
+	cdc->tx_busy = false;
+
+	cdcacm_tx_start(cdc, cdc->tx_age >= cdc->tx_timeout);
+}
+
+/*
+ * Sends whole packets as soon as they are available. A partial packet only
+ * goes out on a flush, when nothing has been sent for tx_timeout frames,
+ * so small writes are gathered into full packets. A transfer that ended
+ * with a full packet is terminated with a ZLP once no more data follows.
+ */
+static void cdcacm_tx_start(usbd_cdcacm *cdc, bool flush)
+{
+	u16 len;
+
+	if (cdc->tx_busy || !cdc->usbd_dev->current_config)
+		return;
+
+	len = MIN(cdc->tx_count, cdc->tx_size - cdc->tx_tail);
+
+	/* A partial packet at the end of the buffer does not wait. */
+	if ((len == cdc->tx_count) && !flush)
+		len -= len % cdc->ep_size;
+
+	if (!len && !(flush && cdc->tx_zlp))
+		return;
+
+	cdc->tx_busy = true;
+	cdc->tx_len = len;
+	cdc->tx_zlp = false;
+	cdc->tx_age = 0;
+	usbd_ep_transfer_in(cdc->usbd_dev, cdc->ep_in,
+			    cdc->tx_buf + cdc->tx_tail, len, !len,
+			    cdcacm_tx_done);
+}
+
+static void cdcacm_sof(usbd_device *usbd_dev)
+{
+	usbd_cdcacm *cdc = &_cdcacm;
+
+	(void)usbd_dev;
+
+	if (cdc->tx_age < 0xff)
+		cdc->tx_age++;
+
+	if (!cdc->tx_busy && (cdc->tx_age >= cdc->tx_timeout))
+		cdcacm_tx_start(cdc, true);
+}
+
+/*-- Notifications -----------------------------------------------------------*/
+
+static void cdcacm_notify(usbd_cdcacm *cdc);
+
+static void cdcacm_notify_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_cdcacm *cdc = &_cdcacm;
+
+	(void)usbd_dev;
+	(void)ep;
+	(void)len;
+
+	cdc->notif_busy = false;
+	if (cdc->notif_pending)
+		cdcacm_notify(cdc);
+}
+
+/* Sends the serial state, or the latest one when the endpoint is free. */
+static void cdcacm_notify(usbd_cdcacm *cdc)
+{
+	struct usb_cdc_notification *notif = (void *)cdc->notif;
+
+	if (cdc->notif_busy || !cdc->usbd_dev->current_config) {
+		cdc->notif_pending = true;
+		return;
+	}
+
+	notif->bmRequestType = 0xA1;
+	notif->bNotification = USB_CDC_NOTIFY_SERIAL_STATE;
+	notif->wValue = 0;
+	notif->wIndex = cdc->iface;
+	notif->wLength = 2;
+	cdc->notif[8] = cdc->serial_state & 0xff;
+	cdc->notif[9] = cdc->serial_state >> 8;
+
+	cdc->notif_pending = false;
+	cdc->notif_busy = true;
+	usbd_ep_transfer_in(cdc->usbd_dev, cdc->ep_notif, cdc->notif,
+			    sizeof(cdc->notif), false, cdcacm_notify_done);
+}
+
+/*-- Control requests --------------------------------------------------------*/
+
+static int cdcacm_control_request(usbd_device *usbd_dev,
+				  struct usb_setup_data *req, u8 **buf,
+				  u16 *len,
+				  void (**complete)(usbd_device *usbd_dev,
+						    struct usb_setup_data *req))
+{
+	usbd_cdcacm *cdc = &_cdcacm;
+
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->wIndex != cdc->iface)
+		return USBD_REQ_NEXT_CALLBACK;
+
+	switch (req->bRequest) {
+	case USB_CDC_REQ_SET_LINE_CODING:
+		if (*len < sizeof(struct usb_cdc_line_coding))
+			return USBD_REQ_NOTSUPP;
+		memcpy(&cdc->line_coding, *buf, sizeof(cdc->line_coding));
+		break;
+	case USB_CDC_REQ_GET_LINE_CODING:
+		*buf = (u8 *)&cdc->line_coding;
+		*len = MIN(*len, sizeof(cdc->line_coding));
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
+		cdc->line_state = req->wValue;
+		break;
+	case USB_CDC_REQ_SEND_BREAK:
+		return USBD_REQ_HANDLED;
+	default:
+		return USBD_REQ_NOTSUPP;
+	}
+
+	if (cdc->line_changed)
+		(*cdc->line_changed)(cdc);
+
+	return USBD_REQ_HANDLED;
+}
+
+static void cdcacm_set_config(usbd_device *usbd_dev, u16 wValue)
+{
+	usbd_cdcacm *cdc = &_cdcacm;
+
+	(void)wValue;
+
+	usbd_ep_setup(usbd_dev, cdc->ep_out, USB_ENDPOINT_ATTR_BULK,
+		      cdc->ep_size, NULL);
+	usbd_ep_setup(usbd_dev, cdc->ep_in, USB_ENDPOINT_ATTR_BULK,
+		      cdc->ep_size, NULL);
+	usbd_ep_setup(usbd_dev, cdc->ep_notif, USB_ENDPOINT_ATTR_INTERRUPT,
+		      CDCACM_NOTIF_SIZE, NULL);
+
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				cdcacm_control_request);
+
+	/* Transfers were dropped by the reset before. */
+	cdc->tx_busy = false;
+	cdc->tx_len = 0;
+	cdc->tx_zlp = false;
+	cdc->rx_busy = false;
+	cdc->notif_busy = false;
+	cdc->line_state = 0;
+
+	cdcacm_rx_arm(cdc);
+	cdcacm_tx_start(cdc, true);
+	if (cdc->notif_pending)
+		cdcacm_notify(cdc);
+}
+
+/** @addtogroup usb_cdc */
+/** @{ */
+
+/** @brief Initializes a CDC-ACM virtual serial port.
+
+@note Currently you can only have this profile active.
+
+The application provides the descriptors: a communications interface with
+an interrupt IN notification endpoint of 16 bytes, and a data interface
+with a bulk IN and a bulk OUT endpoint of @a ep_size bytes.
+
+Data written with usb_cdcacm_write() is gathered into full packets; a
+partial packet is sent once nothing has been sent for the flush timeout
+(see usb_cdcacm_set_flush_timeout()). When the receive buffer has no room
+for another packet, the OUT endpoint is NAKed until usb_cdcacm_read()
+frees some.
+
+Adds its set configuration and SOF callbacks to those of the device, so
+other class functions and the application can register theirs as well.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] iface Number of the communications interface.
+@param[in] ep_notif Notification endpoint, interrupt IN.
+@param[in] ep_in Data endpoint, bulk IN.
+@param[in] ep_out Data endpoint, bulk OUT.
+@param[in] ep_size Size of the data endpoints, 64, or 512 at high speed.
+@param[in] tx_buf Buffer for data to the host. Best a multiple of
+		  @a ep_size bytes.
+@param[in] tx_size Size of @a tx_buf in bytes.
+@param[in] rx_buf Buffer for data from the host, at least @a ep_size bytes.
+@param[in] rx_size Size of @a rx_buf in bytes.
+@return Pointer to the usbd_cdcacm struct, NULL if the device has no room
+left for its callbacks.
+*/
+usbd_cdcacm *usb_cdcacm_init(usbd_device *usbd_dev, u8 iface, u8 ep_notif,
+			     u8 ep_in, u8 ep_out, u16 ep_size,
+			     u8 *tx_buf, u16 tx_size,
+			     u8 *rx_buf, u16 rx_size)
+{
+	usbd_cdcacm *cdc = &_cdcacm;
+
+	memset(cdc, 0, sizeof(*cdc));
+
+	cdc->usbd_dev = usbd_dev;
+	cdc->iface = iface;
+	cdc->ep_notif = ep_notif;
+	cdc->ep_in = ep_in;
+	cdc->ep_out = ep_out;
+	cdc->ep_size = ep_size;
+	cdc->tx_buf = tx_buf;
+	cdc->tx_size = tx_size;
+	cdc->tx_timeout = 1;
+	cdc->rx_buf = rx_buf;
+	cdc->rx_size = rx_size;
+
+	cdc->line_coding.dwDTERate = 115200;
+	cdc->line_coding.bCharFormat = USB_CDC_1_STOP_BITS;
+	cdc->line_coding.bParityType = USB_CDC_NO_PARITY;
+	cdc->line_coding.bDataBits = 8;
+
+	if (usbd_register_set_config_callback(usbd_dev, cdcacm_set_config) ||
+	    usbd_register_sof_callback(usbd_dev, cdcacm_sof))
+		return NULL;
+
+	return cdc;
+}
+
+/** @brief Set how long small writes are held back
+
+@param[in] cdc CDC-ACM instance returned by usb_cdcacm_init().
+@param[in] frames Number of frames (1 ms each at full speed) after the last
+transfer before a partial packet is sent. 0 sends data right away.
+*/
+void usb_cdcacm_set_flush_timeout(usbd_cdcacm *cdc, u8 frames)
+{
+	cdc->tx_timeout = frames;
+}
+
+/** @brief Queue data for the host
+
+@note Must not interrupt usbd_poll(); call it from the same context, or with
+the USB interrupt masked.
+
+@param[in] cdc CDC-ACM instance returned by usb_cdcacm_init().
+@param[in] buf The data to send.
+@param[in] len The number of bytes to send.
+@return The number of bytes queued, less than @a len if the buffer is full.
+*/
+u16 usb_cdcacm_write(usbd_cdcacm *cdc, const void *buf, u16 len)
+{
+	u16 head = (cdc->tx_tail + cdc->tx_count) % cdc->tx_size;
+	u16 n;
+
+	len = MIN(len, cdc->tx_size - cdc->tx_count);
+
+	n = MIN(len, cdc->tx_size - head);
+	memcpy(cdc->tx_buf + head, buf, n);
+	memcpy(cdc->tx_buf, (const u8 *)buf + n, len - n);
+	cdc->tx_count += len;
+
+	cdcacm_tx_start(cdc, cdc->tx_timeout == 0);
+
+	return len;
+}
+
+/** @brief Send the queued data without waiting for the flush timeout
+
+@param[in] cdc CDC-ACM instance returned by usb_cdcacm_init().
+*/
+void usb_cdcacm_flush(usbd_cdcacm *cdc)
+{
+	cdcacm_tx_start(cdc, true);
+}
+
+/** @brief Get the free space for usb_cdcacm_write()
+
+@param[in] cdc CDC-ACM instance returned by usb_cdcacm_init().
+@return The number of bytes that can be written.
+*/
+u16 usb_cdcacm_write_space(usbd_cdcacm *cdc)
+{
+	return cdc->tx_size - cdc->tx_count;
+}
+
+/** @brief Read data received from the host
+
+@note Must not interrupt usbd_poll(); call it from the same context, or with
+the USB interrupt masked.
+
+@param[in] cdc CDC-ACM instance returned by usb_cdcacm_init().
+@param[out] buf The location to read into.
+@param[in] len The size of @a buf in bytes.
+@return The number of bytes read, 0 if there is no data.
+*/
+u16 usb_cdcacm_read(usbd_cdcacm *cdc, void *buf, u16 len)
+{
+	u8 *dst = buf;
+	u16 total = 0, n;
+
+	while (total < len) {
+		n = cdc->rx_wrapped ? cdc->rx_end : cdc->rx_head;
+		n = MIN(n - cdc->rx_tail, len - total);
+		if (!n)
+			break;
+
+		memcpy(dst + total, cdc->rx_buf + cdc->rx_tail, n);
+		cdc->rx_tail += n;
+		total += n;
+
+		if (cdc->rx_wrapped && (cdc->rx_tail == cdc->rx_end)) {
+			cdc->rx_tail = 0;
+			cdc->rx_wrapped = false;
+		}
+	}
+
+	cdcacm_rx_arm(cdc);
+
+	return total;
+}
+
+/** @brief Get the amount of data received from the host
+
+@param[in] cdc CDC-ACM instance returned by usb_cdcacm_init().
+@return The number of bytes usb_cdcacm_read() can return.
+*/
+u16 usb_cdcacm_read_available(usbd_cdcacm *cdc)
+{
+	if (cdc->rx_wrapped)
+		return cdc->rx_end - cdc->rx_tail + cdc->rx_head;
+	return cdc->rx_head - cdc->rx_tail;
+}
+
+/** @brief Set the function called on line coding or control line changes
+
+@param[in] cdc CDC-ACM instance returned by usb_cdcacm_init().
+@param[in] callback Called after SET_LINE_CODING and
+SET_CONTROL_LINE_STATE, may be NULL.
+*/
+void usb_cdcacm_set_line_callback(usbd_cdcacm *cdc,
+				  void (*callback)(usbd_cdcacm *cdc))
+{
+	cdc->line_changed = callback;
+}
+
+/** @brief Get the line coding last set by the host
+
+@param[in] cdc CDC-ACM instance returned by usb_cdcacm_init().
+*/
+const struct usb_cdc_line_coding *usb_cdcacm_get_line_coding(
+							usbd_cdcacm *cdc)
+{
+	return &cdc->line_coding;
+}
+
+/** @brief Get the control line state last set by the host
+
+@param[in] cdc CDC-ACM instance returned by usb_cdcacm_init().
+@return USB_CDC_CONTROL_LINE_DTR and USB_CDC_CONTROL_LINE_RTS bits.
+*/
+u16 usb_cdcacm_get_line_state(usbd_cdcacm *cdc)
+{
+	return cdc->line_state;
+}
+
+/** @brief Report the serial state to the host
+
+Sends a SERIAL_STATE notification. If one is still on the bus, the latest
+state is sent after it.
+
+@param[in] cdc CDC-ACM instance returned by usb_cdcacm_init().
+@param[in] state USB_CDC_SERIAL_STATE_* bits.
+*/
+void usb_cdcacm_set_serial_state(usbd_cdcacm *cdc, u16 state)
+{
+	cdc->serial_state = state;
+	cdcacm_notify(cdc);
+}
+
+/** @} */
@@ -53,7 +53,10 @@ int usbd_register_control_callback(usbd_device *usbd_dev, u8 type, u8 type_mask,
 
 static void usb_control_send_chunk(usbd_device *usbd_dev)
 {
-	if (usbd_dev->desc->bMaxPacketSize0 < usbd_dev->control_state.ctrl_len) {
+	if ((usbd_dev->desc->bMaxPacketSize0 < usbd_dev->control_state.ctrl_len) ||
+	    ((usbd_dev->desc->bMaxPacketSize0 ==
+	      usbd_dev->control_state.ctrl_len) &&
+	     usbd_dev->control_state.needs_zlp)) {
 		/* Data stage, normal transmission */
 		usbd_ep_write_packet(usbd_dev, 0,
 				     usbd_dev->control_state.ctrl_buf,
@@ -130,6 +133,12 @@ static void usb_control_setup_read(usbd_device *usbd_dev,
 	usbd_dev->control_state.ctrl_len = req->wLength;
 
 	if (usb_control_request_dispatch(usbd_dev, req)) {
+		/* The host only sees the end of a reply shorter than it asked
+		 * for from a short packet. */
+		usbd_dev->control_state.needs_zlp =
+			(usbd_dev->control_state.ctrl_len < req->wLength) &&
+			!(usbd_dev->control_state.ctrl_len %
+			  usbd_dev->desc->bMaxPacketSize0);
 		if (usbd_dev->control_state.ctrl_len) {
 			/* Go to data out stage if handled. */
 			usb_control_send_chunk(usbd_dev);
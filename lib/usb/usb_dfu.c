@@ -0,0 +1,406 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/dfu.h>
+#include "usb_private.h"
+
+/* Definitions of Device Firmware Upgrade from:
+ * "Universal Serial Bus Device Class Specification for Device Firmware
+ * Upgrade Version 1.1"
+ */
+
+struct _usbd_dfu {
+	usbd_device *usbd_dev;
+	u8 iface;
+	u8 attributes;
+	u16 transfer_size;
+
+	enum dfu_state state;
+	enum dfu_status status;
+
+	/*
+	 * Two block buffers: the host sends the next block while the one
+	 * before is programmed.
+	 */
+	u8 *buf;
+	u16 len[2];
+	u16 block_num[2];
+	u8 head;		/* Block being programmed. */
+	u8 count;		/* Blocks not programmed yet. */
+	bool busy;
+	bool manifested;
+	bool in_call;
+	bool early;
+	int early_status;
+
+	u16 block_time;		/* Worst case ms to program a block. */
+	u32 elapsed;		/* SOFs since programming started. */
+
+	int (*download)(u16 block_num, const u8 *data, u16 len);
+	u16 (*upload)(u16 block_num, u8 *data, u16 len);
+	void (*manifest)(void);
+};
+
+static usbd_dfu _dfu;
+
+static void dfu_program_done(usbd_dfu *dfu, int status);
+
+/* Starts programming the next block, unless busy. */
+static void dfu_program_next(usbd_dfu *dfu)
+{
+	u8 i = dfu->head;
+	int status;
+
+	if (dfu->busy || !dfu->count)
+		return;
+
+	dfu->busy = true;
+	dfu->elapsed = 0;
+
+	dfu->in_call = true;
+	dfu->early = false;
+	status = (*dfu->download)(dfu->block_num[i],
+				  dfu->buf + i * dfu->transfer_size,
+				  dfu->len[i]);
+	dfu->in_call = false;
+
+	if (status == USB_DFU_PENDING) {
+		if (!dfu->early)
+			return;
+		status = dfu->early_status;
+	}
+
+	dfu_program_done(dfu, status);
+}
+
+static void dfu_manifest(usbd_dfu *dfu)
+{
+	if (dfu->manifest)
+		(*dfu->manifest)();
+
+	dfu->manifested = true;
+	if (dfu->attributes & USB_DFU_MANIFEST_TOLERANT)
+		dfu->state = STATE_DFU_MANIFEST_SYNC;
+	else
+		dfu->state = STATE_DFU_MANIFEST_WAIT_RESET;
+}
+
+static void dfu_program_done(usbd_dfu *dfu, int status)
+{
+	dfu->busy = false;
+
+	if (status != DFU_STATUS_OK) {
+		/* The error is reported by the next GETSTATUS. */
+		dfu->status = (status > DFU_STATUS_OK) &&
+			      (status <= DFU_STATUS_ERR_STALLEDPKT) ?
+			      status : DFU_STATUS_ERR_PROG;
+		dfu->count = 0;
+		return;
+	}
+
+	dfu->head = !dfu->head;
+	dfu->count--;
+
+	if (dfu->count)
+		dfu_program_next(dfu);
+	else if (dfu->state == STATE_DFU_MANIFEST)
+		dfu_manifest(dfu);
+}
+
+/*
+ * Milliseconds until the host may send the next request. A high speed bus
+ * has a SOF per microframe, 8 per ms.
+ */
+static u32 dfu_poll_timeout(usbd_dfu *dfu, u8 blocks)
+{
+	u32 left = dfu->block_time * blocks;
+	u32 elapsed = dfu->elapsed >> (dfu->usbd_dev->high_speed ? 3 : 0);
+
+	if (!blocks)
+		return 0;
+
+	left -= MIN(elapsed, dfu->block_time);
+	return left ? left : 1;
+}
+
+static void dfu_getstatus_complete(usbd_device *usbd_dev,
+				   struct usb_setup_data *req)
+{
+	usbd_dfu *dfu = &_dfu;
+
+	(void)usbd_dev;
+	(void)req;
+
+	if ((dfu->state == STATE_DFU_MANIFEST) && !dfu->count)
+		dfu_manifest(dfu);
+}
+
+static void dfu_dnload_complete(usbd_device *usbd_dev,
+				struct usb_setup_data *req)
+{
+	(void)usbd_dev;
+	(void)req;
+
+	dfu_program_next(&_dfu);
+}
+
+/*
+ * A block is done for the host as soon as it is buffered; the host only
+ * waits in dfuDNBUSY while both buffers are full.
+ */
+static void dfu_getstatus(usbd_dfu *dfu, u8 *buf)
+{
+	u32 timeout = 0;
+
+	switch (dfu->state) {
+	case STATE_DFU_DNLOAD_SYNC:
+	case STATE_DFU_DNBUSY:
+		if (dfu->count < 2) {
+			dfu->state = STATE_DFU_DNLOAD_IDLE;
+		} else {
+			dfu->state = STATE_DFU_DNBUSY;
+			timeout = dfu_poll_timeout(dfu, 1);
+		}
+		break;
+	case STATE_DFU_MANIFEST_SYNC:
+		if (dfu->manifested) {
+			dfu->manifested = false;
+			dfu->state = STATE_DFU_IDLE;
+			break;
+		}
+		/* fall through */
+	case STATE_DFU_MANIFEST:
+		dfu->state = STATE_DFU_MANIFEST;
+		timeout = dfu_poll_timeout(dfu, dfu->count);
+		break;
+	default:
+		break;
+	}
+
+	if (dfu->status != DFU_STATUS_OK)
+		dfu->state = STATE_DFU_ERROR;
+
+	buf[0] = dfu->status;
+	buf[1] = timeout & 0xff;
+	buf[2] = (timeout >> 8) & 0xff;
+	buf[3] = (timeout >> 16) & 0xff;
+	buf[4] = dfu->state;
+	buf[5] = 0;
+}
+
+static int dfu_control_request(usbd_device *usbd_dev,
+			       struct usb_setup_data *req, u8 **buf,
+			       u16 *len,
+			       void (**complete)(usbd_device *usbd_dev,
+						 struct usb_setup_data *req))
+{
+	usbd_dfu *dfu = &_dfu;
+	u8 i;
+
+	(void)usbd_dev;
+
+	if (req->wIndex != dfu->iface)
+		return USBD_REQ_NEXT_CALLBACK;
+
+	switch (req->bRequest) {
+	case DFU_DNLOAD:
+		if ((dfu->state != STATE_DFU_IDLE) &&
+		    (dfu->state != STATE_DFU_DNLOAD_IDLE))
+			break;
+		if (*len == 0) {
+			if (dfu->state != STATE_DFU_DNLOAD_IDLE)
+				break;
+			dfu->state = STATE_DFU_MANIFEST_SYNC;
+			return USBD_REQ_HANDLED;
+		}
+		if ((*len > dfu->transfer_size) || (dfu->count == 2))
+			break;
+
+		i = (dfu->head + dfu->count) % 2;
+		memcpy(dfu->buf + i * dfu->transfer_size, *buf, *len);
+		dfu->len[i] = *len;
+		dfu->block_num[i] = req->wValue;
+		dfu->count++;
+		dfu->state = STATE_DFU_DNLOAD_SYNC;
+		*complete = dfu_dnload_complete;
+		return USBD_REQ_HANDLED;
+	case DFU_UPLOAD:
+		if (!dfu->upload || ((dfu->state != STATE_DFU_IDLE) &&
+				     (dfu->state != STATE_DFU_UPLOAD_IDLE)))
+			break;
+		*len = (*dfu->upload)(req->wValue, *buf,
+				      MIN(*len, dfu->transfer_size));
+		/* A short block ends the upload. */
+		dfu->state = (*len < req->wLength) ? STATE_DFU_IDLE :
+			     STATE_DFU_UPLOAD_IDLE;
+		return USBD_REQ_HANDLED;
+	case DFU_GETSTATUS:
+		if (*len < 6)
+			break;
+		dfu_getstatus(dfu, *buf);
+		*len = 6;
+		*complete = dfu_getstatus_complete;
+		return USBD_REQ_HANDLED;
+	case DFU_CLRSTATUS:
+		if (dfu->state != STATE_DFU_ERROR)
+			break;
+		dfu->status = DFU_STATUS_OK;
+		dfu->state = STATE_DFU_IDLE;
+		return USBD_REQ_HANDLED;
+	case DFU_GETSTATE:
+		(*buf)[0] = dfu->state;
+		*len = 1;
+		return USBD_REQ_HANDLED;
+	case DFU_ABORT:
+		/* The block being programmed is finished, the next dropped. */
+		dfu->count = MIN(dfu->count, dfu->busy ? 1 : 0);
+		dfu->state = STATE_DFU_IDLE;
+		return USBD_REQ_HANDLED;
+	case DFU_DETACH:
+		return USBD_REQ_HANDLED;
+	}
+
+	dfu->status = DFU_STATUS_ERR_STALLEDPKT;
+	dfu->state = STATE_DFU_ERROR;
+	return USBD_REQ_NOTSUPP;
+}
+
+static void dfu_sof(usbd_device *usbd_dev)
+{
+	usbd_dfu *dfu = &_dfu;
+
+	(void)usbd_dev;
+
+	if (dfu->busy && (dfu->elapsed < 0xffffffff))
+		dfu->elapsed++;
+}
+
+static void dfu_set_config(usbd_device *usbd_dev, u16 wValue)
+{
+	(void)wValue;
+
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				dfu_control_request);
+}
+
+/** @addtogroup usb_dfu */
+/** @{ */
+
+/** @brief Initializes the DFU mode of a device.
+
+@note Currently you can only have this profile active.
+
+Each DNLOAD block is copied into one of two buffers and programmed from
+there, so the host can send the next block while the last one is still
+being programmed. It only has to wait in dfuDNBUSY while both buffers are
+full, for the rest of the programming time of the current block.
+
+The control buffer must hold @a transfer_size bytes, see
+usbd_set_control_buffer_size().
+
+Adds its set configuration and SOF callbacks to those of the device, so
+other class functions and the application can register theirs as well.
+The SOFs are the time base of bwPollTimeout.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] iface Number of the DFU interface.
+@param[in] attributes bmAttributes of the DFU functional descriptor.
+@param[in] transfer_size wTransferSize of the DFU functional descriptor.
+@param[in] buf Block buffer, 2 * @a transfer_size bytes.
+@param[in] block_time Worst case time to program one block in ms, used for
+		      bwPollTimeout.
+@param[in] download Programs a block, returns DFU_STATUS_OK or an error
+		    status. It may also return USB_DFU_PENDING and report
+		    the status later with usb_dfu_complete().
+@return Pointer to the usbd_dfu struct, NULL if the device has no room
+left for its callbacks.
+*/
+usbd_dfu *usb_dfu_init(usbd_device *usbd_dev, u8 iface, u8 attributes,
+		       u16 transfer_size, u8 *buf, u16 block_time,
+		       int (*download)(u16 block_num, const u8 *data,
+				       u16 len))
+{
+	usbd_dfu *dfu = &_dfu;
+
+	memset(dfu, 0, sizeof(*dfu));
+
+	dfu->usbd_dev = usbd_dev;
+	dfu->iface = iface;
+	dfu->attributes = attributes;
+	dfu->transfer_size = transfer_size;
+	dfu->buf = buf;
+	dfu->block_time = block_time;
+	dfu->download = download;
+	dfu->state = STATE_DFU_IDLE;
+	dfu->status = DFU_STATUS_OK;
+
+	if (usbd_register_set_config_callback(usbd_dev, dfu_set_config) ||
+	    usbd_register_sof_callback(usbd_dev, dfu_sof))
+		return NULL;
+
+	return dfu;
+}
+
+/** @brief Set the optional upload and manifestation functions
+
+@param[in] dfu DFU instance returned by usb_dfu_init().
+@param[in] upload Copies up to @a len bytes of block @a block_num and
+returns the number copied, less at the end. NULL if upload is not
+supported.
+@param[in] manifest Called once all blocks are programmed after the host
+ended the download. Without USB_DFU_MANIFEST_TOLERANT it may reset the
+device. May be NULL.
+*/
+void usb_dfu_set_callbacks(usbd_dfu *dfu,
+			   u16 (*upload)(u16 block_num, u8 *data, u16 len),
+			   void (*manifest)(void))
+{
+	dfu->upload = upload;
+	dfu->manifest = manifest;
+}
+
+/** @brief Finish programming a block
+
+Called when a download function that returned USB_DFU_PENDING is done. It
+may also be called from within the download function itself.
+
+@note Must not interrupt usbd_poll(); call it from the same context, or with
+the USB interrupt masked.
+
+@param[in] dfu DFU instance returned by usb_dfu_init().
+@param[in] status DFU_STATUS_OK or an error status.
+*/
+void usb_dfu_complete(usbd_dfu *dfu, int status)
+{
+	if (!dfu->busy)
+		return;
+
+	if (dfu->in_call) {
+		dfu->early_status = status;
+		dfu->early = true;
+		return;
+	}
+
+	dfu_program_done(dfu, status);
+}
+
+/** @} */
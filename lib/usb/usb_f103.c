@@ -17,6 +17,7 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include <libopencm3/stm32/f1/rcc.h>
 #include <libopencm3/cm3/common.h>
 #include <libopencm3/stm32/tools.h>
@@ -38,10 +39,44 @@ static u16 stm32f103_ep_write_packet(usbd_device *usbd_dev, u8 addr,
 static u16 stm32f103_ep_read_packet(usbd_device *usbd_dev, u8 addr, void *buf,
 				    u16 len);
 static void stm32f103_poll(usbd_device *usbd_dev);
+static u16 stm32f103_mem_free(usbd_device *usbd_dev);
+static bool stm32f103_config_plan(usbd_device *usbd_dev, u16 wValue);
+static bool stm32f103_ep_write_begin(usbd_device *usbd_dev,
+				     struct usbd_ep_buffer *buf);
+static void stm32f103_ep_write_end(usbd_device *usbd_dev,
+				   struct usbd_ep_buffer *buf);
+static bool stm32f103_ep_read_begin(usbd_device *usbd_dev,
+				    struct usbd_ep_buffer *buf);
+static void stm32f103_ep_read_end(usbd_device *usbd_dev,
+				  struct usbd_ep_buffer *buf);
 
 static u8 force_nak[8];
+/* Endpoints using the hardware double buffering (bulk with EP_KIND set). */
+static u8 dbl_buf[8];
+/* Double buffered IN endpoints: the application buffer is filled, but the
+ * peripheral is still sending the other one. */
+static u8 dbl_tx_pending[8];
+/* Isochronous endpoints, always double buffered by the hardware. They have
+ * no handshake, so they stay VALID and cannot be NAKed. */
+static u8 iso[8];
+/*
+ * Packet memory held by the TX and RX entries of the buffer table of each
+ * endpoint, size 0 when unused. See pm_alloc().
+ */
+static struct {
+	u16 addr;
+	u16 size;
+} pm_buf[8][2];
+/* Packet memory of each endpoint planned for the configuration, see
+ * stm32f103_config_plan(). */
+static u16 pm_planned[8];
 static struct _usbd_device usbd_dev;
 
+#define PM_TX		0
+#define PM_RX		1
+/* The buffer table comes first in packet memory. */
+#define PM_START	0x40
+
 const struct _usbd_driver stm32f103_usb_driver = {
 	.init = stm32f103_usbd_init,
 	.set_address = stm32f103_set_address,
@@ -53,6 +88,12 @@ const struct _usbd_driver stm32f103_usb_driver = {
 	.ep_write_packet = stm32f103_ep_write_packet,
 	.ep_read_packet = stm32f103_ep_read_packet,
 	.poll = stm32f103_poll,
+	.ep_write_begin = stm32f103_ep_write_begin,
+	.ep_write_end = stm32f103_ep_write_end,
+	.ep_read_begin = stm32f103_ep_read_begin,
+	.ep_read_end = stm32f103_ep_read_end,
+	.mem_free = stm32f103_mem_free,
+	.config_plan = stm32f103_config_plan,
 };
 
 /** Initialize the USB device controller hardware of the STM32. */
@@ -63,9 +104,14 @@ static usbd_device *stm32f103_usbd_init(void)
 	SET_REG(USB_BTABLE_REG, 0);
 	SET_REG(USB_ISTR_REG, 0);
 
-	/* Enable RESET, SUSPEND, RESUME and CTR interrupts. */
+	/*
+	 * Enable RESET, SUSPEND, RESUME, CTR and SOF interrupts. The SOF
+	 * one serves isochronous endpoints and the SOF callbacks every
+	 * frame when usbd_poll() runs from the interrupt, as on the OTG
+	 * cores.
+	 */
 	SET_REG(USB_CNTR_REG, USB_CNTR_RESETM | USB_CNTR_CTRM |
-		USB_CNTR_SUSPM | USB_CNTR_WKUPM);
+		USB_CNTR_SUSPM | USB_CNTR_WKUPM | USB_CNTR_SOFM);
 	return &usbd_dev;
 }
 
@@ -79,21 +125,321 @@ static void stm32f103_set_address(usbd_device *usbd_dev, u8 addr)
 /**
  * Set the receive buffer size for a given USB endpoint.
  *
+ * The size is counted in blocks of 2 bytes up to 62 bytes and in blocks of
+ * 32 bytes above, rounded up like pm_size().
+ *
  * @param ep Index of endpoint to configure.
  * @param size Size in bytes of the RX buffer.
  */
+static u16 usb_ep_rx_bufsize(u32 size)
+{
+	if (size > 62)
+		return 0x8000 | (((size + 31) / 32 - 1) << 10);
+	return ((size + 1) / 2) << 10;
+}
+
 static void usb_set_ep_rx_bufsize(usbd_device *usbd_dev, u8 ep, u32 size)
 {
 	(void)usbd_dev;
-	if (size > 62) {
-		if (size & 0x1f)
-			size -= 32;
-		USB_SET_EP_RX_COUNT(ep, (size << 5) | 0x8000);
+	USB_SET_EP_RX_COUNT(ep, usb_ep_rx_bufsize(size));
+}
+
+/* Packet memory taken by a buffer of size bytes. */
+static u16 pm_size(u16 size, bool rx)
+{
+	if (rx && (size > 62))
+		return (size + 31) & ~31;
+	return (size + 1) & ~1;
+}
+
+/* Lowest address with size bytes free, 0 if there is none. */
+static u16 pm_find(u16 size)
+{
+	u16 addr = PM_START;
+	bool moved;
+	int ep, entry;
+
+	do {
+		moved = false;
+		for (ep = 0; ep < 8; ep++) {
+			for (entry = PM_TX; entry <= PM_RX; entry++) {
+				if (!pm_buf[ep][entry].size ||
+				    (addr >= pm_buf[ep][entry].addr +
+					     pm_buf[ep][entry].size) ||
+				    (addr + size <= pm_buf[ep][entry].addr))
+					continue;
+				addr = pm_buf[ep][entry].addr +
+				       pm_buf[ep][entry].size;
+				moved = true;
+			}
+		}
+	} while (moved && (addr + size <= USB_PMA_SIZE));
+
+	return (addr + size <= USB_PMA_SIZE) ? addr : 0;
+}
+
+/*
+ * Moves a buffer down to a lower address with its contents. The peripheral
+ * is kept off the endpoint meanwhile: NAKed, or disabled if isochronous.
+ * It is made VALID again unless it completed a transaction before that.
+ */
+static void pm_move(u8 ep, u8 entry, u16 to)
+{
+	volatile u16 *src = (volatile u16 *)&MMIO8(USB_PMA_BASE +
+						   pm_buf[ep][entry].addr * 2);
+	volatile u16 *dst = (volatile u16 *)&MMIO8(USB_PMA_BASE + to * 2);
+	u16 reg16 = GET_REG(USB_EP_REG(ep));
+	bool keep = dbl_buf[ep] || iso[ep];
+	u16 len;
+
+	if ((reg16 & USB_EP_TX_STAT) == USB_EP_TX_STAT_VALID)
+		USB_SET_EP_TX_STAT(ep, iso[ep] ? USB_EP_TX_STAT_DISABLED :
+				   USB_EP_TX_STAT_NAK);
+	if ((reg16 & USB_EP_RX_STAT) == USB_EP_RX_STAT_VALID)
+		USB_SET_EP_RX_STAT(ep, iso[ep] ? USB_EP_RX_STAT_DISABLED :
+				   USB_EP_RX_STAT_NAK);
+
+	for (len = pm_buf[ep][entry].size / 2; len; src += 2, dst += 2, len--)
+		*dst = *src;
+
+	pm_buf[ep][entry].addr = to;
+	if (entry == PM_TX)
+		USB_SET_EP_TX_ADDR(ep, to);
+	else
+		USB_SET_EP_RX_ADDR(ep, to);
+
+	if (((reg16 & USB_EP_TX_STAT) == USB_EP_TX_STAT_VALID) &&
+	    (keep || !(GET_REG(USB_EP_REG(ep)) & USB_EP_TX_CTR)))
+		USB_SET_EP_TX_STAT(ep, USB_EP_TX_STAT_VALID);
+	if (((reg16 & USB_EP_RX_STAT) == USB_EP_RX_STAT_VALID) &&
+	    (keep || !(GET_REG(USB_EP_REG(ep)) & USB_EP_RX_CTR)))
+		USB_SET_EP_RX_STAT(ep, USB_EP_RX_STAT_VALID);
+}
+
+/* Moves all buffers down, in address order, to join the free space. */
+static void pm_pack(void)
+{
+	u16 top = PM_START;
+	int ep, entry, low_ep, low_entry;
+
+	for (;;) {
+		low_ep = -1;
+		low_entry = 0;
+		for (ep = 0; ep < 8; ep++) {
+			for (entry = PM_TX; entry <= PM_RX; entry++) {
+				if (!pm_buf[ep][entry].size ||
+				    (pm_buf[ep][entry].addr < top))
+					continue;
+				if ((low_ep < 0) ||
+				    (pm_buf[ep][entry].addr <
+				     pm_buf[low_ep][low_entry].addr)) {
+					low_ep = ep;
+					low_entry = entry;
+				}
+			}
+		}
+		if (low_ep < 0)
+			return;
+
+		if (pm_buf[low_ep][low_entry].addr != top)
+			pm_move(low_ep, low_entry, top);
+		top += pm_buf[low_ep][low_entry].size;
+	}
+}
+
+/*
+ * Takes packet memory for a buffer table entry and sets its address. The
+ * lowest free space that fits is used. When the free space is fragmented
+ * the other buffers are packed first. Returns false if it does not fit.
+ */
+static bool pm_alloc(u8 ep, u8 entry, u16 max_size, bool rx)
+{
+	u16 size = pm_size(max_size, rx);
+	u16 addr;
+
+	pm_buf[ep][entry].size = 0;
+
+	addr = pm_find(size);
+	if (!addr && (size <= stm32f103_mem_free(&usbd_dev))) {
+		pm_pack();
+		addr = pm_find(size);
+	}
+	if (!addr)
+		return false;
+
+	pm_buf[ep][entry].addr = addr;
+	pm_buf[ep][entry].size = size;
+	if (entry == PM_TX)
+		USB_SET_EP_TX_ADDR(ep, addr);
+	else
+		USB_SET_EP_RX_ADDR(ep, addr);
+
+	return true;
+}
+
+static void pm_free_all(u8 first_ep)
+{
+	int ep;
+
+	for (ep = first_ep; ep < 8; ep++) {
+		pm_buf[ep][PM_TX].size = 0;
+		pm_buf[ep][PM_RX].size = 0;
+	}
+}
+
+static u16 stm32f103_mem_free(usbd_device *usbd_dev)
+{
+	u16 used = PM_START;
+	int ep;
+
+	(void)usbd_dev;
+
+	for (ep = 0; ep < 8; ep++)
+		used += pm_buf[ep][PM_TX].size + pm_buf[ep][PM_RX].size;
+
+	return USB_PMA_SIZE - used;
+}
+
+/*
+ * Checks that the endpoints of a configuration fit in the packet memory
+ * left after endpoint 0, each with one buffer for its largest packet over
+ * all alternate settings, two if isochronous. Buffers are given back when
+ * an endpoint is set up again and packed when fragmented, so any
+ * alternate settings fit then. A double buffered bulk endpoint only gets
+ * its second buffer from what is left beyond the plan, see pm_reserved().
+ */
+static bool stm32f103_config_plan(usbd_device *usbd_dev, u16 wValue)
+{
+	struct usbd_ep_sizes sizes;
+	u16 planned[8];
+	u16 size, used = PM_START;
+	int ep, dir;
+
+	memset(&sizes, 0, sizeof(sizes));
+	_usbd_config_endpoints(usbd_dev, wValue, &sizes);
+
+	used += pm_buf[0][PM_TX].size + pm_buf[0][PM_RX].size;
+	planned[0] = 0;
+	for (ep = 1; ep < 8; ep++) {
+		planned[ep] = 0;
+		for (dir = USB_TRANSACTION_IN; dir <= USB_TRANSACTION_OUT;
+		     dir++) {
+			if (!sizes.max_size[ep][dir])
+				continue;
+			size = pm_size(sizes.max_size[ep][dir],
+				       dir == USB_TRANSACTION_OUT);
+			if (sizes.type[ep][dir] ==
+			    USB_ENDPOINT_ATTR_ISOCHRONOUS)
+				size *= 2;
+			if (size > USB_PMA_SIZE - used)
+				return false;
+			used += size;
+			planned[ep] += size;
+		}
+	}
+
+	memcpy(pm_planned, planned, sizeof(planned));
+
+	return true;
+}
+
+/* Packet memory the other endpoints may still take up to their plan. */
+static u16 pm_reserved(u8 skip_ep)
+{
+	u16 held, reserved = 0;
+	int ep;
+
+	for (ep = 1; ep < 8; ep++) {
+		if (ep == skip_ep)
+			continue;
+		held = pm_buf[ep][PM_TX].size + pm_buf[ep][PM_RX].size;
+		if (pm_planned[ep] > held)
+			reserved += pm_planned[ep] - held;
+	}
+
+	return reserved;
+}
+
+/*
+ * Double buffered endpoints use one direction only. Buffer 0 is described by
+ * the TX entry of the buffer table and buffer 1 by the RX entry. The
+ * peripheral owns the buffer selected by DTOG, the application the one
+ * selected by SW_BUF. The peripheral NAKs while both select the same buffer.
+ */
+static bool stm32f103_ep_setup_dbl_buf(usbd_device *usbd_dev, u8 addr,
+				       u8 dir, u16 max_size)
+{
+	if (2 * pm_size(max_size, !dir) + pm_reserved(addr) >
+	    stm32f103_mem_free(usbd_dev))
+		return false;
+
+	if (!pm_alloc(addr, PM_TX, max_size, !dir) ||
+	    !pm_alloc(addr, PM_RX, max_size, !dir)) {
+		pm_buf[addr][PM_TX].size = 0;
+		pm_buf[addr][PM_RX].size = 0;
+		return false;
+	}
+
+	USB_SET_EP_KIND(addr);
+	USB_CLR_EP_TX_DTOG(addr);
+	USB_CLR_EP_RX_DTOG(addr);
+	dbl_buf[addr] = 1;
+	dbl_tx_pending[addr] = 0;
+
+	if (dir) {
+		/* DTOG == SW_BUF: nothing to send until the first write. */
+		USB_SET_EP_TX_COUNT(addr, 0);
+		USB_SET_EP_RX_COUNT(addr, 0);
+		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_DISABLED);
+		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_VALID);
+	} else {
+		/* Both buffers start out free, the application holds buffer 1. */
+		USB_SET_EP_TX_COUNT(addr, usb_ep_rx_bufsize(max_size));
+		USB_SET_EP_RX_COUNT(addr, usb_ep_rx_bufsize(max_size));
+		USB_TOG_EP_RX_SW_BUF(addr);
+		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_DISABLED);
+		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_VALID);
+	}
+
+	return true;
+}
+
+/*
+ * Isochronous endpoints use the same buffer layout, but the peripheral
+ * selects the buffer with DTOG alone and toggles it every frame it is
+ * polled. The application owns the other buffer.
+ */
+static bool stm32f103_ep_setup_iso(usbd_device *usbd_dev, u8 addr, u8 dir,
+				   u16 max_size)
+{
+	(void)usbd_dev;
+
+	if (!pm_alloc(addr, PM_TX, max_size, !dir) ||
+	    !pm_alloc(addr, PM_RX, max_size, !dir)) {
+		pm_buf[addr][PM_TX].size = 0;
+		pm_buf[addr][PM_RX].size = 0;
+		return false;
+	}
+
+	USB_CLR_EP_KIND(addr);
+	USB_CLR_EP_TX_DTOG(addr);
+	USB_CLR_EP_RX_DTOG(addr);
+	iso[addr] = 1;
+
+	if (dir) {
+		/* Zero length packets until the first write. */
+		USB_SET_EP_TX_COUNT(addr, 0);
+		USB_SET_EP_RX_COUNT(addr, 0);
+		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_DISABLED);
+		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_VALID);
 	} else {
-		if (size & 1)
-			size++;
-		USB_SET_EP_RX_COUNT(ep, size << 10);
+		USB_SET_EP_TX_COUNT(addr, usb_ep_rx_bufsize(max_size));
+		USB_SET_EP_RX_COUNT(addr, usb_ep_rx_bufsize(max_size));
+		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_DISABLED);
+		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_VALID);
 	}
+
+	return true;
 }
 
 static void stm32f103_ep_setup(usbd_device *usbd_dev, u8 addr, u8 type,
@@ -108,25 +454,74 @@ static void stm32f103_ep_setup(usbd_device *usbd_dev, u8 addr, u8 type,
 		[USB_ENDPOINT_ATTR_INTERRUPT] = USB_EP_TYPE_INTERRUPT,
 	};
 	u8 dir = addr & 0x80;
+	bool dbl = (type & USBD_EP_DOUBLEBUF) &&
+		   ((type & USB_ENDPOINT_ATTR_TYPE) == USB_ENDPOINT_ATTR_BULK);
+	bool both = dbl || ((type & USB_ENDPOINT_ATTR_TYPE) ==
+			    USB_ENDPOINT_ATTR_ISOCHRONOUS);
 	addr &= 0x7f;
 
+	/*
+	 * Give back the buffers of an earlier setup, e.g. for another
+	 * alternate setting. Double buffered and isochronous endpoints, and
+	 * the control endpoint, use both entries of the buffer table.
+	 */
+	if (!addr || both || dbl_buf[addr] || iso[addr] || dir) {
+		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_DISABLED);
+		pm_buf[addr][PM_TX].size = 0;
+	}
+	if (!addr || both || dbl_buf[addr] || iso[addr] || !dir) {
+		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_DISABLED);
+		pm_buf[addr][PM_RX].size = 0;
+	}
+
 	/* Assign address. */
 	USB_SET_EP_ADDR(addr, addr);
-	USB_SET_EP_TYPE(addr, typelookup[type]);
+	USB_SET_EP_TYPE(addr, typelookup[type & USB_ENDPOINT_ATTR_TYPE]);
+
+	dbl_buf[addr] = 0;
+	iso[addr] = 0;
+	if (addr && both) {
+		if (dbl ? stm32f103_ep_setup_dbl_buf(usbd_dev, addr, dir,
+						     max_size) :
+			  stm32f103_ep_setup_iso(usbd_dev, addr, dir,
+						 max_size)) {
+			if (callback) {
+				usbd_dev->user_callback_ctr[addr][dir ?
+					USB_TRANSACTION_IN :
+					USB_TRANSACTION_OUT] = (void *)callback;
+			}
+			return;
+		}
+		/* Isochronous endpoints have no handshake to refuse with. */
+		if (!dbl)
+			return;
+		/* Not enough room for two buffers, fall back to one. */
+	}
+	USB_CLR_EP_KIND(addr);
 
+	/*
+	 * Without a buffer the endpoint is stalled, so the host sees the
+	 * failure instead of NAKs. Only endpoints used beyond what the
+	 * configuration planned can get here.
+	 */
 	if (dir || (addr == 0)) {
-		USB_SET_EP_TX_ADDR(addr, usbd_dev->pm_top);
+		if (!pm_alloc(addr, PM_TX, max_size, false)) {
+			USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_STALL);
+			return;
+		}
 		if (callback) {
 			usbd_dev->user_callback_ctr[addr][USB_TRANSACTION_IN] =
 			    (void *)callback;
 		}
 		USB_CLR_EP_TX_DTOG(addr);
 		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_NAK);
-		usbd_dev->pm_top += max_size;
 	}
 
 	if (!dir) {
-		USB_SET_EP_RX_ADDR(addr, usbd_dev->pm_top);
+		if (!pm_alloc(addr, PM_RX, max_size, true)) {
+			USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_STALL);
+			return;
+		}
 		usb_set_ep_rx_bufsize(usbd_dev, addr, max_size);
 		if (callback) {
 			usbd_dev->user_callback_ctr[addr][USB_TRANSACTION_OUT] =
@@ -134,7 +529,6 @@ static void stm32f103_ep_setup(usbd_device *usbd_dev, u8 addr, u8 type,
 		}
 		USB_CLR_EP_RX_DTOG(addr);
 		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_VALID);
-		usbd_dev->pm_top += max_size;
 	}
 }
 
@@ -142,17 +536,35 @@ static void stm32f103_endpoints_reset(usbd_device *usbd_dev)
 {
 	int i;
 
-	/* Reset all endpoints. */
+	(void)usbd_dev;
+
+	/* Reset all endpoints and give back their buffers. */
 	for (i = 1; i < 8; i++) {
 		USB_SET_EP_TX_STAT(i, USB_EP_TX_STAT_DISABLED);
 		USB_SET_EP_RX_STAT(i, USB_EP_RX_STAT_DISABLED);
+		dbl_buf[i] = 0;
+		iso[i] = 0;
 	}
-	usbd_dev->pm_top = 0x40 + (2 * usbd_dev->desc->bMaxPacketSize0);
+	pm_free_all(1);
 }
 
 static void stm32f103_ep_stall_set(usbd_device *usbd_dev, u8 addr, u8 stall)
 {
 	(void)usbd_dev;
+
+	/* Isochronous endpoints cannot stall, only be switched off. */
+	if (iso[addr & 0x7f]) {
+		if (addr & 0x80)
+			USB_SET_EP_TX_STAT(addr & 0x7f, stall ?
+					   USB_EP_TX_STAT_DISABLED :
+					   USB_EP_TX_STAT_VALID);
+		else
+			USB_SET_EP_RX_STAT(addr, stall ?
+					   USB_EP_RX_STAT_DISABLED :
+					   USB_EP_RX_STAT_VALID);
+		return;
+	}
+
 	if (addr == 0)
 		USB_SET_EP_TX_STAT(addr, stall ? USB_EP_TX_STAT_STALL :
 				   USB_EP_TX_STAT_NAK);
@@ -160,16 +572,41 @@ static void stm32f103_ep_stall_set(usbd_device *usbd_dev, u8 addr, u8 stall)
 	if (addr & 0x80) {
 		addr &= 0x7F;
 
+		/*
+		 * Double buffered IN endpoints stay VALID, flow control is
+		 * done with DTOG and SW_BUF.
+		 */
 		USB_SET_EP_TX_STAT(addr, stall ? USB_EP_TX_STAT_STALL :
+				   dbl_buf[addr] ? USB_EP_TX_STAT_VALID :
 				   USB_EP_TX_STAT_NAK);
 
 		/* Reset to DATA0 if clearing stall condition. */
-		if (!stall)
+		if (!stall) {
 			USB_CLR_EP_TX_DTOG(addr);
+			if (dbl_buf[addr]) {
+				/* Drop queued data, both buffers are free. */
+				if (GET_REG(USB_EP_REG(addr)) &
+				    USB_EP_TX_SW_BUF)
+					USB_TOG_EP_TX_SW_BUF(addr);
+				dbl_tx_pending[addr] = 0;
+			}
+		}
 	} else {
 		/* Reset to DATA0 if clearing stall condition. */
-		if (!stall)
+		if (!stall) {
 			USB_CLR_EP_RX_DTOG(addr);
+			if (dbl_buf[addr]) {
+				/*
+				 * Drop received data, the application holds
+				 * buffer 1 again and the peripheral fills
+				 * buffer 0.
+				 */
+				if (!(GET_REG(USB_EP_REG(addr)) &
+				      USB_EP_RX_SW_BUF))
+					USB_TOG_EP_RX_SW_BUF(addr);
+				USB_CLR_EP_RX_CTR(addr);
+			}
+		}
 
 		USB_SET_EP_RX_STAT(addr, stall ? USB_EP_RX_STAT_STALL :
 				   USB_EP_RX_STAT_VALID);
@@ -195,7 +632,7 @@ static void stm32f103_ep_nak_set(usbd_device *usbd_dev, u8 addr, u8 nak)
 {
 	(void)usbd_dev;
 	/* It does not make sence to force NAK on IN endpoints. */
-	if (addr & 0x80)
+	if ((addr & 0x80) || iso[addr])
 		return;
 
 	force_nak[addr] = nak;
@@ -209,113 +646,363 @@ static void stm32f103_ep_nak_set(usbd_device *usbd_dev, u8 addr, u8 nak)
 /**
  * Copy a data buffer to packet memory.
  *
+ * Packet memory is written a halfword at a time. Halfword aligned buffers
+ * are copied four halfwords per iteration, others are assembled from
+ * bytes. No byte past @a len is read.
+ *
  * @param vPM Destination pointer into packet memory.
  * @param buf Source pointer to data buffer.
  * @param len Number of bytes to copy.
  */
 static void usb_copy_to_pm(volatile void *vPM, const void *buf, u16 len)
 {
-	const u16 *lbuf = buf;
+	const u8 *src = buf;
 	volatile u16 *PM = vPM;
+	u16 n;
+
+	if (!((uintptr_t)src & 1)) {
+		const u16 *lbuf = buf;
+
+		for (n = len >> 3; n; PM += 8, lbuf += 4, n--) {
+			PM[0] = lbuf[0];
+			PM[2] = lbuf[1];
+			PM[4] = lbuf[2];
+			PM[6] = lbuf[3];
+		}
+		for (n = (len >> 1) & 3; n; PM += 2, lbuf++, n--)
+			*PM = *lbuf;
+		src = (const u8 *)lbuf;
+	} else {
+		for (n = len >> 1; n; PM += 2, src += 2, n--)
+			*PM = src[0] | (src[1] << 8);
+	}
+
+	if (len & 1)
+		*PM = *src;
+}
+
+static volatile void *stm32f103_pm_buff(u8 addr, u8 entry)
+{
+	if (entry == PM_TX)
+		return USB_GET_EP_TX_BUFF(addr);
+	return USB_GET_EP_RX_BUFF(addr);
+}
+
+/*
+ * Selects the buffer for an IN packet, returns false while the endpoint
+ * still holds one. Double buffered endpoints use the application buffer
+ * unless it is already waiting to be sent. Isochronous endpoints use the
+ * buffer the peripheral does not, it is sent in the next frame the host
+ * polls the endpoint; a packet written earlier and not sent yet is
+ * replaced.
+ */
+static bool stm32f103_tx_buffer(u8 addr, u8 *entry)
+{
+	u16 reg16 = GET_REG(USB_EP_REG(addr));
+
+	if (dbl_buf[addr]) {
+		if (dbl_tx_pending[addr])
+			return false;
+		*entry = (reg16 & USB_EP_TX_SW_BUF) ? PM_RX : PM_TX;
+	} else if (iso[addr]) {
+		*entry = (reg16 & USB_EP_TX_DTOG) ? PM_TX : PM_RX;
+	} else {
+		if ((reg16 & USB_EP_TX_STAT) == USB_EP_TX_STAT_VALID)
+			return false;
+		*entry = PM_TX;
+	}
 
-	for (len = (len + 1) >> 1; len; PM += 2, lbuf++, len--)
-		*PM = *lbuf;
+	return true;
+}
+
+/* Sets the length of the packet written and hands it to the peripheral. */
+static void stm32f103_tx_commit(u8 addr, u8 entry, u16 len)
+{
+	u16 reg16;
+
+	if (entry == PM_TX)
+		USB_SET_EP_TX_COUNT(addr, len);
+	else
+		USB_SET_EP_RX_COUNT(addr, len);
+
+	if (dbl_buf[addr]) {
+		/*
+		 * Hand the buffer over now if the peripheral is idle,
+		 * otherwise when it has finished sending the other buffer
+		 * (see stm32f103_ctr()).
+		 */
+		reg16 = GET_REG(USB_EP_REG(addr));
+		if (!(reg16 & USB_EP_TX_DTOG) == !(reg16 & USB_EP_TX_SW_BUF))
+			USB_TOG_EP_TX_SW_BUF(addr);
+		else
+			dbl_tx_pending[addr] = 1;
+	} else if (!iso[addr]) {
+		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_VALID);
+	}
 }
 
 static u16 stm32f103_ep_write_packet(usbd_device *usbd_dev, u8 addr,
 				     const void *buf, u16 len)
 {
+	u8 entry;
+
 	(void)usbd_dev;
 	addr &= 0x7F;
 
-	if ((*USB_EP_REG(addr) & USB_EP_TX_STAT) == USB_EP_TX_STAT_VALID)
+	if (!stm32f103_tx_buffer(addr, &entry))
 		return 0;
 
-	usb_copy_to_pm(USB_GET_EP_TX_BUFF(addr), buf, len);
-	USB_SET_EP_TX_COUNT(addr, len);
-	USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_VALID);
+	usb_copy_to_pm(stm32f103_pm_buff(addr, entry), buf, len);
+	stm32f103_tx_commit(addr, entry, len);
 
 	return len;
 }
 
+static bool stm32f103_ep_write_begin(usbd_device *usbd_dev,
+				     struct usbd_ep_buffer *buf)
+{
+	u8 addr = buf->addr & 0x7F;
+	u8 entry;
+
+	(void)usbd_dev;
+
+	if (!stm32f103_tx_buffer(addr, &entry))
+		return false;
+
+	buf->mem = stm32f103_pm_buff(addr, entry);
+	buf->width = 2;
+	buf->stride = 4;
+	buf->size = MIN(buf->size, pm_buf[addr][entry].size);
+	buf->buffer = entry;
+
+	return true;
+}
+
+static void stm32f103_ep_write_end(usbd_device *usbd_dev,
+				   struct usbd_ep_buffer *buf)
+{
+	(void)usbd_dev;
+	stm32f103_tx_commit(buf->addr & 0x7F, buf->buffer, buf->size);
+}
+
 /**
  * Copy a data buffer from packet memory.
  *
- * @param buf Source pointer to data buffer.
- * @param vPM Destination pointer into packet memory.
+ * The counterpart of usb_copy_to_pm(), no byte past @a len is written.
+ *
+ * @param buf Destination pointer to data buffer.
+ * @param vPM Source pointer into packet memory.
  * @param len Number of bytes to copy.
  */
 static void usb_copy_from_pm(void *buf, const volatile void *vPM, u16 len)
 {
-	u16 *lbuf = buf;
+	u8 *dst = buf;
 	const volatile u16 *PM = vPM;
-	u8 odd = len & 1;
+	u16 n, val;
+
+	if (!((uintptr_t)dst & 1)) {
+		u16 *lbuf = buf;
 
-	for (len >>= 1; len; PM += 2, lbuf++, len--)
-		*lbuf = *PM;
+		for (n = len >> 3; n; PM += 8, lbuf += 4, n--) {
+			lbuf[0] = PM[0];
+			lbuf[1] = PM[2];
+			lbuf[2] = PM[4];
+			lbuf[3] = PM[6];
+		}
+		for (n = (len >> 1) & 3; n; PM += 2, lbuf++, n--)
+			*lbuf = *PM;
+		dst = (u8 *)lbuf;
+	} else {
+		for (n = len >> 1; n; PM += 2, dst += 2, n--) {
+			val = *PM;
+			dst[0] = val;
+			dst[1] = val >> 8;
+		}
+	}
 
-	if (odd)
-		*(u8 *) lbuf = *(u8 *) PM;
+	if (len & 1)
+		*dst = *PM;
 }
 
-static u16 stm32f103_ep_read_packet(usbd_device *usbd_dev, u8 addr, void *buf,
-				    u16 len)
+/*
+ * Selects the buffer holding a received packet, returns false if there is
+ * none. Double buffered endpoints take the filled buffer and release the
+ * one held, so the peripheral can receive the next packet while this one
+ * is read. Isochronous endpoints have moved on to the other buffer after a
+ * packet, it is overwritten by the packet of the frame after next.
+ */
+static bool stm32f103_rx_buffer(u8 addr, u8 *entry)
 {
-	(void)usbd_dev;
-	if ((*USB_EP_REG(addr) & USB_EP_RX_STAT) == USB_EP_RX_STAT_VALID)
-		return 0;
+	u16 reg16 = GET_REG(USB_EP_REG(addr));
+
+	if (dbl_buf[addr]) {
+		/* A buffer is filled when the peripheral has moved on to the
+		 * buffer held by the application. */
+		if (!(reg16 & USB_EP_RX_DTOG) != !(reg16 & USB_EP_RX_SW_BUF))
+			return false;
+
+		USB_CLR_EP_RX_CTR(addr);
+		USB_TOG_EP_RX_SW_BUF(addr);
+		*entry = (reg16 & USB_EP_RX_SW_BUF) ? PM_TX : PM_RX;
+	} else if (iso[addr]) {
+		USB_CLR_EP_RX_CTR(addr);
+		*entry = (GET_REG(USB_EP_REG(addr)) & USB_EP_RX_DTOG) ?
+			 PM_TX : PM_RX;
+	} else {
+		if ((reg16 & USB_EP_RX_STAT) == USB_EP_RX_STAT_VALID)
+			return false;
+		*entry = PM_RX;
+	}
+
+	return true;
+}
+
+static u16 stm32f103_rx_count(u8 addr, u8 entry)
+{
+	if (entry == PM_TX)
+		return USB_GET_EP_TX_COUNT(addr) & 0x3ff;
+	return USB_GET_EP_RX_COUNT(addr) & 0x3ff;
+}
+
+/* Gives the buffer back for the next packet. */
+static void stm32f103_rx_release(u8 addr)
+{
+	if (dbl_buf[addr] || iso[addr])
+		return;
 
-	len = MIN(USB_GET_EP_RX_COUNT(addr) & 0x3ff, len);
-	usb_copy_from_pm(buf, USB_GET_EP_RX_BUFF(addr), len);
 	USB_CLR_EP_RX_CTR(addr);
 
 	if (!force_nak[addr])
 		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_VALID);
+}
+
+static u16 stm32f103_ep_read_packet(usbd_device *usbd_dev, u8 addr, void *buf,
+				    u16 len)
+{
+	u8 entry;
+
+	(void)usbd_dev;
+
+	if (!stm32f103_rx_buffer(addr, &entry))
+		return 0;
+
+	len = MIN(stm32f103_rx_count(addr, entry), len);
+	usb_copy_from_pm(buf, stm32f103_pm_buff(addr, entry), len);
+	stm32f103_rx_release(addr);
 
 	return len;
 }
 
+static bool stm32f103_ep_read_begin(usbd_device *usbd_dev,
+				    struct usbd_ep_buffer *buf)
+{
+	u8 addr = buf->addr & 0x7F;
+	u8 entry;
+
+	(void)usbd_dev;
+
+	if (!stm32f103_rx_buffer(addr, &entry))
+		return false;
+
+	buf->mem = stm32f103_pm_buff(addr, entry);
+	buf->width = 2;
+	buf->stride = 4;
+	buf->size = stm32f103_rx_count(addr, entry);
+
+	return true;
+}
+
+static void stm32f103_ep_read_end(usbd_device *usbd_dev,
+				  struct usbd_ep_buffer *buf)
+{
+	(void)usbd_dev;
+	stm32f103_rx_release(buf->addr & 0x7F);
+}
+
+/*
+ * Handles the endpoint reported in ISTR. Returns false if its CTR flag is
+ * still set, i.e. the callback has not read the packet yet.
+ */
+static bool stm32f103_ctr(usbd_device *usbd_dev, u16 istr)
+{
+	u8 ep = istr & USB_ISTR_EP_ID;
+	u8 type = (istr & USB_ISTR_DIR) ? 1 : 0;
+
+	if (type) { /* OUT or SETUP transaction */
+		type += (*USB_EP_REG(ep) & USB_EP_SETUP) ? 1 : 0;
+		/*
+		 * Normally the flag is cleared when the callback reads the
+		 * packet. The endpoint NAKs until then, so it can be cleared
+		 * right away if the callback runs later.
+		 */
+		if (usbd_dev->deferred || !usbd_dev->user_callback_ctr[ep][type])
+			USB_CLR_EP_RX_CTR(ep);
+	} else { /* IN transaction */
+		USB_CLR_EP_TX_CTR(ep);
+		/* Send the buffer queued behind the one just sent. */
+		if (dbl_tx_pending[ep]) {
+			dbl_tx_pending[ep] = 0;
+			USB_TOG_EP_TX_SW_BUF(ep);
+		}
+		/* Send a zero length packet rather than this one again if
+		 * the next one is not written in time. */
+		if (iso[ep]) {
+			if (GET_REG(USB_EP_REG(ep)) & USB_EP_TX_DTOG)
+				USB_SET_EP_TX_COUNT(ep, 0);
+			else
+				USB_SET_EP_RX_COUNT(ep, 0);
+		}
+	}
+
+	_usbd_event(usbd_dev, USBD_EVENT_TRANSACTION, ep, type);
+
+	return !(GET_REG(USB_EP_REG(ep)) &
+		 (type ? USB_EP_RX_CTR : USB_EP_TX_CTR));
+}
+
 static void stm32f103_poll(usbd_device *usbd_dev)
 {
 	u16 istr = *USB_ISTR_REG;
+	u16 budget = usbd_dev->poll_budget;
+	u16 n = 0;
 
 	if (istr & USB_ISTR_RESET) {
-		usbd_dev->pm_top = 0x40;
-		_usbd_reset(usbd_dev);
+		pm_free_all(0);
+		_usbd_event(usbd_dev, USBD_EVENT_RESET, 0, 0);
 		USB_CLR_ISTR_RESET();
+		usbd_dev->poll_stats.last++;
 		return;
 	}
 
-	if (istr & USB_ISTR_CTR) {
-		u8 ep = istr & USB_ISTR_EP_ID;
-		u8 type = (istr & USB_ISTR_DIR) ? 1 : 0;
-
-		if (type) /* OUT or SETUP transaction */
-			type += (*USB_EP_REG(ep) & USB_EP_SETUP) ? 1 : 0;
-		else /* IN transaction */
-			USB_CLR_EP_TX_CTR(ep);
-
-		if (usbd_dev->user_callback_ctr[ep][type])
-			usbd_dev->user_callback_ctr[ep][type] (usbd_dev, ep);
-		else
-			USB_CLR_EP_RX_CTR(ep);
+	/*
+	 * ISTR reports one endpoint at a time and keeps CTR set while any
+	 * endpoint has a completed transfer, so handle them all here. A
+	 * packet the callback leaves unread keeps its endpoint at the head
+	 * of ISTR, it is reported again by the next call.
+	 */
+	while ((istr & USB_ISTR_CTR) && (!budget || (n < budget))) {
+		n++;
+		if (!stm32f103_ctr(usbd_dev, istr))
+			break;
+		istr = *USB_ISTR_REG;
 	}
+	usbd_dev->poll_stats.last += n;
 
 	if (istr & USB_ISTR_SUSP) {
 		USB_CLR_ISTR_SUSP();
-		if (usbd_dev->user_callback_suspend)
-			usbd_dev->user_callback_suspend();
+		_usbd_event(usbd_dev, USBD_EVENT_SUSPEND, 0, 0);
+		usbd_dev->poll_stats.last++;
 	}
 
 	if (istr & USB_ISTR_WKUP) {
 		USB_CLR_ISTR_WKUP();
-		if (usbd_dev->user_callback_resume)
-			usbd_dev->user_callback_resume();
+		_usbd_event(usbd_dev, USBD_EVENT_RESUME, 0, 0);
+		usbd_dev->poll_stats.last++;
 	}
 
 	if (istr & USB_ISTR_SOF) {
-		if (usbd_dev->user_callback_sof)
-			usbd_dev->user_callback_sof();
+		_usbd_event(usbd_dev, USBD_EVENT_SOF, 0, 0);
 		USB_CLR_ISTR_SOF();
+		usbd_dev->poll_stats.last++;
 	}
 }
@@ -25,8 +25,8 @@
 #include "usb_private.h"
 #include "usb_fx07_common.h"
 
-/* Receive FIFO size in 32-bit words. */
-#define RX_FIFO_SIZE 128
+/* FIFO memory of the core in 32-bit words, 1.25 KB. */
+#define FIFO_MEM_SIZE 320
 
 static usbd_device *stm32f107_usbd_init(void);
 
@@ -42,11 +42,20 @@ const struct _usbd_driver stm32f107_usb_driver = {
 	.ep_nak_set = stm32fx07_ep_nak_set,
 	.ep_write_packet = stm32fx07_ep_write_packet,
 	.ep_read_packet = stm32fx07_ep_read_packet,
+	.ep_write_begin = stm32fx07_ep_write_begin,
+	.ep_read_begin = stm32fx07_ep_read_begin,
+	.ep_read_end = stm32fx07_ep_read_end,
 	.poll = stm32fx07_poll,
 	.disconnect = stm32fx07_disconnect,
+	.rx_done = stm32fx07_rx_done,
+	.ep_transfer = stm32fx07_ep_transfer,
+	.ep_transfer_count = stm32fx07_ep_transfer_count,
+	.mem_free = stm32fx07_mem_free,
+	.config_plan = stm32fx07_config_plan,
 	.base_address = USB_OTG_FS_BASE,
 	.set_address_before_status = 1,
-	.rx_fifo_size = RX_FIFO_SIZE,
+	.ep_count = 4,
+	.fifo_mem_size = FIFO_MEM_SIZE,
 };
 
 /** Initialize the USB device controller hardware of the STM32. */
@@ -73,8 +82,7 @@ static usbd_device *stm32f107_usbd_init(void)
 	/* Restart the PHY clock. */
 	OTG_FS_PCGCCTL = 0;
 
-	OTG_FS_GRXFSIZ = stm32f107_usb_driver.rx_fifo_size;
-	usbd_dev.fifo_mem_top = stm32f107_usb_driver.rx_fifo_size;
+	/* The FIFOs are sized on bus reset, see stm32fx07_poll(). */
 
 	/* Unmask interrupts for TX and RX. */
 	OTG_FS_GAHBCFG |= OTG_FS_GAHBCFG_GINT;
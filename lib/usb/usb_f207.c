@@ -25,12 +25,16 @@
 #include "usb_private.h"
 #include "usb_fx07_common.h"
 
-/* Receive FIFO size in 32-bit words. */
-#define RX_FIFO_SIZE 512
+/* FIFO memory of the core in 32-bit words, 4 KB. */
+#define FIFO_MEM_SIZE 1024
+/* Packet buffers of the endpoints in DMA mode, in 32-bit words. */
+#define DMA_MEM_SIZE 512
 
 static usbd_device *stm32f207_usbd_init(void);
+static usbd_device *stm32f207_usbd_init_dma(void);
 
 static struct _usbd_device usbd_dev;
+static u32 dma_mem[DMA_MEM_SIZE];
 
 const struct _usbd_driver stm32f207_usb_driver = {
 	.init = stm32f207_usbd_init,
@@ -42,15 +46,52 @@ const struct _usbd_driver stm32f207_usb_driver = {
 	.ep_nak_set = stm32fx07_ep_nak_set,
 	.ep_write_packet = stm32fx07_ep_write_packet,
 	.ep_read_packet = stm32fx07_ep_read_packet,
+	.ep_write_begin = stm32fx07_ep_write_begin,
+	.ep_read_begin = stm32fx07_ep_read_begin,
+	.ep_read_end = stm32fx07_ep_read_end,
 	.poll = stm32fx07_poll,
 	.disconnect = stm32fx07_disconnect,
+	.rx_done = stm32fx07_rx_done,
+	.ep_transfer = stm32fx07_ep_transfer,
+	.ep_transfer_count = stm32fx07_ep_transfer_count,
+	.mem_free = stm32fx07_mem_free,
+	.config_plan = stm32fx07_config_plan,
 	.base_address = USB_OTG_HS_BASE,
 	.set_address_before_status = 1,
-	.rx_fifo_size = RX_FIFO_SIZE,
+	.ep_count = 6,
+	.fifo_mem_size = FIFO_MEM_SIZE,
 };
 
-/** Initialize the USB device controller hardware of the STM32. */
-static usbd_device *stm32f207_usbd_init(void)
+/*
+ * The same core moving the packets with its own DMA, the CPU only handles
+ * the completion. There is no FIFO to access in place.
+ */
+const struct _usbd_driver stm32f207_usb_driver_dma = {
+	.init = stm32f207_usbd_init_dma,
+	.set_address = stm32fx07_set_address,
+	.ep_setup = stm32fx07_ep_setup,
+	.ep_reset = stm32fx07_endpoints_reset,
+	.ep_stall_set = stm32fx07_ep_stall_set,
+	.ep_stall_get = stm32fx07_ep_stall_get,
+	.ep_nak_set = stm32fx07_ep_nak_set,
+	.ep_write_packet = stm32fx07_ep_write_packet,
+	.ep_read_packet = stm32fx07_ep_read_packet,
+	.poll = stm32fx07_poll,
+	.disconnect = stm32fx07_disconnect,
+	.rx_done = stm32fx07_rx_done,
+	.ep_transfer = stm32fx07_ep_transfer,
+	.ep_transfer_count = stm32fx07_ep_transfer_count,
+	.mem_free = stm32fx07_mem_free,
+	.config_plan = stm32fx07_config_plan,
+	.base_address = USB_OTG_HS_BASE,
+	.set_address_before_status = 1,
+	.ep_count = 6,
+	.fifo_mem_size = FIFO_MEM_SIZE,
+	.dma_mem_size = DMA_MEM_SIZE,
+	.dma = true,
+};
+
+static void stm32f207_core_init(void)
 {
 	OTG_HS_GINTSTS = OTG_HS_GINTSTS_MMIS;
 
@@ -73,8 +114,13 @@ static usbd_device *stm32f207_usbd_init(void)
 	/* Restart the PHY clock. */
 	OTG_HS_PCGCCTL = 0;
 
-	OTG_HS_GRXFSIZ = stm32f207_usb_driver.rx_fifo_size;
-	usbd_dev.fifo_mem_top = stm32f207_usb_driver.rx_fifo_size;
+	/* The FIFOs are sized on bus reset, see stm32fx07_poll(). */
+}
+
+/** Initialize the USB device controller hardware of the STM32. */
+static usbd_device *stm32f207_usbd_init(void)
+{
+	stm32f207_core_init();
 
 	/* Unmask interrupts for TX and RX. */
 	OTG_HS_GAHBCFG |= OTG_HS_GAHBCFG_GINT;
@@ -84,8 +130,30 @@ static usbd_device *stm32f207_usbd_init(void)
 			 OTG_HS_GINTMSK_USBSUSPM |
 			 OTG_HS_GINTMSK_WUIM |
 			 OTG_HS_GINTMSK_SOFM;
-	OTG_HS_DAINTMSK = 0xF;
+	OTG_HS_DAINTMSK = 0x3F;
+	OTG_HS_DIEPMSK = OTG_HS_DIEPMSK_XFRCM;
+
+	return &usbd_dev;
+}
+
+/** Initialize the USB device controller hardware of the STM32, DMA mode. */
+static usbd_device *stm32f207_usbd_init_dma(void)
+{
+	stm32f207_core_init();
+	usbd_dev.dma_mem = dma_mem;
+
+	/* Received packets are reported per endpoint, once in memory. */
+	OTG_HS_GAHBCFG |= OTG_HS_GAHBCFG_GINT | OTG_HS_GAHBCFG_DMAEN |
+			  OTG_HS_GAHBCFG_HBSTLEN_INCR4;
+	OTG_HS_GINTMSK = OTG_HS_GINTMSK_ENUMDNEM |
+			 OTG_HS_GINTMSK_OEPINT |
+			 OTG_HS_GINTMSK_IEPINT |
+			 OTG_HS_GINTMSK_USBSUSPM |
+			 OTG_HS_GINTMSK_WUIM |
+			 OTG_HS_GINTMSK_SOFM;
+	OTG_HS_DAINTMSK = 0x3F | (0x3F << 16);
 	OTG_HS_DIEPMSK = OTG_HS_DIEPMSK_XFRCM;
+	OTG_HS_DOEPMSK = OTG_HS_DOEPMSK_XFRCM | OTG_HS_DOEPMSK_STUPM;
 
 	return &usbd_dev;
 }
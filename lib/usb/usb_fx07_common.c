@@ -31,7 +31,224 @@
  * according to the selected cores base address. */
 #define dev_base_address   (usbd_dev->driver->base_address)
 #define REBASE(x)          MMIO32((x)+(dev_base_address))
-#define REBASE_FIFO(x)     ((volatile u32*)((dev_base_address) + (OTG_FIFO(x))))
+#define REBASE_FIFO(x)     (&MMIO32((dev_base_address) + (OTG_FIFO(x))))
+
+#define EPTYP_ISO	(USB_ENDPOINT_ATTR_ISOCHRONOUS << 18)
+
+/* Smallest TX FIFO the core supports, in words. */
+#define FIFO_TX_MIN	16
+
+/*
+ * Isochronous packets are sent and received in the frame of the parity set
+ * when the endpoint is enabled. Returns the bit for the next frame.
+ */
+static u32 stm32fx07_iso_next_frame(usbd_device *usbd_dev)
+{
+	return (REBASE(OTG_DSTS) & OTG_FS_DSTS_FNSOF_ODD) ?
+	       OTG_FS_DIEPCTLX_SEVNFRM : OTG_FS_DIEPCTLX_SODDFRM;
+}
+
+/*
+ * Called at the start of a frame: a pending isochronous packet that missed
+ * its frame, because the host did not poll the endpoint, is moved to this
+ * one instead of waiting for the next frame of the same parity.
+ */
+static void stm32fx07_iso_sof(usbd_device *usbd_dev)
+{
+	u32 frame = (REBASE(OTG_DSTS) & OTG_FS_DSTS_FNSOF_ODD) ?
+		    OTG_FS_DIEPCTLX_SODDFRM : OTG_FS_DIEPCTLX_SEVNFRM;
+	u32 ctl;
+	int i;
+
+	for (i = 1; i < usbd_dev->driver->ep_count; i++) {
+		ctl = REBASE(OTG_DIEPCTL(i));
+		if (((ctl & OTG_FS_DIEPCTL0_EPTYP_MASK) == EPTYP_ISO) &&
+		    (ctl & OTG_FS_DIEPCTL0_EPENA))
+			REBASE(OTG_DIEPCTL(i)) |= frame;
+
+		ctl = REBASE(OTG_DOEPCTL(i));
+		if (((ctl & OTG_FS_DOEPCTL0_EPTYP_MASK) == EPTYP_ISO) &&
+		    (ctl & OTG_FS_DOEPCTL0_EPENA))
+			REBASE(OTG_DOEPCTL(i)) |= frame;
+	}
+}
+
+/*
+ * Receive FIFO in words, from the largest OUT packet of all configurations:
+ * 13 for the SETUP packets, room for two packets with their status entries
+ * so the next one arrives while the last one is read, a transfer complete
+ * entry per OUT endpoint and one for the global OUT NAK.
+ */
+static u16 stm32fx07_fifo_rx_words(usbd_device *usbd_dev)
+{
+	struct usbd_ep_sizes sizes;
+	u16 largest = usbd_dev->desc->bMaxPacketSize0;
+	u8 outs = 1;
+	int i;
+
+	memset(&sizes, 0, sizeof(sizes));
+	_usbd_config_endpoints(usbd_dev, USBD_CONFIG_ANY, &sizes);
+
+	for (i = 1; i < usbd_dev->driver->ep_count; i++) {
+		if (!sizes.max_size[i][USB_TRANSACTION_OUT])
+			continue;
+		if (sizes.max_size[i][USB_TRANSACTION_OUT] > largest)
+			largest = sizes.max_size[i][USB_TRANSACTION_OUT];
+		outs++;
+	}
+
+	return 13 + 2 * ((largest + 3) / 4 + 1) + 2 * outs + 1;
+}
+
+/*
+ * TX FIFO of an IN endpoint in words. Bulk and isochronous endpoints get
+ * room for two packets, so the next one is pushed while the last one is
+ * sent; interrupt and control endpoints only need one.
+ */
+static u16 stm32fx07_fifo_tx_words(u16 max_size, u8 type)
+{
+	u16 words = (max_size + 3) / 4;
+
+	if ((type == USB_ENDPOINT_ATTR_BULK) ||
+	    (type == USB_ENDPOINT_ATTR_ISOCHRONOUS))
+		words *= 2;
+
+	return (words > FIFO_TX_MIN) ? words : FIFO_TX_MIN;
+}
+
+/* End of the FIFO memory, in DMA mode the core keeps the DMA addresses of
+ * the endpoints there. */
+static u16 stm32fx07_fifo_end(usbd_device *usbd_dev)
+{
+	u16 end = usbd_dev->driver->fifo_mem_size;
+
+	if (usbd_dev->driver->dma)
+		end -= 2 * usbd_dev->driver->ep_count;
+
+	return end;
+}
+
+/*
+ * Plans the TX FIFOs of the IN endpoints of a configuration, after the
+ * receive FIFO and the one of endpoint 0, and in DMA mode the packet
+ * buffers of all its endpoints after those of endpoint 0. Each endpoint
+ * gets room for its largest packet over all alternate settings, so
+ * switching them needs no new memory. Returns false if they do not fit,
+ * or the configuration has endpoints the core does not.
+ */
+bool stm32fx07_config_plan(usbd_device *usbd_dev, u16 wValue)
+{
+	struct usbd_ep_sizes sizes;
+	u16 addr[OTG_MAX_ENDPOINTS], size[OTG_MAX_ENDPOINTS];
+	u16 dma_in[OTG_MAX_ENDPOINTS], dma_out[OTG_MAX_ENDPOINTS];
+	u16 top = usbd_dev->fifo_mem_top_ep0;
+	u16 dma_top = usbd_dev->dma_mem_top_ep0;
+	u16 mps;
+	int i;
+
+	memset(&sizes, 0, sizeof(sizes));
+	_usbd_config_endpoints(usbd_dev, wValue, &sizes);
+
+	for (i = usbd_dev->driver->ep_count; i < 8; i++) {
+		if (sizes.max_size[i][USB_TRANSACTION_IN] ||
+		    sizes.max_size[i][USB_TRANSACTION_OUT])
+			return false;
+	}
+
+	addr[0] = size[0] = 0;
+	dma_in[0] = usbd_dev->dma_in_size[0];
+	dma_out[0] = usbd_dev->dma_out_size[0];
+	for (i = 1; i < usbd_dev->driver->ep_count; i++) {
+		mps = sizes.max_size[i][USB_TRANSACTION_IN];
+		addr[i] = top;
+		size[i] = mps ? stm32fx07_fifo_tx_words(mps,
+				sizes.type[i][USB_TRANSACTION_IN]) : 0;
+		top += size[i];
+
+		dma_in[i] = (mps + 3) / 4;
+		dma_out[i] = (sizes.max_size[i][USB_TRANSACTION_OUT] + 3) / 4;
+		dma_top += dma_in[i] + dma_out[i];
+	}
+
+	if (top > stm32fx07_fifo_end(usbd_dev))
+		return false;
+
+	memcpy(usbd_dev->fifo_tx_addr, addr, sizeof(addr));
+	memcpy(usbd_dev->fifo_tx_size, size, sizeof(size));
+	usbd_dev->fifo_plan_top = top;
+
+	if (!usbd_dev->driver->dma)
+		return true;
+
+	if (dma_top > usbd_dev->driver->dma_mem_size)
+		return false;
+
+	dma_top = usbd_dev->dma_mem_top_ep0;
+	for (i = 1; i < usbd_dev->driver->ep_count; i++) {
+		usbd_dev->dma_in[i] = (u8 *)(usbd_dev->dma_mem + dma_top);
+		dma_top += dma_in[i];
+		usbd_dev->dma_out[i] = (u8 *)(usbd_dev->dma_mem + dma_top);
+		dma_top += dma_out[i];
+	}
+	memcpy(usbd_dev->dma_in_size, dma_in, sizeof(dma_in));
+	memcpy(usbd_dev->dma_out_size, dma_out, sizeof(dma_out));
+	usbd_dev->dma_plan_top = dma_top;
+
+	return true;
+}
+
+/* In DMA mode the lesser of the FIFO and the DMA buffer memory left. */
+u16 stm32fx07_mem_free(usbd_device *usbd_dev)
+{
+	u16 end = stm32fx07_fifo_end(usbd_dev);
+	u16 words = (end > usbd_dev->fifo_mem_top) ?
+		    (end - usbd_dev->fifo_mem_top) : 0;
+
+	if (usbd_dev->driver->dma &&
+	    (usbd_dev->driver->dma_mem_size - usbd_dev->dma_mem_top < words))
+		words = usbd_dev->driver->dma_mem_size - usbd_dev->dma_mem_top;
+
+	return words * 4;
+}
+
+/*
+ * DMA mode: takes a packet buffer from dma_mem, word aligned for the core.
+ * Returns NULL if there is not enough left.
+ */
+static u8 *stm32fx07_dma_alloc(usbd_device *usbd_dev, u16 size)
+{
+	u8 *buf = (u8 *)(usbd_dev->dma_mem + usbd_dev->dma_mem_top);
+	u16 words = (size + 3) / 4;
+
+	if (words > usbd_dev->driver->dma_mem_size - usbd_dev->dma_mem_top)
+		return NULL;
+
+	usbd_dev->dma_mem_top += words;
+	return buf;
+}
+
+/*
+ * DMA mode: the packet buffer of an endpoint, the planned one if it is big
+ * enough, else a new one from what is left. Returns NULL if there is not
+ * enough left.
+ */
+static u8 *stm32fx07_dma_buf(usbd_device *usbd_dev, u8 **buf, u16 *words,
+			     u16 size)
+{
+	if (*words < (size + 3) / 4) {
+		*buf = stm32fx07_dma_alloc(usbd_dev, size);
+		*words = *buf ? (size + 3) / 4 : 0;
+	}
+
+	return *buf;
+}
+
+/* DMA mode: whether a packet buffer is one planned for the configuration. */
+static bool stm32fx07_dma_planned(usbd_device *usbd_dev, u8 *buf)
+{
+	return buf &&
+	       ((u32 *)buf < usbd_dev->dma_mem + usbd_dev->dma_plan_top);
+}
 
 void stm32fx07_set_address(usbd_device *usbd_dev, u8 addr)
 {
@@ -46,7 +263,10 @@ void stm32fx07_ep_setup(usbd_device *usbd_dev, u8 addr, u8 type, u16 max_size,
 	 * endpoint. Install callback funciton.
 	 */
 	u8 dir = addr & 0x80;
+	u16 words;
 	addr &= 0x7f;
+	/* The FIFOs already decouple the CPU, ignore USBD_EP_DOUBLEBUF. */
+	type &= USB_ENDPOINT_ATTR_TYPE;
 
 	if (addr == 0) { /* For the default control endpoint */
 		/* Configure IN part. */
@@ -68,29 +288,77 @@ void stm32fx07_ep_setup(usbd_device *usbd_dev, u8 addr, u8 type, u16 max_size,
 		usbd_dev->doeptsiz[0] = OTG_FS_DIEPSIZ0_STUPCNT_1 |
 			OTG_FS_DIEPSIZ0_PKTCNT |
 			(max_size & OTG_FS_DIEPSIZ0_XFRSIZ_MASK);
+		if (usbd_dev->driver->dma) {
+			/*
+			 * The core writes up to three back to back SETUP
+			 * packets one after the other, room for them and
+			 * for a DATA OUT packet.
+			 */
+			usbd_dev->doeptsiz[0] |= OTG_FS_DIEPSIZ0_STUPCNT_3;
+			usbd_dev->dma_in[0] = stm32fx07_dma_alloc(usbd_dev,
+								  max_size);
+			usbd_dev->dma_out[0] = stm32fx07_dma_alloc(usbd_dev,
+					(max_size > 3 * 8) ? max_size : 3 * 8);
+			usbd_dev->dma_in_size[0] = usbd_dev->dma_in[0] ?
+						   (max_size + 3) / 4 : 0;
+			usbd_dev->dma_mem_top_ep0 = usbd_dev->dma_mem_top;
+			usbd_dev->dma_plan_top = usbd_dev->dma_mem_top;
+			REBASE(OTG_DOEPDMA(0)) =
+				(uintptr_t)usbd_dev->dma_out[0];
+		}
 		REBASE(OTG_DOEPTSIZ(0)) = usbd_dev->doeptsiz[0];
 		REBASE(OTG_DOEPCTL(0)) |=
 		    OTG_FS_DOEPCTL0_EPENA | OTG_FS_DIEPCTL0_SNAK;
 
-		REBASE(OTG_GNPTXFSIZ) = ((max_size / 4) << 16) |
-					 usbd_dev->driver->rx_fifo_size;
-		usbd_dev->fifo_mem_top += max_size / 4;
+		words = stm32fx07_fifo_tx_words(max_size,
+						USB_ENDPOINT_ATTR_CONTROL);
+		REBASE(OTG_GNPTXFSIZ) = (words << 16) | usbd_dev->fifo_mem_top;
+		usbd_dev->fifo_mem_top += words;
 		usbd_dev->fifo_mem_top_ep0 = usbd_dev->fifo_mem_top;
+		usbd_dev->fifo_plan_top = usbd_dev->fifo_mem_top;
 
 		return;
 	}
 
+	/* Without a packet buffer the endpoint is left disabled. */
+	if (usbd_dev->driver->dma &&
+	    !(dir ? stm32fx07_dma_buf(usbd_dev, &usbd_dev->dma_in[addr],
+				      &usbd_dev->dma_in_size[addr], max_size) :
+		    stm32fx07_dma_buf(usbd_dev, &usbd_dev->dma_out[addr],
+				      &usbd_dev->dma_out_size[addr], max_size)))
+		return;
+
 	if (dir) {
-		REBASE(OTG_DIEPTXF(addr)) = ((max_size / 4) << 16) |
-					     usbd_dev->fifo_mem_top;
-		usbd_dev->fifo_mem_top += max_size / 4;
+		usbd_dev->xfer_in[addr].left = 0;
+		REBASE(OTG_DIEPEMPMSK) &= ~(1 << addr);
+
+		/* Endpoints not planned from the configuration, or too big
+		 * for it, get their FIFO from what is left. */
+		words = stm32fx07_fifo_tx_words(max_size, type);
+		if (usbd_dev->fifo_tx_size[addr] < words) {
+			usbd_dev->fifo_tx_addr[addr] = usbd_dev->fifo_mem_top;
+			usbd_dev->fifo_tx_size[addr] = words;
+			usbd_dev->fifo_mem_top += words;
+		}
+		REBASE(OTG_DIEPTXF(addr)) =
+			(usbd_dev->fifo_tx_size[addr] << 16) |
+			usbd_dev->fifo_tx_addr[addr];
 
 		REBASE(OTG_DIEPTSIZ(addr)) =
-		    (max_size & OTG_FS_DIEPSIZ0_XFRSIZ_MASK);
-		REBASE(OTG_DIEPCTL(addr)) |=
-		    OTG_FS_DIEPCTL0_EPENA | OTG_FS_DIEPCTL0_SNAK | (type << 18)
+		    (max_size & OTG_FS_DIEPSIZX_XFRSIZ_MASK);
+		/* An earlier setup of the endpoint may have left its own
+		 * type, FIFO and size. */
+		REBASE(OTG_DIEPCTL(addr)) =
+		    (REBASE(OTG_DIEPCTL(addr)) &
+		     ~(OTG_FS_DIEPCTL0_TXFNUM_MASK |
+		       OTG_FS_DIEPCTL0_EPTYP_MASK |
+		       OTG_FS_DIEPCTLX_MPSIZ_MASK))
+		    | OTG_FS_DIEPCTL0_SNAK | (type << 18)
 		    | OTG_FS_DIEPCTL0_USBAEP | OTG_FS_DIEPCTLX_SD0PID
 		    | (addr << 22) | max_size;
+		/* Isochronous endpoints are enabled per packet. */
+		if (type != USB_ENDPOINT_ATTR_ISOCHRONOUS)
+			REBASE(OTG_DIEPCTL(addr)) |= OTG_FS_DIEPCTL0_EPENA;
 
 		if (callback) {
 			usbd_dev->user_callback_ctr[addr][USB_TRANSACTION_IN] =
@@ -99,12 +367,25 @@ void stm32fx07_ep_setup(usbd_device *usbd_dev, u8 addr, u8 type, u16 max_size,
 	}
 
 	if (!dir) {
+		usbd_dev->xfer_out[addr].active = false;
+		usbd_dev->out_stopped[addr] = false;
+
 		usbd_dev->doeptsiz[addr] = OTG_FS_DIEPSIZ0_PKTCNT |
-				 (max_size & OTG_FS_DIEPSIZ0_XFRSIZ_MASK);
+				 (max_size & OTG_FS_DIEPSIZX_XFRSIZ_MASK);
+		if (usbd_dev->driver->dma)
+			REBASE(OTG_DOEPDMA(addr)) =
+				(uintptr_t)usbd_dev->dma_out[addr];
 		REBASE(OTG_DOEPTSIZ(addr)) = usbd_dev->doeptsiz[addr];
-		REBASE(OTG_DOEPCTL(addr)) |= OTG_FS_DOEPCTL0_EPENA |
+		REBASE(OTG_DOEPCTL(addr)) =
+		    (REBASE(OTG_DOEPCTL(addr)) &
+		     ~(OTG_FS_DOEPCTL0_EPTYP_MASK |
+		       OTG_FS_DOEPCTLX_MPSIZ_MASK)) |
+		    OTG_FS_DOEPCTL0_EPENA |
 		    OTG_FS_DOEPCTL0_USBAEP | OTG_FS_DIEPCTL0_CNAK |
-		    OTG_FS_DOEPCTLX_SD0PID | (type << 18) | max_size;
+		    (type << 18) | max_size |
+		    ((type == USB_ENDPOINT_ATTR_ISOCHRONOUS) ?
+		     stm32fx07_iso_next_frame(usbd_dev) :
+		     OTG_FS_DOEPCTLX_SD0PID);
 
 		if (callback) {
 			usbd_dev->user_callback_ctr[addr][USB_TRANSACTION_OUT] =
@@ -113,10 +394,39 @@ void stm32fx07_ep_setup(usbd_device *usbd_dev, u8 addr, u8 type, u16 max_size,
 	}
 }
 
+/* Drops the multi-packet transfers in progress. */
+static void stm32fx07_xfer_reset(usbd_device *usbd_dev)
+{
+	int i;
+
+	REBASE(OTG_DIEPEMPMSK) = 0;
+
+	for (i = 0; i < usbd_dev->driver->ep_count; i++) {
+		usbd_dev->xfer_in[i].left = 0;
+		usbd_dev->xfer_out[i].active = false;
+		usbd_dev->out_stopped[i] = false;
+	}
+}
+
 void stm32fx07_endpoints_reset(usbd_device *usbd_dev)
 {
-	/* The core resets the endpoints automatically on reset. */
-	usbd_dev->fifo_mem_top = usbd_dev->fifo_mem_top_ep0;
+	int i;
+
+	/* The core resets the endpoint registers on a bus reset only, on
+	 * SET_CONFIGURATION stm32fx07_ep_setup() replaces their type, FIFO
+	 * and size. The planned FIFOs and DMA buffers are kept, the others
+	 * given back. */
+	for (i = 1; i < usbd_dev->driver->ep_count; i++) {
+		if (usbd_dev->fifo_tx_addr[i] >= usbd_dev->fifo_plan_top)
+			usbd_dev->fifo_tx_size[i] = 0;
+		if (!stm32fx07_dma_planned(usbd_dev, usbd_dev->dma_in[i]))
+			usbd_dev->dma_in_size[i] = 0;
+		if (!stm32fx07_dma_planned(usbd_dev, usbd_dev->dma_out[i]))
+			usbd_dev->dma_out_size[i] = 0;
+	}
+	usbd_dev->fifo_mem_top = usbd_dev->fifo_plan_top;
+	usbd_dev->dma_mem_top = usbd_dev->dma_plan_top;
+	stm32fx07_xfer_reset(usbd_dev);
 }
 
 void stm32fx07_ep_stall_set(usbd_device *usbd_dev, u8 addr, u8 stall)
@@ -158,6 +468,24 @@ u8 stm32fx07_ep_stall_get(usbd_device *usbd_dev, u8 addr)
 				OTG_FS_DOEPCTL0_STALL) ? 1 : 0;
 }
 
+/*
+ * Enables an OUT endpoint for its next packet, once the core has finished
+ * with the last one.
+ */
+static void stm32fx07_out_enable(usbd_device *usbd_dev, u8 ep)
+{
+	u32 ctl = OTG_FS_DOEPCTL0_EPENA | (usbd_dev->force_nak[ep] ?
+		  OTG_FS_DOEPCTL0_SNAK : OTG_FS_DOEPCTL0_CNAK);
+
+	if ((REBASE(OTG_DOEPCTL(ep)) & OTG_FS_DOEPCTL0_EPTYP_MASK) == EPTYP_ISO)
+		ctl |= stm32fx07_iso_next_frame(usbd_dev);
+
+	if (usbd_dev->driver->dma)
+		REBASE(OTG_DOEPDMA(ep)) = (uintptr_t)usbd_dev->dma_out[ep];
+	REBASE(OTG_DOEPTSIZ(ep)) = usbd_dev->doeptsiz[ep];
+	REBASE(OTG_DOEPCTL(ep)) |= ctl;
+}
+
 void stm32fx07_ep_nak_set(usbd_device *usbd_dev, u8 addr, u8 nak)
 {
 	/* It does not make sence to force NAK on IN endpoints. */
@@ -166,145 +494,590 @@ void stm32fx07_ep_nak_set(usbd_device *usbd_dev, u8 addr, u8 nak)
 
 	usbd_dev->force_nak[addr] = nak;
 
-	if (nak)
+	if (nak) {
+		/* Packets of a cancelled transfer are reported one by one. */
+		usbd_dev->xfer_out[addr].active = false;
 		REBASE(OTG_DOEPCTL(addr)) |= OTG_FS_DOEPCTL0_SNAK;
-	else
+	} else if (usbd_dev->out_stopped[addr]) {
+		usbd_dev->out_stopped[addr] = false;
+		stm32fx07_out_enable(usbd_dev, addr);
+	} else {
 		REBASE(OTG_DOEPCTL(addr)) |= OTG_FS_DOEPCTL0_CNAK;
+	}
+}
+
+/* Programs the length of the next IN packet and enables the endpoint, the
+ * data is pushed into the FIFO after. Returns false while the endpoint
+ * still holds a packet. */
+static bool stm32fx07_tx_start(usbd_device *usbd_dev, u8 addr, u16 len)
+{
+	/* Return if endpoint is already enabled. */
+	if (REBASE(OTG_DIEPTSIZ(addr)) & OTG_FS_DIEPSIZX_PKTCNT_MASK)
+		return false;
+
+	/* Enable endpoint for transmission. */
+	if ((REBASE(OTG_DIEPCTL(addr)) & OTG_FS_DIEPCTL0_EPTYP_MASK) ==
+	    EPTYP_ISO) {
+		/* One packet per frame, sent in the next one. */
+		REBASE(OTG_DIEPTSIZ(addr)) = OTG_FS_DIEPSIZX_MCNT_1 |
+					     OTG_FS_DIEPSIZ0_PKTCNT | len;
+		REBASE(OTG_DIEPCTL(addr)) |= OTG_FS_DIEPCTL0_EPENA |
+					     OTG_FS_DIEPCTL0_CNAK |
+					     stm32fx07_iso_next_frame(usbd_dev);
+	} else {
+		REBASE(OTG_DIEPTSIZ(addr)) = OTG_FS_DIEPSIZ0_PKTCNT | len;
+		REBASE(OTG_DIEPCTL(addr)) |= OTG_FS_DIEPCTL0_EPENA |
+					     OTG_FS_DIEPCTL0_CNAK;
+	}
+
+	return true;
+}
+
+/*
+ * Pushes a packet into the FIFO of an IN endpoint. Every write to the FIFO
+ * window pushes a word, so each one is a store to the same address, like
+ * the pops in stm32fx07_ep_read_packet().
+ */
+static void stm32fx07_fifo_write(usbd_device *usbd_dev, u8 addr,
+				 const void *buf, u16 len)
+{
+	const u8 *src = buf;
+	u32 fifo = dev_base_address + OTG_FIFO(addr);
+	u16 n;
+
+	/* Copy buffer to endpoint FIFO, note - memcpy does not work */
+	if (!((uintptr_t)src & 3)) {
+		const u32 *buf32 = buf;
+
+		for (n = len >> 4; n; buf32 += 4, n--) {
+			MMIO32(fifo) = buf32[0];
+			MMIO32(fifo) = buf32[1];
+			MMIO32(fifo) = buf32[2];
+			MMIO32(fifo) = buf32[3];
+		}
+		for (n = (len >> 2) & 3; n; n--)
+			MMIO32(fifo) = *buf32++;
+		src = (const u8 *)buf32;
+	} else {
+		for (n = len >> 2; n; src += 4, n--)
+			MMIO32(fifo) = src[0] | (src[1] << 8) |
+				       (src[2] << 16) | ((u32)src[3] << 24);
+	}
+
+	/* The last word is padded, without reading past the buffer. */
+	switch (len & 3) {
+	case 3:
+		MMIO32(fifo) = src[0] | (src[1] << 8) | (src[2] << 16);
+		break;
+	case 2:
+		MMIO32(fifo) = src[0] | (src[1] << 8);
+		break;
+	case 1:
+		MMIO32(fifo) = src[0];
+		break;
+	}
 }
 
 u16 stm32fx07_ep_write_packet(usbd_device *usbd_dev, u8 addr,
 			      const void *buf, u16 len)
 {
-	const u32 *buf32 = buf;
-	int i;
-
 	addr &= 0x7F;
 
-	/* Return if endpoint is already enabled. */
-	if (REBASE(OTG_DIEPTSIZ(addr)) & OTG_FS_DIEPSIZ0_PKTCNT)
-		return 0;
+	/* The core fetches the packet itself when the host asks for it. */
+	if (usbd_dev->driver->dma) {
+		if (REBASE(OTG_DIEPTSIZ(addr)) & OTG_FS_DIEPSIZX_PKTCNT_MASK)
+			return 0;
+		/* Nothing is sent from an endpoint left without a big
+		 * enough packet buffer. */
+		if (!usbd_dev->dma_in[addr] ||
+		    len > usbd_dev->dma_in_size[addr] * 4)
+			return 0;
+		memcpy(usbd_dev->dma_in[addr], buf, len);
+		REBASE(OTG_DIEPDMA(addr)) = (uintptr_t)usbd_dev->dma_in[addr];
+	}
 
-	/* Enable endpoint for transmission. */
-	REBASE(OTG_DIEPTSIZ(addr)) = OTG_FS_DIEPSIZ0_PKTCNT | len;
-	REBASE(OTG_DIEPCTL(addr)) |= OTG_FS_DIEPCTL0_EPENA |
-				     OTG_FS_DIEPCTL0_CNAK;
-	volatile u32 *fifo = REBASE_FIFO(addr);
+	if (!stm32fx07_tx_start(usbd_dev, addr, len))
+		return 0;
 
-	/* Copy buffer to endpoint FIFO, note - memcpy does not work */
-	for (i = len; i > 0; i -= 4)
-		*fifo++ = *buf32++;
+	if (!usbd_dev->driver->dma)
+		stm32fx07_fifo_write(usbd_dev, addr, buf, len);
 
 	return len;
 }
 
+/* The packet is pushed into the FIFO word by word, its length is fixed
+ * before. */
+bool stm32fx07_ep_write_begin(usbd_device *usbd_dev,
+			      struct usbd_ep_buffer *buf)
+{
+	u8 addr = buf->addr & 0x7F;
+
+	if (!stm32fx07_tx_start(usbd_dev, addr, buf->size))
+		return false;
+
+	buf->mem = REBASE_FIFO(addr);
+	buf->width = 4;
+	buf->stride = 0;
+
+	return true;
+}
+
 u16 stm32fx07_ep_read_packet(usbd_device *usbd_dev, u8 addr, void *buf, u16 len)
 {
-	int i;
-	u32 *buf32 = buf;
-	u32 extra;
+	u8 *dst = buf;
+	u32 word;
+	u16 n;
 
 	len = MIN(len, usbd_dev->rxbcnt);
 	usbd_dev->rxbcnt -= len;
 
-	volatile u32 *fifo = REBASE_FIFO(addr);
-	for (i = len; i >= 4; i -= 4)
-		*buf32++ = *fifo++;
+	/* The core has already written the packet to memory. */
+	if (usbd_dev->driver->dma) {
+		memcpy(buf, usbd_dev->dma_rx, len);
+		usbd_dev->dma_rx += len;
+		return len;
+	}
+
+	/* Every read of the FIFO window pops the next word. */
+	if (!((uintptr_t)dst & 3)) {
+		u32 *buf32 = buf;
 
-	if (i) {
-		extra = *fifo++;
-		memcpy(buf32, &extra, i);
+		for (n = len >> 4; n; buf32 += 4, n--) {
+			buf32[0] = *REBASE_FIFO(addr);
+			buf32[1] = *REBASE_FIFO(addr);
+			buf32[2] = *REBASE_FIFO(addr);
+			buf32[3] = *REBASE_FIFO(addr);
+		}
+		for (n = (len >> 2) & 3; n; n--)
+			*buf32++ = *REBASE_FIFO(addr);
+		dst = (u8 *)buf32;
+	} else {
+		for (n = len >> 2; n; dst += 4, n--) {
+			word = *REBASE_FIFO(addr);
+			dst[0] = word;
+			dst[1] = word >> 8;
+			dst[2] = word >> 16;
+			dst[3] = word >> 24;
+		}
 	}
 
-	REBASE(OTG_DOEPTSIZ(addr)) = usbd_dev->doeptsiz[addr];
-	REBASE(OTG_DOEPCTL(addr)) |= OTG_FS_DOEPCTL0_EPENA |
-	    (usbd_dev->force_nak[addr] ?
-	     OTG_FS_DOEPCTL0_SNAK : OTG_FS_DOEPCTL0_CNAK);
+	/* Only the bytes asked for of the last word are stored. */
+	if (len & 3) {
+		word = *REBASE_FIFO(addr);
+		for (n = len & 3; n; word >>= 8, n--)
+			*dst++ = word;
+	}
 
+	/* The endpoint is enabled again by stm32fx07_poll() once the core
+	 * reports the transfer as complete. */
 	return len;
 }
 
-void stm32fx07_poll(usbd_device *usbd_dev)
+/* Only valid from the OUT callback, while the packet is at the head of
+ * the receive FIFO. */
+bool stm32fx07_ep_read_begin(usbd_device *usbd_dev,
+			     struct usbd_ep_buffer *buf)
+{
+	buf->mem = REBASE_FIFO(buf->addr & 0x7F);
+	buf->width = 4;
+	buf->stride = 0;
+	buf->size = usbd_dev->rxbcnt;
+
+	return true;
+}
+
+/* The words popped are gone, stm32fx07_rx_done() drops the rest. */
+void stm32fx07_ep_read_end(usbd_device *usbd_dev, struct usbd_ep_buffer *buf)
+{
+	u16 popped = buf->len + buf->count;
+
+	usbd_dev->rxbcnt = (buf->size > popped) ? buf->size - popped : 0;
+}
+
+/* Enables an OUT endpoint for the whole of its multi-packet transfer. */
+static void stm32fx07_xfer_out_start(usbd_device *usbd_dev, u8 ep)
+{
+	u32 mps = REBASE(OTG_DOEPCTL(ep)) & OTG_FS_DOEPCTLX_MPSIZ_MASK;
+	u32 len = usbd_dev->xfer_out[ep].left;
+
+	usbd_dev->xfer_out[ep].started = true;
+	if (usbd_dev->driver->dma)
+		REBASE(OTG_DOEPDMA(ep)) = (uintptr_t)usbd_dev->xfer_out[ep].buf;
+	REBASE(OTG_DOEPTSIZ(ep)) =
+		((len / mps) << OTG_FS_DIEPSIZX_PKTCNT_SHIFT) | len;
+	REBASE(OTG_DOEPCTL(ep)) |= OTG_FS_DOEPCTL0_EPENA |
+				   OTG_FS_DOEPCTL0_CNAK;
+}
+
+/* The core has finished with the last packet of an OUT endpoint. */
+static void stm32fx07_out_done(usbd_device *usbd_dev, u8 ep)
+{
+	if (usbd_dev->xfer_out[ep].active)
+		stm32fx07_xfer_out_start(usbd_dev, ep);
+	else
+		stm32fx07_out_enable(usbd_dev, ep);
+}
+
+/*
+ * Pushes the packets of a multi-packet IN transfer that fit into the FIFO.
+ * The rest follows from stm32fx07_poll() when the FIFO has drained, the
+ * TXFE interrupt of the endpoint is enabled until then.
+ */
+static void stm32fx07_tx_fill(usbd_device *usbd_dev, u8 ep)
+{
+	u16 mps = REBASE(OTG_DIEPCTL(ep)) & OTG_FS_DIEPCTLX_MPSIZ_MASK;
+	u16 len;
+
+	while (usbd_dev->xfer_in[ep].left) {
+		len = MIN(mps, usbd_dev->xfer_in[ep].left);
+		if ((REBASE(OTG_DTXFSTS(ep)) & OTG_FS_DTXFSTS_INEPTFSAV_MASK) <
+		    (u32)(len + 3) / 4)
+			break;
+
+		stm32fx07_fifo_write(usbd_dev, ep, usbd_dev->xfer_in[ep].buf,
+				     len);
+		usbd_dev->xfer_in[ep].buf += len;
+		usbd_dev->xfer_in[ep].left -= len;
+	}
+
+	if (usbd_dev->xfer_in[ep].left)
+		REBASE(OTG_DIEPEMPMSK) |= 1 << ep;
+	else
+		REBASE(OTG_DIEPEMPMSK) &= ~(1 << ep);
+}
+
+/*
+ * Programs a transfer of several packets, the core only reports the end of
+ * it. IN packets are pushed into the FIFO as it drains. OUT packets are
+ * copied to the buffer by stm32fx07_poll() and a short one ends the
+ * transfer; the endpoint is left disabled after, so it NAKs until the next
+ * transfer or ep_nak_set() enables it again. An OUT endpoint can only be
+ * programmed while it is disabled: stopped, or busy with the last packet
+ * read, then it is enabled when the core has finished with that one.
+ * In DMA mode the core moves the packets from and to the buffer itself,
+ * which must be word aligned.
+ */
+u32 stm32fx07_ep_transfer(usbd_device *usbd_dev, u8 addr, void *buf, u32 len)
+{
+	u8 ep = addr & 0x7F;
+	u32 ctl, mps, pkts;
+
+	if ((ep == 0) || (usbd_dev->driver->dma && ((uintptr_t)buf & 3)))
+		return 0;
+
+	if (addr & 0x80) {
+		ctl = REBASE(OTG_DIEPCTL(ep));
+		mps = ctl & OTG_FS_DIEPCTLX_MPSIZ_MASK;
+		if (((ctl & OTG_FS_DIEPCTL0_EPTYP_MASK) == EPTYP_ISO) ||
+		    (REBASE(OTG_DIEPTSIZ(ep)) & OTG_FS_DIEPSIZX_PKTCNT_MASK))
+			return 0;
+
+		pkts = MIN((len + mps - 1) / mps, OTG_FS_DIEPSIZX_PKTCNT_MASK >>
+			   OTG_FS_DIEPSIZX_PKTCNT_SHIFT);
+		len = MIN(len, pkts * mps);
+
+		if (usbd_dev->driver->dma) {
+			REBASE(OTG_DIEPDMA(ep)) = (uintptr_t)buf;
+		} else {
+			usbd_dev->xfer_in[ep].buf = buf;
+			usbd_dev->xfer_in[ep].left = len;
+		}
+		REBASE(OTG_DIEPTSIZ(ep)) =
+			(pkts << OTG_FS_DIEPSIZX_PKTCNT_SHIFT) | len;
+		REBASE(OTG_DIEPCTL(ep)) |= OTG_FS_DIEPCTL0_EPENA |
+					   OTG_FS_DIEPCTL0_CNAK;
+		if (!usbd_dev->driver->dma)
+			stm32fx07_tx_fill(usbd_dev, ep);
+
+		return len;
+	}
+
+	ctl = REBASE(OTG_DOEPCTL(ep));
+	mps = ctl & OTG_FS_DOEPCTLX_MPSIZ_MASK;
+	pkts = MIN(len / mps, OTG_FS_DIEPSIZX_PKTCNT_MASK >>
+		   OTG_FS_DIEPSIZX_PKTCNT_SHIFT);
+	if (((ctl & OTG_FS_DOEPCTL0_EPTYP_MASK) == EPTYP_ISO) ||
+	    (ctl & OTG_FS_DOEPCTL0_EPENA) || (pkts < 2))
+		return 0;
+
+	usbd_dev->xfer_out[ep].buf = buf;
+	usbd_dev->xfer_out[ep].left = pkts * mps;
+	usbd_dev->xfer_out[ep].count = 0;
+	usbd_dev->xfer_out[ep].active = true;
+	usbd_dev->xfer_out[ep].started = false;
+	usbd_dev->force_nak[ep] = 0;
+
+	if (usbd_dev->out_stopped[ep]) {
+		usbd_dev->out_stopped[ep] = false;
+		stm32fx07_xfer_out_start(usbd_dev, ep);
+	}
+
+	return pkts * mps;
+}
+
+u32 stm32fx07_ep_transfer_count(usbd_device *usbd_dev, u8 addr)
+{
+	return usbd_dev->xfer_out[addr & 0x7F].count;
+}
+
+/*
+ * Drop what the callback did not read of the current packet. In DMA mode
+ * its buffer is given back to the endpoint instead.
+ */
+void stm32fx07_rx_done(usbd_device *usbd_dev)
 {
-	/* Read interrupt status register. */
-	u32 intsts = REBASE(OTG_GINTSTS);
 	int i;
 
-	if (intsts & OTG_FS_GINTSTS_ENUMDNE) {
-		/* Handle USB RESET condition. */
-		REBASE(OTG_GINTSTS) = OTG_FS_GINTSTS_ENUMDNE;
-		usbd_dev->fifo_mem_top = usbd_dev->driver->rx_fifo_size;
-		_usbd_reset(usbd_dev);
+	if (usbd_dev->driver->dma) {
+		if (usbd_dev->dma_rx_pending) {
+			usbd_dev->dma_rx_pending = false;
+			stm32fx07_out_done(usbd_dev, usbd_dev->dma_rx_ep);
+		}
+		usbd_dev->rxbcnt = 0;
+		REBASE(OTG_GINTMSK) |= OTG_FS_GINTMSK_OEPINT;
 		return;
 	}
 
-	/* Note: RX and TX handled differently in this device. */
-	if (intsts & OTG_FS_GINTSTS_RXFLVL) {
-		/* Receive FIFO non-empty. */
-		u32 rxstsp = REBASE(OTG_GRXSTSP);
-		u32 pktsts = rxstsp & OTG_FS_GRXSTSP_PKTSTS_MASK;
-		if ((pktsts != OTG_FS_GRXSTSP_PKTSTS_OUT) &&
-		    (pktsts != OTG_FS_GRXSTSP_PKTSTS_SETUP))
+	for (i = 0; i < usbd_dev->rxbcnt; i += 4)
+		(void)*REBASE_FIFO(0);
+
+	usbd_dev->rxbcnt = 0;
+	REBASE(OTG_GINTMSK) |= OTG_FS_GINTMSK_RXFLVLM;
+}
+
+/* Events handled by this call of stm32fx07_poll() are counted in
+ * poll_stats.last, see usbd_set_poll_budget(). */
+static bool stm32fx07_budget_left(usbd_device *usbd_dev)
+{
+	return !usbd_dev->poll_budget ||
+	       (usbd_dev->poll_stats.last < usbd_dev->poll_budget);
+}
+
+/*
+ * Reports a received packet or a completed OUT transfer. In deferred mode
+ * the receive interrupt stays masked until usbd_process() is done with it,
+ * so they are reported one at a time and in order.
+ */
+static void stm32fx07_rx_event(usbd_device *usbd_dev, u8 ep, u8 type)
+{
+	u32 mask = usbd_dev->driver->dma ? OTG_FS_GINTMSK_OEPINT :
+		   OTG_FS_GINTMSK_RXFLVLM;
+
+	if (usbd_dev->deferred) {
+		REBASE(OTG_GINTMSK) &= ~mask;
+		if (_usbd_event(usbd_dev, USBD_EVENT_TRANSACTION, ep, type) < 0)
+			stm32fx07_rx_done(usbd_dev);
+	} else {
+		_usbd_event(usbd_dev, USBD_EVENT_TRANSACTION, ep, type);
+		stm32fx07_rx_done(usbd_dev);
+	}
+	usbd_dev->poll_stats.last++;
+}
+
+/*
+ * DMA mode: the core reports a packet once it is in memory, the endpoint
+ * is disabled until stm32fx07_rx_done() gives the buffer back. SETUP
+ * packets are reported when the setup stage is done, the last one is just
+ * before where the core would write the next.
+ */
+static void stm32fx07_dma_out(usbd_device *usbd_dev)
+{
+	u32 doepint, rest;
+	u8 ep;
+
+	for (ep = 0; ep < usbd_dev->driver->ep_count; ep++) {
+		/* In deferred mode one packet waits for usbd_process(). */
+		if (!(REBASE(OTG_GINTMSK) & OTG_FS_GINTMSK_OEPINT) ||
+		    !stm32fx07_budget_left(usbd_dev))
 			return;
 
-		u8 ep = rxstsp & OTG_FS_GRXSTSP_EPNUM_MASK;
-		u8 type;
-		if (pktsts == OTG_FS_GRXSTSP_PKTSTS_SETUP)
-			type = USB_TRANSACTION_SETUP;
-		else
-			type = USB_TRANSACTION_OUT;
+		doepint = REBASE(OTG_DOEPINT(ep));
+		rest = REBASE(OTG_DOEPTSIZ(ep)) & OTG_FS_DIEPSIZX_XFRSIZ_MASK;
 
-		/* Save packet size for stm32f107_ep_read_packet(). */
-		usbd_dev->rxbcnt = (rxstsp & OTG_FS_GRXSTSP_BCNT_MASK) >> 4;
+		if (doepint & OTG_FS_DOEPINTX_STUP) {
+			/* The SETUP packet is not a transfer of its own. */
+			REBASE(OTG_DOEPINT(ep)) = OTG_FS_DOEPINTX_STUP |
+						  OTG_FS_DOEPINTX_XFRC;
+			usbd_dev->dma_rx =
+				(u8 *)(uintptr_t)REBASE(OTG_DOEPDMA(ep)) - 8;
+			usbd_dev->rxbcnt = 8;
+			usbd_dev->dma_rx_ep = ep;
+			usbd_dev->dma_rx_pending = true;
+			stm32fx07_rx_event(usbd_dev, ep, USB_TRANSACTION_SETUP);
+			continue;
+		}
 
-		/*
-		 * FIXME: Why is a delay needed here?
-		 * This appears to fix a problem where the first 4 bytes
-		 * of the DATA OUT stage of a control transaction are lost.
-		 */
-		for (i = 0; i < 1000; i++)
-			__asm__("nop");
+		if (!(doepint & OTG_FS_DOEPINTX_XFRC))
+			continue;
+		REBASE(OTG_DOEPINT(ep)) = OTG_FS_DOEPINTX_XFRC;
 
-		if (usbd_dev->user_callback_ctr[ep][type])
-			usbd_dev->user_callback_ctr[ep][type] (usbd_dev, ep);
+		if (usbd_dev->xfer_out[ep].active) {
+			/* The whole transfer is done, leave the endpoint
+			 * disabled until the next one. */
+			usbd_dev->xfer_out[ep].count =
+				usbd_dev->xfer_out[ep].left - rest;
+			usbd_dev->xfer_out[ep].active = false;
+			usbd_dev->out_stopped[ep] = true;
+			usbd_dev->rxbcnt = 0;
+		} else {
+			usbd_dev->dma_rx = usbd_dev->dma_out[ep];
+			usbd_dev->rxbcnt = (usbd_dev->doeptsiz[ep] &
+					    OTG_FS_DIEPSIZX_XFRSIZ_MASK) - rest;
+			usbd_dev->dma_rx_ep = ep;
+			usbd_dev->dma_rx_pending = true;
+		}
+		stm32fx07_rx_event(usbd_dev, ep, USB_TRANSACTION_OUT);
+	}
+}
+
+/* Pops the next entry of the receive FIFO. */
+static void stm32fx07_rx(usbd_device *usbd_dev)
+{
+	u32 rxstsp = REBASE(OTG_GRXSTSP);
+	u32 pktsts = rxstsp & OTG_FS_GRXSTSP_PKTSTS_MASK;
+	u8 ep = rxstsp & OTG_FS_GRXSTSP_EPNUM_MASK;
 
-		/* Discard unread packet data. */
-		for (i = 0; i < usbd_dev->rxbcnt; i += 4)
-			(void)*REBASE_FIFO(ep);
+	/*
+	 * Each OUT/SETUP data packet is followed by a 'completed'
+	 * status entry. Only then the core has finished with the
+	 * endpoint and it can be enabled for the next packet.
+	 * Enabling it earlier, from ep_read_packet(), could lose the
+	 * start of the DATA OUT stage following a SETUP.
+	 */
+	if ((pktsts == OTG_FS_GRXSTSP_PKTSTS_OUT_COMP) &&
+	    usbd_dev->xfer_out[ep].active &&
+	    usbd_dev->xfer_out[ep].started) {
 
-		usbd_dev->rxbcnt = 0;
+		/* The whole transfer is done, leave the endpoint
+		 * disabled until the next one. */
+		usbd_dev->xfer_out[ep].active = false;
+		usbd_dev->out_stopped[ep] = true;
+		stm32fx07_rx_event(usbd_dev, ep, USB_TRANSACTION_OUT);
+		return;
+	}
+
+	if ((pktsts == OTG_FS_GRXSTSP_PKTSTS_OUT_COMP) ||
+	    (pktsts == OTG_FS_GRXSTSP_PKTSTS_SETUP_COMP)) {
+		stm32fx07_out_done(usbd_dev, ep);
+		return;
+	}
+
+	if ((pktsts != OTG_FS_GRXSTSP_PKTSTS_OUT) &&
+	    (pktsts != OTG_FS_GRXSTSP_PKTSTS_SETUP))
+		return;
+
+	u8 type;
+	if (pktsts == OTG_FS_GRXSTSP_PKTSTS_SETUP)
+		type = USB_TRANSACTION_SETUP;
+	else
+		type = USB_TRANSACTION_OUT;
+
+	/* Save packet size for stm32f107_ep_read_packet(). */
+	usbd_dev->rxbcnt = (rxstsp & OTG_FS_GRXSTSP_BCNT_MASK) >> 4;
+
+	/* Packets of a multi-packet transfer go straight to its
+	 * buffer, it is reported when complete. */
+	if ((type == USB_TRANSACTION_OUT) &&
+	    usbd_dev->xfer_out[ep].active) {
+		u16 len = stm32fx07_ep_read_packet(usbd_dev, ep,
+			usbd_dev->xfer_out[ep].buf +
+			usbd_dev->xfer_out[ep].count,
+			MIN(usbd_dev->xfer_out[ep].left, 0xffff));
+
+		usbd_dev->xfer_out[ep].count += len;
+		usbd_dev->xfer_out[ep].left -= len;
+		stm32fx07_rx_done(usbd_dev);
+		return;
+	}
+
+	stm32fx07_rx_event(usbd_dev, ep, type);
+}
+
+void stm32fx07_poll(usbd_device *usbd_dev)
+{
+	/* Read interrupt status register. */
+	u32 intsts = REBASE(OTG_GINTSTS);
+	int i;
+
+	if (intsts & OTG_FS_GINTSTS_ENUMDNE) {
+		/* Handle USB RESET condition. */
+		REBASE(OTG_GINTSTS) = OTG_FS_GINTSTS_ENUMDNE;
+		usbd_dev->high_speed = (REBASE(OTG_DSTS) &
+					OTG_FS_DSTS_ENUMSPD_MASK) ==
+				       OTG_FS_DSTS_ENUMSPD_HS;
+		/* The FIFOs are sized for the descriptors. */
+		usbd_dev->fifo_mem_top = stm32fx07_fifo_rx_words(usbd_dev);
+		REBASE(OTG_GRXFSIZ) = usbd_dev->fifo_mem_top;
+		memset(usbd_dev->fifo_tx_size, 0,
+		       sizeof(usbd_dev->fifo_tx_size));
+		memset(usbd_dev->dma_in_size, 0,
+		       sizeof(usbd_dev->dma_in_size));
+		memset(usbd_dev->dma_out_size, 0,
+		       sizeof(usbd_dev->dma_out_size));
+		usbd_dev->dma_mem_top = 0;
+		stm32fx07_xfer_reset(usbd_dev);
+		_usbd_event(usbd_dev, USBD_EVENT_RESET, 0, 0);
+		usbd_dev->poll_stats.last++;
+		return;
 	}
 
 	/*
 	 * There is no global interrupt flag for transmit complete.
 	 * The XFRC bit must be checked in each OTG_FS_DIEPINT(x).
+	 * Those left over the budget are handled by the next call.
+	 * They are handled before the OUT and SETUP packets received
+	 * since: the status stage of a control transfer has finished
+	 * before the next SETUP arrives, the last DATA IN before its
+	 * status OUT.
 	 */
-	for (i = 0; i < 4; i++) { /* Iterate over endpoints. */
-		if (REBASE(OTG_DIEPINT(i)) & OTG_FS_DIEPINTX_XFRC) {
-			/* Transfer complete. */
-			if (usbd_dev->user_callback_ctr[i][USB_TRANSACTION_IN])
-				usbd_dev->user_callback_ctr[i]
-					[USB_TRANSACTION_IN](usbd_dev, i);
+	for (i = 0; (i < usbd_dev->driver->ep_count) &&
+		    stm32fx07_budget_left(usbd_dev); i++) {
+		if ((REBASE(OTG_DIEPEMPMSK) & (1 << i)) &&
+		    (REBASE(OTG_DIEPINT(i)) & OTG_FS_DIEPINTX_TXFE))
+			stm32fx07_tx_fill(usbd_dev, i);
 
+		if (REBASE(OTG_DIEPINT(i)) & OTG_FS_DIEPINTX_XFRC) {
+			/* Transfer complete. Cleared first, the callback
+			 * may start the next transfer. */
 			REBASE(OTG_DIEPINT(i)) = OTG_FS_DIEPINTX_XFRC;
+			_usbd_event(usbd_dev, USBD_EVENT_TRANSACTION, i,
+				    USB_TRANSACTION_IN);
+			usbd_dev->poll_stats.last++;
 		}
 	}
 
+	if ((intsts & OTG_FS_GINTSTS_OEPINT) &&
+	    (REBASE(OTG_GINTMSK) & OTG_FS_GINTMSK_OEPINT))
+		stm32fx07_dma_out(usbd_dev);
+
+	/*
+	 * Note: RX and TX handled differently in this device.
+	 * The receive FIFO is emptied up to the poll budget. In deferred
+	 * mode RXFLVL stays masked while the packet waits for
+	 * usbd_process(), the status entries behind it are left alone.
+	 */
+	while ((REBASE(OTG_GINTSTS) & OTG_FS_GINTSTS_RXFLVL) &&
+	       (REBASE(OTG_GINTMSK) & OTG_FS_GINTMSK_RXFLVLM) &&
+	       stm32fx07_budget_left(usbd_dev))
+		stm32fx07_rx(usbd_dev);
+
 	if (intsts & OTG_FS_GINTSTS_USBSUSP) {
-		if (usbd_dev->user_callback_suspend)
-			usbd_dev->user_callback_suspend();
+		_usbd_event(usbd_dev, USBD_EVENT_SUSPEND, 0, 0);
 		REBASE(OTG_GINTSTS) = OTG_FS_GINTSTS_USBSUSP;
+		usbd_dev->poll_stats.last++;
 	}
 
 	if (intsts & OTG_FS_GINTSTS_WKUPINT) {
-		if (usbd_dev->user_callback_resume)
-			usbd_dev->user_callback_resume();
+		_usbd_event(usbd_dev, USBD_EVENT_RESUME, 0, 0);
 		REBASE(OTG_GINTSTS) = OTG_FS_GINTSTS_WKUPINT;
+		usbd_dev->poll_stats.last++;
 	}
 
 	if (intsts & OTG_FS_GINTSTS_SOF) {
-		if (usbd_dev->user_callback_sof)
-			usbd_dev->user_callback_sof();
+		stm32fx07_iso_sof(usbd_dev);
+		_usbd_event(usbd_dev, USBD_EVENT_SOF, 0, 0);
 		REBASE(OTG_GINTSTS) = OTG_FS_GINTSTS_SOF;
+		usbd_dev->poll_stats.last++;
 	}
 }
 
@@ -31,8 +31,18 @@ u16 stm32fx07_ep_write_packet(usbd_device *usbd_dev, u8 addr, const void *buf,
 			      u16 len);
 u16 stm32fx07_ep_read_packet(usbd_device *usbd_dev, u8 addr, void *buf,
 			     u16 len);
+bool stm32fx07_ep_write_begin(usbd_device *usbd_dev,
+			      struct usbd_ep_buffer *buf);
+bool stm32fx07_ep_read_begin(usbd_device *usbd_dev,
+			     struct usbd_ep_buffer *buf);
+void stm32fx07_ep_read_end(usbd_device *usbd_dev, struct usbd_ep_buffer *buf);
+u32 stm32fx07_ep_transfer(usbd_device *usbd_dev, u8 addr, void *buf, u32 len);
+u32 stm32fx07_ep_transfer_count(usbd_device *usbd_dev, u8 addr);
 void stm32fx07_poll(usbd_device *usbd_dev);
+void stm32fx07_rx_done(usbd_device *usbd_dev);
 void stm32fx07_disconnect(usbd_device *usbd_dev, bool disconnected);
+bool stm32fx07_config_plan(usbd_device *usbd_dev, u16 wValue);
+u16 stm32fx07_mem_free(usbd_device *usbd_dev);
 
 
 #endif /* __USB_FX07_COMMON_H_ */
@@ -24,6 +24,9 @@
 #include <libopencm3/usb/mass.h>
 #include "usb_private.h"
 
+/* The write cache is flushed after the host has been idle this many ms. */
+#define MASS_CACHE_TIMEOUT		500
+
 /* Definitions of Mass Storage Class from:
  *
  * (A) "Universal Serial Bus Mass Storage Class Bulk-Only Transport
@@ -31,6 +34,9 @@
  *
  * (B) "Universal Serial Bus Mass Storage Class Specification Overview
  *      Revision 1.0"
+ *
+ * (C) "Universal Serial Bus Mass Storage Class - USB Attached SCSI
+ *      Protocol (UASP) Revision 1.0"
  */
 
 /* (A) Table 3.1/3.2 Class-Specific Request Codes */
@@ -38,10 +44,33 @@
 #define USB_MASS_REQ_GET_MAX_LUN	0xFE
 
 #define CBW_SIGNATURE			0x43425355
+#define CSW_SIGNATURE			0x53425355
 #define CBW_STATUS_SUCCESS		0
 #define CBW_STATUS_FAILED		1
 #define CBW_STATUS_PHASE_ERROR		2
 
+/* (C) Table 5: Information Unit IDs */
+#define UAS_IU_COMMAND			0x01
+#define UAS_IU_SENSE			0x03
+#define UAS_IU_RESPONSE			0x04
+#define UAS_IU_TASK_MANAGEMENT		0x05
+#define UAS_IU_READ_READY		0x06
+#define UAS_IU_WRITE_READY		0x07
+
+/* (C) Table 17: Response Codes */
+#define UAS_RESPONSE_INVALID_IU		0x02
+#define UAS_RESPONSE_TMF_NOT_SUPPORTED	0x04
+#define UAS_RESPONSE_OVERLAPPED_TAG	0x0A
+
+#define UAS_STATUS_CHECK_CONDITION	0x02
+
+/* Commands queued from the host, including the one running. */
+#define UAS_QUEUE_DEPTH			4
+/* Status IUs waiting to be sent. */
+#define UAS_STATUS_RING			8
+/* SENSE IU with fixed format sense data. */
+#define UAS_SENSE_IU_SIZE		(16 + 18)
+
 /* Implemented SCSI Commands */
 #define SCSI_TEST_UNIT_READY			0x00
 #define SCSI_REQUEST_SENSE			0x03
@@ -51,8 +80,15 @@
 #define SCSI_INQUIRY				0x12
 #define SCSI_MODE_SENSE_6			0x1A
 #define SCSI_SEND_DIAGNOSTIC			0x1D
+#define SCSI_SYNCHRONIZE_CACHE			0x35
 #define SCSI_READ_CAPACITY			0x25
 #define SCSI_READ_10				0x28
+#define SCSI_READ_16				0x88
+#define SCSI_WRITE_16				0x8A
+#define SCSI_SERVICE_ACTION_IN_16		0x9E
+
+/* SERVICE ACTION IN(16) service actions */
+#define SCSI_SAI_READ_CAPACITY_16		0x10
 
 
 /* Required SCSI Commands */
@@ -67,8 +103,11 @@
 #define SCSI_READ_FORMAT_CAPACITIES		0x23
 #define SCSI_READ_TOC_PMA_ATIP			0x43
 #define SCSI_START_STOP_UNIT			0x1B
-#define SCSI_SYNCHRONIZE_CACHE			0x35
 #define SCSI_VERIFY				0x2F
+/* Mode page of the write cache, SBC-3 6.4.5. */
+#define SCSI_MODE_PAGE_CACHING			0x08
+#define SCSI_MODE_PAGE_ALL			0x3F
+#define SCSI_CACHING_WCE			0x04
 #define SCSI_WRITE_10				0x2A
 #define SCSI_WRITE_12				0xAA
 
@@ -140,44 +179,111 @@ struct sbc_sense_info {
 };
 
 struct usb_mass_trans {
-	u8 cbw_cnt;	/* Read until 31 bytes */
-	union {
-		struct usb_mass_cbw cbw;
-		u8 buf[1];
-	} cbw;
+	struct usb_mass_cbw cbw;
 
 	u32 bytes_to_read;
 	u32 bytes_to_write;
-	u32 byte_count;		/* Either read until equal to bytes_to_read or
-				   write until equal to bytes_to_write. */
+	u32 byte_count;		/* Data bytes transferred for the command. */
+	u32 discarded;		/* Data bytes received but not used. */
 	u32 lba_start;
 	u32 block_count;
-	u32 current_block;
-
-	u8 msd_buf[512];
+	u32 current_block;	/* Next block to read from or write to media. */
+	u32 usb_block;		/* Next block to receive from the host. */
+
+	bool format;		/* FORMAT UNIT, write zeroed blocks. */
+	bool sync;		/* SYNCHRONIZE CACHE, flush the write cache. */
+
+	bool idle;		/* Waiting for a CBW. */
+	bool cbw_pending;	/* CBW received during an idle flush. */
+	u32 cbw_len;
+
+	/*
+	 * Block data goes through two halves of a buffer, so the media can
+	 * be accessed for one half while the other is on the bus.
+	 */
+	void (*pump)(usbd_mass_storage *ms);
+	u32 half_blocks[2];	/* Blocks held by each half, 0 if empty. */
+	bool usb_busy;
+	u8 usb_half;		/* Next half to go over USB. */
+	bool media_busy;
+	bool media_write;
+	bool media_flush;	/* Flush the write cache, no blocks. */
+	u8 media_half;		/* Next half to go to or from the media. */
+	u32 media_count;	/* Blocks of the current media access. */
+	u32 media_done;		/* Blocks of it already finished. */
+	u32 media_step;		/* Blocks of the callback in progress. */
+	bool media_in_call;
+	bool media_early;	/* Completed before the callback returned. */
+	int media_status;
+
+	u8 msd_buf[1024];
+
+	struct usb_mass_csw csw;
+};
 
-	bool csw_valid;
-	u8 csw_sent;		/* Write until 13 bytes */
-	union {
-		struct usb_mass_csw csw;
-		u8 buf[1];
-	} csw;
+struct usb_mass_uas {
+	u8 iface;
+	u8 ep_cmd;
+	u8 ep_status;
+	u8 ep_in;
+	u8 ep_out;
+	u16 ep_size;
+
+	/* Command IUs, the one at the head is running. */
+	u8 cmd[UAS_QUEUE_DEPTH][32];
+	u8 cmd_head;
+	u8 cmd_count;
+	bool cmd_armed;
+	bool active;
+
+	/* Status IUs, sent in order through the endpoint queue. */
+	struct usbd_queue_entry status_q[UAS_STATUS_RING];
+	u8 status[UAS_STATUS_RING][UAS_SENSE_IU_SIZE];
+	u8 status_head;
+	u8 status_count;
 };
 
 struct _usbd_mass_storage {
 	usbd_device *usbd_dev;
-	u8 ep_in;
-	u8 ep_in_size;
+	u8 ep_in;		/* Data endpoints of the alternate setting. */
+	u16 ep_in_size;
 	u8 ep_out;
-	u8 ep_out_size;
+	u16 ep_out_size;
+	u8 bot_ep_in;
+	u8 bot_ep_out;
+
+	bool has_uas;
+	u8 altsetting;		/* 0: Bulk-Only, 1: UAS */
+	struct usb_mass_uas uas;
 
 	const char *vendor_id;
 	const char *product_id;
 	const char *product_revision_level;
 	u32 block_count;
+	u8 block_shift;		/* log2 of the block size. */
 
 	int (*read_block)(u32 lba, u8 *copy_to);
 	int (*write_block)(u32 lba, const u8 *copy_from);
+	int (*read_blocks)(u32 lba, u32 count, u8 *copy_to);
+	int (*write_blocks)(u32 lba, u32 count, const u8 *copy_from);
+
+	u8 *buf;		/* Block buffer, split into two halves. */
+	u32 buf_size;
+	u32 buf_blocks;		/* Blocks per half. */
+
+	/*
+	 * Write-back cache of one erase unit. Writes are gathered in it and
+	 * the unit is written to the media in one go, with the blocks the
+	 * host did not write read back from the media first.
+	 */
+	u8 *cache;
+	u32 cache_blocks;	/* Blocks per erase unit. */
+	u32 cache_lba;		/* First block of the cached unit. */
+	bool cache_dirty;	/* The cache holds a unit. */
+	u32 cache_valid[8];	/* Blocks of the unit in the cache. */
+	u32 cache_written;	/* Blocks of the unit flushed so far. */
+	u16 cache_timeout;	/* Idle ms before a flush, 0 for never. */
+	u32 cache_idle;		/* SOFs since the last command. */
 
 	void (*lock)(void);
 	void (*unlock)(void);
@@ -247,7 +353,34 @@ static void set_sbc_status_good(usbd_mass_storage *ms)
 
 static u8 *get_cbw_buf(struct usb_mass_trans *trans)
 {
-	return &trans->cbw.cbw.CBWCB[0];
+	return &trans->cbw.CBWCB[0];
+}
+
+/* Fails the command if the blocks are not on the media. */
+static bool scsi_check_range(usbd_mass_storage *ms,
+			     struct usb_mass_trans *trans)
+{
+	/* ms->block_count is the last valid LBA. */
+	if ((trans->lba_start > ms->block_count) ||
+	    (trans->block_count > ms->block_count - trans->lba_start + 1)) {
+		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			       SBC_ASC_LBA_OUT_OF_RANGE, SBC_ASCQ_NA);
+		trans->csw.bCSWStatus = CBW_STATUS_FAILED;
+		trans->block_count = 0;
+		return false;
+	}
+
+	/* The data length of a transfer is limited to 32 bits. */
+	if (trans->block_count > (0xffffffff >> ms->block_shift)) {
+		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			       SBC_ASC_INVALID_FIELD_IN_CDB, SBC_ASCQ_NA);
+		trans->csw.bCSWStatus = CBW_STATUS_FAILED;
+		trans->block_count = 0;
+		return false;
+	}
+
+	set_sbc_status_good(ms);
+	return true;
 }
 
 static void scsi_read_6(usbd_mass_storage *ms,
@@ -259,16 +392,13 @@ static void scsi_read_6(usbd_mass_storage *ms,
 
 		buf = get_cbw_buf(trans);
 
-		trans->lba_start = (buf[2] << 8) | buf[3];
-		trans->block_count = buf[4];
-		trans->current_block = 0;
-
-		/* TODO: Check the lba & block_count for range. */
-
-		/* both are in terms of 512 byte blocks, so shift by 9 */
-		trans->bytes_to_write = trans->block_count << 9;
+		trans->lba_start = ((0x1f & buf[1]) << 16) | (buf[2] << 8) | buf[3];
+		/* A transfer length of 0 means 256 blocks. */
+		trans->block_count = buf[4] ? buf[4] : 256;
 
-		set_sbc_status_good(ms);
+		if (scsi_check_range(ms, trans))
+			trans->bytes_to_write = trans->block_count <<
+						ms->block_shift;
 	}
 }
 
@@ -276,18 +406,17 @@ static void scsi_write_6(usbd_mass_storage *ms,
 			 struct usb_mass_trans *trans,
 			 enum trans_event event)
 {
-	(void) ms;
-
 	if (EVENT_CBW_VALID == event) {
 		u8 *buf;
 
 		buf = get_cbw_buf(trans);
 
 		trans->lba_start = ((0x1f & buf[1]) << 16) | (buf[2] << 8) | buf[3];
-		trans->block_count = buf[4];
-		trans->current_block = 0;
+		trans->block_count = buf[4] ? buf[4] : 256;
 
-		trans->bytes_to_read = trans->block_count << 9;
+		if (scsi_check_range(ms, trans))
+			trans->bytes_to_read = trans->block_count <<
+					       ms->block_shift;
 	}
 }
 
@@ -295,8 +424,6 @@ static void scsi_write_10(usbd_mass_storage *ms,
 			  struct usb_mass_trans *trans,
 			  enum trans_event event)
 {
-	(void) ms;
-
 	if (EVENT_CBW_VALID == event) {
 		u8 *buf;
 
@@ -305,9 +432,10 @@ static void scsi_write_10(usbd_mass_storage *ms,
 		trans->lba_start = (buf[2] << 24) | (buf[3] << 16) |
 					(buf[4] << 8) | buf[5];
 		trans->block_count = (buf[7] << 8) | buf[8];
-		trans->current_block = 0;
 
-		trans->bytes_to_read = trans->block_count << 9;
+		if (scsi_check_range(ms, trans))
+			trans->bytes_to_read = trans->block_count <<
+					       ms->block_shift;
 	}
 }
 
@@ -323,12 +451,53 @@ static void scsi_read_10(usbd_mass_storage *ms,
 		trans->lba_start = (buf[2] << 24) | (buf[3] << 16) | (buf[4] << 8) | buf[5];
 		trans->block_count = (buf[7] << 8) | buf[8];
 
-		/* TODO: Check the lba & block_count for range. */
+		if (scsi_check_range(ms, trans))
+			trans->bytes_to_write = trans->block_count <<
+						ms->block_shift;
+	}
+}
 
-		/* both are in terms of 512 byte blocks, so shift by 9 */
-		trans->bytes_to_write = trans->block_count << 9;
+/* Decodes the LBA and transfer length of READ(16) and WRITE(16). */
+static void scsi_rw_16(struct usb_mass_trans *trans)
+{
+	u8 *buf = get_cbw_buf(trans);
+
+	/*
+	 * The block callbacks take 32 bit LBAs. Anything above is past the
+	 * end of the media, so let the range check fail it.
+	 */
+	if (buf[2] | buf[3] | buf[4] | buf[5])
+		trans->lba_start = 0xffffffff;
+	else
+		trans->lba_start = (buf[6] << 24) | (buf[7] << 16) |
+				   (buf[8] << 8) | buf[9];
+	trans->block_count = (buf[10] << 24) | (buf[11] << 16) |
+			     (buf[12] << 8) | buf[13];
+}
 
-		set_sbc_status_good(ms);
+static void scsi_read_16(usbd_mass_storage *ms,
+			 struct usb_mass_trans *trans,
+			 enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		scsi_rw_16(trans);
+
+		if (scsi_check_range(ms, trans))
+			trans->bytes_to_write = trans->block_count <<
+						ms->block_shift;
+	}
+}
+
+static void scsi_write_16(usbd_mass_storage *ms,
+			  struct usb_mass_trans *trans,
+			  enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		scsi_rw_16(trans);
+
+		if (scsi_check_range(ms, trans))
+			trans->bytes_to_read = trans->block_count <<
+					       ms->block_shift;
 	}
 }
 
@@ -342,33 +511,97 @@ static void scsi_read_capacity(usbd_mass_storage *ms,
 		trans->msd_buf[2] = 0xff & (ms->block_count >> 8);
 		trans->msd_buf[3] = 0xff & ms->block_count;
 
-		/* Block size: 512 */
+		/* Block size */
 		trans->msd_buf[4] = 0;
 		trans->msd_buf[5] = 0;
-		trans->msd_buf[6] = 2;
+		trans->msd_buf[6] = 0xff & ((1 << ms->block_shift) >> 8);
 		trans->msd_buf[7] = 0;
 		trans->bytes_to_write = 8;
 		set_sbc_status_good(ms);
 	}
 }
 
+static void scsi_service_action_in_16(usbd_mass_storage *ms,
+				      struct usb_mass_trans *trans,
+				      enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		u8 *buf = get_cbw_buf(trans);
+		u32 alloc_len = (buf[10] << 24) | (buf[11] << 16) |
+				(buf[12] << 8) | buf[13];
+
+		if ((buf[1] & 0x1f) != SCSI_SAI_READ_CAPACITY_16) {
+			set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+				       SBC_ASC_INVALID_FIELD_IN_CDB,
+				       SBC_ASCQ_NA);
+			trans->csw.bCSWStatus = CBW_STATUS_FAILED;
+			return;
+		}
+
+		memset(trans->msd_buf, 0, 32);
+		trans->msd_buf[4] = ms->block_count >> 24;
+		trans->msd_buf[5] = 0xff & (ms->block_count >> 16);
+		trans->msd_buf[6] = 0xff & (ms->block_count >> 8);
+		trans->msd_buf[7] = 0xff & ms->block_count;
+		trans->msd_buf[10] = 0xff & ((1 << ms->block_shift) >> 8);
+
+		trans->bytes_to_write = MIN(alloc_len, 32);
+		set_sbc_status_good(ms);
+	}
+}
+
 static void scsi_format_unit(usbd_mass_storage *ms,
 			     struct usb_mass_trans *trans,
 			     enum trans_event event)
 {
 	if (EVENT_CBW_VALID == event) {
-		u32 i;
+		/* The blocks are written by the transport layer. */
+		trans->format = true;
+		trans->lba_start = 0;
+		trans->block_count = ms->block_count + 1;
 
-		memset(trans->msd_buf, 0, 512);
+		set_sbc_status_good(ms);
+	}
+}
 
-		for (i = 0; i < ms->block_count; i++) {
-			(*ms->write_block)(i, trans->msd_buf);
-		}
+static void scsi_synchronize_cache(usbd_mass_storage *ms,
+				   struct usb_mass_trans *trans,
+				   enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		/* The cache is flushed by the transport layer. */
+		trans->sync = true;
 
 		set_sbc_status_good(ms);
 	}
 }
 
+/*
+ * START STOP UNIT and PREVENT ALLOW MEDIUM REMOVAL come before the media is
+ * ejected or may be removed; the cache is flushed like on SYNCHRONIZE
+ * CACHE. There is no medium to load or lock.
+ */
+static void scsi_start_stop_unit(usbd_mass_storage *ms,
+				 struct usb_mass_trans *trans,
+				 enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		trans->sync = true;
+
+		set_sbc_status_good(ms);
+	}
+}
+
+/* Fixed format sense data, 18 bytes. */
+static void scsi_sense_data(usbd_mass_storage *ms, u8 *buf)
+{
+	memcpy(buf, _spc3_request_sense, sizeof(_spc3_request_sense));
+
+	buf[2] = ms->sense.key;
+	buf[12] = ms->sense.asc;
+	buf[13] = ms->sense.ascq;
+}
+
 static void scsi_request_sense(usbd_mass_storage *ms,
 			       struct usb_mass_trans *trans,
 			       enum trans_event event)
@@ -376,53 +609,75 @@ static void scsi_request_sense(usbd_mass_storage *ms,
 	if (EVENT_CBW_VALID == event) {
 		u8 *buf;
 
-		buf = &trans->cbw.cbw.CBWCB[0];
-
-		trans->bytes_to_write = buf[4];	/* allocation length */
-		memcpy(trans->msd_buf, _spc3_request_sense, sizeof(_spc3_request_sense));
+		buf = get_cbw_buf(trans);
 
-		trans->msd_buf[2] = ms->sense.key;
-		trans->msd_buf[12] = ms->sense.asc;
-		trans->msd_buf[13] = ms->sense.ascq;
+		/* allocation length */
+		trans->bytes_to_write = MIN(buf[4], sizeof(_spc3_request_sense));
+		scsi_sense_data(ms, trans->msd_buf);
 	}
 }
 
+/*
+ * Mode pages asked for by a MODE SENSE CDB, returns their length. With the
+ * write cache the caching page reports WCE, so the host sends SYNCHRONIZE
+ * CACHE; nothing can be changed. Other pages are not reported.
+ */
+static u8 scsi_mode_pages(usbd_mass_storage *ms, const u8 *cdb, u8 *page)
+{
+	u8 pc = cdb[2] >> 6;	/* Page control. */
+	u8 code = cdb[2] & 0x3f;
+
+	if (!ms->cache || ((code != SCSI_MODE_PAGE_CACHING) &&
+			   (code != SCSI_MODE_PAGE_ALL)))
+		return 0;
+
+	memset(page, 0, 20);
+	page[0] = SCSI_MODE_PAGE_CACHING;
+	page[1] = 18;
+	/* Changeable values are all zero. */
+	if (pc != 1)
+		page[2] = SCSI_CACHING_WCE;
+
+	return 20;
+}
+
 static void scsi_mode_sense_6(usbd_mass_storage *ms,
 			      struct usb_mass_trans *trans,
 			      enum trans_event event)
 {
-	(void) ms;
+	if (EVENT_CBW_VALID == event) {
+		u8 *cdb = get_cbw_buf(trans);
+		u8 len;
+
+		len = 4 + scsi_mode_pages(ms, cdb, &trans->msd_buf[4]);
 
+		trans->msd_buf[0] = len - 1;	/* Num bytes that follow */
+		trans->msd_buf[1] = 0;	/* Medium Type */
+		trans->msd_buf[2] = 0;	/* Device specific param */
+		trans->msd_buf[3] = 0;	/* Block descriptor length */
+
+		/* allocation length */
+		trans->bytes_to_write = MIN(cdb[4], len);
+		set_sbc_status_good(ms);
+	}
+}
+
+static void scsi_mode_sense_10(usbd_mass_storage *ms,
+			       struct usb_mass_trans *trans,
+			       enum trans_event event)
+{
 	if (EVENT_CBW_VALID == event) {
-#if 0
-		u8 *buf;
-		u8 page_code;
-		u8 allocation_length;
-
-		buf = &trans->cbw.cbw.CBWCB[0];
-		page_code = buf[2];
-		allocation_length = buf[4];
-
-		if (0x1C == page_code) {	/* Informational Exceptions */
-#endif
-			trans->bytes_to_write = 4;
-
-			trans->msd_buf[0] = 3;	/* Num bytes that follow */
-			trans->msd_buf[1] = 0;	/* Medium Type */
-			trans->msd_buf[2] = 0;	/* Device specific param */
-			trans->csw.csw.dCSWDataResidue = 4;
-#if 0
-		} else if (0x01 == page_code) {	/* Error recovery */
-		} else if (0x3F == page_code) {	/* All */
-		} else {
-			/* Error */
-			trans->csw.csw.bCSWStatus = CBW_STATUS_FAILED;
-			set_sbc_status(ms,
-				       SBC_SENSE_KEY_ILLEGAL_REQUEST,
-				       SBC_ASC_INVALID_FIELD_IN_CDB,
-				       SBC_ASCQ_NA);
-		}
-#endif
+		u8 *cdb = get_cbw_buf(trans);
+		u16 len;
+
+		len = 8 + scsi_mode_pages(ms, cdb, &trans->msd_buf[8]);
+
+		memset(trans->msd_buf, 0, 8);
+		trans->msd_buf[1] = len - 2;	/* Num bytes that follow */
+
+		/* allocation length */
+		trans->bytes_to_write = MIN((cdb[7] << 8) | cdb[8], len);
+		set_sbc_status_good(ms);
 	}
 }
 
@@ -439,7 +694,12 @@ static void scsi_inquiry(usbd_mass_storage *ms,
 
 		if (0 == evpd) {
 			size_t len;
-			trans->bytes_to_write = sizeof(_spc3_inquiry_response);
+			/* Allocation length; in UAS there is no transfer
+			 * length to clamp to. */
+			u16 alloc_len = (buf[3] << 8) | buf[4];
+
+			trans->bytes_to_write = MIN(alloc_len,
+					sizeof(_spc3_inquiry_response));
 			memcpy(trans->msd_buf, _spc3_inquiry_response, sizeof(_spc3_inquiry_response));
 
 			len = strlen(ms->vendor_id);
@@ -454,8 +714,6 @@ static void scsi_inquiry(usbd_mass_storage *ms,
 			len = MIN(len, 4);
 			memcpy(&trans->msd_buf[32], ms->product_revision_level, len);
 
-			trans->csw.csw.dCSWDataResidue = sizeof(_spc3_inquiry_response);
-
 			set_sbc_status_good(ms);
 		} else {
 			/* TODO: Add VPD 0x83 support */
@@ -471,18 +729,21 @@ static void scsi_command(usbd_mass_storage *ms,
 {
 	if (EVENT_CBW_VALID == event) {
 		/* Setup the default success */
-		trans->csw_sent = 0;
-		trans->csw.csw.dCSWSignature = CBW_SIGNATURE;
-		trans->csw.csw.dCSWTag = trans->cbw.cbw.dCBWTag;
-		trans->csw.csw.dCSWDataResidue = 0;
-		trans->csw.csw.bCSWStatus = CBW_STATUS_SUCCESS;
+		trans->csw.dCSWSignature = CSW_SIGNATURE;
+		trans->csw.dCSWTag = trans->cbw.dCBWTag;
+		trans->csw.dCSWDataResidue = 0;
+		trans->csw.bCSWStatus = CBW_STATUS_SUCCESS;
 
 		trans->bytes_to_write = 0;
 		trans->bytes_to_read = 0;
 		trans->byte_count = 0;
+		trans->discarded = 0;
+		trans->block_count = 0;
+		trans->format = false;
+		trans->sync = false;
 	}
 
-	switch (trans->cbw.cbw.CBWCB[0]) {
+	switch (trans->cbw.CBWCB[0]) {
 	case SCSI_TEST_UNIT_READY:
 	case SCSI_SEND_DIAGNOSTIC:
 		/* Do nothing, just send the success. */
@@ -491,12 +752,22 @@ static void scsi_command(usbd_mass_storage *ms,
 	case SCSI_FORMAT_UNIT:
 		scsi_format_unit(ms, trans, event);
 		break;
+	case SCSI_SYNCHRONIZE_CACHE:
+		scsi_synchronize_cache(ms, trans, event);
+		break;
 	case SCSI_REQUEST_SENSE:
 		scsi_request_sense(ms, trans, event);
 		break;
 	case SCSI_MODE_SENSE_6:
 		scsi_mode_sense_6(ms, trans, event);
 		break;
+	case SCSI_MODE_SENSE_10:
+		scsi_mode_sense_10(ms, trans, event);
+		break;
+	case SCSI_START_STOP_UNIT:
+	case SCSI_PREVENT_ALLOW_MEDIUM_REMOVAL:
+		scsi_start_stop_unit(ms, trans, event);
+		break;
 	case SCSI_READ_6:
 		scsi_read_6(ms, trans, event);
 		break;
@@ -515,6 +786,15 @@ static void scsi_command(usbd_mass_storage *ms,
 	case SCSI_WRITE_10:
 		scsi_write_10(ms, trans, event);
 		break;
+	case SCSI_READ_16:
+		scsi_read_16(ms, trans, event);
+		break;
+	case SCSI_WRITE_16:
+		scsi_write_16(ms, trans, event);
+		break;
+	case SCSI_SERVICE_ACTION_IN_16:
+		scsi_service_action_in_16(ms, trans, event);
+		break;
 	default:
 		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
 					SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
@@ -522,189 +802,862 @@ static void scsi_command(usbd_mass_storage *ms,
 
 		trans->bytes_to_write = 0;
 		trans->bytes_to_read = 0;
-		trans->csw.csw.bCSWStatus = CBW_STATUS_FAILED;
+		trans->csw.bCSWStatus = CBW_STATUS_FAILED;
 		break;
 	}
 }
 
 /*-- USB Mass Storage Layer --------------------------------------------------*/
 
-/** @brief Handle the USB 'OUT' requests. */
-static void mass_data_rx_cb(usbd_device *usbd_dev, u8 ep)
-{
-	usbd_mass_storage *ms;
-	struct usb_mass_trans *trans;
-	int len, max_len, left;
-	void *p;
-
-	ms = &_mass_storage;
-	trans = &ms->trans;
-
-	/* RX only */
-	left = sizeof(struct usb_mass_cbw) - trans->cbw_cnt;
-	if (0 < left) {
-		max_len = MIN(ms->ep_out_size, left);
-		p = &trans->cbw.buf[0x1ff & trans->cbw_cnt];
-		len = usbd_ep_read_packet(usbd_dev, ep, p, max_len);
-		trans->cbw_cnt += len;
-
-		if (sizeof(struct usb_mass_cbw) == trans->cbw_cnt) {
-			scsi_command(ms, trans, EVENT_CBW_VALID);
-			if (trans->byte_count < trans->bytes_to_read) {
-				/* We must wait until there is something to
-				 * read again. */
+static void mass_cbw_start(usbd_mass_storage *ms);
+static void mass_data_end(usbd_mass_storage *ms);
+static void uas_next(usbd_mass_storage *ms);
+static void uas_status(usbd_mass_storage *ms);
+
+static u8 *mass_half(usbd_mass_storage *ms, u8 half)
+{
+	return ms->buf + half * (ms->buf_blocks << ms->block_shift);
+}
+
+/** @brief Send the status of the command to the host. */
+static void mass_csw_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	(void)usbd_dev;
+	(void)ep;
+	(void)len;
+
+	mass_cbw_start(&_mass_storage);
+}
+
+static void mass_csw_start(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+
+	scsi_command(ms, trans, EVENT_NEED_STATUS);
+
+	trans->csw.dCSWDataResidue = trans->cbw.dCBWDataTransferLength -
+				     trans->byte_count;
+	usbd_ep_transfer_in(ms->usbd_dev, ms->ep_in, &trans->csw,
+			    sizeof(trans->csw), false, mass_csw_done);
+}
+
+/** @brief Receive and drop the data the host sends beyond what is used. */
+static void mass_discard_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	ms->trans.discarded += len;
+	if (len == 0)
+		ms->trans.discarded = ms->trans.cbw.dCBWDataTransferLength;
+
+	mass_data_end(ms);
+}
+
+/* Finishes the data stage of the command, then sends the status. */
+static void mass_data_end(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+	u32 left = trans->cbw.dCBWDataTransferLength - trans->byte_count -
+		   trans->discarded;
+
+	if (ms->altsetting == 1) {
+		uas_status(ms);
+		return;
+	}
+
+	if (!(trans->cbw.bmCBWFlags & 0x80) && left) {
+		usbd_ep_transfer_out(ms->usbd_dev, ms->ep_out, trans->msd_buf,
+				     MIN(left, sizeof(trans->msd_buf)),
+				     mass_discard_done);
+		return;
+	}
+
+	mass_csw_start(ms);
+}
+
+/** @brief Command data other than blocks has been sent. */
+static void mass_data_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	(void)usbd_dev;
+	(void)ep;
+
+	_mass_storage.trans.byte_count += len;
+	mass_data_end(&_mass_storage);
+}
+
+/*
+ * Media access. A block callback may return USB_MASS_PENDING and finish
+ * later through usb_mass_complete(); meanwhile the endpoints stay NAKed
+ * and the rest of the device keeps running.
+ */
+static int mass_read(usbd_mass_storage *ms, u32 lba, u32 count, u8 *buf,
+		     u32 *step)
+{
+	if (!ms->read_blocks) {
+		*step = 1;
+		return (*ms->read_block)(lba, buf);
+	}
+	*step = count;
+	return (*ms->read_blocks)(lba, count, buf);
+}
+
+static int mass_write(usbd_mass_storage *ms, u32 lba, u32 count,
+		      const u8 *buf, u32 *step)
+{
+	if (!ms->write_blocks) {
+		*step = 1;
+		return (*ms->write_block)(lba, buf);
+	}
+	*step = count;
+	return (*ms->write_blocks)(lba, count, buf);
+}
+
+static bool mass_cache_valid(usbd_mass_storage *ms, u32 i)
+{
+	return ms->cache_valid[i >> 5] & (1 << (i & 31));
+}
+
+static void mass_cache_set_valid(usbd_mass_storage *ms, u32 i, u32 count)
+{
+	for (; count; count--, i++)
+		ms->cache_valid[i >> 5] |= 1 << (i & 31);
+}
+
+/* Blocks from i on that are (or are not) in the cache, at most count. */
+static u32 mass_cache_run(usbd_mass_storage *ms, u32 i, u32 count,
+			  bool valid)
+{
+	u32 n;
+
+	for (n = 0; (n < count) && (i + n < ms->cache_blocks); n++) {
+		if (mass_cache_valid(ms, i + n) != valid)
+			break;
+	}
+
+	return n;
+}
+
+/*
+ * One step of writing the cached unit to the media: read the blocks the
+ * host did not write, then write the whole unit.
+ */
+static int mass_cache_flush(usbd_mass_storage *ms)
+{
+	u32 step, i = mass_cache_run(ms, 0, ms->cache_blocks, true);
+	u8 *buf;
+	int ret;
+
+	ms->trans.media_step = 0;
+
+	if (i < ms->cache_blocks) {
+		buf = ms->cache + (i << ms->block_shift);
+		ret = mass_read(ms, ms->cache_lba + i,
+				mass_cache_run(ms, i, ms->cache_blocks, false),
+				buf, &step);
+		mass_cache_set_valid(ms, i, step);
+		return ret;
+	}
+
+	i = ms->cache_written;
+	buf = ms->cache + (i << ms->block_shift);
+	ret = mass_write(ms, ms->cache_lba + i, ms->cache_blocks - i, buf,
+			 &step);
+	ms->cache_written += step;
+	if (ms->cache_written == ms->cache_blocks)
+		ms->cache_dirty = false;
+	return ret;
+}
+
+static int mass_cache_write(usbd_mass_storage *ms, u32 lba, u32 count,
+			    const u8 *buf)
+{
+	u32 unit = lba - (lba % ms->cache_blocks);
+	u32 n;
+
+	if (ms->cache_dirty && (unit != ms->cache_lba))
+		return mass_cache_flush(ms);
+
+	if (!ms->cache_dirty) {
+		/* Whole units do not need the cache. */
+		if ((unit == lba) && (count >= ms->cache_blocks))
+			return mass_write(ms, lba, count - (count %
+					  ms->cache_blocks), buf,
+					  &ms->trans.media_step);
+
+		ms->cache_lba = unit;
+		ms->cache_dirty = true;
+		ms->cache_written = 0;
+		memset(ms->cache_valid, 0, sizeof(ms->cache_valid));
+	}
+
+	n = MIN(count, unit + ms->cache_blocks - lba);
+	memcpy(ms->cache + ((lba - unit) << ms->block_shift), buf,
+	       n << ms->block_shift);
+	mass_cache_set_valid(ms, lba - unit, n);
+	ms->trans.media_step = n;
+
+	return 0;
+}
+
+static int mass_cache_read(usbd_mass_storage *ms, u32 lba, u32 count,
+			   u8 *buf)
+{
+	u32 i, n;
+
+	if (lba < ms->cache_lba) {
+		return mass_read(ms, lba, MIN(count, ms->cache_lba - lba),
+				 buf, &ms->trans.media_step);
+	}
+
+	i = lba - ms->cache_lba;
+	if (i >= ms->cache_blocks)
+		return mass_read(ms, lba, count, buf, &ms->trans.media_step);
+
+	if (!mass_cache_valid(ms, i)) {
+		return mass_read(ms, lba, mass_cache_run(ms, i, count, false),
+				 buf, &ms->trans.media_step);
+	}
+
+	n = mass_cache_run(ms, i, count, true);
+	memcpy(buf, ms->cache + (i << ms->block_shift), n << ms->block_shift);
+	ms->trans.media_step = n;
+
+	return 0;
+}
+
+static int mass_media_call(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+	u32 lba = trans->lba_start + trans->current_block + trans->media_done;
+	u8 *buf = mass_half(ms, trans->media_half) +
+		 (trans->media_done << ms->block_shift);
+	u32 count = trans->media_count - trans->media_done;
+
+	if (trans->media_flush)
+		return mass_cache_flush(ms);
+
+	if (trans->media_write) {
+		if (ms->cache)
+			return mass_cache_write(ms, lba, count, buf);
+		return mass_write(ms, lba, count, buf, &trans->media_step);
+	}
+
+	if (ms->cache_dirty)
+		return mass_cache_read(ms, lba, count, buf);
+	return mass_read(ms, lba, count, buf, &trans->media_step);
+}
+
+/* Goes on with the media access after a callback has finished. */
+static void mass_media_next(usbd_mass_storage *ms, int status)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+
+	while (!status) {
+		trans->media_done += trans->media_step;
+		trans->media_step = 0;
+		if ((trans->media_done == trans->media_count) &&
+		    !(trans->media_flush && ms->cache_dirty))
+			break;
+
+		trans->media_in_call = true;
+		trans->media_early = false;
+		status = mass_media_call(ms);
+		trans->media_in_call = false;
+
+		if (status == USB_MASS_PENDING) {
+			if (!trans->media_early)
 				return;
-			}
+			status = trans->media_status;
 		}
 	}
 
-	if (trans->byte_count < trans->bytes_to_read) {
-		if (0 < trans->block_count) {
-			if ((0 == trans->byte_count) && (NULL != ms->lock)){
-				(*ms->lock)();
-			}
+	if (status) {
+		trans->csw.bCSWStatus = CBW_STATUS_FAILED;
+		if (!trans->media_write) {
+			set_sbc_status(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+				       SBC_ASC_UNRECOVERED_READ_ERROR,
+				       SBC_ASCQ_NA);
+			memset(mass_half(ms, trans->media_half), 0,
+			       trans->media_count << ms->block_shift);
+		} else {
+			set_sbc_status(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+				       SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT,
+				       SBC_ASCQ_NA);
 		}
+	}
 
-		left = trans->bytes_to_read - trans->byte_count;
-		max_len = MIN(ms->ep_out_size, left);
-		p = &trans->msd_buf[0x1ff & trans->byte_count];
-		len = usbd_ep_read_packet(usbd_dev, ep, p, max_len);
-		trans->byte_count += len;
-
-		if (0 < trans->block_count) {
-			if (0 == (0x1ff & trans->byte_count)) {
-				u32 lba;
-
-				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->write_block)(lba, trans->msd_buf)) {
-					/* Error */
-				}
-				trans->current_block++;
-		{
-			u8 foo[20] = { 1, 2, 3, 4, 5, 6, 7, 8 };
-			foo[3] = 0xff & (trans->byte_count >> 24);
-			foo[4] = 0xff & (trans->byte_count >> 16);
-			foo[5] = 0xff & (trans->byte_count >> 8);
-			foo[6] = 0xff & trans->byte_count;
-			usbd_ep_write_packet(usbd_dev, ms->ep_in, foo, 8);
-		}
-			}
-		}
-	} else if (trans->byte_count < trans->bytes_to_write) {
-		if (0 < trans->block_count) {
-			if ((0 == trans->byte_count) && (NULL != ms->lock)) {
-				(*ms->lock)();
-			}
-
-			if (0 == (0x1ff & trans->byte_count)) {
-				u32 lba;
-
-				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->read_block)(lba, trans->msd_buf)) {
-					/* Error */
-				}
-				trans->current_block++;
-			}
-		}
+	trans->media_busy = false;
+	trans->current_block += trans->media_count;
+	if (trans->media_write)
+		trans->half_blocks[trans->media_half] = 0;
+	trans->media_half = !trans->media_half;
+
+	(*trans->pump)(ms);
+}
+
+static void mass_media_start(usbd_mass_storage *ms, u8 half, u32 count)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+
+	trans->media_busy = true;
+	trans->media_half = half;
+	trans->media_count = count;
+	trans->media_done = 0;
+	trans->media_step = 0;
+	trans->media_flush = false;
+
+	mass_media_next(ms, 0);
+}
+
+static void mass_media_flush(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+
+	trans->media_busy = true;
+	trans->media_half = 0;
+	trans->media_count = 0;
+	trans->media_done = 0;
+	trans->media_step = 0;
+	trans->media_flush = true;
+
+	mass_media_next(ms, 0);
+}
+
+/* The data stage of a block command is over. */
+static void mass_blocks_end(usbd_mass_storage *ms)
+{
+	if (ms->unlock)
+		(*ms->unlock)();
+	mass_data_end(ms);
+}
+
+/*
+ * Block reads: while one half of the buffer is sent to the host, the next
+ * blocks are read into the other half.
+ */
+static void mass_read_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+	struct usb_mass_trans *trans = &ms->trans;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	trans->usb_busy = false;
+	trans->byte_count += len;
+	trans->half_blocks[trans->usb_half] = 0;
+	trans->usb_half = !trans->usb_half;
 
-		left = trans->bytes_to_write - trans->byte_count;
-		max_len = MIN(ms->ep_out_size, left);
-		p = &trans->msd_buf[0x1ff & trans->byte_count];
-		len = usbd_ep_write_packet(usbd_dev, ms->ep_in, p, max_len);
-		trans->byte_count += len;
+	(*trans->pump)(ms);
+}
+
+static void mass_read_pump(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+	u8 half = trans->usb_half;
+	u32 count;
+
+	if (!trans->usb_busy && trans->half_blocks[half] &&
+	    !(trans->media_busy && (trans->media_half == half))) {
+		u32 len = trans->half_blocks[half] << ms->block_shift;
+		/* A short transfer is terminated if the host asked for more. */
+		bool zlp = (trans->byte_count + len == trans->bytes_to_write) &&
+			   (trans->cbw.dCBWDataTransferLength >
+			    trans->bytes_to_write);
+
+		trans->usb_busy = true;
+		usbd_ep_transfer_in(ms->usbd_dev, ms->ep_in,
+				    mass_half(ms, half), len, zlp,
+				    mass_read_done);
+	}
+
+	half = trans->media_half;
+	count = MIN(ms->buf_blocks,
+		    trans->block_count - trans->current_block);
+	if (!trans->media_busy && !trans->half_blocks[half] && count) {
+		trans->half_blocks[half] = count;
+		mass_media_start(ms, half, count);
+		return;
+	}
+
+	if (!trans->usb_busy && !trans->media_busy && !count &&
+	    !trans->half_blocks[0] && !trans->half_blocks[1])
+		mass_blocks_end(ms);
+}
+
+/*
+ * Block writes: the next blocks are received into one half of the buffer
+ * while the other half is written to the media.
+ */
+static void mass_write_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+	struct usb_mass_trans *trans = &ms->trans;
+	u8 half = trans->usb_half;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	trans->usb_busy = false;
+	trans->byte_count += len;
+
+	if (len != (trans->half_blocks[half] << ms->block_shift)) {
+		/* The host ended the data stage early. */
+		trans->csw.bCSWStatus = CBW_STATUS_PHASE_ERROR;
+		trans->usb_block = trans->block_count;
+		trans->half_blocks[half] = len >> ms->block_shift;
+	}
+	trans->usb_half = !half;
+
+	(*trans->pump)(ms);
+}
+
+static void mass_write_pump(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+	u8 half = trans->usb_half;
+	u32 count = MIN(ms->buf_blocks, trans->block_count - trans->usb_block);
+
+	if (!trans->usb_busy && !trans->half_blocks[half] && count) {
+		trans->half_blocks[half] = count;
+		trans->usb_block += count;
+		trans->usb_busy = true;
+		usbd_ep_transfer_out(ms->usbd_dev, ms->ep_out,
+				     mass_half(ms, half),
+				     count << ms->block_shift,
+				     mass_write_done);
+	}
+
+	half = trans->media_half;
+	if (!trans->media_busy && trans->half_blocks[half] &&
+	    !(trans->usb_busy && (trans->usb_half == half))) {
+		mass_media_start(ms, half, trans->half_blocks[half]);
+		return;
+	}
+
+	if (!trans->usb_busy && !trans->media_busy &&
+	    (trans->usb_block == trans->block_count) &&
+	    !trans->half_blocks[0] && !trans->half_blocks[1])
+		mass_blocks_end(ms);
+}
+
+/* FORMAT UNIT writes zeroed blocks over the whole media. */
+static void mass_format_pump(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+	u32 count = MIN(ms->buf_blocks,
+			trans->block_count - trans->current_block);
+
+	if (trans->media_busy)
+		return;
+
+	if (count) {
+		trans->half_blocks[0] = count;
+		mass_media_start(ms, 0, count);
+		return;
+	}
+
+	mass_blocks_end(ms);
+}
+
+/* SYNCHRONIZE CACHE writes the cached unit to the media. */
+static void mass_sync_pump(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+
+	if (trans->media_busy)
+		return;
+
+	if (ms->cache_dirty &&
+	    (trans->csw.bCSWStatus == CBW_STATUS_SUCCESS)) {
+		mass_media_flush(ms);
+		return;
+	}
+
+	mass_blocks_end(ms);
+}
+
+static void mass_cbw_done(usbd_device *usbd_dev, u8 ep, u32 len);
+
+/* Flush started by usb_mass_flush() while waiting for a CBW. */
+static void mass_idle_pump(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+
+	if (ms->unlock)
+		(*ms->unlock)();
+
+	if (ms->altsetting == 1) {
+		uas_next(ms);
+	} else if (trans->cbw_pending) {
+		trans->cbw_pending = false;
+		mass_cbw_done(ms->usbd_dev, ms->ep_out, trans->cbw_len);
+	}
+}
+
+static void mass_blocks_start(usbd_mass_storage *ms, bool write,
+			      void (*pump)(usbd_mass_storage *ms))
+{
+	struct usb_mass_trans *trans = &ms->trans;
+
+	if (ms->lock)
+		(*ms->lock)();
+
+	trans->pump = pump;
+	trans->media_write = write;
+	trans->current_block = 0;
+	trans->usb_block = 0;
+	trans->half_blocks[0] = 0;
+	trans->half_blocks[1] = 0;
+	trans->usb_busy = false;
+	trans->usb_half = 0;
+	trans->media_busy = false;
+	trans->media_half = 0;
+
+	(*pump)(ms);
+}
+
+static void mass_data_start(usbd_mass_storage *ms);
+
+/** @brief A command block wrapper has been received. */
+static void mass_cbw_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+	struct usb_mass_trans *trans = &ms->trans;
+	u32 expected = trans->cbw.dCBWDataTransferLength;
+	bool dir_in = trans->cbw.bmCBWFlags & 0x80;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	if (trans->media_busy) {
+		/* Finish the idle flush first. */
+		trans->cbw_pending = true;
+		trans->cbw_len = len;
+		return;
+	}
+	trans->idle = false;
+	ms->cache_idle = 0;
+
+	if ((len != sizeof(struct usb_mass_cbw)) ||
+	    (trans->cbw.dCBWSignature != CBW_SIGNATURE)) {
+		/* Not a valid CBW, wait for the next one. */
+		mass_cbw_start(ms);
+		return;
+	}
+
+	scsi_command(ms, trans, EVENT_CBW_VALID);
+
+	if (trans->block_count &&
+	    ((trans->bytes_to_write && (!dir_in ||
+					(expected < trans->bytes_to_write))) ||
+	     (trans->bytes_to_read && (dir_in ||
+				       (expected < trans->bytes_to_read))))) {
+		/* The host does not expect the blocks the command moves. */
+		trans->csw.bCSWStatus = CBW_STATUS_PHASE_ERROR;
+		trans->bytes_to_write = 0;
+		trans->bytes_to_read = 0;
+		trans->block_count = 0;
+	} else if (trans->bytes_to_write && !dir_in) {
+		trans->csw.bCSWStatus = CBW_STATUS_PHASE_ERROR;
+		trans->bytes_to_write = 0;
+	}
+	trans->bytes_to_write = MIN(trans->bytes_to_write, expected);
+
+	mass_data_start(ms);
+}
+
+/* Starts the data stage of a command, or its status if it has no data. */
+static void mass_data_start(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+
+	if (trans->block_count && trans->bytes_to_write) {
+		mass_blocks_start(ms, false, mass_read_pump);
+	} else if (trans->block_count && trans->bytes_to_read) {
+		mass_blocks_start(ms, true, mass_write_pump);
+	} else if (trans->format) {
+		memset(mass_half(ms, 0), 0, ms->buf_blocks << ms->block_shift);
+		mass_blocks_start(ms, true, mass_format_pump);
+	} else if (trans->sync) {
+		mass_blocks_start(ms, true, mass_sync_pump);
+	} else if (trans->bytes_to_write) {
+		usbd_ep_transfer_in(ms->usbd_dev, ms->ep_in, trans->msd_buf,
+				    trans->bytes_to_write,
+				    trans->bytes_to_write <
+				    trans->cbw.dCBWDataTransferLength,
+				    mass_data_done);
 	} else {
-		if (0 < trans->block_count) {
-			if (trans->current_block == trans->block_count) {
-				u32 lba;
-
-				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->write_block)(lba, trans->msd_buf)) {
-					/* Error */
-				}
-
-				trans->current_block = 0;
-				if (NULL != ms->unlock){
-					(*ms->unlock)();
-				}
-			}
-		}
-		if (false == trans->csw_valid) {
-			scsi_command(ms, trans, EVENT_NEED_STATUS);
-			trans->csw_valid = true;
+		mass_data_end(ms);
+	}
+}
+
+static void mass_cbw_start(usbd_mass_storage *ms)
+{
+	ms->trans.idle = true;
+	usbd_ep_transfer_out(ms->usbd_dev, ms->ep_out, &ms->trans.cbw,
+			     sizeof(struct usb_mass_cbw), mass_cbw_done);
+}
+
+/*-- USB Attached SCSI Layer -------------------------------------------------*/
+
+/*
+ * Without streams (below SuperSpeed) only one command can use the data
+ * pipes at a time. Further commands are queued while it runs, so the host
+ * does not wait for a status round trip before sending the next one.
+ */
+
+static void uas_cmd_arm(usbd_mass_storage *ms);
+
+static u8 uas_status_free(usbd_mass_storage *ms)
+{
+	return UAS_STATUS_RING - ms->uas.status_count;
+}
+
+/* The next status IU buffer, sent in order by uas_status_send(). */
+static u8 *uas_status_buf(usbd_mass_storage *ms)
+{
+	struct usb_mass_uas *uas = &ms->uas;
+
+	return uas->status[(uas->status_head + uas->status_count) %
+			   UAS_STATUS_RING];
+}
+
+static void uas_status_send(usbd_mass_storage *ms, u8 *iu, u8 id, u16 tag,
+			    u32 len)
+{
+	iu[0] = id;
+	iu[1] = 0;
+	iu[2] = tag >> 8;
+	iu[3] = tag & 0xff;
+
+	ms->uas.status_count++;
+	usbd_ep_queue_in(ms->usbd_dev, ms->uas.ep_status, iu, len);
+}
+
+static void uas_status_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+
+	(void)usbd_dev;
+	(void)ep;
+	(void)len;
+
+	ms->uas.status_head = (ms->uas.status_head + 1) % UAS_STATUS_RING;
+	ms->uas.status_count--;
+
+	uas_next(ms);
+	uas_cmd_arm(ms);
+}
+
+static void uas_response(usbd_mass_storage *ms, u16 tag, u8 code)
+{
+	u8 *iu = uas_status_buf(ms);
+
+	memset(iu, 0, 8);
+	iu[7] = code;
+	uas_status_send(ms, iu, UAS_IU_RESPONSE, tag, 8);
+}
+
+static u16 uas_tag(const u8 *iu)
+{
+	return (iu[2] << 8) | iu[3];
+}
+
+/* Sends the status of the running command and starts the next one. */
+static void uas_status(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+	struct usb_mass_uas *uas = &ms->uas;
+	u8 *iu = uas_status_buf(ms);
+	u32 len = 16;
+
+	scsi_command(ms, trans, EVENT_NEED_STATUS);
+
+	memset(iu, 0, 16);
+	if (trans->csw.bCSWStatus != CBW_STATUS_SUCCESS) {
+		iu[6] = UAS_STATUS_CHECK_CONDITION;
+		iu[15] = sizeof(_spc3_request_sense);
+		scsi_sense_data(ms, &iu[16]);
+		len += sizeof(_spc3_request_sense);
+	}
+	uas_status_send(ms, iu, UAS_IU_SENSE, uas_tag(uas->cmd[uas->cmd_head]),
+			len);
+
+	uas->cmd_head = (uas->cmd_head + 1) % UAS_QUEUE_DEPTH;
+	uas->cmd_count--;
+	uas->active = false;
+	trans->idle = true;
+
+	uas_next(ms);
+	uas_cmd_arm(ms);
+}
+
+/* Runs the command at the head of the queue. */
+static void uas_next(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+	struct usb_mass_uas *uas = &ms->uas;
+	u8 *iu = uas->cmd[uas->cmd_head];
+
+	/* Keep room for its READY and SENSE IUs. */
+	if (uas->active || !uas->cmd_count || trans->media_busy ||
+	    (uas_status_free(ms) < 2))
+		return;
+
+	uas->active = true;
+	trans->idle = false;
+	ms->cache_idle = 0;
+
+	memcpy(trans->cbw.CBWCB, &iu[16], sizeof(trans->cbw.CBWCB));
+	trans->cbw.dCBWTag = uas_tag(iu);
+	trans->cbw.bCBWLUN = 0;
+	trans->cbw.bCBWCBLength = sizeof(trans->cbw.CBWCB);
+
+	scsi_command(ms, trans, EVENT_CBW_VALID);
+
+	/* The data length and direction follow from the command. */
+	trans->cbw.bmCBWFlags = trans->bytes_to_write ? 0x80 : 0;
+	trans->cbw.dCBWDataTransferLength = trans->bytes_to_write +
+					    trans->bytes_to_read;
+
+	if (trans->bytes_to_write || trans->bytes_to_read) {
+		u8 *ready = uas_status_buf(ms);
+
+		uas_status_send(ms, ready, trans->bytes_to_write ?
+				UAS_IU_READ_READY : UAS_IU_WRITE_READY,
+				trans->cbw.dCBWTag, 4);
+	}
+
+	mass_data_start(ms);
+}
+
+static void uas_cmd_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+	struct usb_mass_uas *uas = &ms->uas;
+	u8 *iu = uas->cmd[(uas->cmd_head + uas->cmd_count) % UAS_QUEUE_DEPTH];
+	u8 i;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	uas->cmd_armed = false;
+
+	if ((len < 4) || ((iu[0] == UAS_IU_COMMAND) && (len < 32))) {
+		uas_response(ms, 0, UAS_RESPONSE_INVALID_IU);
+	} else if (iu[0] == UAS_IU_COMMAND) {
+		for (i = 0; i < uas->cmd_count; i++) {
+			if (uas_tag(uas->cmd[(uas->cmd_head + i) %
+					     UAS_QUEUE_DEPTH]) == uas_tag(iu))
+				break;
 		}
 
-		left = sizeof(struct usb_mass_csw) - trans->csw_sent;
-		if (0 < left) {
-			max_len = MIN(ms->ep_out_size, left);
-			p = &trans->csw.buf[trans->csw_sent];
-			len = usbd_ep_write_packet(usbd_dev, ms->ep_in, p, max_len);
-			trans->csw_sent += len;
+		if (i < uas->cmd_count) {
+			uas_response(ms, uas_tag(iu),
+				     UAS_RESPONSE_OVERLAPPED_TAG);
+		} else {
+			uas->cmd_count++;
+			uas_next(ms);
 		}
+	} else if (iu[0] == UAS_IU_TASK_MANAGEMENT) {
+		uas_response(ms, uas_tag(iu), UAS_RESPONSE_TMF_NOT_SUPPORTED);
+	} else {
+		uas_response(ms, uas_tag(iu), UAS_RESPONSE_INVALID_IU);
 	}
+
+	uas_cmd_arm(ms);
 }
 
-/** @brief Handle the USB 'IN' requests. */
-static void mass_data_tx_cb(usbd_device *usbd_dev, u8 ep)
+/* Receives the next command IU if there is room to queue and answer it. */
+static void uas_cmd_arm(usbd_mass_storage *ms)
 {
-	usbd_mass_storage *ms;
-	struct usb_mass_trans *trans;
-	int len, max_len, left;
-	void *p;
+	struct usb_mass_uas *uas = &ms->uas;
 
-	ms = &_mass_storage;
-	trans = &ms->trans;
+	if ((ms->altsetting != 1) || uas->cmd_armed ||
+	    (uas->cmd_count == UAS_QUEUE_DEPTH) || (uas_status_free(ms) <= 2))
+		return;
 
-	if (trans->byte_count < trans->bytes_to_write) {
-		if (0 < trans->block_count) {
-			if (0 == (0x1ff & trans->byte_count)) {
-				u32 lba;
+	uas->cmd_armed = true;
+	usbd_ep_transfer_out(ms->usbd_dev, uas->ep_cmd,
+			     uas->cmd[(uas->cmd_head + uas->cmd_count) %
+				      UAS_QUEUE_DEPTH],
+			     sizeof(uas->cmd[0]), uas_cmd_done);
+}
 
-				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->read_block)(lba, trans->msd_buf)) {
-					/* Error */
-				}
-				trans->current_block++;
-			}
-		}
+/* Switches between Bulk-Only (0) and UAS (1). */
+static void mass_set_altsetting(usbd_mass_storage *ms, u8 altsetting)
+{
+	usbd_device *usbd_dev = ms->usbd_dev;
+	struct usb_mass_uas *uas = &ms->uas;
+
+	_usbd_transfer_cancel(usbd_dev, ms->ep_in);
+	_usbd_transfer_cancel(usbd_dev, ms->ep_out);
+	_usbd_transfer_cancel(usbd_dev, uas->ep_cmd);
+	_usbd_transfer_cancel(usbd_dev, uas->ep_status);
+
+	ms->altsetting = altsetting;
+	uas->cmd_head = 0;
+	uas->cmd_count = 0;
+	uas->cmd_armed = false;
+	uas->active = false;
+	uas->status_head = 0;
+	uas->status_count = 0;
+
+	if (altsetting == 1) {
+		ms->ep_in = uas->ep_in;
+		ms->ep_out = uas->ep_out;
+	} else {
+		ms->ep_in = ms->bot_ep_in;
+		ms->ep_out = ms->bot_ep_out;
+	}
 
-		left = trans->bytes_to_write - trans->byte_count;
-		max_len = MIN(ms->ep_out_size, left);
-		p = &trans->msd_buf[0x1ff & trans->byte_count];
-		len = usbd_ep_write_packet(usbd_dev, ep, p, max_len);
-		trans->byte_count += len;
+	/* Selecting an alternate setting resets the data toggles. */
+	usbd_ep_stall_set(usbd_dev, ms->ep_in, 0);
+	usbd_ep_stall_set(usbd_dev, ms->ep_out, 0);
+
+	if (altsetting == 1) {
+		usbd_ep_stall_set(usbd_dev, uas->ep_cmd, 0);
+		usbd_ep_stall_set(usbd_dev, uas->ep_status, 0);
+		ms->trans.idle = true;
+		uas_cmd_arm(ms);
 	} else {
-		if (0 < trans->block_count) {
-			if (trans->current_block == trans->block_count) {
-				trans->current_block = 0;
-				if (NULL != ms->unlock){
-					(*ms->unlock)();
-				}
-			}
-		}
-		if (false == trans->csw_valid) {
-			scsi_command(ms, trans, EVENT_NEED_STATUS);
-			trans->csw_valid = true;
-		}
+		mass_cbw_start(ms);
+	}
+}
 
-		left = sizeof(struct usb_mass_csw) - trans->csw_sent;
-		if (0 < left) {
-			max_len = MIN(ms->ep_out_size, left);
-			p = &trans->csw.buf[trans->csw_sent];
-			len = usbd_ep_write_packet(usbd_dev, ep, p, max_len);
-			trans->csw_sent += len;
-		} else if (sizeof(struct usb_mass_csw) == trans->csw_sent) {
-			/* End of transaction */
-			trans->lba_start = 0xffffffff;
-			trans->block_count = 0;
-			trans->current_block = 0;
-			trans->cbw_cnt = 0;
-			trans->bytes_to_read = 0;
-			trans->bytes_to_write = 0;
-			trans->byte_count = 0;
-			trans->csw_sent = 0;
-			trans->csw_valid = false;
-		}
+/** @brief Handle the alternate setting of the mass storage interface. */
+static int mass_interface_request(usbd_device *usbd_dev,
+				  struct usb_setup_data *req, u8 **buf,
+				  u16 *len,
+				  void (**complete)(usbd_device *usbd_dev,
+						    struct usb_setup_data *req))
+{
+	usbd_mass_storage *ms = &_mass_storage;
+
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->wIndex != ms->uas.iface)
+		return USBD_REQ_NEXT_CALLBACK;
+
+	switch (req->bRequest) {
+	case USB_REQ_GET_INTERFACE:
+		*len = 1;
+		(*buf)[0] = ms->altsetting;
+		return USBD_REQ_HANDLED;
+	case USB_REQ_SET_INTERFACE:
+		if (req->wValue > 1)
+			return USBD_REQ_NOTSUPP;
+		mass_set_altsetting(ms, req->wValue);
+		*len = 0;
+		return USBD_REQ_HANDLED;
 	}
+
+	return USBD_REQ_NEXT_CALLBACK;
 }
 
 /** @brief Handle various control requests related to the mass storage
@@ -731,6 +1684,25 @@ static int mass_control_request(usbd_device *usbd_dev,
 	return USBD_REQ_NOTSUPP;
 }
 
+/* Flushes the write cache once the host has been idle for cache_timeout. */
+static void mass_sof(usbd_device *usbd_dev)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+	struct usb_mass_trans *trans = &ms->trans;
+	u32 limit = (u32)ms->cache_timeout << (usbd_dev->high_speed ? 3 : 0);
+
+	if (!ms->cache_dirty || !trans->idle || trans->media_busy ||
+	    !limit) {
+		ms->cache_idle = 0;
+		return;
+	}
+
+	if (++ms->cache_idle >= limit) {
+		ms->cache_idle = 0;
+		usb_mass_flush(ms);
+	}
+}
+
 /** @brief Setup the endpoints to be bulk & register the callbacks. */
 static void mass_set_config(usbd_device *usbd_dev, u16 wValue)
 {
@@ -738,16 +1710,51 @@ static void mass_set_config(usbd_device *usbd_dev, u16 wValue)
 
 	(void)wValue;
 
+	ms->altsetting = 0;
+	ms->ep_in = ms->bot_ep_in;
+	ms->ep_out = ms->bot_ep_out;
+
 	usbd_ep_setup(usbd_dev, ms->ep_in, USB_ENDPOINT_ATTR_BULK,
-		      ms->ep_in_size, mass_data_tx_cb);
+		      ms->ep_in_size, NULL);
 	usbd_ep_setup(usbd_dev, ms->ep_out, USB_ENDPOINT_ATTR_BULK,
-		      ms->ep_out_size, mass_data_rx_cb);
+		      ms->ep_out_size, NULL);
 
 	usbd_register_control_callback(
 				usbd_dev,
 				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
 				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
 				mass_control_request);
+
+	if (ms->has_uas) {
+		struct usb_mass_uas *uas = &ms->uas;
+
+		usbd_ep_setup(usbd_dev, uas->ep_cmd, USB_ENDPOINT_ATTR_BULK,
+			      uas->ep_size, NULL);
+		usbd_ep_setup(usbd_dev, uas->ep_status, USB_ENDPOINT_ATTR_BULK,
+			      uas->ep_size, NULL);
+		/* The data pipes may be the Bulk-Only endpoints. */
+		if (uas->ep_in != ms->bot_ep_in)
+			usbd_ep_setup(usbd_dev, uas->ep_in,
+				      USB_ENDPOINT_ATTR_BULK, uas->ep_size,
+				      NULL);
+		if (uas->ep_out != ms->bot_ep_out)
+			usbd_ep_setup(usbd_dev, uas->ep_out,
+				      USB_ENDPOINT_ATTR_BULK, uas->ep_size,
+				      NULL);
+
+		uas->status_head = 0;
+		uas->status_count = 0;
+		usbd_ep_queue_setup(usbd_dev, uas->ep_status, uas->status_q,
+				    UAS_STATUS_RING, uas_status_done);
+
+		usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				mass_interface_request);
+	}
+
+	mass_cbw_start(ms);
 }
 
 /** @addtogroup usb_mass */
@@ -759,24 +1766,35 @@ static void mass_set_config(usbd_device *usbd_dev, u16 wValue)
 
 @param[in] usbd_dev The USB device to associate the Mass Storage with.
 @param[in] ep_in The USB 'IN' endpoint.
-@param[in] ep_in_size The maximum endpoint size.  Valid values: 8, 16, 32 or 64
+@param[in] ep_in_size The maximum endpoint size.  Valid values: 8, 16, 32 or 64,
+		or 512 on a high speed port.
 @param[in] ep_out The USB 'OUT' endpoint.
-@param[in] ep_out_size The maximum endpoint size.  Valid values: 8, 16, 32 or 64
+@param[in] ep_out_size The maximum endpoint size.  Valid values: 8, 16, 32 or
+		64, or 512 on a high speed port.
 @param[in] vendor_id The SCSI vendor ID to return.  Maximum used length is 8.
 @param[in] product_id The SCSI product ID to return.  Maximum used length is 16.
 @param[in] product_revision_level The SCSI product revision level to return.
 		Maximum used length is 4.
-@param[in] block_count The number of 512-byte blocks available.
+@param[in] block_count The number of blocks available. Blocks are 512 bytes
+		unless changed with usb_mass_set_block_size().
 @param[in] read_block The function called when the host requests to read a LBA
 		block.  Must _NOT_ be NULL.
 @param[in] write_block The function called when the host requests to write a
 		LBA block.  Must _NOT_ be NULL.
 
-@return Pointer to the usbd_mass_storage struct.
+The block functions return 0 on success and nonzero on failure. They may
+also return USB_MASS_PENDING and report the result later with
+usb_mass_complete().
+
+Adds its set configuration and SOF callbacks to those of the device, so
+other class functions and the application can register theirs as well.
+
+@return Pointer to the usbd_mass_storage struct, NULL if the device has no
+room left for its callbacks.
 */
 usbd_mass_storage *usb_mass_init(usbd_device *usbd_dev,
-				 u8 ep_in, u8 ep_in_size,
-				 u8 ep_out, u8 ep_out_size,
+				 u8 ep_in, u16 ep_in_size,
+				 u8 ep_out, u16 ep_out_size,
 				 const char *vendor_id,
 				 const char *product_id,
 				 const char *product_revision_level,
@@ -786,8 +1804,12 @@ usbd_mass_storage *usb_mass_init(usbd_device *usbd_dev,
 {
 	_mass_storage.usbd_dev = usbd_dev;
 	_mass_storage.ep_in = ep_in;
+	_mass_storage.bot_ep_in = ep_in;
 	_mass_storage.ep_in_size = ep_in_size;
 	_mass_storage.ep_out = ep_out;
+	_mass_storage.bot_ep_out = ep_out;
+	_mass_storage.has_uas = false;
+	_mass_storage.altsetting = 0;
 	_mass_storage.ep_out_size = ep_out_size;
 	_mass_storage.vendor_id = vendor_id;
 	_mass_storage.product_id = product_id;
@@ -795,24 +1817,238 @@ usbd_mass_storage *usb_mass_init(usbd_device *usbd_dev,
 	_mass_storage.block_count = block_count - 1;
 	_mass_storage.read_block = read_block;
 	_mass_storage.write_block = write_block;
+	_mass_storage.read_blocks = NULL;
+	_mass_storage.write_blocks = NULL;
+	_mass_storage.block_shift = 9;
+	_mass_storage.buf = _mass_storage.trans.msd_buf;
+	_mass_storage.buf_size = sizeof(_mass_storage.trans.msd_buf);
+	_mass_storage.buf_blocks = _mass_storage.buf_size >> 10;
+	_mass_storage.cache = NULL;
+	_mass_storage.cache_blocks = 0;
+	_mass_storage.cache_dirty = false;
+	_mass_storage.cache_timeout = MASS_CACHE_TIMEOUT;
+	_mass_storage.cache_idle = 0;
 	_mass_storage.lock = NULL;
 	_mass_storage.unlock = NULL;
 
 	_mass_storage.trans.lba_start = 0xffffffff;
 	_mass_storage.trans.block_count = 0;
-	_mass_storage.trans.current_block = 0;
-	_mass_storage.trans.cbw_cnt = 0;
 	_mass_storage.trans.bytes_to_read = 0;
 	_mass_storage.trans.bytes_to_write = 0;
 	_mass_storage.trans.byte_count = 0;
-	_mass_storage.trans.csw_valid = false;
-	_mass_storage.trans.csw_sent = 0;
 
 	set_sbc_status_good(&_mass_storage);
 
-	usbd_register_set_config_callback(usbd_dev, mass_set_config);
+	if (usbd_register_set_config_callback(usbd_dev, mass_set_config) ||
+	    usbd_register_sof_callback(usbd_dev, mass_sof))
+		return NULL;
 
 	return &_mass_storage;
 }
 
+/** @brief Finish a pending block access
+
+Called by the storage driver when a block callback that returned
+USB_MASS_PENDING has finished. It may also be called from within the
+callback itself. The USB endpoints are NAKed while the access is pending.
+
+@note Must not interrupt usbd_poll(); call it from the same context, or with
+the USB interrupt masked.
+
+@param[in] ms Mass storage instance returned by usb_mass_init().
+@param[in] status 0 on success, nonzero if the access failed.
+*/
+void usb_mass_complete(usbd_mass_storage *ms, int status)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+
+	if (!trans->media_busy)
+		return;
+
+	if (trans->media_in_call) {
+		trans->media_status = status;
+		trans->media_early = true;
+		return;
+	}
+
+	mass_media_next(ms, status);
+}
+
+/** @brief Set up multi-block access to the media
+
+Blocks of a READ or WRITE command are then moved through the two halves of
+@a buf: while one half is on the bus the other one is read from or written
+to the media. Each half holds a whole number of blocks.
+
+@param[in] ms Mass storage instance returned by usb_mass_init().
+@param[in] read_blocks Reads @a count blocks starting at @a lba, returns 0
+on success. If NULL, the read_block function is called for each block.
+@param[in] write_blocks Writes @a count blocks starting at @a lba, returns 0
+on success. If NULL, the write_block function is called for each block.
+@param[in] buf Block buffer, at least two blocks.
+@param[in] buf_size Size of @a buf in bytes.
+@return 0 on success, -1 if @a buf is too small.
+*/
+int usb_mass_set_block_io(usbd_mass_storage *ms,
+			  int (*read_blocks)(u32 lba, u32 count, u8 *copy_to),
+			  int (*write_blocks)(u32 lba, u32 count,
+					      const u8 *copy_from),
+			  u8 *buf, u32 buf_size)
+{
+	if (buf_size < (2U << ms->block_shift))
+		return -1;
+
+	ms->read_blocks = read_blocks;
+	ms->write_blocks = write_blocks;
+	ms->buf = buf;
+	ms->buf_size = buf_size;
+	ms->buf_blocks = buf_size >> (ms->block_shift + 1);
+
+	return 0;
+}
+
+/** @brief Set the size of the media blocks
+
+Larger blocks mean fewer block callbacks per transfer. The size is reported
+to the host by READ CAPACITY; block_count and the LBAs passed to the block
+functions are in units of it.
+
+@param[in] ms Mass storage instance returned by usb_mass_init().
+@param[in] block_size Power of two, from 512 to 32768 bytes. The buffer
+set up with usb_mass_set_block_io() must hold at least two blocks. Must be
+set before the write cache.
+@return 0 on success, -1 if the size is not supported.
+*/
+int usb_mass_set_block_size(usbd_mass_storage *ms, u32 block_size)
+{
+	u8 shift;
+
+	for (shift = 9; shift <= 15; shift++) {
+		if (block_size == (1U << shift))
+			break;
+	}
+
+	if ((shift > 15) || (ms->buf_size < (2U << shift)) || ms->cache)
+		return -1;
+
+	ms->block_shift = shift;
+	ms->buf_blocks = ms->buf_size >> (shift + 1);
+
+	return 0;
+}
+
+/** @brief Set up a write-back cache for media with large erase units
+
+Writes are gathered in the cache as long as they fall into the same erase
+unit. The unit is written to the media in one multi-block write when a
+write to another unit comes in, on SYNCHRONIZE CACHE, START STOP UNIT or
+PREVENT ALLOW MEDIUM REMOVAL, once the host has been idle for the flush
+timeout (see usb_mass_set_flush_timeout()), or when usb_mass_flush() is
+called. Blocks of the unit the host did not write are read from the media
+first, so the write_blocks function always sees whole, aligned units and
+has to erase each one only once.
+
+While the cache is set up, MODE SENSE reports the caching mode page with
+the write cache enabled, so the host knows to send SYNCHRONIZE CACHE.
+
+@note The cache is lost if the device is powered off before a flush.
+
+@param[in] ms Mass storage instance returned by usb_mass_init().
+@param[in] cache Buffer of @a unit_size bytes, NULL to disable the cache.
+@param[in] unit_size Erase unit of the media in bytes, a multiple of the
+block size of at most 256 blocks. On media with erase units of different
+sizes, use the smallest one.
+@return 0 on success, -1 if the size is not supported or the cache still
+holds data.
+*/
+int usb_mass_set_write_cache(usbd_mass_storage *ms, u8 *cache,
+			     u32 unit_size)
+{
+	u32 blocks = unit_size >> ms->block_shift;
+
+	if (ms->cache_dirty)
+		return -1;
+
+	if (cache && ((blocks == 0) || (blocks > 256) ||
+		      (unit_size != (blocks << ms->block_shift))))
+		return -1;
+
+	ms->cache = cache;
+	ms->cache_blocks = cache ? blocks : 0;
+
+	return 0;
+}
+
+/** @brief Set how long the write cache is held while the host is idle
+
+@param[in] ms Mass storage instance returned by usb_mass_init().
+@param[in] timeout Time without commands in ms after which the cached unit
+is written to the media, counted in SOFs. 0 only flushes on the commands
+and usb_mass_flush(). The default is 500 ms.
+*/
+void usb_mass_set_flush_timeout(usbd_mass_storage *ms, u16 timeout)
+{
+	ms->cache_timeout = timeout;
+	ms->cache_idle = 0;
+}
+
+/** @brief Write the cached unit to the media
+
+Does nothing unless the write cache holds data and no command is in
+progress. The flush may complete later if the block functions return
+USB_MASS_PENDING; a command arriving meanwhile waits for it.
+
+@note Must not interrupt usbd_poll(); call it from the same context, or with
+the USB interrupt masked.
+
+@param[in] ms Mass storage instance returned by usb_mass_init().
+*/
+void usb_mass_flush(usbd_mass_storage *ms)
+{
+	struct usb_mass_trans *trans = &ms->trans;
+
+	if (!ms->cache_dirty || !trans->idle || trans->media_busy)
+		return;
+
+	if (ms->lock)
+		(*ms->lock)();
+
+	trans->pump = mass_idle_pump;
+	trans->media_write = true;
+	mass_media_flush(ms);
+}
+
+/** @brief Add USB Attached SCSI as alternate setting 1
+
+Alternate setting 0 of the interface stays Bulk-Only. In setting 1 the
+host sends command IUs on the command pipe and can queue several commands
+instead of waiting for the status of each one. Commands run in order, using
+READ READY and WRITE READY IUs for the data pipes (no streams).
+
+The configuration descriptor has to describe the four endpoints of setting
+1, each followed by its pipe usage descriptor (see struct
+usb_mass_pipe_usage_descriptor), for example with
+usbd_set_config_descriptors().
+
+@param[in] ms Mass storage instance returned by usb_mass_init().
+@param[in] iface Number of the mass storage interface.
+@param[in] ep_cmd Command pipe, bulk OUT.
+@param[in] ep_status Status pipe, bulk IN.
+@param[in] ep_data_in Data-in pipe, may be the Bulk-Only IN endpoint.
+@param[in] ep_data_out Data-out pipe, may be the Bulk-Only OUT endpoint.
+@param[in] ep_size The maximum endpoint size of the pipes, 512 at high speed.
+*/
+void usb_mass_set_uas(usbd_mass_storage *ms, u8 iface, u8 ep_cmd,
+		      u8 ep_status, u8 ep_data_in, u8 ep_data_out,
+		      u16 ep_size)
+{
+	ms->has_uas = true;
+	ms->uas.iface = iface;
+	ms->uas.ep_cmd = ep_cmd;
+	ms->uas.ep_status = ep_status;
+	ms->uas.ep_in = ep_data_in;
+	ms->uas.ep_out = ep_data_out;
+	ms->uas.ep_size = ep_size;
+}
+
 /** @} */
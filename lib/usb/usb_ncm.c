@@ -0,0 +1,661 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/cdc.h>
+#include "usb_private.h"
+
+/* Datagrams and NDPs start on 4 byte boundaries in both directions. */
+#define NCM_ALIGN(x)		(((x) + 3) & ~3)
+/* Datagrams in one NTB sent to the host. */
+#define NCM_MAX_DATAGRAMS	16
+
+struct _usbd_ncm {
+	usbd_device *usbd_dev;
+	u8 iface;		/* Communications interface, data is iface + 1. */
+	u8 ep_notif;
+	u8 ep_in;
+	u8 ep_out;
+	u16 ep_size;
+	u8 altsetting;
+
+	/* NTBs to the host: one is filled while the other is sent. */
+	u8 *in_buf;
+	u16 in_size;
+	u16 in_max;		/* Limit set by the host. */
+	u8 in_fill;
+	u16 in_pos;
+	u8 in_count;
+	u16 in_dg[NCM_MAX_DATAGRAMS][2];
+	u16 in_seq;
+	bool in_busy;
+	u8 in_age;		/* Frames since the last NTB was started. */
+	u8 in_timeout;
+
+	/* NTBs from the host: one is received while the other is read. */
+	u8 *out_buf;
+	u16 out_size;
+	u16 out_len[2];		/* 0 if the NTB is free. */
+	u8 out_fill;
+	u8 out_read;
+	bool out_busy;
+	u16 out_ndp;		/* NDP being read, 0 before the NTB is parsed. */
+	u16 out_entry;
+
+	/*
+	 * Notifications are sent one at a time, the next from the completion
+	 * of the last, so a buffer is not rewritten while it is sent and a
+	 * link change made meanwhile is sent with the latest state.
+	 */
+	bool link;
+	bool notif_speed_pending;
+	bool notif_conn_pending;
+	u8 notif_speed[16];
+	u8 notif_conn[8];
+	struct usbd_queue_entry notif_q[1];
+};
+
+static usbd_ncm _ncm;
+
+/*-- Device to host ----------------------------------------------------------*/
+
+static void ncm_in_send(usbd_ncm *ncm);
+
+static void ncm_in_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_ncm *ncm = &_ncm;
+
+	(void)usbd_dev;
+	(void)ep;
+	(void)len;
+
+	ncm->in_busy = false;
+
+	/* Frames queued meanwhile go out right away unless held back. */
+	if (ncm->in_count && (ncm->in_age >= ncm->in_timeout))
+		ncm_in_send(ncm);
+}
+
+/* Ends the NTB being filled with its NDP and sends it. */
+static void ncm_in_send(usbd_ncm *ncm)
+{
+	u8 *ntb = ncm->in_buf + ncm->in_fill * ncm->in_size;
+	struct usb_cdc_ncm_nth16 *nth = (void *)ntb;
+	struct usb_cdc_ncm_ndp16 *ndp;
+	u16 ndp_index = NCM_ALIGN(ncm->in_pos);
+	u16 ndp_len = sizeof(*ndp) + 4 * (ncm->in_count + 1);
+	u16 len = ndp_index + ndp_len;
+
+	nth->dwSignature = USB_CDC_NCM_NTH16_SIGNATURE;
+	nth->wHeaderLength = sizeof(*nth);
+	nth->wSequence = ncm->in_seq++;
+	nth->wBlockLength = len;
+	nth->wNdpIndex = ndp_index;
+
+	ndp = (void *)(ntb + ndp_index);
+	ndp->dwSignature = USB_CDC_NCM_NDP16_SIGNATURE;
+	ndp->wLength = ndp_len;
+	ndp->wNextNdpIndex = 0;
+	memcpy(ntb + ndp_index + sizeof(*ndp), ncm->in_dg, 4 * ncm->in_count);
+	memset(ntb + len - 4, 0, 4);
+
+	ncm->in_busy = true;
+	ncm->in_age = 0;
+	ncm->in_fill = !ncm->in_fill;
+	ncm->in_pos = sizeof(*nth);
+	ncm->in_count = 0;
+
+	/* A short packet ends an NTB below the maximum size. */
+	usbd_ep_transfer_in(ncm->usbd_dev, ncm->ep_in, ntb, len,
+			    len < ncm->in_max, ncm_in_done);
+}
+
+/* Whether a datagram of len bytes still fits into the NTB being filled. */
+static bool ncm_in_fits(usbd_ncm *ncm, u16 len)
+{
+	u32 end = NCM_ALIGN(NCM_ALIGN(ncm->in_pos) + len) +
+		  sizeof(struct usb_cdc_ncm_ndp16) + 4 * (ncm->in_count + 2);
+
+	return (ncm->in_count < NCM_MAX_DATAGRAMS) && (end <= ncm->in_max);
+}
+
+static void ncm_sof(usbd_device *usbd_dev)
+{
+	usbd_ncm *ncm = &_ncm;
+
+	(void)usbd_dev;
+
+	if (ncm->in_age < 0xff)
+		ncm->in_age++;
+
+	if (!ncm->in_busy && ncm->in_count &&
+	    (ncm->in_age >= ncm->in_timeout))
+		ncm_in_send(ncm);
+}
+
+/*-- Host to device ----------------------------------------------------------*/
+
+static void ncm_out_arm(usbd_ncm *ncm);
+
+static void ncm_out_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	usbd_ncm *ncm = &_ncm;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	ncm->out_busy = false;
+	if (len) {
+		ncm->out_len[ncm->out_fill] = len;
+		ncm->out_fill = !ncm->out_fill;
+	}
+
+	ncm_out_arm(ncm);
+}
+
+/* Receives the next NTB; the host is NAKed while both are unread. */
+static void ncm_out_arm(usbd_ncm *ncm)
+{
+	if (ncm->out_busy || (ncm->altsetting != 1) ||
+	    ncm->out_len[ncm->out_fill])
+		return;
+
+	ncm->out_busy = true;
+	usbd_ep_transfer_out(ncm->usbd_dev, ncm->ep_out,
+			     ncm->out_buf + ncm->out_fill * ncm->out_size,
+			     ncm->out_size, ncm_out_done);
+}
+
+/* The application is done with the NTB being read. */
+static void ncm_out_release(usbd_ncm *ncm)
+{
+	ncm->out_len[ncm->out_read] = 0;
+	ncm->out_read = !ncm->out_read;
+	ncm->out_ndp = 0;
+	ncm->out_entry = 0;
+
+	ncm_out_arm(ncm);
+}
+
+/* Returns the NDP to read, 0 if the NTB has no (more) valid one. */
+static u16 ncm_out_ndp(const u8 *ntb, u16 len, u16 index)
+{
+	const struct usb_cdc_ncm_ndp16 *ndp = (const void *)(ntb + index);
+
+	if ((index & 3) || (index < sizeof(struct usb_cdc_ncm_nth16)) ||
+	    (index + sizeof(*ndp) > len))
+		return 0;
+
+	if ((ndp->dwSignature != USB_CDC_NCM_NDP16_SIGNATURE) ||
+	    (ndp->wLength < sizeof(*ndp) + 8) ||
+	    (index + ndp->wLength > len))
+		return 0;
+
+	return index;
+}
+
+/*-- Notifications and control requests --------------------------------------*/
+
+/* Sends the next pending notification if the endpoint is free. */
+static void ncm_notify_next(usbd_ncm *ncm)
+{
+	struct usb_cdc_notification *notif;
+	u32 rate = (ncm->ep_size == 512) ? 480000000 : 12000000;
+
+	/* The buffers are only rewritten once the last one was sent. */
+	if (ncm->usbd_dev->tx_queue[ncm->ep_notif & 0x7f].count)
+		return;
+
+	if (ncm->notif_speed_pending) {
+		notif = (void *)ncm->notif_speed;
+		notif->bmRequestType = 0xA1;
+		notif->bNotification = USB_CDC_NOTIFY_SPEED_CHANGE;
+		notif->wValue = 0;
+		notif->wIndex = ncm->iface;
+		notif->wLength = 8;
+		memcpy(&ncm->notif_speed[8], &rate, 4);
+		memcpy(&ncm->notif_speed[12], &rate, 4);
+		if (!usbd_ep_queue_in(ncm->usbd_dev, ncm->ep_notif,
+				      ncm->notif_speed,
+				      sizeof(ncm->notif_speed)))
+			ncm->notif_speed_pending = false;
+		return;
+	}
+
+	if (!ncm->notif_conn_pending)
+		return;
+
+	notif = (void *)ncm->notif_conn;
+	notif->bmRequestType = 0xA1;
+	notif->bNotification = USB_CDC_NOTIFY_NETWORK_CONNECTION;
+	notif->wValue = ncm->link;
+	notif->wIndex = ncm->iface;
+	notif->wLength = 0;
+	if (!usbd_ep_queue_in(ncm->usbd_dev, ncm->ep_notif, ncm->notif_conn,
+			      sizeof(ncm->notif_conn)))
+		ncm->notif_conn_pending = false;
+}
+
+static void ncm_notify_done(usbd_device *usbd_dev, u8 ep, u32 len)
+{
+	(void)usbd_dev;
+	(void)ep;
+	(void)len;
+
+	ncm_notify_next(&_ncm);
+}
+
+/*
+ * The connection state is always sent after the speed. A queue entry still
+ * in flight is left alone, its completion sends what is pending.
+ */
+static void ncm_notify(usbd_ncm *ncm, bool speed)
+{
+	if (speed)
+		ncm->notif_speed_pending = true;
+	ncm->notif_conn_pending = true;
+
+	ncm_notify_next(ncm);
+}
+
+/* Alternate setting 0 of the data interface has no endpoints. */
+static void ncm_set_altsetting(usbd_ncm *ncm, u8 altsetting)
+{
+	usbd_device *usbd_dev = ncm->usbd_dev;
+
+	_usbd_transfer_cancel(usbd_dev, ncm->ep_in);
+	_usbd_transfer_cancel(usbd_dev, ncm->ep_out);
+
+	/* Selecting an alternate setting resets the data toggles. */
+	usbd_ep_stall_set(usbd_dev, ncm->ep_in, 0);
+	usbd_ep_stall_set(usbd_dev, ncm->ep_out, 0);
+
+	ncm->altsetting = altsetting;
+	ncm->in_busy = false;
+	ncm->in_fill = 0;
+	ncm->in_pos = sizeof(struct usb_cdc_ncm_nth16);
+	ncm->in_count = 0;
+	ncm->in_seq = 0;
+	ncm->out_busy = false;
+	ncm->out_len[0] = 0;
+	ncm->out_len[1] = 0;
+	ncm->out_fill = 0;
+	ncm->out_read = 0;
+	ncm->out_ndp = 0;
+	ncm->out_entry = 0;
+	ncm->notif_speed_pending = false;
+	ncm->notif_conn_pending = false;
+
+	if (altsetting == 1) {
+		ncm_out_arm(ncm);
+		ncm_notify(ncm, true);
+	}
+}
+
+static int ncm_interface_request(usbd_device *usbd_dev,
+				 struct usb_setup_data *req, u8 **buf,
+				 u16 *len,
+				 void (**complete)(usbd_device *usbd_dev,
+						   struct usb_setup_data *req))
+{
+	usbd_ncm *ncm = &_ncm;
+
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->wIndex != ncm->iface + 1)
+		return USBD_REQ_NEXT_CALLBACK;
+
+	switch (req->bRequest) {
+	case USB_REQ_GET_INTERFACE:
+		*len = 1;
+		(*buf)[0] = ncm->altsetting;
+		return USBD_REQ_HANDLED;
+	case USB_REQ_SET_INTERFACE:
+		if (req->wValue > 1)
+			return USBD_REQ_NOTSUPP;
+		ncm_set_altsetting(ncm, req->wValue);
+		*len = 0;
+		return USBD_REQ_HANDLED;
+	}
+
+	return USBD_REQ_NEXT_CALLBACK;
+}
+
+static int ncm_control_request(usbd_device *usbd_dev,
+			       struct usb_setup_data *req, u8 **buf,
+			       u16 *len,
+			       void (**complete)(usbd_device *usbd_dev,
+						 struct usb_setup_data *req))
+{
+	usbd_ncm *ncm = &_ncm;
+	struct usb_cdc_ncm_ntb_parameters *params = (void *)*buf;
+	u32 size;
+
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->wIndex != ncm->iface)
+		return USBD_REQ_NEXT_CALLBACK;
+
+	switch (req->bRequest) {
+	case USB_CDC_REQ_GET_NTB_PARAMETERS:
+		params->wLength = sizeof(*params);
+		params->bmNtbFormatsSupported = 1;	/* NTB16 only */
+		params->dwNtbInMaxSize = ncm->in_size;
+		params->wNdpInDivisor = 4;
+		params->wNdpInPayloadRemainder = 0;
+		params->wNdpInAlignment = 4;
+		params->wReserved = 0;
+		params->dwNtbOutMaxSize = ncm->out_size;
+		params->wNdpOutDivisor = 4;
+		params->wNdpOutPayloadRemainder = 0;
+		params->wNdpOutAlignment = 4;
+		params->wNtbOutMaxDatagrams = 0;
+		*len = MIN(*len, sizeof(*params));
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_GET_NTB_INPUT_SIZE:
+		size = ncm->in_max;
+		memcpy(*buf, &size, 4);
+		*len = MIN(*len, 4);
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_SET_NTB_INPUT_SIZE:
+		if (*len < 4)
+			return USBD_REQ_NOTSUPP;
+		memcpy(&size, *buf, 4);
+		if (size > ncm->in_size)
+			return USBD_REQ_NOTSUPP;
+		ncm->in_max = size;
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_GET_NTB_FORMAT:
+		(*buf)[0] = 0;
+		(*buf)[1] = 0;
+		*len = MIN(*len, 2);
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_SET_NTB_FORMAT:
+		return (req->wValue == 0) ? USBD_REQ_HANDLED : USBD_REQ_NOTSUPP;
+	case USB_CDC_REQ_SET_ETHERNET_PACKET_FILTER:
+		/* Filtering is left to the application. */
+		return USBD_REQ_HANDLED;
+	}
+
+	return USBD_REQ_NOTSUPP;
+}
+
+static void ncm_set_config(usbd_device *usbd_dev, u16 wValue)
+{
+	usbd_ncm *ncm = &_ncm;
+
+	(void)wValue;
+
+	usbd_ep_setup(usbd_dev, ncm->ep_in, USB_ENDPOINT_ATTR_BULK,
+		      ncm->ep_size, NULL);
+	usbd_ep_setup(usbd_dev, ncm->ep_out, USB_ENDPOINT_ATTR_BULK,
+		      ncm->ep_size, NULL);
+	usbd_ep_setup(usbd_dev, ncm->ep_notif, USB_ENDPOINT_ATTR_INTERRUPT,
+		      16, NULL);
+	usbd_ep_queue_setup(usbd_dev, ncm->ep_notif, ncm->notif_q, 1,
+			    ncm_notify_done);
+
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				ncm_control_request);
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				ncm_interface_request);
+
+	ncm->in_max = ncm->in_size;
+	ncm_set_altsetting(ncm, 0);
+}
+
+/** @addtogroup usb_cdc */
+/** @{ */
+
+/** @brief Initializes a CDC-NCM network function.
+
+@note Currently you can only have this profile active.
+
+Ethernet frames are carried in NCM Transfer Blocks (NTBs), several frames
+per transfer. The application provides the descriptors: the communications
+interface @a iface with an interrupt IN notification endpoint of 16 bytes,
+and the data interface @a iface + 1 with an empty alternate setting 0 and
+the bulk endpoints in alternate setting 1.
+
+Adds its set configuration and SOF callbacks to those of the device, so
+other class functions and the application can register theirs as well.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] iface Number of the communications interface.
+@param[in] ep_notif Notification endpoint, interrupt IN.
+@param[in] ep_in Data endpoint, bulk IN.
+@param[in] ep_out Data endpoint, bulk OUT.
+@param[in] ep_size Size of the data endpoints, 64, or 512 at high speed.
+@param[in] in_buf Buffer for two NTBs to the host, 2 * @a in_size bytes.
+@param[in] in_size Maximum size of an NTB to the host.
+@param[in] out_buf Buffer for two NTBs from the host, 2 * @a out_size
+		   bytes.
+@param[in] out_size Maximum size of an NTB from the host, at least the
+		    largest frame plus 32 bytes.
+@return Pointer to the usbd_ncm struct, NULL if the device has no room
+left for its callbacks.
+*/
+usbd_ncm *usb_ncm_init(usbd_device *usbd_dev, u8 iface, u8 ep_notif,
+		       u8 ep_in, u8 ep_out, u16 ep_size,
+		       u8 *in_buf, u16 in_size, u8 *out_buf, u16 out_size)
+{
+	usbd_ncm *ncm = &_ncm;
+
+	memset(ncm, 0, sizeof(*ncm));
+
+	ncm->usbd_dev = usbd_dev;
+	ncm->iface = iface;
+	ncm->ep_notif = ep_notif;
+	ncm->ep_in = ep_in;
+	ncm->ep_out = ep_out;
+	ncm->ep_size = ep_size;
+	ncm->in_buf = in_buf;
+	ncm->in_size = in_size & ~3;
+	ncm->in_max = ncm->in_size;
+	ncm->in_pos = sizeof(struct usb_cdc_ncm_nth16);
+	ncm->out_buf = out_buf;
+	ncm->out_size = out_size;
+	ncm->link = true;
+
+	if (usbd_register_set_config_callback(usbd_dev, ncm_set_config) ||
+	    usbd_register_sof_callback(usbd_dev, ncm_sof))
+		return NULL;
+
+	return ncm;
+}
+
+/** @brief Set how long frames are gathered before an NTB is sent
+
+An NTB is always sent when the next frame does not fit. Otherwise it is
+sent when the IN endpoint is free and the last NTB was started at least
+@a frames frames ago.
+
+@param[in] ncm NCM instance returned by usb_ncm_init().
+@param[in] frames Number of frames, 0 (the default) sends as soon as the
+endpoint is free.
+*/
+void usb_ncm_set_flush_timeout(usbd_ncm *ncm, u8 frames)
+{
+	ncm->in_timeout = frames;
+}
+
+/** @brief Report the network link state to the host
+
+@param[in] ncm NCM instance returned by usb_ncm_init().
+@param[in] up true if the link is up, the default.
+*/
+void usb_ncm_set_link(usbd_ncm *ncm, bool up)
+{
+	ncm->link = up;
+
+	if (ncm->altsetting == 1)
+		ncm_notify(ncm, false);
+}
+
+/** @brief Get room for a frame to the host in the NTB being filled
+
+The frame is built in place and handed over with usb_ncm_send_commit().
+
+@note Must not interrupt usbd_poll(); call it from the same context, or with
+the USB interrupt masked.
+
+@param[in] ncm NCM instance returned by usb_ncm_init().
+@param[in] len The maximum length of the frame.
+@return Where to put the frame, NULL if both NTBs are in use or the host
+has not enabled the data interface.
+*/
+u8 *usb_ncm_send_alloc(usbd_ncm *ncm, u16 len)
+{
+	if (ncm->altsetting != 1)
+		return NULL;
+
+	if (!ncm_in_fits(ncm, len)) {
+		if (!ncm->in_count || ncm->in_busy)
+			return NULL;
+		ncm_in_send(ncm);
+		if (!ncm_in_fits(ncm, len))
+			return NULL;
+	}
+
+	return ncm->in_buf + ncm->in_fill * ncm->in_size +
+	       NCM_ALIGN(ncm->in_pos);
+}
+
+/** @brief Queue the frame built after usb_ncm_send_alloc()
+
+@param[in] ncm NCM instance returned by usb_ncm_init().
+@param[in] len The length of the frame, at most the one allocated.
+*/
+void usb_ncm_send_commit(usbd_ncm *ncm, u16 len)
+{
+	u16 pos = NCM_ALIGN(ncm->in_pos);
+
+	ncm->in_dg[ncm->in_count][0] = pos;
+	ncm->in_dg[ncm->in_count][1] = len;
+	ncm->in_count++;
+	ncm->in_pos = pos + len;
+
+	if (!ncm->in_busy && (ncm->in_age >= ncm->in_timeout))
+		ncm_in_send(ncm);
+}
+
+/** @brief Queue a frame to the host
+
+@param[in] ncm NCM instance returned by usb_ncm_init().
+@param[in] frame The Ethernet frame.
+@param[in] len The length of the frame.
+@return 0 on success, -1 if there is no room for the frame now.
+*/
+int usb_ncm_send(usbd_ncm *ncm, const void *frame, u16 len)
+{
+	u8 *buf = usb_ncm_send_alloc(ncm, len);
+
+	if (!buf)
+		return -1;
+
+	memcpy(buf, frame, len);
+	usb_ncm_send_commit(ncm, len);
+
+	return 0;
+}
+
+/** @brief Get the next frame received from the host
+
+The frame is returned in place in the NTB and stays valid until the next
+call. An NTB is given back for receiving once all of its frames have been
+read; malformed NTBs are dropped.
+
+@note Must not interrupt usbd_poll(); call it from the same context, or with
+the USB interrupt masked.
+
+@param[in] ncm NCM instance returned by usb_ncm_init().
+@param[out] len The length of the frame.
+@return The frame, NULL if there is none.
+*/
+const u8 *usb_ncm_recv(usbd_ncm *ncm, u16 *len)
+{
+	const struct usb_cdc_ncm_nth16 *nth;
+	const struct usb_cdc_ncm_ndp16 *ndp;
+	const u8 *ntb;
+	u16 ntb_len, entry, index, dg_len;
+
+	while ((ntb_len = ncm->out_len[ncm->out_read])) {
+		ntb = ncm->out_buf + ncm->out_read * ncm->out_size;
+		nth = (const void *)ntb;
+
+		if (!ncm->out_ndp) {
+			if ((ntb_len < sizeof(*nth)) ||
+			    (nth->dwSignature != USB_CDC_NCM_NTH16_SIGNATURE) ||
+			    (nth->wHeaderLength != sizeof(*nth)) ||
+			    (nth->wBlockLength > ntb_len)) {
+				ncm_out_release(ncm);
+				continue;
+			}
+			if (nth->wBlockLength)
+				ntb_len = nth->wBlockLength;
+			ncm->out_len[ncm->out_read] = ntb_len;
+			ncm->out_ndp = ncm_out_ndp(ntb, ntb_len, nth->wNdpIndex);
+			ncm->out_entry = 0;
+			if (!ncm->out_ndp) {
+				ncm_out_release(ncm);
+				continue;
+			}
+		}
+
+		ndp = (const void *)(ntb + ncm->out_ndp);
+		entry = ncm->out_ndp + sizeof(*ndp) + 4 * ncm->out_entry;
+		index = 0;
+		dg_len = 0;
+		if (entry + 4 <= ncm->out_ndp + ndp->wLength) {
+			memcpy(&index, ntb + entry, 2);
+			memcpy(&dg_len, ntb + entry + 2, 2);
+		}
+
+		if (!index || !dg_len) {
+			/* Later NDPs must follow, so a bad chain ends. */
+			if (ndp->wNextNdpIndex > ncm->out_ndp)
+				ncm->out_ndp = ncm_out_ndp(ntb, ntb_len,
+							   ndp->wNextNdpIndex);
+			else
+				ncm->out_ndp = 0;
+			ncm->out_entry = 0;
+			if (!ncm->out_ndp)
+				ncm_out_release(ncm);
+			continue;
+		}
+
+		ncm->out_entry++;
+		if ((u32)index + dg_len > ntb_len)
+			continue;
+
+		*len = dg_len;
+		return ntb + index;
+	}
+
+	return NULL;
+}
+
+/** @} */
@@ -20,7 +20,19 @@
 #ifndef __USB_PRIVATE_H
 #define __USB_PRIVATE_H
 
-#define MAX_USER_CONTROL_CALLBACK	4
+#define MAX_USER_CONTROL_CALLBACK	8
+/* Set configuration and SOF callbacks, one per class function and one for
+ * the application. */
+#define MAX_USER_SET_CONFIG_CALLBACK	4
+#define MAX_USER_SOF_CALLBACK		4
+/* Endpoints of the largest OTG core, the HS one; see driver->ep_count. */
+#define OTG_MAX_ENDPOINTS		6
+/* Any configuration, see _usbd_config_endpoints(). */
+#define USBD_CONFIG_ANY			0xffff
+/* One transfer complete event per endpoint and direction. */
+#define DEFAULT_POLL_BUDGET		16
+/* Deferred event queue, must be a power of two below 256. */
+#define USBD_EVENT_QUEUE_SIZE		64
 
 #define MIN(a, b) ((a)<(b) ? (a) : (b))
 
@@ -28,22 +40,44 @@
 struct _usbd_device {
 	const struct usb_device_descriptor *desc;
 	const struct usb_config_descriptor *config;
+	/* Prebuilt configuration descriptors, see usbd_set_config_descriptors(). */
+	const u8 * const *config_raw;
 	const char **strings;
 	int num_strings;
+	/* Pre-encoded string tables, see usbd_set_string_descriptors(). */
+	const struct usbd_string_lang *string_langs;
+	int num_string_langs;
 
 	u8 *ctrl_buf;  /**< Internal buffer used for control transfers */
 	u16 ctrl_buf_len;
 
 	u8 current_address;
 	u8 current_config;
+	bool high_speed;	/* Enumerated at high speed: 8 SOFs per ms. */
 
-	u16 pm_top;    /**< Top of allocated endpoint buffer memory */
+	u16 poll_budget; /**< Max transfer events per poll, 0 for no limit */
+	struct usbd_poll_stats poll_stats;
+
+	/*
+	 * Events captured by usbd_poll() in deferred mode. Only usbd_poll()
+	 * advances event_head and only usbd_process() advances event_tail,
+	 * so no locking is needed. SOF events are merged into a flag.
+	 */
+	bool deferred;
+	volatile struct usbd_event {
+		u8 type;
+		u8 ep;
+		u8 transaction;
+	} events[USBD_EVENT_QUEUE_SIZE];
+	volatile u8 event_head;
+	volatile u8 event_tail;
+	volatile bool sof_pending;
 
 	/* User callback functions for various USB events */
 	void (*user_callback_reset)(void);
 	void (*user_callback_suspend)(void);
 	void (*user_callback_resume)(void);
-	void (*user_callback_sof)(void);
+	usbd_sof_callback user_callback_sof[MAX_USER_SOF_CALLBACK];
 
 	struct usb_control_state {
 		enum {
@@ -54,6 +88,7 @@ struct _usbd_device {
 		struct usb_setup_data req __attribute__((aligned(4)));
 		u8 *ctrl_buf;
 		u16 ctrl_len;
+		bool needs_zlp;	/* Short reply that ends on a packet boundary. */
 		void (*complete)(usbd_device *usbd_dev,
 				 struct usb_setup_data *req);
 	} control_state;
@@ -66,8 +101,44 @@ struct _usbd_device {
 
 	void (*user_callback_ctr[8][3])(usbd_device *usbd_dev, u8 ea);
 
-	/* User callback function for some standard USB function hooks */
-	void (*user_callback_set_config)(usbd_device *usbd_dev, u16 wValue);
+	/* Multi-packet transfers, indexed by endpoint and USB_TRANSACTION_IN
+	 * or USB_TRANSACTION_OUT. */
+	struct usbd_transfer {
+		u8 *buf;
+		u32 len;
+		u32 count;
+		u16 max_size;
+		bool active;
+		bool zlp;	/* A zero length packet is still to be sent. */
+		u32 hw_len;	/* Handed to the hardware in one go, see
+				 * usbd_transfer_out_next(). */
+		usbd_transfer_callback callback;
+		/* Endpoint callback to restore when the transfer is done. */
+		void (*saved_cb)(usbd_device *usbd_dev, u8 ea);
+	} transfer[8][2];
+
+	/* Buffers waiting to be sent on an IN endpoint, see
+	 * usbd_ep_queue_setup(). */
+	struct usbd_tx_queue {
+		struct usbd_queue_entry *entries;
+		u8 size;
+		u8 head;	/* Entry being sent, if count is not 0. */
+		u8 count;
+		usbd_transfer_callback callback;
+	} tx_queue[8];
+
+	/* Isochronous endpoints served once per frame, indexed like
+	 * transfer, see usbd_ep_iso_setup(). */
+	struct usbd_iso {
+		u8 *buf;
+		u16 max_size;
+		bool ready;	/* IN: the last packet was sent. */
+		usbd_iso_callback callback;
+	} iso[8][2];
+
+	/* User callback functions for some standard USB function hooks */
+	usbd_set_config_callback
+		user_callback_set_config[MAX_USER_SET_CONFIG_CALLBACK];
 
 	const struct _usbd_driver *driver;
 
@@ -75,18 +146,62 @@ struct _usbd_device {
 
 	uint16_t fifo_mem_top;
 	uint16_t fifo_mem_top_ep0;
-    u8 force_nak[4];
+    /*
+     * TX FIFOs of the IN endpoints planned from the configuration by
+     * stm32fx07_config_plan(), size 0 if not planned. Other endpoints get
+     * theirs after fifo_plan_top.
+     */
+    u16 fifo_tx_addr[OTG_MAX_ENDPOINTS];
+    u16 fifo_tx_size[OTG_MAX_ENDPOINTS];
+    u16 fifo_plan_top;
+    u8 force_nak[OTG_MAX_ENDPOINTS];
     /*
      * We keep a backup copy of the out endpoint size registers to restore them
      * after a transaction.
      */
-    u32 doeptsiz[4];
+    u32 doeptsiz[OTG_MAX_ENDPOINTS];
     /*
      * Received packet size for each endpoint. This is assigned in
      * stm32f107_poll() which reads the packet status push register GRXSTSP
      * for use in stm32f107_ep_read_packet().
      */
     uint16_t rxbcnt;
+    /*
+     * Multi-packet transfers programmed into the core, see
+     * stm32fx07_ep_transfer(). For IN the data not yet pushed into the
+     * FIFO, for OUT the room left in the buffer and the bytes received.
+     */
+    struct {
+        u8 *buf;
+        u32 left;
+    } xfer_in[OTG_MAX_ENDPOINTS];
+    struct {
+        u8 *buf;
+        u32 left;
+        u32 count;
+        bool active;
+        bool started;	/* Enabled with the size of the transfer. */
+    } xfer_out[OTG_MAX_ENDPOINTS];
+    /* OUT endpoints left disabled after a transfer, they NAK until the
+     * next one is started. */
+    bool out_stopped[OTG_MAX_ENDPOINTS];
+    /*
+     * DMA mode: packet buffers of the endpoints, allocated from dma_mem
+     * and planned like the FIFOs, sizes in words. A received packet is
+     * read from dma_rx; while dma_rx_pending, its buffer belongs to
+     * endpoint dma_rx_ep until stm32fx07_rx_done().
+     */
+    u32 *dma_mem;
+    u16 dma_mem_top;
+    u16 dma_mem_top_ep0;
+    u16 dma_plan_top;
+    u8 *dma_in[OTG_MAX_ENDPOINTS];
+    u8 *dma_out[OTG_MAX_ENDPOINTS];
+    u16 dma_in_size[OTG_MAX_ENDPOINTS];
+    u16 dma_out_size[OTG_MAX_ENDPOINTS];
+    u8 *dma_rx;
+    u8 dma_rx_ep;
+    bool dma_rx_pending;
 };
 
 enum _usbd_transaction {
@@ -102,7 +217,29 @@ void _usbd_control_setup(usbd_device *usbd_dev, u8 ea);
 int _usbd_standard_request(usbd_device *usbd_dev, struct usb_setup_data *req,
 			   u8 **buf, u16 *len);
 
+enum _usbd_event_type {
+	USBD_EVENT_RESET,
+	USBD_EVENT_SUSPEND,
+	USBD_EVENT_RESUME,
+	USBD_EVENT_SOF,
+	USBD_EVENT_TRANSACTION,
+};
+
+int _usbd_event(usbd_device *usbd_dev, u8 type, u8 ep, u8 transaction);
+
 void _usbd_reset(usbd_device *usbd_dev);
+void _usbd_transfer_reset(usbd_device *usbd_dev);
+void _usbd_transfer_cancel(usbd_device *usbd_dev, u8 addr);
+void _usbd_iso_sof(usbd_device *usbd_dev);
+
+/* Largest packet of each endpoint, indexed like usbd_device.transfer. */
+struct usbd_ep_sizes {
+	u16 max_size[8][2];
+	u8 type[8][2];
+};
+
+void _usbd_config_endpoints(usbd_device *usbd_dev, u16 wValue,
+			    struct usbd_ep_sizes *sizes);
 
 /* Functions provided by the hardware abstraction. */
 struct _usbd_driver {
@@ -120,9 +257,45 @@ struct _usbd_driver {
 			      u16 len);
 	void (*poll)(usbd_device *usbd_dev);
 	void (*disconnect)(usbd_device *usbd_dev, bool disconnected);
+	/* Called by usbd_process() after a queued OUT or SETUP transaction. */
+	void (*rx_done)(usbd_device *usbd_dev);
+	/*
+	 * In place access to the packet buffer, see usbd_ep_write_begin().
+	 * begin fills in mem, width and stride, or returns false if the
+	 * endpoint is busy (IN) or has no packet (OUT). read_begin also
+	 * sets size.
+	 */
+	bool (*ep_write_begin)(usbd_device *usbd_dev,
+			       struct usbd_ep_buffer *buf);
+	void (*ep_write_end)(usbd_device *usbd_dev,
+			     struct usbd_ep_buffer *buf);
+	bool (*ep_read_begin)(usbd_device *usbd_dev,
+			      struct usbd_ep_buffer *buf);
+	void (*ep_read_end)(usbd_device *usbd_dev,
+			    struct usbd_ep_buffer *buf);
+	/*
+	 * Optional multi-packet transfers, see usbd_ep_transfer_in().
+	 * ep_transfer hands up to len bytes to the hardware and returns how
+	 * many it took, 0 if the endpoint can not take them now. The
+	 * endpoint callback is called once they are done; for OUT,
+	 * ep_transfer_count then returns the number of bytes received.
+	 */
+	u32 (*ep_transfer)(usbd_device *usbd_dev, u8 addr, void *buf, u32 len);
+	u32 (*ep_transfer_count)(usbd_device *usbd_dev, u8 addr);
+	/* Bytes of endpoint buffer memory left, see usbd_get_free_memory(). */
+	u16 (*mem_free)(usbd_device *usbd_dev);
+	/*
+	 * Optional, plans the endpoint buffer memory of configuration
+	 * wValue before SET_CONFIGURATION sets up its endpoints. Returns
+	 * false if they do not fit, the request is refused then.
+	 */
+	bool (*config_plan)(usbd_device *usbd_dev, u16 wValue);
 	u32 base_address;
 	bool set_address_before_status;
-	u16 rx_fifo_size;
+	u8 ep_count;		/* OTG: endpoints per direction. */
+	u16 fifo_mem_size;	/* OTG: FIFO memory in 32-bit words. */
+	u16 dma_mem_size;	/* OTG: DMA buffer memory in 32-bit words. */
+	bool dma;	/* OTG: the core moves the packets with its own DMA. */
 };
 
 #endif
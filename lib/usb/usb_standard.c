@@ -21,18 +21,54 @@
 #include <libopencm3/usb/usbd.h>
 #include "usb_private.h"
 
-void usbd_register_set_config_callback(usbd_device *usbd_dev,
-				       void (*callback)(usbd_device *usbd_dev,
-					       		u16 wValue))
+/** @brief Registers a callback function for SET_CONFIGURATION.
+
+Up to MAX_USER_SET_CONFIG_CALLBACK callbacks are kept, so class functions and
+the application can each set up their endpoints and control callbacks. They
+are called in the order they were registered. Registering the same callback
+again has no effect.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] callback The callback.
+
+@return 0 if successful, -1 if all slots are taken.
+*/
+int usbd_register_set_config_callback(usbd_device *usbd_dev,
+				      usbd_set_config_callback callback)
 {
-	usbd_dev->user_callback_set_config = callback;
+	int i;
+
+	for (i = 0; i < MAX_USER_SET_CONFIG_CALLBACK; i++) {
+		if (usbd_dev->user_callback_set_config[i] == callback)
+			return 0;
+		if (usbd_dev->user_callback_set_config[i])
+			continue;
+
+		usbd_dev->user_callback_set_config[i] = callback;
+		return 0;
+	}
+
+	return -1;
 }
 
-static u16 build_config_descriptor(usbd_device *usbd_dev,
-				   u8 index, u8 *buf, u16 len)
+/** @brief Serialize a configuration descriptor.
+
+Writes the configuration descriptor and all interface, function and endpoint
+descriptors it references to a buffer, in the order they are sent to the
+host, and fills in wTotalLength. The result can be passed to
+usbd_set_config_descriptors(), so this only has to be done once instead of
+for every GET_DESCRIPTOR request.
+
+@param[in] cfg The configuration descriptor.
+@param[out] buf Destination buffer.
+@param[in] len Size of the destination buffer. The descriptor is truncated
+	       if it does not fit.
+@returns Number of bytes written.
+*/
+u16 usbd_build_config_descriptor(const struct usb_config_descriptor *cfg,
+				 u8 *buf, u16 len)
 {
 	u8 *tmpbuf = buf;
-	const struct usb_config_descriptor *cfg = &usbd_dev->config[index];
 	u16 count, total = 0, totallen = 0;
 	u16 i, j, k;
 
@@ -85,11 +121,127 @@ static u16 build_config_descriptor(usbd_device *usbd_dev,
 	}
 
 	/* Fill in wTotalLength. */
-	*(u16 *)(tmpbuf + 2) = totallen;
+	if (total >= 4) {
+		tmpbuf[2] = totallen;
+		tmpbuf[3] = totallen >> 8;
+	}
 
 	return total;
 }
 
+/** @brief Serve configuration descriptors from prebuilt blobs.
+
+By default the configuration descriptor is assembled in the control buffer
+for every GET_DESCRIPTOR request, which limits it to the size of that
+buffer. With prebuilt descriptors the data is sent straight from the blob,
+in packets of the control endpoint size, without copying. The blobs can be
+const data in flash, or be built once with usbd_build_config_descriptor().
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] raw Array of complete configuration descriptors, indexed like
+	       the configuration descriptors passed to usbd_init(). The array
+	       and the descriptors must not be changed while the device is in
+	       use. NULL restores the default behaviour.
+*/
+void usbd_set_config_descriptors(usbd_device *usbd_dev, const u8 * const *raw)
+{
+	usbd_dev->config_raw = raw;
+}
+
+/** @brief Encode a string descriptor.
+
+Converts an ASCII string to a UTF-16 string descriptor. The result can be
+put into a table passed to usbd_set_string_descriptors().
+
+@param[in] str The string.
+@param[out] buf Destination buffer.
+@param[in] len Size of the destination buffer. The descriptor is truncated
+	       if it does not fit, bLength still holds the full length.
+@returns Number of bytes written.
+*/
+u16 usbd_build_string_descriptor(const char *str, u8 *buf, u16 len)
+{
+	u16 i, count;
+	u8 length = MIN(strlen(str), 126) * 2 + 2;
+
+	count = MIN(len, length);
+	for (i = 0; i < count; i++) {
+		if (i == 0)
+			buf[i] = length;
+		else if (i == 1)
+			buf[i] = USB_DT_STRING;
+		else
+			buf[i] = (i & 1) ? 0 : str[(i - 2) / 2];
+	}
+
+	return count;
+}
+
+/** @brief Serve string descriptors from pre-encoded tables.
+
+By default the ASCII strings passed to usbd_init() are converted to UTF-16
+in the control buffer for every GET_DESCRIPTOR request, and only US English
+is reported. With pre-encoded tables the descriptors are sent straight from
+the table, and one table can be provided per language. The language ID
+descriptor lists the languages in the order of the array.
+
+@param[in] usbd_dev The USB device to interact with.
+@param[in] langs Array of string tables. The array and the descriptors must
+		 not be changed while the device is in use. NULL restores the
+		 default behaviour.
+@param[in] num_langs Number of entries in langs.
+*/
+void usbd_set_string_descriptors(usbd_device *usbd_dev,
+				 const struct usbd_string_lang *langs,
+				 int num_langs)
+{
+	usbd_dev->string_langs = langs;
+	usbd_dev->num_string_langs = langs ? num_langs : 0;
+}
+
+static int usb_standard_get_string_raw(usbd_device *usbd_dev,
+				       struct usb_setup_data *req,
+				       int descr_idx, u8 **buf, u16 *len)
+{
+	const struct usbd_string_lang *lang = NULL;
+	struct usb_string_descriptor *sd;
+	const u8 *raw;
+	int i;
+
+	if (descr_idx == 0) {
+		/* Language ID descriptor, built from the table. */
+		sd = (struct usb_string_descriptor *)usbd_dev->ctrl_buf;
+		for (i = 0; (i < usbd_dev->num_string_langs) &&
+			    (4 + 2 * i <= usbd_dev->ctrl_buf_len); i++)
+			sd->wData[i] = usbd_dev->string_langs[i].langid;
+		sd->bLength = sizeof(sd->bLength) + sizeof(sd->bDescriptorType) +
+			      i * sizeof(sd->wData[0]);
+		sd->bDescriptorType = USB_DT_STRING;
+
+		*buf = (u8 *)sd;
+		*len = MIN(*len, sd->bLength);
+		return USBD_REQ_HANDLED;
+	}
+
+	for (i = 0; i < usbd_dev->num_string_langs; i++) {
+		if (usbd_dev->string_langs[i].langid == req->wIndex) {
+			lang = &usbd_dev->string_langs[i];
+			break;
+		}
+	}
+
+	if (!lang || (descr_idx > lang->num_strings))
+		return USBD_REQ_NOTSUPP;
+
+	raw = lang->strings[descr_idx - 1];
+	if (!raw)
+		return USBD_REQ_NOTSUPP;
+
+	*buf = (u8 *)raw;
+	*len = MIN(*len, raw[0]);
+	return USBD_REQ_HANDLED;
+}
+
 static int usb_descriptor_type(u16 wValue)
 {
 	return wValue >> 8;
@@ -104,8 +256,7 @@ static int usb_standard_get_descriptor(usbd_device *usbd_dev,
 				       struct usb_setup_data *req,
 				       u8 **buf, u16 *len)
 {
-	int i, array_idx, descr_idx;
-	struct usb_string_descriptor *sd;
+	int array_idx, descr_idx;
 
 	descr_idx = usb_descriptor_index(req->wValue);
 
@@ -115,19 +266,37 @@ static int usb_standard_get_descriptor(usbd_device *usbd_dev,
 		*len = MIN(*len, usbd_dev->desc->bLength);
 		return USBD_REQ_HANDLED;
 	case USB_DT_CONFIGURATION:
+		if (descr_idx >= usbd_dev->desc->bNumConfigurations)
+			return USBD_REQ_NOTSUPP;
+
+		if (usbd_dev->config_raw) {
+			const u8 *raw = usbd_dev->config_raw[descr_idx];
+
+			*buf = (u8 *)raw;
+			*len = MIN(*len, raw[2] | (raw[3] << 8));
+			return USBD_REQ_HANDLED;
+		}
+
 		*buf = usbd_dev->ctrl_buf;
-		*len = build_config_descriptor(usbd_dev, descr_idx, *buf, *len);
+		*len = usbd_build_config_descriptor(&usbd_dev->config[descr_idx],
+						    *buf, MIN(*len,
+						    usbd_dev->ctrl_buf_len));
 		return USBD_REQ_HANDLED;
 	case USB_DT_STRING:
-		sd = (struct usb_string_descriptor *)usbd_dev->ctrl_buf;
+		if (usbd_dev->string_langs)
+			return usb_standard_get_string_raw(usbd_dev, req,
+							   descr_idx, buf, len);
+
+		*buf = usbd_dev->ctrl_buf;
 
 		if (descr_idx == 0) {
 			/* Send sane Language ID descriptor... */
-			sd->wData[0] = USB_LANGID_ENGLISH_US;
-			sd->bLength = sizeof(sd->bLength) + sizeof(sd->bDescriptorType) 
-				+ sizeof(sd->wData[0]);
+			(*buf)[0] = 4;
+			(*buf)[1] = USB_DT_STRING;
+			(*buf)[2] = USB_LANGID_ENGLISH_US & 0xff;
+			(*buf)[3] = USB_LANGID_ENGLISH_US >> 8;
 
-			*len = MIN(*len, sd->bLength);
+			*len = MIN(*len, 4);
 		} else {
 			array_idx = descr_idx - 1;
 
@@ -142,20 +311,11 @@ static int usb_standard_get_descriptor(usbd_device *usbd_dev,
 			if (req->wIndex != USB_LANGID_ENGLISH_US)
 				return USBD_REQ_NOTSUPP;
 
-			/* Ths string is returned as UTF16, hence the multiplication */
-			sd->bLength = strlen(usbd_dev->strings[array_idx]) * 2 +
-				sizeof(sd->bLength) + sizeof(sd->bDescriptorType);
-
-			*len = MIN(*len, sd->bLength);
-
-			for (i = 0; i < (*len / 2) - 1; i++)
-				sd->wData[i] =
-					usbd_dev->strings[array_idx][i];
+			*len = usbd_build_string_descriptor(
+					usbd_dev->strings[array_idx], *buf,
+					MIN(*len, usbd_dev->ctrl_buf_len));
 		}
 
-		sd->bDescriptorType = USB_DT_STRING;
-		*buf = (u8 *)sd;
-
 		return USBD_REQ_HANDLED;
 	}
 	return USBD_REQ_NOTSUPP;
@@ -185,6 +345,70 @@ static int usb_standard_set_address(usbd_device *usbd_dev,
 	return 1;
 }
 
+static void usb_ep_size(struct usbd_ep_sizes *sizes,
+			const struct usb_endpoint_descriptor *ep)
+{
+	u8 num = ep->bEndpointAddress & 0x7f;
+	u8 dir = (ep->bEndpointAddress & 0x80) ? USB_TRANSACTION_IN :
+		 USB_TRANSACTION_OUT;
+	/* High bandwidth endpoints move up to three packets per microframe. */
+	u16 size = (ep->wMaxPacketSize & 0x7ff) *
+		   (((ep->wMaxPacketSize >> 11) & 3) + 1);
+
+	if ((num >= 8) || (size <= sizes->max_size[num][dir]))
+		return;
+
+	sizes->max_size[num][dir] = size;
+	sizes->type[num][dir] = ep->bmAttributes & USB_ENDPOINT_ATTR_TYPE;
+}
+
+/*
+ * Collects the largest packet of each endpoint over all alternate settings
+ * of the configuration with bConfigurationValue wValue, or of all of them
+ * for USBD_CONFIG_ANY. sizes is only ever increased, the caller clears it.
+ */
+void _usbd_config_endpoints(usbd_device *usbd_dev, u16 wValue,
+			    struct usbd_ep_sizes *sizes)
+{
+	const struct usb_config_descriptor *cfg;
+	const struct usb_interface_descriptor *iface;
+	const struct usb_endpoint_descriptor *ep;
+	const u8 *raw;
+	u16 pos, total;
+	int i, j, k, n;
+
+	for (n = 0; n < usbd_dev->desc->bNumConfigurations; n++) {
+		if (usbd_dev->config_raw) {
+			raw = usbd_dev->config_raw[n];
+			if ((wValue != USBD_CONFIG_ANY) && (raw[5] != wValue))
+				continue;
+
+			total = raw[2] | (raw[3] << 8);
+			for (pos = 0; (pos + 1 < total) && raw[pos];
+			     pos += raw[pos]) {
+				ep = (const struct usb_endpoint_descriptor *)
+				     &raw[pos];
+				if (ep->bDescriptorType == USB_DT_ENDPOINT)
+					usb_ep_size(sizes, ep);
+			}
+			continue;
+		}
+
+		cfg = &usbd_dev->config[n];
+		if ((wValue != USBD_CONFIG_ANY) &&
+		    (cfg->bConfigurationValue != wValue))
+			continue;
+
+		for (i = 0; i < cfg->bNumInterfaces; i++) {
+			for (j = 0; j < cfg->interface[i].num_altsetting; j++) {
+				iface = &cfg->interface[i].altsetting[j];
+				for (k = 0; k < iface->bNumEndpoints; k++)
+					usb_ep_size(sizes, &iface->endpoint[k]);
+			}
+		}
+	}
+}
+
 static int usb_standard_set_configuration(usbd_device *usbd_dev,
 					  struct usb_setup_data *req,
 					  u8 **buf, u16 *len)
@@ -199,20 +423,29 @@ static int usb_standard_set_configuration(usbd_device *usbd_dev,
 	if (req->wValue == usbd_dev->current_config)
 		return 1;
 
+	/* Refuse a configuration the endpoint buffers can not hold. */
+	if (usbd_dev->driver->config_plan &&
+	    !usbd_dev->driver->config_plan(usbd_dev, req->wValue))
+		return 0;
+
 	usbd_dev->current_config = req->wValue;
 
 	/* Reset all endpoints. */
 	usbd_dev->driver->ep_reset(usbd_dev);
+	_usbd_transfer_reset(usbd_dev);
 
-	if (usbd_dev->user_callback_set_config) {
+	if (usbd_dev->user_callback_set_config[0]) {
 		/*
 		 * Flush control callbacks. These will be reregistered
-		 * by the user handler.
+		 * by the user handlers.
 		 */
 		for (i = 0; i < MAX_USER_CONTROL_CALLBACK; i++)
 			usbd_dev->user_control_callback[i].cb = NULL;
 
-		usbd_dev->user_callback_set_config(usbd_dev, req->wValue);
+		for (i = 0; (i < MAX_USER_SET_CONFIG_CALLBACK) &&
+			    usbd_dev->user_callback_set_config[i]; i++)
+			usbd_dev->user_callback_set_config[i](usbd_dev,
+							      req->wValue);
 	}
 
 	return 1;